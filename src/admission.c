@@ -0,0 +1,273 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * データストアへ送信するコマンドの受け付けを制限します。
+ *
+ * クライアントのアドレス毎にコマンド数(dinio.client_ops_limit)と
+ * バイト数(dinio.client_bytes_limit)のトークンバケットを持ち、
+ * トークンが不足している場合はコマンドを受け付けません。
+ * バケットの容量は1秒分です。ひとつのコマンドが容量を超える場合でも
+ * 受け付けられるようにトークンは負の値まで消費します。
+ *
+ * ディスパッチ中のコマンド数が dinio.max_inflight 以上の場合も
+ * コマンドを受け付けません。
+ *
+ * 受け付けなかったコマンド数はクライアントのアドレス毎に記録します。
+ * 記録するアドレスは区分毎に ADM_STRIPE_SLOTS 件までで、
+ * 区分が一杯の場合は最も長く使用されていないアドレスと置き換えます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define ADM_STRIPES         16      /* クライアントのアドレスの区分数 */
+#define ADM_STRIPE_SLOTS    64      /* 区分毎に記録するアドレス数 */
+
+/* クライアントのアドレス毎の状態 */
+struct adm_entry_t {
+    unsigned long addr;             /* IPアドレス(ゼロは未使用) */
+    double ops_tokens;              /* コマンド数のトークン */
+    double bytes_tokens;            /* バイト数のトークン */
+    int64 last_time;                /* 最後にトークンを補充した時間(usec) */
+    int64 requests;                 /* 受け付けたコマンド数 */
+    int64 throttled;                /* 受け付けなかったコマンド数 */
+};
+
+struct adm_stripe_t {
+    CS_DEF(critical_section);
+    struct adm_entry_t entries[ADM_STRIPE_SLOTS];
+};
+
+static struct adm_stripe_t* adm_stripes;
+
+/* アドレスのエントリを検索します。存在しない場合は割り当てます。
+   区分のロックを取得して呼び出します。*/
+static struct adm_entry_t* find_entry(struct adm_stripe_t* stripe, unsigned long addr, int64 now)
+{
+    struct adm_entry_t* e;
+    struct adm_entry_t* lru = NULL;
+    int i;
+
+    for (i = 0; i < ADM_STRIPE_SLOTS; i++) {
+        e = &stripe->entries[i];
+        if (e->addr == addr)
+            return e;
+        if (e->addr == 0) {
+            lru = e;
+            break;
+        }
+        if (lru == NULL || e->last_time < lru->last_time)
+            lru = e;
+    }
+
+    /* 新しいアドレスはトークンが満たされた状態で開始します。*/
+    e = lru;
+    e->addr = addr;
+    e->ops_tokens = g_conf->client_ops_limit;
+    e->bytes_tokens = (double)g_conf->client_bytes_limit * 1024;
+    e->last_time = now;
+    e->requests = 0;
+    e->throttled = 0;
+    return e;
+}
+
+/* 経過時間分のトークンを補充します。*/
+static void refill(struct adm_entry_t* e, int64 now)
+{
+    double sec;
+
+    if (now <= e->last_time)
+        return;
+    sec = (double)(now - e->last_time) / 1000000.0;
+    e->last_time = now;
+
+    if (g_conf->client_ops_limit > 0) {
+        e->ops_tokens += sec * g_conf->client_ops_limit;
+        if (e->ops_tokens > g_conf->client_ops_limit)
+            e->ops_tokens = g_conf->client_ops_limit;
+    }
+    if (g_conf->client_bytes_limit > 0) {
+        double max_bytes = (double)g_conf->client_bytes_limit * 1024;
+
+        e->bytes_tokens += sec * max_bytes;
+        if (e->bytes_tokens > max_bytes)
+            e->bytes_tokens = max_bytes;
+    }
+}
+
+/*
+ * データストアへ送信するコマンドを受け付けるか判定します。
+ * 受け付ける場合はクライアントのトークンを消費します。
+ *
+ * addr: クライアントのアドレス
+ * ops: コマンド数(複数キーの get はキー数)
+ * bytes: コマンド行とデータブロックのバイト数
+ *
+ * 戻り値
+ *  受け付ける場合はゼロを返します。
+ *  受け付けない場合は -1 を返します。
+ */
+int admission_check(struct in_addr addr, int ops, int bytes)
+{
+    struct adm_stripe_t* stripe;
+    struct adm_entry_t* e;
+    unsigned long ip;
+    int64 now;
+    int busy = 0;
+
+    if (adm_stripes == NULL)
+        return 0;
+
+    if (g_conf->max_inflight > 0 && dispatch_inflight_count() >= g_conf->max_inflight)
+        busy = 1;
+
+    ip = (unsigned long)addr.s_addr;
+    stripe = &adm_stripes[(ip ^ (ip >> 16)) % ADM_STRIPES];
+    now = system_time();
+
+    CS_START(&stripe->critical_section);
+    e = find_entry(stripe, ip, now);
+    refill(e, now);
+    if (! busy) {
+        if (g_conf->client_ops_limit > 0 && e->ops_tokens <= 0)
+            busy = 1;
+        else if (g_conf->client_bytes_limit > 0 && e->bytes_tokens <= 0)
+            busy = 1;
+    }
+    if (busy) {
+        e->throttled++;
+    } else {
+        if (g_conf->client_ops_limit > 0)
+            e->ops_tokens -= ops;
+        if (g_conf->client_bytes_limit > 0)
+            e->bytes_tokens -= bytes;
+        e->requests++;
+    }
+    CS_END(&stripe->critical_section);
+
+    if (busy) {
+        stats_add(STATS_THROTTLED, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 記録しているクライアントのコマンド数を求めます。
+ *
+ * list: クライアントのコマンド数を設定する配列
+ * max_num: 配列の要素数
+ *
+ * 戻り値
+ *  設定したクライアント数を返します。
+ */
+int admission_list(struct client_stat_t* list, int max_num)
+{
+    int n = 0;
+    int i, j;
+
+    if (adm_stripes == NULL)
+        return 0;
+
+    for (i = 0; i < ADM_STRIPES; i++) {
+        struct adm_stripe_t* stripe = &adm_stripes[i];
+
+        CS_START(&stripe->critical_section);
+        for (j = 0; j < ADM_STRIPE_SLOTS && n < max_num; j++) {
+            struct adm_entry_t* e = &stripe->entries[j];
+
+            if (e->addr == 0)
+                break;
+            list[n].addr.s_addr = e->addr;
+            list[n].requests = e->requests;
+            list[n].throttled = e->throttled;
+            n++;
+        }
+        CS_END(&stripe->critical_section);
+    }
+    return n;
+}
+
+/*
+ * 記録できるクライアント数を返します。
+ *
+ * 戻り値
+ *  クライアント数を返します。制限しない場合はゼロを返します。
+ */
+int admission_capacity()
+{
+    if (adm_stripes == NULL)
+        return 0;
+    return ADM_STRIPES * ADM_STRIPE_SLOTS;
+}
+
+/*
+ * コマンドの受け付けの制限を初期化します。
+ * 制限するパラメータが設定されていない場合は何もしません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int admission_initialize()
+{
+    int i;
+
+    if (g_conf->client_ops_limit < 1 &&
+        g_conf->client_bytes_limit < 1 &&
+        g_conf->max_inflight < 1)
+        return 0;
+
+    adm_stripes = (struct adm_stripe_t*)calloc(ADM_STRIPES, sizeof(struct adm_stripe_t));
+    if (adm_stripes == NULL) {
+        err_write("admission: no memory.");
+        return -1;
+    }
+    for (i = 0; i < ADM_STRIPES; i++)
+        CS_INIT(&adm_stripes[i].critical_section);
+    return 0;
+}
+
+/*
+ * コマンドの受け付けの制限を終了します。
+ *
+ * 戻り値
+ *  なし
+ */
+void admission_finalize()
+{
+    if (adm_stripes) {
+        struct adm_stripe_t* stripes = adm_stripes;
+        int i;
+
+        adm_stripes = NULL;
+        for (i = 0; i < ADM_STRIPES; i++)
+            CS_DELETE(&stripes[i].critical_section);
+        free(stripes);
+    }
+}
@@ -0,0 +1,1395 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * データストアとのコマンドの送受信をイベント駆動で実行します。
+ *
+ * ディスパッチスレッドはプールから取得したソケットとコマンドを
+ * I/O スレッド(dinio.backend_io_threads)に登録すると、応答を待たずに
+ * 次のコマンドを処理します。
+ * I/O スレッドは epoll でソケットを監視して、リクエスト毎に
+ * 送信、応答行の受信、データブロックの受信の順に状態を進めます。
+ * 応答がそろった時点で完了のコールバック関数を呼び出します。
+ * 応答を待っているリクエストはスレッドを占有しないため、
+ * 応答の遅いデータストアはメモリを消費するだけになります。
+ *
+ * dinio.backend_pipeline を指定した場合はプールを使用せずに、I/O スレッドが
+ * サーバー毎に保持する接続に複数のコマンドを続けて送信します。
+ * 応答は送信した順番にリクエストへ対応させます。
+ * サーバーへの接続数を減らして、接続あたりのスループットを高めます。
+ *
+ * 応答のタイムアウト(dinio.datastore_timeout)はスレッド毎の
+ * タイマーホイールで管理します。BIO_TICK_MSEC 毎に経過したスロットの
+ * リクエストを調べて期限を過ぎたものをエラーとして完了します。
+ * パイプライン接続で応答を待っていたリクエストは、そのリクエストだけを
+ * 完了して接続を切り離します(draining)。後から届く応答は読み捨てて、
+ * 応答待ちがなくなった時点で接続を解放します。
+ * ヘッジを指定した get は先にヘッジの時間で登録して、応答が届いて
+ * いなければコールバック関数でレプリカへの送信を依頼します。
+ *
+ * epoll が使用できない環境では I/O スレッドを開始しないので
+ * コマンドはディスパッチスレッドで実行されます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+
+#ifdef __linux__
+
+#define BIO_TICK_MSEC       10      /* タイマーホイールの間隔(ms) */
+#define BIO_WHEEL_SLOTS     512     /* タイマーホイールのスロット数 */
+#define BIO_MAX_EVENTS      256     /* 一度に処理するイベント数 */
+#define BIO_RECV_SIZE       16384   /* 一度に受信するバイト数 */
+#define BIO_MAX_IOV         64      /* 一度に送信する領域の数 */
+
+/* リクエストの状態 */
+#define BIO_SEND            0       /* コマンドの送信待ち */
+#define BIO_HEADER          1       /* 応答行の受信待ち */
+#define BIO_BODY            2       /* データブロックの受信待ち */
+#define BIO_STREAM          3       /* データブロックの中継中 */
+
+#define END_LINE            "END" LINE_DELIMITER
+
+/*
+ * データストアへの接続
+ *
+ * プールから取得したソケットはリクエストひとつの間だけ使用します。
+ * パイプライン接続(dinio.backend_pipeline)は I/O スレッドが
+ * サーバー毎に保持して、複数のリクエストを続けて送信します。
+ * データストアは受信した順に応答するので、応答は送信した順番の
+ * リクエストに対応させます。
+ */
+struct bio_conn_t {
+    struct server_t* server;
+    SOCKET socket;
+    int pooled;                             /* プールから取得したソケット */
+    int draining;                           /* 応答待ちの完了後に解放する */
+    int connecting;                         /* 接続の完了待ち */
+    unsigned int events;                    /* 監視中のイベント(ゼロは未登録) */
+    struct bio_request_t* send_head;        /* 送信待ちのリクエスト */
+    struct bio_request_t* send_tail;
+    struct bio_request_t* recv_head;        /* 応答待ちのリクエスト(送信順) */
+    struct bio_request_t* recv_tail;
+    int outstanding;                        /* 応答待ちのリクエスト数 */
+    int flush_pending;                      /* 送信リストに登録済み */
+    struct bio_conn_t* flush_next;          /* 送信する接続のリスト */
+    struct bio_conn_t* next;                /* スレッドの接続リスト */
+};
+
+struct bio_thread_t {
+    pthread_t thread_id;
+    int epfd;                               /* epoll のディスクリプタ */
+    int wakefd;                             /* 登録を通知する eventfd */
+    volatile int stop_flag;
+    CS_DEF(critical_section);
+    struct bio_request_t* submit_head;      /* 登録されたリクエスト */
+    struct bio_request_t* submit_tail;
+    struct server_t* detach_server;         /* 接続を切断するサーバー(bio_detach_mutex) */
+    struct bio_conn_t* conns;               /* 使用中の接続 */
+    struct bio_request_t* wheel[BIO_WHEEL_SLOTS];
+    int64 tick;                             /* 処理済みのティック */
+};
+
+static struct bio_thread_t* bio_threads;
+static int bio_thread_num;
+static volatile long bio_next;              /* 登録するスレッドの通番 */
+static volatile long bio_count;             /* 実行中のリクエスト数 */
+static volatile long bio_conn_count;        /* パイプライン接続数 */
+static volatile int64 bio_writes;           /* 送信のシステムコール数 */
+static volatile int64 bio_write_requests;   /* 送信したリクエスト数 */
+static volatile long bio_write_batch_max;   /* 一度に送信した最大リクエスト数 */
+static pthread_mutex_t bio_detach_mutex;    /* サーバーの切断の排他 */
+static pthread_cond_t bio_detach_cond;      /* サーバーの切断の完了通知 */
+
+static int64 current_tick()
+{
+    return system_time() / 1000 / BIO_TICK_MSEC;
+}
+
+/* ミリ秒後のティックを求めます。現在のティックの経過分を切り上げて1ティック加えます。*/
+static int64 msec_tick(int msec)
+{
+    return current_tick() + (msec + BIO_TICK_MSEC - 1) / BIO_TICK_MSEC + 1;
+}
+
+static void timer_insert(struct bio_thread_t* th, struct bio_request_t* req, int64 tick)
+{
+    struct bio_request_t** slot;
+
+    req->expire_tick = tick;
+    if (tick == 0)
+        return;
+    slot = &th->wheel[req->expire_tick % BIO_WHEEL_SLOTS];
+    req->prev = NULL;
+    req->next = *slot;
+    if (*slot)
+        (*slot)->prev = req;
+    *slot = req;
+}
+
+/*
+ * リクエストをタイマーホイールに登録します。
+ * ヘッジを指定したリクエストは先にヘッジの時間で登録します。
+ */
+static void timer_add(struct bio_thread_t* th, struct bio_request_t* req)
+{
+    int64 tick;
+
+    req->timeout_tick = 0;
+    if (g_conf->datastore_timeout >= 0)
+        req->timeout_tick = msec_tick(g_conf->datastore_timeout);
+    tick = req->timeout_tick;
+    if (req->hedge) {
+        int64 hedge_tick = msec_tick((req->hedge_usec + 999) / 1000);
+
+        if (tick == 0 || hedge_tick < tick)
+            tick = hedge_tick;
+    }
+    timer_insert(th, req, tick);
+}
+
+static void timer_remove(struct bio_thread_t* th, struct bio_request_t* req)
+{
+    if (req->expire_tick == 0)
+        return;
+    if (req->prev)
+        req->prev->next = req->next;
+    else
+        th->wheel[req->expire_tick % BIO_WHEEL_SLOTS] = req->next;
+    if (req->next)
+        req->next->prev = req->prev;
+    req->expire_tick = 0;
+}
+
+/* リクエストを完了してコールバック関数を呼び出します。*/
+static void bio_complete(struct bio_thread_t* th, struct bio_request_t* req, int result)
+{
+    timer_remove(th, req);
+    req->conn = NULL;
+    ATOMIC_DEC(&bio_count);
+    /* req はコールバック関数で解放されます。*/
+    req->done(req, result);
+}
+
+/*
+ * 応答待ちのリクエストを完了します。
+ * タイムアウトしたリクエストの代わりに応答を読み捨てていた
+ * リクエスト(done が NULL)は解放します。
+ */
+static void bio_release(struct bio_thread_t* th, struct bio_request_t* req, int result)
+{
+    if (req->done == NULL) {
+        mb_free(req->mb);
+        free(req);
+        return;
+    }
+    bio_complete(th, req, result);
+}
+
+static int conn_watch(struct bio_thread_t* th, struct bio_conn_t* conn, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (conn->events == events)
+        return 0;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (conn->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+    if (epoll_ctl(th->epfd, op, conn->socket, &ev) < 0) {
+        err_write("backend_io: %s:%d epoll_ctl() error[%d].",
+                  conn->server->ip, conn->server->port, errno);
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+/* 接続を解放します。プールのソケットはコールバック関数で返却されます。*/
+static void conn_free(struct bio_thread_t* th, struct bio_conn_t* conn)
+{
+    struct bio_conn_t** pp = &th->conns;
+
+    conn_watch(th, conn, 0);
+    while (*pp && *pp != conn)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = conn->next;
+    if (! conn->pooled) {
+        shutdown(conn->socket, 2);
+        SOCKET_CLOSE(conn->socket);
+        ATOMIC_DEC(&bio_conn_count);
+    }
+    free(conn);
+}
+
+/*
+ * 接続をエラーとして解放して、送信待ちと応答待ちのリクエストを
+ * すべてエラーで完了します。
+ * パイプライン接続は応答の対応が分からなくなるためです。
+ */
+static void conn_fail(struct bio_thread_t* th, struct bio_conn_t* conn)
+{
+    struct bio_request_t* list;
+    struct bio_request_t* req;
+
+    /* 応答待ち、送信待ちの順に連結します。*/
+    list = conn->recv_head;
+    if (conn->recv_tail)
+        conn->recv_tail->queue_next = conn->send_head;
+    else
+        list = conn->send_head;
+    conn_free(th, conn);
+
+    req = list;
+    while (req) {
+        struct bio_request_t* next = req->queue_next;
+
+        bio_release(th, req, -1);
+        req = next;
+    }
+}
+
+static void send_enqueue(struct bio_conn_t* conn, struct bio_request_t* req)
+{
+    req->conn = conn;
+    req->queue_next = NULL;
+    if (conn->send_tail)
+        conn->send_tail->queue_next = req;
+    else
+        conn->send_head = req;
+    conn->send_tail = req;
+}
+
+/* パイプライン接続を開始します。接続の完了は EPOLLOUT で通知されます。*/
+static struct bio_conn_t* conn_open(struct bio_thread_t* th, struct server_t* server)
+{
+    struct bio_conn_t* conn;
+    struct sockaddr_in sa;
+    int on = 1;
+
+    conn = (struct bio_conn_t*)calloc(1, sizeof(struct bio_conn_t));
+    if (conn == NULL) {
+        err_write("backend_io: no memory.");
+        return NULL;
+    }
+    conn->server = server;
+    conn->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->socket == INVALID_SOCKET) {
+        err_write("backend_io: %s:%d socket() error[%d].", server->ip, server->port, errno);
+        free(conn);
+        return NULL;
+    }
+    fcntl(conn->socket, F_SETFL, fcntl(conn->socket, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((ushort)server->port);
+    sa.sin_addr.s_addr = inet_addr(server->ip);
+    if (connect(conn->socket, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        if (errno != EINPROGRESS) {
+            err_write("backend_io: %s:%d connect error[%d].", server->ip, server->port, errno);
+            SOCKET_CLOSE(conn->socket);
+            free(conn);
+            return NULL;
+        }
+        conn->connecting = 1;
+    }
+    conn->next = th->conns;
+    th->conns = conn;
+    ATOMIC_INC(&bio_conn_count);
+    return conn;
+}
+
+/* 送信したリクエスト数を集計します。*/
+static void write_record(int reqs)
+{
+    long max;
+
+    ATOMIC_INC(&bio_writes);
+    if (reqs < 1)
+        return;
+    ATOMIC_ADD64(&bio_write_requests, reqs);
+    while ((max = bio_write_batch_max) < reqs) {
+        if (ATOMIC_CAS(&bio_write_batch_max, max, reqs))
+            break;
+    }
+}
+
+/*
+ * 送信した長さだけ送信待ちのリクエストを進めて、送信を終えた
+ * リクエストを応答待ちに移します。
+ *
+ * len: 送信したバイト数
+ * reqs: 送信を終えたリクエスト数が設定されます。
+ *
+ * 戻り値
+ *  接続を継続する場合はゼロを返します。
+ *  接続を解放した場合は -1 を返します。
+ */
+static int conn_advance(struct bio_thread_t* th, struct bio_conn_t* conn, ssize_t len, int* reqs)
+{
+    *reqs = 0;
+    while (conn->send_head) {
+        struct bio_request_t* req = conn->send_head;
+
+        while (req->vec_index < req->vec_count) {
+            int remain = req->vec[req->vec_index].len - req->vec_offset;
+
+            if (len < remain) {
+                req->vec_offset += (int)len;
+                len = 0;
+                break;
+            }
+            len -= remain;
+            req->vec_index++;
+            req->vec_offset = 0;
+        }
+        if (req->vec_index < req->vec_count)
+            break;
+
+        conn->send_head = req->queue_next;
+        if (conn->send_head == NULL)
+            conn->send_tail = NULL;
+        (*reqs)++;
+
+        if (req->noreply_flag) {
+            /* noreply のコマンドは送信で完了します(プールのソケットのみ)。*/
+            conn_free(th, conn);
+            bio_complete(th, req, 0);
+            return -1;
+        }
+        req->state = BIO_HEADER;
+        req->queue_next = NULL;
+        if (conn->recv_tail)
+            conn->recv_tail->queue_next = req;
+        else
+            conn->recv_head = req;
+        conn->recv_tail = req;
+        conn->outstanding++;
+    }
+    return 0;
+}
+
+/*
+ * 送信待ちのリクエストを送信して応答待ちに移します。
+ * 送信待ちのリクエストの領域をまとめて一度の sendmsg() で送信します。
+ * 同じ周回で登録されたリクエストがまとめられるので、負荷が高いほど
+ * リクエストあたりのシステムコールは少なくなります。
+ * パイプライン接続は応答待ちが dinio.backend_pipeline 未満の間だけ送信します。
+ *
+ * 戻り値
+ *  接続を継続する場合はゼロを返します。
+ *  接続を解放した場合は -1 を返します。
+ */
+static int conn_flush(struct bio_thread_t* th, struct bio_conn_t* conn)
+{
+    unsigned int events;
+    int blocked = 0;
+
+    if (conn->connecting)
+        return 0;
+
+    while (conn->send_head) {
+        struct iovec iov[BIO_MAX_IOV];
+        struct msghdr msg;
+        struct bio_request_t* req;
+        int outstanding = conn->outstanding;
+        int n = 0;
+        ssize_t len;
+        int reqs;
+
+        for (req = conn->send_head; req; req = req->queue_next) {
+            int i;
+
+            if (! conn->pooled && outstanding >= g_conf->backend_pipeline)
+                break;
+            if (n + req->vec_count - req->vec_index > BIO_MAX_IOV)
+                break;
+            for (i = req->vec_index; i < req->vec_count; i++) {
+                int offset = (i == req->vec_index)? req->vec_offset : 0;
+
+                iov[n].iov_base = (char*)req->vec[i].buf + offset;
+                iov[n].iov_len = req->vec[i].len - offset;
+                n++;
+            }
+            outstanding++;
+        }
+        if (n == 0)
+            break;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        len = sendmsg(conn->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked = 1;
+                break;
+            }
+            err_write("backend_io: (%s) %s:%d send error[%d].",
+                      conn->send_head->cmdline, conn->server->ip, conn->server->port, errno);
+            conn_fail(th, conn);
+            return -1;
+        }
+        if (conn_advance(th, conn, len, &reqs) < 0) {
+            write_record(reqs);
+            return -1;
+        }
+        write_record(reqs);
+    }
+
+    /* パイプライン接続は切断を検知するために常に受信を監視します。*/
+    events = (conn->outstanding > 0 || ! conn->pooled)? EPOLLIN : 0;
+    if (blocked)
+        events |= EPOLLOUT;
+    if (conn_watch(th, conn, events) < 0) {
+        conn_fail(th, conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 応答行を解析して受信する応答のサイズを求めます。
+ * 大きな値はクライアントへの中継を開始します。
+ * mb には応答行だけが格納されています。
+ *
+ * 戻り値
+ *  応答がそろった場合は 1 を返します。
+ *  受信を続ける場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int parse_header(struct bio_request_t* req)
+{
+    struct membuf_t* mb = req->mb;
+    char tbuf[CMDLINE_SIZE];
+    struct cmdline_t cmdl;
+    int hlen;
+    int bytes;
+
+    req->header_len = mb->size;
+
+    /* VALUE <key> <flags> <bytes> [<cas>]<CRLF> 以外は応答行だけです。*/
+    if (req->cmd_grp != CMDGRP_GET || mb->size < 6 || memcmp(mb->buf, "VALUE ", 6) != 0)
+        return 1;
+
+    hlen = req->header_len - strlen(LINE_DELIMITER);
+    if (hlen < 0 || hlen >= (int)sizeof(tbuf)) {
+        err_write("backend_io: (%s) %s:%d illegal reply.",
+                  req->cmdline, req->server->ip, req->server->port);
+        return -1;
+    }
+    memcpy(tbuf, mb->buf, hlen);
+    tbuf[hlen] = '\0';
+    if (cmd_tokenize(tbuf, &cmdl) < 4 || (bytes = atoi(cmdl.cl[3])) < 0) {
+        err_write("backend_io: (%s) %s:%d illegal reply=%s.",
+                  req->cmdline, req->server->ip, req->server->port, tbuf);
+        return -1;
+    }
+    req->body_left = bytes + strlen(LINE_DELIMITER);
+    req->reply_size = req->header_len + req->body_left + strlen(END_LINE);
+
+    if (req->stream && req->stream_size > 0 && bytes >= req->stream_size &&
+        req->stream(req, mb->buf, req->header_len) == 0) {
+        /* 大きな値は受信しながらクライアントへ中継します。
+           mb には最後の "END<CRLF>" だけを格納します。*/
+        req->state = BIO_STREAM;
+        mb->size = 0;
+        return 0;
+    }
+    req->state = BIO_BODY;
+    return 0;
+}
+
+/*
+ * 受信したデータをリクエストの応答として処理します。
+ * 応答の終わりを超えたデータは次のリクエストの応答です。
+ *
+ * used: 処理したバイト数
+ *
+ * 戻り値
+ *  応答がそろった場合は 1 を返します。
+ *  受信を続ける場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int bio_parse(struct bio_request_t* req, const char* buf, int len, int* used)
+{
+    int n;
+
+    *used = 0;
+    if (req->state == BIO_HEADER) {
+        const char* p = (const char*)memchr(buf, '\n', len);
+        int result;
+
+        n = (p)? (int)(p - buf) + 1 : len;
+        mb_append(req->mb, buf, n);
+        *used += n;
+        if (p == NULL) {
+            if (req->mb->size > BUF_SIZE) {
+                err_write("backend_io: (%s) %s:%d illegal reply.",
+                          req->cmdline, req->server->ip, req->server->port);
+                return -1;
+            }
+            return 0;
+        }
+        result = parse_header(req);
+        if (result != 0)
+            return result;
+        buf += n;
+        len -= n;
+    }
+
+    if (req->state == BIO_STREAM) {
+        n = (len < req->body_left)? len : req->body_left;
+        if (n > 0) {
+            /* 中継できなくなった場合は残りのデータブロックを読み捨てます。*/
+            if (! req->stream_error && req->stream(req, buf, n) < 0)
+                req->stream_error = 1;
+            req->body_left -= n;
+            buf += n;
+            len -= n;
+            *used += n;
+        }
+        if (req->body_left > 0)
+            return 0;
+        n = strlen(END_LINE) - req->mb->size;
+        if (n > len)
+            n = len;
+        mb_append(req->mb, buf, n);
+        *used += n;
+        if (req->mb->size < (int)strlen(END_LINE))
+            return 0;
+        if (memcmp(req->mb->buf, END_LINE, strlen(END_LINE)) != 0) {
+            err_write("backend_io: (%s) %s:%d illegal data block.",
+                      req->cmdline, req->server->ip, req->server->port);
+            return -1;
+        }
+        return 1;
+    }
+
+    /* <data block><CRLF>END<CRLF> */
+    n = req->reply_size - req->mb->size;
+    if (n > len)
+        n = len;
+    if (mb_append(req->mb, buf, n) < 0) {
+        err_write("backend_io: (%s) %s:%d no memory.",
+                  req->cmdline, req->server->ip, req->server->port);
+        return -1;
+    }
+    *used += n;
+    if (req->mb->size < req->reply_size)
+        return 0;
+    if (memcmp(req->mb->buf + req->reply_size - strlen(END_LINE), END_LINE, strlen(END_LINE)) != 0) {
+        err_write("backend_io: (%s) %s:%d illegal data block.",
+                  req->cmdline, req->server->ip, req->server->port);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * 受信できるだけ応答を受信して、そろった応答のリクエストを完了します。
+ *
+ * 戻り値
+ *  接続を継続する場合はゼロを返します。
+ *  接続を解放した場合は -1 を返します。
+ */
+static int conn_recv(struct bio_thread_t* th, struct bio_conn_t* conn)
+{
+    char buf[BIO_RECV_SIZE];
+
+    while (1) {
+        ssize_t n;
+        int pos = 0;
+
+        n = recv(conn->socket, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            err_write("backend_io: %s:%d recv error[%d].",
+                      conn->server->ip, conn->server->port, errno);
+            conn_fail(th, conn);
+            return -1;
+        }
+        if (n == 0) {
+            if (conn->outstanding > 0)
+                err_write("backend_io: %s:%d connection closed.",
+                          conn->server->ip, conn->server->port);
+            conn_fail(th, conn);
+            return -1;
+        }
+
+        while (pos < n) {
+            struct bio_request_t* req = conn->recv_head;
+            int used;
+            int result;
+
+            if (req == NULL) {
+                err_write("backend_io: %s:%d unexpected reply.",
+                          conn->server->ip, conn->server->port);
+                conn_fail(th, conn);
+                return -1;
+            }
+            result = bio_parse(req, buf + pos, (int)n - pos, &used);
+            if (result < 0) {
+                conn_fail(th, conn);
+                return -1;
+            }
+            pos += used;
+            if (result == 0)
+                continue;
+
+            /* 送信した順番の応答がそろいました。*/
+            conn->recv_head = req->queue_next;
+            if (conn->recv_head == NULL)
+                conn->recv_tail = NULL;
+            conn->outstanding--;
+            if (conn->pooled) {
+                if (pos < n) {
+                    err_write("backend_io: %s:%d unexpected reply.",
+                              conn->server->ip, conn->server->port);
+                    conn_free(th, conn);
+                    bio_complete(th, req, -1);
+                    return -1;
+                }
+                conn_free(th, conn);
+                bio_complete(th, req, (req->stream_error)? -1 : 0);
+                return -1;
+            }
+            /* 中継に失敗した応答はエラーとして完了します(接続は継続します)。*/
+            bio_release(th, req, (req->stream_error)? -1 : 0);
+            if (conn->draining && conn->outstanding == 0 && conn->send_head == NULL) {
+                /* 切り離した接続の応答をすべて受信しました。*/
+                conn_free(th, conn);
+                return -1;
+            }
+        }
+    }
+    /* 応答待ちが減ったので送信待ちのリクエストを送信します。*/
+    return conn_flush(th, conn);
+}
+
+/* 接続のイベントを処理します。*/
+static void conn_event(struct bio_thread_t* th, struct bio_conn_t* conn, unsigned int events)
+{
+    if (conn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            err_write("backend_io: %s:%d connect error[%d].",
+                      conn->server->ip, conn->server->port, err);
+            conn_fail(th, conn);
+            return;
+        }
+        conn->connecting = 0;
+        conn_flush(th, conn);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if (conn_recv(th, conn) < 0)
+            return;
+    }
+    if (events & EPOLLOUT)
+        conn_flush(th, conn);
+}
+
+/* パイプライン接続を求めます。接続がない場合は接続を開始します。*/
+static struct bio_conn_t* conn_get(struct bio_thread_t* th, struct server_t* server)
+{
+    struct bio_conn_t* conn;
+
+    for (conn = th->conns; conn; conn = conn->next) {
+        if (! conn->pooled && ! conn->draining && conn->server == server)
+            return conn;
+    }
+    conn = conn_open(th, server);
+    if (conn && conn->connecting) {
+        if (conn_watch(th, conn, EPOLLOUT) < 0) {
+            conn_fail(th, conn);
+            return NULL;
+        }
+    }
+    return conn;
+}
+
+/* 登録されたリクエストを接続の送信待ちに追加して送信します。*/
+static void bio_accept(struct bio_thread_t* th)
+{
+    struct bio_request_t* req;
+    struct bio_conn_t* flush_list = NULL;
+
+    CS_START(&th->critical_section);
+    req = th->submit_head;
+    th->submit_head = th->submit_tail = NULL;
+    CS_END(&th->critical_section);
+
+    while (req) {
+        struct bio_request_t* next = req->next;
+        struct bio_conn_t* conn;
+
+        timer_add(th, req);
+        if (req->ss) {
+            /* プールのソケットはリクエストひとつの接続とします。*/
+            conn = (struct bio_conn_t*)calloc(1, sizeof(struct bio_conn_t));
+            if (conn) {
+                conn->server = req->server;
+                conn->socket = req->ss->socket;
+                conn->pooled = 1;
+                conn->next = th->conns;
+                th->conns = conn;
+            } else {
+                err_write("backend_io: no memory.");
+            }
+        } else {
+            conn = conn_get(th, req->server);
+        }
+        if (conn == NULL) {
+            bio_complete(th, req, -1);
+        } else {
+            send_enqueue(conn, req);
+            if (! conn->flush_pending) {
+                conn->flush_pending = 1;
+                conn->flush_next = flush_list;
+                flush_list = conn;
+            }
+        }
+        req = next;
+    }
+
+    /* 接続毎にまとめて送信します。*/
+    while (flush_list) {
+        struct bio_conn_t* conn = flush_list;
+
+        flush_list = conn->flush_next;
+        conn->flush_pending = 0;
+        conn_flush(th, conn);
+    }
+}
+
+/*
+ * タイムアウトした応答待ちのリクエストを応答を読み捨てるリクエストと
+ * 置き換えます。接続の応答の順番はそのまま維持されます。
+ *
+ * 戻り値
+ *  置き換えた場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int request_discard(struct bio_conn_t* conn, struct bio_request_t* req)
+{
+    struct bio_request_t** pp = &conn->recv_head;
+    struct bio_request_t* dummy;
+    struct membuf_t* mb;
+
+    while (*pp && *pp != req)
+        pp = &(*pp)->queue_next;
+    if (*pp == NULL)
+        return -1;
+
+    dummy = (struct bio_request_t*)malloc(sizeof(struct bio_request_t));
+    mb = mb_alloc(BUF_SIZE);
+    if (dummy == NULL || mb == NULL) {
+        err_write("backend_io: no memory.");
+        if (dummy)
+            free(dummy);
+        if (mb)
+            mb_free(mb);
+        return -1;
+    }
+    /* 受信途中の応答は読み捨てるリクエストが引き継ぎます。*/
+    *dummy = *req;
+    dummy->ss = NULL;
+    dummy->cmdline = "timed out";
+    dummy->stream = NULL;
+    dummy->stream_error = 1;
+    dummy->done = NULL;
+    dummy->arg = NULL;
+    dummy->hedge = NULL;
+    dummy->timeout_tick = 0;
+    dummy->expire_tick = 0;
+    dummy->next = dummy->prev = NULL;
+    req->mb = mb;
+
+    *pp = dummy;
+    if (conn->recv_tail == req)
+        conn->recv_tail = dummy;
+    req->queue_next = NULL;
+    return 0;
+}
+
+/*
+ * パイプライン接続を切り離して新しいリクエストを送信しないようにします。
+ * 送信を開始していないリクエストは別の接続に移します。
+ */
+static void conn_drain(struct bio_thread_t* th, struct bio_conn_t* conn)
+{
+    struct bio_request_t* req;
+    struct bio_conn_t* next_conn;
+
+    conn->draining = 1;
+    req = conn->send_head;
+    if (req == NULL)
+        return;
+    if (req->vec_index > 0 || req->vec_offset > 0) {
+        /* 送信途中のリクエストはこの接続で送信を終えます。*/
+        conn->send_tail = req;
+        req = req->queue_next;
+        conn->send_tail->queue_next = NULL;
+    } else {
+        conn->send_head = conn->send_tail = NULL;
+    }
+    if (req == NULL)
+        return;
+
+    next_conn = conn_get(th, conn->server);
+    while (req) {
+        struct bio_request_t* next = req->queue_next;
+
+        if (next_conn)
+            send_enqueue(next_conn, req);
+        else
+            bio_complete(th, req, -1);
+        req = next;
+    }
+    if (next_conn)
+        conn_flush(th, next_conn);
+}
+
+/*
+ * 期限を過ぎたリクエストをタイムアウトのエラーとして完了します。
+ * 送信を開始していないリクエストはそのリクエストだけを完了します。
+ * パイプライン接続で応答を待っているリクエストもそのリクエストだけを
+ * 完了して、接続は応答待ちがなくなるまで切り離します。
+ * プールのソケットと送信途中のリクエストは接続をエラーにします。
+ */
+static void request_timeout(struct bio_thread_t* th, struct bio_request_t* req)
+{
+    struct bio_conn_t* conn = req->conn;
+
+    err_write("backend_io: (%s) %s:%d data store server timeout.",
+              req->cmdline, req->server->ip, req->server->port);
+
+    if (conn == NULL) {
+        bio_complete(th, req, -1);
+        return;
+    }
+    if (! conn->pooled && req->state == BIO_SEND &&
+        req->vec_index == 0 && req->vec_offset == 0) {
+        struct bio_request_t** pp = &conn->send_head;
+        struct bio_request_t* prev = NULL;
+
+        while (*pp && *pp != req) {
+            prev = *pp;
+            pp = &(*pp)->queue_next;
+        }
+        if (*pp) {
+            *pp = req->queue_next;
+            if (conn->send_tail == req)
+                conn->send_tail = prev;
+            bio_complete(th, req, -1);
+            return;
+        }
+    }
+    if (! conn->pooled && req->state != BIO_SEND && request_discard(conn, req) == 0) {
+        bio_complete(th, req, -1);
+        conn_drain(th, conn);
+        return;
+    }
+    conn_fail(th, conn);
+}
+
+static void bio_expire(struct bio_thread_t* th)
+{
+    int64 now;
+    int64 n;
+
+    now = current_tick();
+    if (th->tick == 0 || now - th->tick > BIO_WHEEL_SLOTS)
+        th->tick = now - BIO_WHEEL_SLOTS;
+
+    for (n = th->tick + 1; n <= now; n++) {
+        struct bio_request_t* req = th->wheel[n % BIO_WHEEL_SLOTS];
+
+        while (req) {
+            if (req->expire_tick <= now && req->hedge &&
+                (req->timeout_tick == 0 || req->timeout_tick > now)) {
+                void (*hedge)(struct bio_request_t*) = req->hedge;
+
+                /* 応答を待ったままヘッジのリクエストを送信します。*/
+                timer_remove(th, req);
+                req->hedge = NULL;
+                timer_insert(th, req, req->timeout_tick);
+                hedge(req);
+                req = th->wheel[n % BIO_WHEEL_SLOTS];
+            } else if (req->expire_tick <= now) {
+                /* 同じ接続のリクエストも完了するので先頭から調べ直します。*/
+                request_timeout(th, req);
+                req = th->wheel[n % BIO_WHEEL_SLOTS];
+            } else {
+                req = req->next;
+            }
+        }
+    }
+    th->tick = now;
+}
+
+/* 切断の完了を待機しているスレッドに通知します。*/
+static void detach_done(struct bio_thread_t* th)
+{
+    pthread_mutex_lock(&bio_detach_mutex);
+    th->detach_server = NULL;
+    pthread_cond_broadcast(&bio_detach_cond);
+    pthread_mutex_unlock(&bio_detach_mutex);
+}
+
+/* 切断を指示されたサーバーのパイプライン接続をエラーにします。*/
+static void bio_detach(struct bio_thread_t* th)
+{
+    struct server_t* server;
+    struct bio_conn_t* conn;
+
+    pthread_mutex_lock(&bio_detach_mutex);
+    server = th->detach_server;
+    pthread_mutex_unlock(&bio_detach_mutex);
+    if (server == NULL)
+        return;
+    conn = th->conns;
+    while (conn) {
+        struct bio_conn_t* next = conn->next;
+
+        if (! conn->pooled && conn->server == server)
+            conn_fail(th, conn);
+        conn = next;
+    }
+    detach_done(th);
+}
+
+/* 実行中のリクエストをすべてエラーで完了します。*/
+static void bio_abort(struct bio_thread_t* th)
+{
+    int i;
+
+    bio_accept(th);
+    while (th->conns)
+        conn_fail(th, th->conns);
+    /* 接続を開始できずに残ったリクエストはありませんが念のためです。*/
+    for (i = 0; i < BIO_WHEEL_SLOTS; i++) {
+        while (th->wheel[i])
+            bio_complete(th, th->wheel[i], -1);
+    }
+}
+
+static void bio_thread(void* argv)
+{
+    struct bio_thread_t* th = (struct bio_thread_t*)argv;
+    struct epoll_event events[BIO_MAX_EVENTS];
+
+    while (! th->stop_flag) {
+        int n;
+        int i;
+
+        n = epoll_wait(th->epfd, events, BIO_MAX_EVENTS, BIO_TICK_MSEC);
+        if (n < 0 && errno != EINTR) {
+            err_write("backend_io: epoll_wait() error[%d].", errno);
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            struct bio_conn_t* conn = (struct bio_conn_t*)events[i].data.ptr;
+
+            if (conn == NULL) {
+                uint64_t v;
+
+                /* 登録の通知を読み捨てます。*/
+                while (read(th->wakefd, &v, sizeof(v)) > 0)
+                    ;
+                continue;
+            }
+            conn_event(th, conn, events[i].events);
+        }
+        bio_accept(th);
+        bio_detach(th);
+        bio_expire(th);
+    }
+    bio_abort(th);
+
+    /* 接続はすべて解放したので切断を待機しているスレッドを再開します。*/
+    th->stop_flag = 1;
+    detach_done(th);
+}
+
+static void bio_wakeup(struct bio_thread_t* th)
+{
+    uint64_t v = 1;
+
+    if (write(th->wakefd, &v, sizeof(v)) < 0)
+        err_write("backend_io: eventfd write error[%d].", errno);
+}
+
+/*
+ * コマンドを I/O スレッドに登録します。
+ * req->ss が NULL の場合はパイプライン接続で送信します。
+ * プールから取得したソケットは完了のコールバック関数で返却します。
+ * 登録した後はコールバック関数が呼び出されるまで req を参照できません。
+ *
+ * req: リクエストのポインタ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int backend_io_submit(struct bio_request_t* req)
+{
+    struct bio_thread_t* th;
+    int notify;
+
+    if (bio_threads == NULL)
+        return -1;
+
+    /* パイプライン接続はスレッド毎なので同じサーバーは同じスレッドに
+       集めて、接続あたりのリクエスト数を増やします。
+       ポインタの下位ビットは揃っているので素数で割った余りを使います。*/
+    if (req->ss == NULL)
+        th = &bio_threads[(unsigned long)req->server % 977 % bio_thread_num];
+    else
+        th = &bio_threads[(unsigned long)ATOMIC_INC(&bio_next) % bio_thread_num];
+    req->state = BIO_SEND;
+    req->vec_index = 0;
+    req->vec_offset = 0;
+    req->header_len = 0;
+    req->reply_size = 0;
+    req->body_left = 0;
+    req->stream_error = 0;
+    req->timeout_tick = 0;
+    req->expire_tick = 0;
+    req->conn = NULL;
+    req->queue_next = NULL;
+    req->next = req->prev = NULL;
+    req->mb = mb_alloc(BUF_SIZE);
+    if (req->mb == NULL) {
+        err_write("backend_io: mb_alloc() no memory.");
+        return -1;
+    }
+    ATOMIC_INC(&bio_count);
+
+    CS_START(&th->critical_section);
+    notify = (th->submit_head == NULL);
+    if (th->submit_tail)
+        th->submit_tail->next = req;
+    else
+        th->submit_head = req;
+    th->submit_tail = req;
+    CS_END(&th->critical_section);
+
+    if (notify)
+        bio_wakeup(th);
+    return 0;
+}
+
+/*
+ * 削除するサーバーのパイプライン接続を切断します。
+ * 応答待ちのリクエストはエラーとして完了します。
+ * すべての I/O スレッドが切断するまで待機します。
+ * 同時に呼び出された場合は順番に切断します。
+ *
+ * server: サーバー構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void backend_io_detach_server(struct server_t* server)
+{
+    int i;
+
+    if (bio_threads == NULL || g_conf->backend_pipeline < 1)
+        return;
+
+    /* I/O スレッドに指示するサーバーはひとつなので前の切断の完了を待ちます。
+       I/O スレッドは切断を終えると条件変数で通知します。*/
+    pthread_mutex_lock(&bio_detach_mutex);
+    for (i = 0; i < bio_thread_num; i++) {
+        struct bio_thread_t* th = &bio_threads[i];
+
+        while (th->detach_server && ! th->stop_flag)
+            pthread_cond_wait(&bio_detach_cond, &bio_detach_mutex);
+        if (th->stop_flag)
+            continue;
+        th->detach_server = server;
+        bio_wakeup(th);
+    }
+    for (i = 0; i < bio_thread_num; i++) {
+        struct bio_thread_t* th = &bio_threads[i];
+
+        while (th->detach_server == server && ! th->stop_flag)
+            pthread_cond_wait(&bio_detach_cond, &bio_detach_mutex);
+    }
+    pthread_mutex_unlock(&bio_detach_mutex);
+}
+
+/*
+ * パイプライン接続を使用するか調べます。
+ *
+ * 戻り値
+ *  使用する場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+int backend_io_pipelined()
+{
+    return (bio_threads != NULL && g_conf->backend_pipeline > 0);
+}
+
+/*
+ * I/O スレッドが開始されているか調べます。
+ *
+ * 戻り値
+ *  開始されている場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+int backend_io_enabled()
+{
+    return (bio_threads != NULL);
+}
+
+/*
+ * I/O スレッドで実行中のリクエスト数を返します。
+ *
+ * 戻り値
+ *  リクエスト数を返します。
+ */
+int backend_io_count()
+{
+    return (int)bio_count;
+}
+
+/*
+ * I/O スレッドが保持しているパイプライン接続数を返します。
+ *
+ * 戻り値
+ *  接続数を返します。
+ */
+int backend_io_conns()
+{
+    return (int)bio_conn_count;
+}
+
+/*
+ * I/O スレッドの送信の統計を求めます。
+ *
+ * writes: 送信のシステムコール数が設定されます。
+ * requests: 送信したリクエスト数が設定されます。
+ * batch_max: 一度に送信した最大リクエスト数が設定されます。
+ *
+ * 戻り値
+ *  なし
+ */
+void backend_io_write_stats(int64* writes, int64* requests, int* batch_max)
+{
+    *writes = bio_writes;
+    *requests = bio_write_requests;
+    *batch_max = (int)bio_write_batch_max;
+}
+
+static void bio_close(struct bio_thread_t* th)
+{
+    if (th->epfd >= 0)
+        close(th->epfd);
+    if (th->wakefd >= 0)
+        close(th->wakefd);
+    CS_DELETE(&th->critical_section);
+}
+
+/* 開始したスレッドを終了します。*/
+static void bio_stop(struct bio_thread_t* threads, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        uint64_t v = 1;
+
+        threads[i].stop_flag = 1;
+        if (write(threads[i].wakefd, &v, sizeof(v)) < 0)
+            err_write("backend_io: eventfd write error[%d].", errno);
+    }
+    for (i = 0; i < num; i++)
+        pthread_join(threads[i].thread_id, NULL);
+}
+
+/*
+ * I/O スレッドを開始します。
+ * dinio.backend_io_threads がゼロの場合は何もしません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int backend_io_initialize()
+{
+    struct bio_thread_t* threads;
+    int i;
+
+    if (g_conf->backend_io_threads < 1)
+        return 0;
+
+    threads = (struct bio_thread_t*)calloc(g_conf->backend_io_threads, sizeof(struct bio_thread_t));
+    if (threads == NULL) {
+        err_write("backend_io: no memory.");
+        return -1;
+    }
+    pthread_mutex_init(&bio_detach_mutex, NULL);
+    pthread_cond_init(&bio_detach_cond, NULL);
+
+    for (i = 0; i < g_conf->backend_io_threads; i++) {
+        struct bio_thread_t* th = &threads[i];
+        struct epoll_event ev;
+
+        CS_INIT(&th->critical_section);
+        th->epfd = epoll_create(BIO_MAX_EVENTS);
+        th->wakefd = eventfd(0, EFD_NONBLOCK);
+        if (th->epfd < 0 || th->wakefd < 0) {
+            err_write("backend_io: epoll_create()/eventfd() error[%d].", errno);
+            goto error;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, th->wakefd, &ev) < 0) {
+            err_write("backend_io: epoll_ctl() error[%d].", errno);
+            goto error;
+        }
+        if (pthread_create(&th->thread_id, NULL, (void*)bio_thread, th) != 0) {
+            err_write("backend_io: pthread_create() error.");
+            goto error;
+        }
+    }
+    bio_threads = threads;
+    bio_thread_num = g_conf->backend_io_threads;
+    TRACE("%d backend I/O threads started.\n", bio_thread_num);
+    return 0;
+
+error:
+    bio_stop(threads, i);
+    for (; i >= 0; i--)
+        bio_close(&threads[i]);
+    free(threads);
+    pthread_cond_destroy(&bio_detach_cond);
+    pthread_mutex_destroy(&bio_detach_mutex);
+    return -1;
+}
+
+/*
+ * I/O スレッドを終了します。
+ * 実行中のリクエストはエラーとして完了します。
+ *
+ * 戻り値
+ *  なし
+ */
+void backend_io_finalize()
+{
+    struct bio_thread_t* threads = bio_threads;
+    int i;
+
+    if (threads == NULL)
+        return;
+
+    bio_stop(threads, bio_thread_num);
+    for (i = 0; i < bio_thread_num; i++)
+        bio_close(&threads[i]);
+    bio_threads = NULL;
+    bio_thread_num = 0;
+    free(threads);
+    pthread_cond_destroy(&bio_detach_cond);
+    pthread_mutex_destroy(&bio_detach_mutex);
+}
+
+#else   /* __linux__ */
+
+int backend_io_submit(struct bio_request_t* req)
+{
+    return -1;
+}
+
+int backend_io_enabled()
+{
+    return 0;
+}
+
+int backend_io_count()
+{
+    return 0;
+}
+
+int backend_io_conns()
+{
+    return 0;
+}
+
+void backend_io_write_stats(int64* writes, int64* requests, int* batch_max)
+{
+    *writes = 0;
+    *requests = 0;
+    *batch_max = 0;
+}
+
+int backend_io_pipelined()
+{
+    return 0;
+}
+
+void backend_io_detach_server(struct server_t* server)
+{
+}
+
+int backend_io_initialize()
+{
+    if (g_conf->backend_io_threads > 0)
+        TRACE("%s\n", "backend I/O threads are supported on Linux only.");
+    return 0;
+}
+
+void backend_io_finalize()
+{
+}
+
+#endif  /* __linux__ */
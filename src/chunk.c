@@ -0,0 +1,753 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * データストアの最大サイズ(MAX_MEMCACHED_DATASIZE)を超える値を
+ * 分割して保存します。
+ *
+ * set の値は CHUNK_DATASIZE 毎に分割してチャンクキーで保存します。
+ * チャンクキーは ds_key_server() で配置されるので値の転送は
+ * 複数のデータストアに分散されます。
+ * 利用者のキーにはチャンクの情報(マニフェスト)を保存します。
+ *
+ * マニフェスト: CHUNK_MAGIC <id> <bytes> <chunks>
+ * チャンクキー: __dinio_chunk:<id>:<n>
+ *
+ * get の応答にマニフェストが含まれている場合はチャンクを
+ * データストア毎にまとめて並行して取得して値を復元します。
+ * チャンクが取得できない場合はキーが存在しないものとします。
+ *
+ * set, delete でキーを置き換える場合は更新の前に chunk_lookup() で
+ * 以前のマニフェストを取得して、更新が完了した後に chunk_remove() で
+ * 以前のチャンクを削除します。
+ * その他の更新コマンドやエラーで削除できなかったチャンクは
+ * マニフェストと同じ有効期限で保存されているので
+ * データストアの有効期限または LRU で削除されます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define CHUNK_DATASIZE      (512*1024)
+#define CHUNK_MAGIC         "\001DINIO-CHUNKS/1 "
+#define CHUNK_KEY_FORMAT    "__dinio_chunk:%016llx:%d"
+#define CHUNK_MANIFEST_SIZE 256     /* マニフェストの最大サイズ */
+
+/* データストア毎にまとめたチャンク */
+struct chunk_group_t {
+    struct server_t* server;
+    struct server_socket_t* ss;
+    int pending;        /* 応答を受信していないリクエスト数 */
+    int result;
+};
+
+static volatile long chunk_seq;
+
+/* key を保持している稼動中のサーバーを求めます。*/
+static struct server_t* chunk_server(const char* key)
+{
+    struct server_t* server;
+    int retry;
+
+    server = ds_key_server(key, strlen(key));
+    retry = g_conf->replications + 1;
+    while (server && server->status == DSS_INACTIVE) {
+        if (--retry < 1)
+            return NULL;
+        server = ds_next_server(server);
+    }
+    return server;
+}
+
+/*
+ * チャンクを保存するサーバー毎にまとめます。
+ *
+ * 戻り値
+ *  グループ数を返します。
+ *  サーバーが存在しない場合は -1 を返します。
+ */
+static int chunk_grouping(int64 id,
+                          int chunks,
+                          struct chunk_group_t* groups,
+                          int* group_index)
+{
+    int group_num = 0;
+    int i, g;
+
+    for (i = 0; i < chunks; i++) {
+        char ckey[MAX_MEMCACHED_KEYSIZE+1];
+        struct server_t* server;
+
+        snprintf(ckey, sizeof(ckey), CHUNK_KEY_FORMAT, id, i);
+        server = chunk_server(ckey);
+        if (server == NULL) {
+            err_write("chunk: (%s) ds_key_server() is NULL.", ckey);
+            return -1;
+        }
+        for (g = 0; g < group_num; g++) {
+            if (groups[g].server == server)
+                break;
+        }
+        if (g == group_num) {
+            groups[g].server = server;
+            groups[g].ss = NULL;
+            groups[g].pending = 0;
+            groups[g].result = -1;
+            group_num++;
+        }
+        group_index[i] = g;
+    }
+    return group_num;
+}
+
+/* グループのソケットを取得します。*/
+static int group_socket(struct chunk_group_t* grp)
+{
+    if (grp->ss)
+        return 0;
+    if (ds_check_server(grp->server) < 0) {
+        err_write("chunk: %s:%d was locked/inactive.", grp->server->ip, grp->server->port);
+        return -1;
+    }
+    grp->ss = ds_server_socket(grp->server);
+    if (grp->ss == NULL) {
+        err_write("chunk: %s:%d ds_server_socket() is NULL.", grp->server->ip, grp->server->port);
+        return -1;
+    }
+    grp->ss->probe = ds_breaker_probe(grp->server);
+    grp->result = 0;
+    return 0;
+}
+
+/*
+ * グループのソケットをプールへ返却します。
+ * エラーで中断した場合に応答を受信していないリクエストが残っている
+ * ソケットはリセットして、次のコマンドが古い応答を受信しないようにします。
+ */
+static void release_groups(struct chunk_group_t* groups, int group_num, int result)
+{
+    int g;
+
+    for (g = 0; g < group_num; g++) {
+        if (groups[g].ss == NULL)
+            continue;
+        if (result < 0 && groups[g].pending > 0)
+            groups[g].result = -1;
+        ds_release_socket(groups[g].server, groups[g].ss, groups[g].result);
+    }
+}
+
+static int recv_reply_line(struct chunk_group_t* grp, char* buf, int bufsize)
+{
+    if (g_conf->datastore_timeout >= 0) {
+        if (! wait_recv_data(grp->ss->socket, g_conf->datastore_timeout)) {
+            err_write("chunk: %s:%d data store server timeout.", grp->server->ip, grp->server->port);
+            return -1;
+        }
+    }
+    return recv_line(grp->ss->socket, buf, bufsize, LINE_DELIMITER);
+}
+
+/*
+ * set の値が分割して保存する大きさか調べます。
+ *
+ * rb: データブロックのバッファ
+ *
+ * 戻り値
+ *  分割する場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+int chunk_required(struct reqbuf_t* rb)
+{
+    if (rb == NULL)
+        return 0;
+    return (rb->size - (int)strlen(LINE_DELIMITER) > MAX_MEMCACHED_DATASIZE);
+}
+
+/*
+ * 値を分割して保存する設定か調べます。
+ * dinio.max_value_size が MAX_MEMCACHED_DATASIZE を超える場合に分割します。
+ *
+ * 戻り値
+ *  分割する設定の場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+int chunk_enabled()
+{
+    return (g_conf->max_value_size * 1024 > MAX_MEMCACHED_DATASIZE);
+}
+
+/*
+ * set <key> <flags> <exptime> <bytes> [noreply] の値を分割して保存します。
+ * チャンクはデータストア毎にまとめて送信してから応答を受信します。
+ * 利用者のキーに保存するマニフェストとコマンド行を作成します。
+ *
+ * cmdline: set のコマンド行
+ * rb: データブロックのバッファ
+ * mcmdline: マニフェストを保存するコマンド行が設定される領域
+ * mcmdline_size: mcmdline の領域サイズ
+ *
+ * 戻り値
+ *  マニフェストのデータブロックのバッファを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct reqbuf_t* chunk_store(const char* cmdline,
+                             struct reqbuf_t* rb,
+                             char* mcmdline,
+                             int mcmdline_size)
+{
+    char tbuf[CMDLINE_SIZE];
+    struct cmdline_t cmdl;
+    int dsize;
+    int chunks;
+    int64 id;
+    struct chunk_group_t* groups = NULL;
+    int* group_index = NULL;
+    int group_num = 0;
+    struct reqbuf_t* mrb = NULL;
+    char manifest[CHUNK_MANIFEST_SIZE];
+    int mlen;
+    int i;
+    int result = -1;
+
+    strcpy(tbuf, cmdline);
+    if (cmd_tokenize(tbuf, &cmdl) < 5)
+        return NULL;
+
+    dsize = rb->size - strlen(LINE_DELIMITER);
+    chunks = (dsize + CHUNK_DATASIZE - 1) / CHUNK_DATASIZE;
+    id = ((int64)ch_hash(cmdl.cl[1], strlen(cmdl.cl[1])) << 32) ^
+         ((int64)ATOMIC_INC(&chunk_seq) << 20) ^ system_time();
+
+    groups = (struct chunk_group_t*)calloc(chunks, sizeof(struct chunk_group_t));
+    group_index = (int*)calloc(chunks, sizeof(int));
+    if (groups == NULL || group_index == NULL) {
+        err_write("chunk_store: no memory.");
+        goto final;
+    }
+    group_num = chunk_grouping(id, chunks, groups, group_index);
+    if (group_num < 0)
+        goto final;
+
+    /* チャンクをサーバー毎のソケットへ送信します。*/
+    for (i = 0; i < chunks; i++) {
+        struct chunk_group_t* grp = &groups[group_index[i]];
+        char cbuf[CMDLINE_SIZE];
+        struct sendvec_t vec[3];
+        int size;
+
+        if (group_socket(grp) < 0)
+            goto final;
+        size = (i < chunks - 1)? CHUNK_DATASIZE : dsize - i * CHUNK_DATASIZE;
+        snprintf(cbuf, sizeof(cbuf), "set " CHUNK_KEY_FORMAT " 0 %s %d%s",
+                 id, i, cmdl.cl[3], size, LINE_DELIMITER);
+        vec[0].buf = cbuf;
+        vec[0].len = strlen(cbuf);
+        vec[1].buf = &rb->data[i * CHUNK_DATASIZE];
+        vec[1].len = size;
+        vec[2].buf = LINE_DELIMITER;
+        vec[2].len = strlen(LINE_DELIMITER);
+        if (send_datav(grp->ss->socket, vec, 3) < 0) {
+            err_write("chunk_store: %s:%d send error.", grp->server->ip, grp->server->port);
+            grp->result = -1;
+            goto final;
+        }
+        grp->pending++;
+    }
+
+    /* チャンクの応答を受信します。*/
+    for (i = 0; i < chunks; i++) {
+        struct chunk_group_t* grp = &groups[group_index[i]];
+        char buf[BUF_SIZE];
+
+        if (recv_reply_line(grp, buf, sizeof(buf)) < 0) {
+            grp->result = -1;
+            goto final;
+        }
+        grp->pending--;
+        if (strcmp(buf, "STORED") != 0) {
+            err_write("chunk_store: %s:%d recv_line(STORED)=%s.",
+                      grp->server->ip, grp->server->port, buf);
+            grp->result = -1;
+            goto final;
+        }
+        mt_increment64(&grp->server->set_count);
+    }
+
+    /* チャンクをレプリケーションします。*/
+    if (g_conf->replications > 0) {
+        for (i = 0; i < chunks; i++) {
+            char ckey[MAX_MEMCACHED_KEYSIZE+1];
+            struct server_t* server = groups[group_index[i]].server;
+
+            snprintf(ckey, sizeof(ckey), CHUNK_KEY_FORMAT, id, i);
+            if (g_conf->replication_threads > 0)
+                replication_event_entry(server, CMDGRP_SET, ckey);
+            else
+                do_replication(server, CMDGRP_SET, ckey);
+        }
+    }
+
+    /* マニフェストを作成します。*/
+    snprintf(manifest, sizeof(manifest), CHUNK_MAGIC "%016llx %d %d", id, dsize, chunks);
+    mlen = strlen(manifest);
+    mrb = reqbuf_alloc(mlen + strlen(LINE_DELIMITER) + 1);
+    if (mrb == NULL) {
+        err_write("chunk_store: no memory.");
+        goto final;
+    }
+    memcpy(mrb->data, manifest, mlen);
+    memcpy(&mrb->data[mlen], LINE_DELIMITER, strlen(LINE_DELIMITER));
+    mrb->size = mlen + strlen(LINE_DELIMITER);
+
+    snprintf(mcmdline, mcmdline_size, "%s %s %s %s %d%s",
+             cmdl.cl[0], cmdl.cl[1], cmdl.cl[2], cmdl.cl[3], mlen,
+             (cmdl.cn > 5)? " noreply" : "");
+    result = 0;
+
+final:
+    if (groups) {
+        release_groups(groups, group_num, result);
+        free(groups);
+    }
+    if (group_index)
+        free(group_index);
+    if (result < 0 && mrb) {
+        reqbuf_release(mrb);
+        mrb = NULL;
+    }
+    return mrb;
+}
+
+/*
+ * チャンクを取得して値を復元します。
+ *
+ * 戻り値
+ *  値のバッファを返します(free() で解放します)。
+ *  チャンクが存在しない場合やエラーの場合は NULL を返します。
+ */
+static char* chunk_load(int64 id, int dsize, int chunks)
+{
+    struct chunk_group_t* groups = NULL;
+    int* group_index = NULL;
+    int group_num = 0;
+    char* data = NULL;
+    int i;
+    int result = -1;
+
+    if (dsize < 1 || chunks < 1 || chunks != (dsize + CHUNK_DATASIZE - 1) / CHUNK_DATASIZE)
+        return NULL;
+
+    groups = (struct chunk_group_t*)calloc(chunks, sizeof(struct chunk_group_t));
+    group_index = (int*)calloc(chunks, sizeof(int));
+    data = (char*)malloc(dsize);
+    if (groups == NULL || group_index == NULL || data == NULL) {
+        err_write("chunk_load: no memory.");
+        goto final;
+    }
+    group_num = chunk_grouping(id, chunks, groups, group_index);
+    if (group_num < 0)
+        goto final;
+
+    /* すべてのサーバーへ get を送信してから応答を受信します。*/
+    for (i = 0; i < chunks; i++) {
+        struct chunk_group_t* grp = &groups[group_index[i]];
+        char cbuf[CMDLINE_SIZE];
+
+        if (group_socket(grp) < 0)
+            goto final;
+        snprintf(cbuf, sizeof(cbuf), "get " CHUNK_KEY_FORMAT "%s", id, i, LINE_DELIMITER);
+        if (send_data(grp->ss->socket, cbuf, strlen(cbuf)) < 0) {
+            err_write("chunk_load: %s:%d send error.", grp->server->ip, grp->server->port);
+            grp->result = -1;
+            goto final;
+        }
+        grp->pending++;
+    }
+
+    /* VALUE <key> <flags> <bytes><CRLF>
+       <data block><CRLF>
+       END<CRLF> */
+    for (i = 0; i < chunks; i++) {
+        struct chunk_group_t* grp = &groups[group_index[i]];
+        char buf[BUF_SIZE];
+        struct cmdline_t cmdl;
+        int size;
+        int status;
+        char crlf[2];
+
+        size = (i < chunks - 1)? CHUNK_DATASIZE : dsize - i * CHUNK_DATASIZE;
+        if (recv_reply_line(grp, buf, sizeof(buf)) < 0) {
+            grp->result = -1;
+            goto final;
+        }
+        if (strcmp(buf, "END") == 0) {
+            /* 以降のチャンクの応答は読み捨てるためにソケットを再接続します。*/
+            grp->result = -1;
+            goto final;
+        }
+        if (cmd_tokenize(buf, &cmdl) < 4 || strcmp(cmdl.cl[0], "VALUE") != 0 ||
+            atoi(cmdl.cl[3]) != size) {
+            err_write("chunk_load: %s:%d invalid chunk %d.", grp->server->ip, grp->server->port, i);
+            grp->result = -1;
+            goto final;
+        }
+        if (recv_nchar(grp->ss->socket, &data[i * CHUNK_DATASIZE], size, &status) != size ||
+            recv_nchar(grp->ss->socket, crlf, sizeof(crlf), &status) != sizeof(crlf) ||
+            recv_reply_line(grp, buf, sizeof(buf)) < 0) {
+            err_write("chunk_load: %s:%d recv error.", grp->server->ip, grp->server->port);
+            grp->result = -1;
+            goto final;
+        }
+        grp->pending--;
+        mt_increment64(&grp->server->get_count);
+    }
+    result = 0;
+
+final:
+    if (groups) {
+        release_groups(groups, group_num, result);
+        free(groups);
+    }
+    if (group_index)
+        free(group_index);
+    if (result < 0 && data) {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+/*
+ * キーの値がマニフェストの場合はチャンクの情報を取得します。
+ * set, delete で置き換えられるチャンクを削除するために更新の前に呼び出します。
+ *
+ * key: キー
+ * chunks: チャンク数が設定される領域
+ *
+ * 戻り値
+ *  マニフェストの場合はチャンクの ID を返します。
+ *  マニフェストではない場合やエラーの場合はゼロを返します。
+ */
+int64 chunk_lookup(const char* key, int* chunks)
+{
+    struct chunk_group_t grp;
+    char buf[BUF_SIZE];
+    struct cmdline_t cmdl;
+    int bytes;
+    int status;
+    int64 id = 0;
+    int dsize;
+
+    if (! chunk_enabled())
+        return 0;
+
+    memset(&grp, 0, sizeof(grp));
+    grp.server = chunk_server(key);
+    if (grp.server == NULL)
+        return 0;
+    if (group_socket(&grp) < 0)
+        return 0;
+
+    snprintf(buf, sizeof(buf), "get %s%s", key, LINE_DELIMITER);
+    if (send_data(grp.ss->socket, buf, strlen(buf)) < 0) {
+        err_write("chunk_lookup: %s:%d send error.", grp.server->ip, grp.server->port);
+        grp.result = -1;
+        goto final;
+    }
+    grp.pending++;
+
+    /* VALUE <key> <flags> <bytes><CRLF>
+       <data block><CRLF>
+       END<CRLF> */
+    if (recv_reply_line(&grp, buf, sizeof(buf)) < 0) {
+        grp.result = -1;
+        goto final;
+    }
+    if (strcmp(buf, "END") == 0) {
+        grp.pending--;
+        goto final;
+    }
+    if (cmd_tokenize(buf, &cmdl) < 4 || strcmp(cmdl.cl[0], "VALUE") != 0) {
+        err_write("chunk_lookup: %s:%d invalid reply.", grp.server->ip, grp.server->port);
+        grp.result = -1;
+        goto final;
+    }
+    bytes = atoi(cmdl.cl[3]) + strlen(LINE_DELIMITER);
+    if (bytes <= CHUNK_MANIFEST_SIZE) {
+        if (recv_nchar(grp.ss->socket, buf, bytes, &status) != bytes) {
+            grp.result = -1;
+            goto final;
+        }
+        buf[bytes] = '\0';
+        if (memcmp(buf, CHUNK_MAGIC, strlen(CHUNK_MAGIC)) == 0 &&
+            sscanf(buf + strlen(CHUNK_MAGIC), "%llx %d %d", &id, &dsize, chunks) != 3)
+            id = 0;
+    } else {
+        /* マニフェストではない値は読み捨てます。*/
+        while (bytes > 0) {
+            int len = (bytes > (int)sizeof(buf))? (int)sizeof(buf) : bytes;
+
+            if (recv_nchar(grp.ss->socket, buf, len, &status) != len) {
+                grp.result = -1;
+                goto final;
+            }
+            bytes -= len;
+        }
+    }
+    if (recv_reply_line(&grp, buf, sizeof(buf)) < 0) {
+        grp.result = -1;
+        id = 0;
+        goto final;
+    }
+    grp.pending--;
+
+final:
+    release_groups(&grp, 1, grp.result);
+    return id;
+}
+
+/*
+ * chunk_lookup() で取得したチャンクを削除します。
+ * set, delete でマニフェストを置き換えた後に呼び出します。
+ *
+ * id: チャンクの ID
+ * chunks: チャンク数
+ *
+ * 戻り値
+ *  なし
+ */
+void chunk_remove(int64 id, int chunks)
+{
+    struct chunk_group_t* groups = NULL;
+    int* group_index = NULL;
+    int group_num = 0;
+    int i;
+    int result = -1;
+
+    if (id == 0 || chunks < 1)
+        return;
+
+    groups = (struct chunk_group_t*)calloc(chunks, sizeof(struct chunk_group_t));
+    group_index = (int*)calloc(chunks, sizeof(int));
+    if (groups == NULL || group_index == NULL) {
+        err_write("chunk_remove: no memory.");
+        goto final;
+    }
+    group_num = chunk_grouping(id, chunks, groups, group_index);
+    if (group_num < 0)
+        goto final;
+
+    /* すべてのサーバーへ delete を送信してから応答を受信します。*/
+    for (i = 0; i < chunks; i++) {
+        struct chunk_group_t* grp = &groups[group_index[i]];
+        char cbuf[CMDLINE_SIZE];
+
+        if (group_socket(grp) < 0)
+            goto final;
+        snprintf(cbuf, sizeof(cbuf), "delete " CHUNK_KEY_FORMAT "%s", id, i, LINE_DELIMITER);
+        if (send_data(grp->ss->socket, cbuf, strlen(cbuf)) < 0) {
+            err_write("chunk_remove: %s:%d send error.", grp->server->ip, grp->server->port);
+            grp->result = -1;
+            goto final;
+        }
+        grp->pending++;
+    }
+
+    for (i = 0; i < chunks; i++) {
+        struct chunk_group_t* grp = &groups[group_index[i]];
+        char buf[BUF_SIZE];
+
+        if (recv_reply_line(grp, buf, sizeof(buf)) < 0) {
+            grp->result = -1;
+            goto final;
+        }
+        grp->pending--;
+        if (strcmp(buf, "DELETED") == 0)
+            mt_increment64(&grp->server->del_count);
+    }
+
+    /* チャンクの削除をレプリケーションします。*/
+    if (g_conf->replications > 0) {
+        for (i = 0; i < chunks; i++) {
+            char ckey[MAX_MEMCACHED_KEYSIZE+1];
+            struct server_t* server = groups[group_index[i]].server;
+
+            snprintf(ckey, sizeof(ckey), CHUNK_KEY_FORMAT, id, i);
+            if (g_conf->replication_threads > 0)
+                replication_event_entry(server, CMDGRP_DELETE, ckey);
+            else
+                do_replication(server, CMDGRP_DELETE, ckey);
+        }
+    }
+    result = 0;
+
+final:
+    if (groups) {
+        release_groups(groups, group_num, result);
+        free(groups);
+    }
+    if (group_index)
+        free(group_index);
+}
+
+/*
+ * get, gets の応答エントリにマニフェストが含まれているか調べます。
+ * I/O スレッドで受信した応答をディスパッチスレッドで
+ * chunk_expand() するか判定するために呼び出します。
+ * データブロックの先頭以外の一致も含まれているとしますが、
+ * chunk_expand() はマニフェストだけを置き換えます。
+ *
+ * reply: 応答エントリのポインタ
+ *
+ * 戻り値
+ *  含まれている場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+int chunk_included(struct reply_t* reply)
+{
+    struct membuf_t* mb;
+    int mlen = strlen(CHUNK_MAGIC);
+    int i;
+
+    if (! chunk_enabled())
+        return 0;
+    if (reply == NULL || reply->streamed || reply->mb == NULL)
+        return 0;
+
+    mb = reply->mb;
+    for (i = 2; i + mlen <= mb->size; i++) {
+        if (mb->buf[i] == CHUNK_MAGIC[0] && mb->buf[i-1] == '\n' &&
+            memcmp(&mb->buf[i], CHUNK_MAGIC, mlen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * get, gets の応答エントリに含まれるマニフェストを
+ * チャンクから復元した値に置き換えます。
+ * 値が復元できない場合は応答から削除します。
+ *
+ * reply: 応答エントリのポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void chunk_expand(struct reply_t* reply)
+{
+    struct membuf_t* src;
+    struct membuf_t* dst = NULL;
+    int pos = 0;
+
+    if (! chunk_enabled())
+        return;
+    if (reply == NULL || reply->mb == NULL || reply->mb->size < 1)
+        return;
+
+    /* VALUE <key> <flags> <bytes> [<cas>]<CRLF>
+       <data block><CRLF> */
+    src = reply->mb;
+    while (pos < src->size) {
+        char line[CMDLINE_SIZE];
+        struct cmdline_t cmdl;
+        char* p;
+        int hlen;
+        int bytes;
+        int next;
+        char* data;
+        int64 id;
+        int dsize;
+        int chunks;
+
+        p = &src->buf[pos];
+        if (src->size - pos < 6 || memcmp(p, "VALUE ", 6) != 0)
+            break;
+        for (hlen = 0; pos + hlen + 1 < src->size; hlen++) {
+            if (p[hlen] == '\r' && p[hlen+1] == '\n')
+                break;
+        }
+        if (pos + hlen + 1 >= src->size || hlen >= (int)sizeof(line))
+            break;
+        memcpy(line, p, hlen);
+        line[hlen] = '\0';
+        if (cmd_tokenize(line, &cmdl) < 4)
+            break;
+        bytes = atoi(cmdl.cl[3]);
+        next = pos + hlen + 2 + bytes + 2;
+        if (next > src->size)
+            break;
+
+        data = p + hlen + 2;
+        if (bytes <= (int)strlen(CHUNK_MAGIC) || memcmp(data, CHUNK_MAGIC, strlen(CHUNK_MAGIC)) != 0) {
+            if (dst)
+                mb_append(dst, p, next - pos);
+            pos = next;
+            continue;
+        }
+
+        /* マニフェストを値に置き換えます。*/
+        if (dst == NULL) {
+            dst = mb_alloc(BUF_SIZE);
+            if (dst == NULL) {
+                err_write("chunk_expand: no memory.");
+                return;
+            }
+            mb_append(dst, src->buf, pos);
+        }
+        if (sscanf(data + strlen(CHUNK_MAGIC), "%llx %d %d", &id, &dsize, &chunks) == 3) {
+            char* value;
+
+            value = chunk_load(id, dsize, chunks);
+            if (value) {
+                char hbuf[CMDLINE_SIZE];
+
+                snprintf(hbuf, sizeof(hbuf), "VALUE %s %s %d%s%s%s",
+                         cmdl.cl[1], cmdl.cl[2], dsize,
+                         (cmdl.cn > 4)? " " : "",
+                         (cmdl.cn > 4)? cmdl.cl[4] : "",
+                         LINE_DELIMITER);
+                mb_append(dst, hbuf, strlen(hbuf));
+                mb_append(dst, value, dsize);
+                mb_append(dst, LINE_DELIMITER, strlen(LINE_DELIMITER));
+                free(value);
+            } else {
+                stats_add(STATS_GET_HITS, -1);
+                stats_add(STATS_GET_MISSES, 1);
+            }
+        }
+        pos = next;
+    }
+
+    if (dst) {
+        /* 残りの応答("END<CRLF>" など)を追加します。*/
+        if (pos < src->size)
+            mb_append(dst, &src->buf[pos], src->size - pos);
+        reply->mb = dst;
+        mb_free(src);
+    }
+}
@@ -0,0 +1,724 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * クライアント接続とパイプライン処理を管理します。
+ *
+ * クライアントはひとつの接続で複数のコマンドを応答を待たずに
+ * 送信(パイプライン)することができます。
+ * コマンドはディスパッチスレッドで並行して実行されますが、
+ * 応答はコマンドを受信した順番でクライアントへ送信されます。
+ *
+ * 1. ワーカスレッドはコマンドを受信した時点で応答エントリ(reply_t)を
+ *    クライアントの応答キューの最後に予約します。
+ * 2. ディスパッチスレッドはデータストアからの応答を予約された
+ *    応答エントリにバッファリングして完了状態にします。
+ * 3. 応答キューの先頭から完了しているエントリを順番に
+ *    クライアントへ送信します。
+ *
+ * クライアント構造体は参照カウントで管理されます。
+ * 応答エントリと実行中のディスパッチ情報はクライアントの参照を保持します。
+ * 接続が終了しても実行中のコマンドが存在する場合は
+ * ソケットのクローズを最後の参照が解放されるまで遅延させます。
+ *
+ * 完了した応答の送信はクライアントのロックを解放して行います。
+ * 応答の順番を守るために送信するスレッドはクライアント毎にひとつで、
+ * 送信中に完了した応答は送信中のスレッドが続けて送信します。
+ *
+ * 参照数が MAX_PIPELINE_REQUESTS を超えた場合はコマンドの受信を中断して、
+ * 参照数が半分以下になった時点でコマンドの受信を再開します。
+ *
+ * 接続中のクライアントはソケット番号を添字とするテーブルで管理します。
+ * テーブルは CLIENT_TABLE_CHUNK 個単位の領域を必要になった時点で
+ * 確保して、確保した領域は移動や解放をしないため参照はロックなしで
+ * 行えます。登録と削除は同じソケット番号に対して同時に行われないので
+ * ロックは領域の確保時のみ使用します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define CLIENT_TABLE_BITS   10
+#define CLIENT_TABLE_CHUNK  (1 << CLIENT_TABLE_BITS)
+#define CLIENT_TABLE_DIRS   1024    /* max 1048576 sockets */
+
+static struct client_t** client_table[CLIENT_TABLE_DIRS];
+static CS_DEF(client_table_lock);
+
+/*
+ * クライアントテーブルを初期化します。
+ *
+ * 戻り値
+ *  なし
+ */
+void client_table_initialize()
+{
+    memset(client_table, 0, sizeof(client_table));
+    CS_INIT(&client_table_lock);
+}
+
+/*
+ * クライアントテーブルを終了します。
+ * テーブルに残っているクライアントは解放されません。
+ *
+ * 戻り値
+ *  なし
+ */
+void client_table_finalize()
+{
+    int i;
+
+    for (i = 0; i < CLIENT_TABLE_DIRS; i++) {
+        if (client_table[i]) {
+            free(client_table[i]);
+            client_table[i] = NULL;
+        }
+    }
+    CS_DELETE(&client_table_lock);
+}
+
+/*
+ * クライアントをソケット番号でテーブルに登録します。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int client_table_put(struct client_t* client)
+{
+    unsigned int index = (unsigned int)client->socket;
+    unsigned int dir = index >> CLIENT_TABLE_BITS;
+
+    if (dir >= CLIENT_TABLE_DIRS) {
+        err_write("client_table_put: socket %d out of range.", client->socket);
+        return -1;
+    }
+    if (client_table[dir] == NULL) {
+        CS_START(&client_table_lock);
+        if (client_table[dir] == NULL) {
+            struct client_t** chunk;
+
+            chunk = (struct client_t**)calloc(CLIENT_TABLE_CHUNK, sizeof(struct client_t*));
+            if (chunk == NULL) {
+                CS_END(&client_table_lock);
+                err_write("client_table_put: no memory.");
+                return -1;
+            }
+            client_table[dir] = chunk;
+        }
+        CS_END(&client_table_lock);
+    }
+    client_table[dir][index & (CLIENT_TABLE_CHUNK - 1)] = client;
+    return 0;
+}
+
+/*
+ * ソケット番号からクライアントを参照します。
+ *
+ * socket: クライアントのソケット
+ *
+ * 戻り値
+ *  クライアント構造体のポインタを返します。
+ *  登録されていない場合は NULL を返します。
+ */
+struct client_t* client_table_get(SOCKET socket)
+{
+    unsigned int index = (unsigned int)socket;
+    unsigned int dir = index >> CLIENT_TABLE_BITS;
+    struct client_t** chunk;
+
+    if (dir >= CLIENT_TABLE_DIRS)
+        return NULL;
+    chunk = client_table[dir];
+    if (chunk == NULL)
+        return NULL;
+    return chunk[index & (CLIENT_TABLE_CHUNK - 1)];
+}
+
+/*
+ * クライアントをテーブルから削除します。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void client_table_remove(struct client_t* client)
+{
+    unsigned int index = (unsigned int)client->socket;
+    unsigned int dir = index >> CLIENT_TABLE_BITS;
+
+    if (dir >= CLIENT_TABLE_DIRS || client_table[dir] == NULL)
+        return;
+    if (client_table[dir][index & (CLIENT_TABLE_CHUNK - 1)] == client)
+        client_table[dir][index & (CLIENT_TABLE_CHUNK - 1)] = NULL;
+}
+
+/*
+ * クライアント構造体を作成します。
+ * 作成時の参照カウントは 1 になります。
+ *
+ * socket: クライアントのソケット
+ * sockaddr: クライアントのアドレス
+ *
+ * 戻り値
+ *  クライアント構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct client_t* client_create(SOCKET socket, struct sockaddr_in sockaddr)
+{
+    struct client_t* client;
+
+    client = (struct client_t*)calloc(1, sizeof(struct client_t));
+    if (client == NULL) {
+        err_write("client_create: no memory.");
+        return NULL;
+    }
+
+    /* ソケットバッファを作成します。*/
+    client->sb = sockbuf_alloc(socket);
+    if (client->sb == NULL) {
+        err_write("client_create: sockbuf_alloc no memory.");
+        free(client);
+        return NULL;
+    }
+    CS_INIT(&client->critical_section);
+#ifdef _WIN32
+    client->drain_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&client->drain_mutex, NULL);
+    pthread_cond_init(&client->drain_cond, NULL);
+#endif
+    client->socket = socket;
+    client->sockaddr = sockaddr;
+    client->refcount = 1;
+
+    stats_add(STATS_CURR_CONNECTIONS, 1);
+    stats_add(STATS_TOTAL_CONNECTIONS, 1);
+    return client;
+}
+
+static void client_free(struct client_t* client)
+{
+    struct reply_t* reply;
+
+    /* ソケットをクローズします。*/
+    shutdown(client->socket, 2);  /* 2: RDWR stop */
+    SOCKET_CLOSE(client->socket);
+
+    reply = client->head;
+    while (reply) {
+        struct reply_t* next;
+
+        next = reply->next;
+        if (reply->mb)
+            mb_free(reply->mb);
+        if (reply->filter_arg)
+            free(reply->filter_arg);
+        free(reply);
+        reply = next;
+    }
+    sockbuf_free(client->sb);
+#ifdef _WIN32
+    CloseHandle(client->drain_cond);
+#else
+    pthread_cond_destroy(&client->drain_cond);
+    pthread_mutex_destroy(&client->drain_mutex);
+#endif
+    CS_DELETE(&client->critical_section);
+    free(client);
+
+    stats_add(STATS_CURR_CONNECTIONS, -1);
+}
+
+/*
+ * クライアントの参照カウントをインクリメントします。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  クライアント構造体のポインタを返します。
+ */
+struct client_t* client_ref(struct client_t* client)
+{
+    CS_START(&client->critical_section);
+    client->refcount++;
+    CS_END(&client->critical_section);
+    return client;
+}
+
+/*
+ * クライアントの参照カウントをデクリメントします。
+ *
+ * 参照カウントがゼロになった場合はソケットをクローズして
+ * 領域を解放します。
+ * コマンドの受信が中断されていて参照数が少なくなった場合は
+ * コマンドの受信を再開します。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void client_release(struct client_t* client)
+{
+    int n;
+    int resume = 0;
+
+    CS_START(&client->critical_section);
+    n = --client->refcount;
+    if (client->suspend_flag && ! client->close_flag &&
+        n <= MAX_PIPELINE_REQUESTS / 2) {
+        client->suspend_flag = 0;
+        client->resume_flag = 1;
+        resume = 1;
+    }
+    CS_END(&client->critical_section);
+
+    if (n == 0) {
+        client_free(client);
+        return;
+    }
+    if (resume) {
+        /* ワーカスレッドでコマンドの受信を再開します。*/
+        memcached_gateway_event(client->socket, client->sockaddr);
+    }
+}
+
+/*
+ * クライアントの接続を終了します。
+ *
+ * 実行中のコマンドが存在する場合はすべての応答を送信した後に
+ * ソケットがクローズされます。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void client_close(struct client_t* client)
+{
+    CS_START(&client->critical_section);
+    client->close_flag = 1;
+    CS_END(&client->critical_section);
+    client_release(client);
+}
+
+/*
+ * 実行中のコマンドが多い場合にコマンドの受信を中断します。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  コマンドの受信を中断した場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+int client_suspend(struct client_t* client)
+{
+    int suspend = 0;
+
+    CS_START(&client->critical_section);
+    if (client->refcount > MAX_PIPELINE_REQUESTS) {
+        client->suspend_flag = 1;
+        suspend = 1;
+    }
+    CS_END(&client->critical_section);
+
+    if (suspend)
+        stats_add(STATS_CONN_YIELDS, 1);
+    return suspend;
+}
+
+/* すべての応答が送信されているか調べます。ロックを取得して呼び出します。*/
+static int replies_drained(struct client_t* client)
+{
+    return (client->head == NULL && ! client->sending);
+}
+
+/* client_wait_replies() で待機しているスレッドを起こします。*/
+static void drain_signal(struct client_t* client)
+{
+#ifdef _WIN32
+    SetEvent(client->drain_cond);
+#else
+    pthread_mutex_lock(&client->drain_mutex);
+    pthread_cond_signal(&client->drain_cond);
+    pthread_mutex_unlock(&client->drain_mutex);
+#endif
+}
+
+/*
+ * 予約されているすべての応答が送信されるまで待機します。
+ * ソケットへ直接応答するコマンドの前に呼び出されます。
+ * 応答キューが空になった時点で reply_complete() から通知されます。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void client_wait_replies(struct client_t* client)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&client->drain_mutex);
+#endif
+    while (! g_shutdown_flag) {
+        int drained;
+
+        CS_START(&client->critical_section);
+        drained = replies_drained(client);
+        client->drain_wait = ! drained;
+        CS_END(&client->critical_section);
+        if (drained)
+            break;
+#ifdef _WIN32
+        WaitForSingleObject(client->drain_cond, INFINITE);
+#else
+        pthread_cond_wait(&client->drain_cond, &client->drain_mutex);
+#endif
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&client->drain_mutex);
+#endif
+}
+
+/*
+ * 応答エントリを応答キューの最後に予約します。
+ * 応答エントリはクライアントの参照を保持します。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  応答エントリのポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct reply_t* reply_reserve(struct client_t* client)
+{
+    struct reply_t* reply;
+
+    reply = (struct reply_t*)calloc(1, sizeof(struct reply_t));
+    if (reply == NULL) {
+        err_write("reply_reserve: no memory.");
+        return NULL;
+    }
+    reply->client = client;
+
+    CS_START(&client->critical_section);
+    client->refcount++;
+    if (client->tail)
+        client->tail->next = reply;
+    else
+        client->head = reply;
+    client->tail = reply;
+    CS_END(&client->critical_section);
+    return reply;
+}
+
+/*
+ * 応答データを応答エントリにバッファリングします。
+ *
+ * reply: 応答エントリのポインタ
+ * buf: 応答データのポインタ
+ * len: 応答データのバイト数
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int reply_append(struct reply_t* reply, const char* buf, int len)
+{
+    if (reply == NULL || len < 1)
+        return 0;
+    if (reply->mb == NULL) {
+        reply->mb = mb_alloc((len > BUF_SIZE)? len : BUF_SIZE);
+        if (reply->mb == NULL) {
+            err_write("reply_append: mb_alloc() no memory.");
+            return -1;
+        }
+    }
+    if (mb_append(reply->mb, buf, len) < 0) {
+        err_write("reply_append: mb_append() no memory %d bytes.", len);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * エラーメッセージを応答エントリにバッファリングします。
+ *
+ * reply: 応答エントリのポインタ
+ * msg: エラーメッセージ(NULLの場合はメッセージなし)
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int reply_append_error(struct reply_t* reply, const char* msg)
+{
+    char buf[256];
+
+    if (msg)
+        snprintf(buf, sizeof(buf), "ERROR %s\r\n", msg);
+    else
+        strcpy(buf, "ERROR\r\n");
+    return reply_append(reply, buf, strlen(buf));
+}
+
+/*
+ * 応答エントリを完了状態にします。
+ *
+ * 応答キューの先頭から完了している応答エントリを順番に
+ * クライアントへ送信します。
+ * 応答エントリは応答キューから取り外してロックを解放した後に
+ * 送信します。他のスレッドが送信中の場合はそのスレッドが送信します。
+ * 送信した応答エントリは解放されます。
+ *
+ * reply->filter が設定されている場合は完了する前に呼び出されて
+ * 応答データ(reply->mb)を変換します。
+ * reply->filter_arg は応答エントリの解放時に free() されます。
+ *
+ * reply: 応答エントリのポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void reply_complete(struct reply_t* reply)
+{
+    struct client_t* client;
+    int n = 0;
+    int drained;
+
+    if (reply == NULL)
+        return;
+
+    /* 応答データを変換します(バイナリプロトコルなど)。*/
+    if (reply->filter)
+        reply->filter(reply);
+
+    client = reply->client;
+    CS_START(&client->critical_section);
+    reply->done = 1;
+    if (client->sending) {
+        /* 送信中のスレッドがこの応答エントリも送信します。*/
+        CS_END(&client->critical_section);
+        return;
+    }
+    client->sending = 1;
+    while (client->head && client->head->done) {
+        struct reply_t* list;
+        struct reply_t* r;
+        int error_flag;
+
+        /* 完了している応答エントリを応答キューから取り外します。*/
+        list = client->head;
+        r = list;
+        while (r->next && r->next->done)
+            r = r->next;
+        client->head = r->next;
+        if (client->head == NULL)
+            client->tail = NULL;
+        r->next = NULL;
+        error_flag = client->error_flag;
+        CS_END(&client->critical_section);
+
+        /* ロックを解放して結果をクライアントへ送信します。*/
+        while (list) {
+            r = list;
+            list = r->next;
+            if (r->mb && ! error_flag) {
+                if (send_data(client->socket, r->mb->buf, r->mb->size) < 0) {
+                    /* クライアントが終了している可能性があるので
+                       以降の応答は破棄します。*/
+                    err_write("reply_complete: %d bytes -> %d client send error.",
+                              r->mb->size, client->socket);
+                    error_flag = 1;
+                } else {
+                    stats_add(STATS_BYTES_WRITTEN, r->mb->size);
+                }
+            }
+            if (r->mb)
+                mb_free(r->mb);
+            if (r->filter_arg)
+                free(r->filter_arg);
+            free(r);
+            n++;
+        }
+
+        CS_START(&client->critical_section);
+        if (error_flag)
+            client->error_flag = 1;
+    }
+    client->sending = 0;
+    drained = (client->head == NULL && client->drain_wait);
+    if (drained)
+        client->drain_wait = 0;
+    CS_END(&client->critical_section);
+
+    if (drained)
+        drain_signal(client);
+
+    /* 送信した応答エントリが保持していた参照を解放します。*/
+    while (n-- > 0)
+        client_release(client);
+}
+
+/*
+ * 応答エントリの応答データを完了を待たずにクライアントへ
+ * 直接送信できるか調べます。
+ *
+ * 応答キューの先頭の応答エントリは完了するまで他のスレッドから
+ * 送信されないので、応答データを受信しながら送信できます。
+ * 先行する応答を他のスレッドが送信中の場合は送信できません。
+ * 応答データを変換する場合(reply->filter)は送信できません。
+ * バッファリングされている応答データは送信されます。
+ *
+ * reply: 応答エントリのポインタ
+ *
+ * 戻り値
+ *  直接送信できる場合はゼロを返します。
+ *  送信できない場合は -1 を返します。
+ */
+int reply_stream_start(struct reply_t* reply)
+{
+    struct client_t* client;
+    int result = -1;
+
+    if (reply == NULL || reply->filter || reply->no_stream)
+        return -1;
+
+    client = reply->client;
+    CS_START(&client->critical_section);
+    if (client->head == reply && ! client->sending && ! client->error_flag)
+        result = 0;
+    CS_END(&client->critical_section);
+    if (result < 0)
+        return -1;
+
+    reply->streamed = 1;
+    if (reply->mb && reply->mb->size > 0) {
+        if (reply_stream(reply, reply->mb->buf, reply->mb->size) < 0)
+            return -1;
+        reply->mb->size = 0;
+    }
+    return 0;
+}
+
+/*
+ * reply_stream_start() で開始した応答エントリの応答データを
+ * クライアントへ送信します。
+ * 送信エラーの場合は以降の応答を破棄します。
+ *
+ * reply: 応答エントリのポインタ
+ * buf: 応答データのポインタ
+ * len: 応答データのバイト数
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int reply_stream(struct reply_t* reply, const char* buf, int len)
+{
+    struct client_t* client = reply->client;
+
+    if (client->error_flag)
+        return -1;
+    if (send_data(client->socket, buf, len) < 0) {
+        err_write("reply_stream: %d bytes -> %d client send error.", len, client->socket);
+        client->error_flag = 1;
+        return -1;
+    }
+    stats_add(STATS_BYTES_WRITTEN, len);
+    return 0;
+}
+
+/*
+ * 応答データの送信を中断します。
+ * 送信済みの応答データが不完全なためクライアントの接続を切断します。
+ *
+ * reply: 応答エントリのポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void reply_stream_abort(struct reply_t* reply)
+{
+    struct client_t* client = reply->client;
+
+    client->error_flag = 1;
+    shutdown(client->socket, 2);
+}
+
+/*
+ * 応答データをクライアントへ送信します。
+ * 実行中のコマンドが存在する場合は応答の順番が守られるように
+ * 先行するコマンドの応答の後に送信されます。
+ *
+ * client: クライアント構造体のポインタ
+ * buf: 応答データのポインタ
+ * len: 応答データのバイト数
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int client_send(struct client_t* client, const char* buf, int len)
+{
+    struct reply_t* reply;
+    int result;
+
+    reply = reply_reserve(client);
+    if (reply == NULL)
+        return -1;
+    result = reply_append(reply, buf, len);
+    reply_complete(reply);
+    return result;
+}
+
+/*
+ * エラーメッセージをクライアントへ送信します。
+ *
+ * client: クライアント構造体のポインタ
+ * msg: エラーメッセージ(NULLの場合はメッセージなし)
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int client_error(struct client_t* client, const char* msg)
+{
+    struct reply_t* reply;
+    int result;
+
+    reply = reply_reserve(client);
+    if (reply == NULL)
+        return -1;
+    result = reply_append_error(reply, msg);
+    reply_complete(reply);
+    return result;
+}
@@ -0,0 +1,202 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * コマンド行の解析を行います。
+ *
+ * コマンド行はバッファ上で空白を NUL に置き換えて要素に分割します。
+ * 要素は先頭のポインタと長さで保持されるためメモリの確保は行いません。
+ *
+ * コマンド名は完全ハッシュの表から検索します。
+ * ハッシュ値はコマンド名の長さと先頭の文字と4文字目(3文字以下の
+ * 場合は最後の文字)から算出され、登録されているコマンド名では
+ * 衝突しません。表を変更した場合は command_hash() の係数を
+ * 衝突しないように見直す必要があります。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define CMD_HASH_SIZE   64
+
+struct command_entry_t {
+    const char* name;       /* コマンド名 */
+    int len;                /* コマンド名の長さ */
+    int cmd;                /* コマンド */
+    int nocase;             /* 大文字小文字を区別しない */
+};
+
+/* command_hash() の値をインデックスにした表 */
+static struct command_entry_t command_table[CMD_HASH_SIZE] = {
+    /*  0 */ { NULL,                0,  0,                  0 },
+    /*  1 */ { "stats",             5,  CMD_STATS,          1 },
+    /*  2 */ { NULL,                0,  0,                  0 },
+    /*  3 */ { NULL,                0,  0,                  0 },
+    /*  4 */ { NULL,                0,  0,                  0 },
+    /*  5 */ { NULL,                0,  0,                  0 },
+    /*  6 */ { REMOVESERVER_CMD,    18, CMD_REMOVESERVER,   0 },
+    /*  7 */ { "prepend",           7,  CMD_PREPEND,        1 },
+    /*  8 */ { IMPORTDATA_CMD,      16, CMD_IMPORTDATA,     0 },
+    /*  9 */ { NULL,                0,  0,                  0 },
+    /* 10 */ { "ms",                2,  CMD_META_SET,       1 },
+    /* 11 */ { NULL,                0,  0,                  0 },
+    /* 12 */ { "decr",              4,  CMD_DECR,           1 },
+    /* 13 */ { NULL,                0,  0,                  0 },
+    /* 14 */ { NULL,                0,  0,                  0 },
+    /* 15 */ { "get",               3,  CMD_GET,            1 },
+    /* 16 */ { NULL,                0,  0,                  0 },
+    /* 17 */ { NULL,                0,  0,                  0 },
+    /* 18 */ { "ma",                2,  CMD_META_ARITHMETIC, 1 },
+    /* 19 */ { NULL,                0,  0,                  0 },
+    /* 20 */ { NULL,                0,  0,                  0 },
+    /* 21 */ { NULL,                0,  0,                  0 },
+    /* 22 */ { "append",            6,  CMD_APPEND,         1 },
+    /* 23 */ { NULL,                0,  0,                  0 },
+    /* 24 */ { NULL,                0,  0,                  0 },
+    /* 25 */ { "verbosity",         9,  CMD_VERBOSITY,      1 },
+    /* 26 */ { UNLOCKSERVER_CMD,    18, CMD_UNLOCKSERVER,   0 },
+    /* 27 */ { NULL,                0,  0,                  0 },
+    /* 28 */ { STATUS_CMD,          12, CMD_STATUS,         0 },
+    /* 29 */ { SLOWLOG_CMD,         13, CMD_SLOWLOG,        0 },
+    /* 30 */ { SHUTDOWN_CMD,        14, CMD_SHUTDOWN,       0 },
+    /* 31 */ { "replace",           7,  CMD_REPLACE,        1 },
+    /* 32 */ { "incr",              4,  CMD_INCR,           1 },
+    /* 33 */ { NULL,                0,  0,                  0 },
+    /* 34 */ { "delete",            6,  CMD_DELETE,         1 },
+    /* 35 */ { "cas",               3,  CMD_CAS,            1 },
+    /* 36 */ { NULL,                0,  0,                  0 },
+    /* 37 */ { NULL,                0,  0,                  0 },
+    /* 38 */ { "md",                2,  CMD_META_DELETE,    1 },
+    /* 39 */ { ADDSERVER_CMD,       15, CMD_ADDSERVER,      0 },
+    /* 40 */ { NULL,                0,  0,                  0 },
+    /* 41 */ { NULL,                0,  0,                  0 },
+    /* 42 */ { NULL,                0,  0,                  0 },
+    /* 43 */ { NULL,                0,  0,                  0 },
+    /* 44 */ { HASHSERVER_CMD,      16, CMD_HASHSERVER,     0 },
+    /* 45 */ { NULL,                0,  0,                  0 },
+    /* 46 */ { NULL,                0,  0,                  0 },
+    /* 47 */ { NULL,                0,  0,                  0 },
+    /* 48 */ { NULL,                0,  0,                  0 },
+    /* 49 */ { NULL,                0,  0,                  0 },
+    /* 50 */ { NULL,                0,  0,                  0 },
+    /* 51 */ { "version",           7,  CMD_VERSION,        1 },
+    /* 52 */ { "gets",              4,  CMD_GETS,           1 },
+    /* 53 */ { NULL,                0,  0,                  0 },
+    /* 54 */ { NULL,                0,  0,                  0 },
+    /* 55 */ { "add",               3,  CMD_ADD,            1 },
+    /* 56 */ { "quit",              4,  CMD_QUIT,           1 },
+    /* 57 */ { NULL,                0,  0,                  0 },
+    /* 58 */ { "mg",                2,  CMD_META_GET,       1 },
+    /* 59 */ { NULL,                0,  0,                  0 },
+    /* 60 */ { NULL,                0,  0,                  0 },
+    /* 61 */ { NULL,                0,  0,                  0 },
+    /* 62 */ { "mn",                2,  CMD_META_NOOP,      1 },
+    /* 63 */ { "set",               3,  CMD_SET,            1 }
+};
+
+static unsigned int command_hash(const char* name, int len)
+{
+    unsigned int c0, c3;
+
+    /* 英字は小文字として計算します。*/
+    c0 = (unsigned char)name[0] | 0x20;
+    c3 = (unsigned char)name[(len > 3)? 3 : len-1] | 0x20;
+    return (len + c0 * 4 + c3 * 28) & (CMD_HASH_SIZE - 1);
+}
+
+/*
+ * コマンド名からコマンドを検索します。
+ *
+ * memcached のコマンドは大文字小文字を区別しません。
+ * 管理用のコマンドは区別します。
+ *
+ * name: コマンド名
+ * len: コマンド名の長さ
+ *
+ * 戻り値
+ *  コマンド(CMD_xxx)を返します。
+ *  該当するコマンドがない場合は -1 を返します。
+ */
+int cmd_lookup(const char* name, int len)
+{
+    struct command_entry_t* ent;
+
+    if (len < 1)
+        return -1;
+    ent = &command_table[command_hash(name, len)];
+    if (ent->len != len)
+        return -1;
+    if (ent->nocase) {
+        if (strnicmp(name, ent->name, len) != 0)
+            return -1;
+    } else {
+        if (memcmp(name, ent->name, len) != 0)
+            return -1;
+    }
+    return ent->cmd;
+}
+
+/*
+ * コマンド行を空白で要素に分割します。
+ *
+ * line の空白は NUL に置き換えられます。
+ * 連続する空白はひとつの区切りとして扱います。
+ *
+ * line: コマンド行(NUL終端)
+ * cmdl: 要素が設定される構造体のポインタ
+ *
+ * 戻り値
+ *  要素数を返します。
+ *  要素数が MAX_CMDLINE_TOKENS を超える場合は -1 を返します。
+ */
+int cmd_tokenize(char* line, struct cmdline_t* cmdl)
+{
+    char* p = line;
+    int n = 0;
+
+    while (1) {
+        char* s;
+
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        if (n >= MAX_CMDLINE_TOKENS)
+            return -1;
+        s = p;
+        while (*p != ' ' && *p != '\0')
+            p++;
+        cmdl->cl[n] = s;
+        cmdl->len[n] = p - s;
+        n++;
+        if (*p == '\0')
+            break;
+        *p++ = '\0';
+    }
+    cmdl->cn = n;
+    return n;
+}
@@ -66,6 +66,28 @@
  * dinio.replication_delay_time = number(default is 0(ms))
  * dinio.informed_port = number(default is 15432)
  * dinio.friend_file = path/file(default is no)
+ * dinio.binary_port = number (default is 0, disable)
+ * dinio.event_loops = number (default is 0, disable. Linux/MacOSX only)
+ * dinio.near_cache_size = number(default is 0(KB), disable)
+ * dinio.near_cache_ttl = number(default is 1000(ms))
+ * dinio.hotkeys = number(default is 10, 0 is disable)
+ * dinio.stream_size = number(default is 256(KB), 0 is disable)
+ * dinio.max_value_size = number(default is 1024(KB))
+ * dinio.unix_socket = path/file(default is no, Linux/MacOSX only)
+ * dinio.unix_socket_mode = octal number(default is 0660)
+ * dinio.noreply_threads = number(default is 2, 0 is disable)
+ * dinio.noreply_queue_size = number(default is 1024)
+ * dinio.client_ops_limit = number(default is 0, disable)
+ * dinio.client_bytes_limit = number(default is 0(KB), disable)
+ * dinio.max_inflight = number(default is 0, disable)
+ * dinio.slowlog_time = number(default is 1000(ms), 0 is disable)
+ * dinio.slowlog_size = number(default is 128)
+ * dinio.backend_io_threads = number (default is 0, disable. Linux only)
+ * dinio.backend_pipeline = number (default is 0, disable)
+ * dinio.breaker_error_rate = number(default is 0(%), disable)
+ * dinio.breaker_min_requests = number(default is 20)
+ * dinio.breaker_open_time = number(default is 5000(ms))
+ * dinio.hedge_percentile = number(default is 0, disable. requires backend_pipeline)
  * include = FILE_NAME
  * ...
  */
@@ -167,6 +189,51 @@ int config(const char* conf_fname)
         } else if (stricmp(name, "dinio.friend_file") == 0) {
             if (strlen(value) > 0)
                 get_abspath(g_conf->friend_file, value, sizeof(g_conf->friend_file)-1);
+        } else if (stricmp(name, "dinio.binary_port") == 0) {
+            g_conf->binary_port = (ushort)atoi(value);
+        } else if (stricmp(name, "dinio.event_loops") == 0) {
+            g_conf->event_loops = atoi(value);
+        } else if (stricmp(name, "dinio.near_cache_size") == 0) {
+            g_conf->near_cache_size = atoi(value);
+        } else if (stricmp(name, "dinio.near_cache_ttl") == 0) {
+            g_conf->near_cache_ttl = atoi(value);
+        } else if (stricmp(name, "dinio.hotkeys") == 0) {
+            g_conf->hotkeys = atoi(value);
+        } else if (stricmp(name, "dinio.stream_size") == 0) {
+            g_conf->stream_size = atoi(value);
+        } else if (stricmp(name, "dinio.max_value_size") == 0) {
+            g_conf->max_value_size = atoi(value);
+        } else if (stricmp(name, "dinio.unix_socket") == 0) {
+            if (strlen(value) > 0)
+                get_abspath(g_conf->unix_socket, value, sizeof(g_conf->unix_socket)-1);
+        } else if (stricmp(name, "dinio.unix_socket_mode") == 0) {
+            g_conf->unix_socket_mode = (int)strtol(value, NULL, 8);
+        } else if (stricmp(name, "dinio.noreply_threads") == 0) {
+            g_conf->noreply_threads = atoi(value);
+        } else if (stricmp(name, "dinio.noreply_queue_size") == 0) {
+            g_conf->noreply_queue_size = atoi(value);
+        } else if (stricmp(name, "dinio.client_ops_limit") == 0) {
+            g_conf->client_ops_limit = atoi(value);
+        } else if (stricmp(name, "dinio.client_bytes_limit") == 0) {
+            g_conf->client_bytes_limit = atoi(value);
+        } else if (stricmp(name, "dinio.max_inflight") == 0) {
+            g_conf->max_inflight = atoi(value);
+        } else if (stricmp(name, "dinio.slowlog_time") == 0) {
+            g_conf->slowlog_time = atoi(value);
+        } else if (stricmp(name, "dinio.slowlog_size") == 0) {
+            g_conf->slowlog_size = atoi(value);
+        } else if (stricmp(name, "dinio.backend_io_threads") == 0) {
+            g_conf->backend_io_threads = atoi(value);
+        } else if (stricmp(name, "dinio.backend_pipeline") == 0) {
+            g_conf->backend_pipeline = atoi(value);
+        } else if (stricmp(name, "dinio.breaker_error_rate") == 0) {
+            g_conf->breaker_error_rate = atoi(value);
+        } else if (stricmp(name, "dinio.breaker_min_requests") == 0) {
+            g_conf->breaker_min_requests = atoi(value);
+        } else if (stricmp(name, "dinio.breaker_open_time") == 0) {
+            g_conf->breaker_open_time = atoi(value);
+        } else if (stricmp(name, "dinio.hedge_percentile") == 0) {
+            g_conf->hedge_percentile = atoi(value);
         } else if (stricmp(name, CMD_INCLUDE) == 0) {
             /* 他のconfigファイルを再帰処理で読み込みます。*/
             if (config(value) < 0)
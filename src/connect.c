@@ -79,6 +79,7 @@ static void* cb_conn(void* s)
     }
     ss->server = svr;
     ss->socket = socket;
+    ss->probe = 0;
     return ss;
 }
 
@@ -231,6 +232,8 @@ struct server_socket_t* ds_server_socket(struct server_t* server)
 
 /*
  * サーバーへのコネクションをプーリングへ返却します。
+ * コマンドの結果はサーキットブレーカーに記録されます。
+ * HALF_OPEN の場合は ss->probe に試行のトークンを持つ結果だけが記録されます。
  *
  * server: サーバー構造体のポインタ
  * ss: サーバーソケット構造体のポインタ
@@ -243,6 +246,8 @@ void ds_release_socket(struct server_t* server,
                        struct server_socket_t* ss,
                        int reset)
 {
+    ds_breaker_record(server, ss->probe, reset);
+    ss->probe = 0;
     if (reset) {
         /* バッファにデータがあればすべて捨てます。*/
         dust_recv(ss->socket);
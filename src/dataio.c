@@ -230,30 +230,23 @@ int bset_command(struct server_socket_t* ss,
                  const char* datablock)
 {
     char cmd[CMDLINE_SIZE];
-    int cmdlen;
-    char* dbuf;
+    struct sendvec_t vec[2];
     int result = 0;
 
     /* bset <key><CRLF>
        <datablock>
      */
     snprintf(cmd, sizeof(cmd), "bset %s%s", key, LINE_DELIMITER);
-    cmdlen = strlen(cmd);
 
-    dbuf = malloc(cmdlen + dbsize);
-    if (dbuf == NULL) {
-        error_cmd(ss, cmd, "dataio: (%s) %s:%d mb_alloc no memory.");
-        return -1;
-    }
-    memcpy(dbuf, cmd, cmdlen);
-    memcpy(dbuf+cmdlen, datablock, dbsize);
-
-    /* サーバーにコマンドを送信します。*/
-    if (send_data(ss->socket, dbuf, cmdlen+dbsize) < 0) {
+    /* データブロックはコピーせずにコマンドと一緒に送信します。*/
+    vec[0].buf = cmd;
+    vec[0].len = strlen(cmd);
+    vec[1].buf = datablock;
+    vec[1].len = dbsize;
+    if (send_datav(ss->socket, vec, 2) < 0) {
         error_cmd(ss, cmd, "dataio: (%s) %s:%d send error.");
         result = -1;
     }
-    free(dbuf);
 
     if (result == 0) {
         char resp_str[2];
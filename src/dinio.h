@@ -46,6 +46,27 @@
 #define DEFAULT_REPLICATION_THREADS     3       /* replication worker threads number */
 #define DEFAULT_REPLICATION_DELAY_TIME  0       /* replication delay time(ms) */
 #define DEFAULT_INFORMED_PORT           15432   /* imformed port number */
+#define DEFAULT_BINARY_PORT             0       /* binary protocol listen port(0 is disable) */
+#define DEFAULT_EVENT_LOOPS             0       /* event loop threads number(0 is disable) */
+#define DEFAULT_NEAR_CACHE_SIZE         0       /* near cache size(KB, 0 is disable) */
+#define DEFAULT_NEAR_CACHE_TTL          1000    /* near cache time to live(ms) */
+#define DEFAULT_HOTKEYS                 10      /* hot keys number(0 is disable) */
+#define DEFAULT_STREAM_SIZE             256     /* streaming value size(KB, 0 is disable) */
+#define DEFAULT_MAX_VALUE_SIZE          1024    /* max value size(KB) */
+#define DEFAULT_UNIX_SOCKET_MODE        0660    /* unix domain socket file mode */
+#define DEFAULT_NOREPLY_THREADS         2       /* noreply writer threads */
+#define DEFAULT_NOREPLY_QUEUE_SIZE      1024    /* noreply queue size per data store */
+#define DEFAULT_CLIENT_OPS_LIMIT        0       /* client commands per second(0 is disable) */
+#define DEFAULT_CLIENT_BYTES_LIMIT      0       /* client bytes per second(KB, 0 is disable) */
+#define DEFAULT_MAX_INFLIGHT            0       /* max dispatching commands(0 is disable) */
+#define DEFAULT_SLOWLOG_TIME            1000    /* slow request time(ms, 0 is disable) */
+#define DEFAULT_SLOWLOG_SIZE            128     /* slow request log entries */
+#define DEFAULT_BACKEND_IO_THREADS      0       /* backend I/O threads number(0 is disable) */
+#define DEFAULT_BACKEND_PIPELINE        0       /* backend pipelined requests per connection(0 is disable) */
+#define DEFAULT_BREAKER_ERROR_RATE      0       /* circuit breaker error rate(%, 0 is disable) */
+#define DEFAULT_BREAKER_MIN_REQUESTS    20      /* circuit breaker minimum requests */
+#define DEFAULT_BREAKER_OPEN_TIME       5000    /* circuit breaker open time(ms) */
+#define DEFAULT_HEDGE_PERCENTILE        0       /* hedged get percentile(0 is disable) */
 
 #define STATUS_CMD          "__/status/__"
 #define SHUTDOWN_CMD        "__/shutdown/__"
@@ -54,22 +75,96 @@
 #define UNLOCKSERVER_CMD    "__/unlockserver/__"
 #define HASHSERVER_CMD      "__/hashserver/__"
 #define IMPORTDATA_CMD      "__/importdata/__"
+#define SLOWLOG_CMD         "__/slowlog/__"
+
+/* command */
+#define CMD_SET           1   /* データの保存(キーが存在している場合は置換) */
+#define CMD_ADD           2   /* データの保存(キーが既に存在しない場合のみ) */
+#define CMD_REPLACE       3   /* データの保存(キーが既に存在する場合のみ) */
+#define CMD_APPEND        4   /* 値への後方追加 */
+#define CMD_PREPEND       5   /* 値への前方追加 */
+#define CMD_CAS           6   /* データの保存(バージョン排他制御) */
+#define CMD_GET           7   /* データの取得 */
+#define CMD_GETS          8   /* データの取得(バージョン付き) */
+#define CMD_DELETE        9   /* データの削除 */
+#define CMD_INCR          10  /* 値への加算 */
+#define CMD_DECR          11  /* 値への減算 */
+#define CMD_STATS         12  /* 各種ステータスを表示 */
+#define CMD_VERSION       13  /* バージョンを表示 */
+#define CMD_VERBOSITY     14  /* 動作確認 */
+#define CMD_META_GET      15  /* meta get(mg) */
+#define CMD_META_SET      16  /* meta set(ms) */
+#define CMD_META_DELETE   17  /* meta delete(md) */
+#define CMD_META_ARITHMETIC 18 /* meta arithmetic(ma) */
+#define CMD_META_NOOP     19  /* meta no-op(mn) */
+#define CMD_QUIT          30  /* 終了(コネクション切断) */
+#define CMD_STATUS        100 /* ステータス確認 */
+#define CMD_SHUTDOWN      110 /* 終了(シャットダウン) */
+#define CMD_ADDSERVER     120 /* データストア追加 */
+#define CMD_REMOVESERVER  121 /* データストア削除 */
+#define CMD_UNLOCKSERVER  122 /* データストアロック解除 */
+#define CMD_HASHSERVER    130 /* キーのサーバー算出 */
+#define CMD_IMPORTDATA    131 /* データのインポート */
+#define CMD_SLOWLOG       140 /* スローログの表示 */
 
 #define CMDGRP_SET      1   /* update group */
 #define CMDGRP_GET      2   /* retrieval group */
 #define CMDGRP_DELETE   3   /* deletion group */
 
+/* statistics counter */
+#define STATS_CURR_CONNECTIONS   0
+#define STATS_TOTAL_CONNECTIONS  1
+#define STATS_CONN_YIELDS        2
+#define STATS_CMD_GET            3
+#define STATS_CMD_SET            4
+#define STATS_GET_HITS           5
+#define STATS_GET_MISSES         6
+#define STATS_DELETE_HITS        7
+#define STATS_DELETE_MISSES      8
+#define STATS_INCR_HITS          9
+#define STATS_INCR_MISSES        10
+#define STATS_DECR_HITS          11
+#define STATS_DECR_MISSES        12
+#define STATS_CAS_HITS           13
+#define STATS_CAS_MISSES         14
+#define STATS_CAS_BADVAL         15
+#define STATS_BYTES_READ         16
+#define STATS_BYTES_WRITTEN      17
+#define STATS_NEAR_CACHE_HITS    18
+#define STATS_NEAR_CACHE_MISSES  19
+#define STATS_NEAR_CACHE_EVICTIONS 20
+#define STATS_GET_COALESCED      21
+#define STATS_NOREPLY_WRITES     22
+#define STATS_NOREPLY_OVERFLOWS  23
+#define STATS_NOREPLY_DROPS      24
+#define STATS_THROTTLED          25
+#define STATS_HEDGED_GETS        26
+#define STATS_HEDGE_WINS         27
+#define STATS_COUNTERS           28
+
+/* gateway status */
+#define STAT_FIN       0x01
+#define STAT_CLOSE     0x02
+#define STAT_SHUTDOWN  0x04
+
+#define PROTOCOL_ASCII   0  /* memcached text protocol */
+#define PROTOCOL_BINARY  1  /* memcached binary protocol */
+
 #define LINE_DELIMITER  "\r\n"
 
 #define MAX_MEMCACHED_KEYSIZE   250
 #define MAX_MEMCACHED_DATASIZE  (1*1024*1024)   /* 1MB */
 
 #define CMDLINE_SIZE          (256+MAX_MEMCACHED_KEYSIZE)
+#define MAX_CMDLINE_TOKENS    (CMDLINE_SIZE/2)  /* max tokens of command line */
+
+#define MAX_PIPELINE_REQUESTS 256   /* max outstanding requests per connection */
 
 #define FRIEND_ADD_SERVER     1
 #define FRIEND_REMOVE_SERVER  2
 #define FRIEND_LOCK_SERVER    3
 #define FRIEND_UNLOCK_SERVER  4
+#define FRIEND_INVALIDATE_KEYS 5
 
 #define FRIEND_ACK     'A'
 #define FRIEND_REJECT  'R'
@@ -87,9 +182,31 @@ struct dinio_conf_t {
     int daemonize;                      /* execute as daemon(Linux/MacOSX only) */
     char username[256];                 /* execute as username(Linux/MacOSX only) */
     ushort port_no;                     /* listen port number */
+    ushort binary_port;                 /* binary protocol listen port(0 is disable) */
+    char unix_socket[MAX_PATH+1];       /* unix domain socket path(empty is disable) */
+    int unix_socket_mode;               /* unix domain socket file mode */
+    int near_cache_size;                /* gateway near cache size(KB, 0 is disable) */
+    int near_cache_ttl;                 /* near cache time to live(ms) */
+    int hotkeys;                        /* reported hot keys number(0 is disable) */
+    int stream_size;                    /* get value size relayed while receiving(KB, 0 is disable) */
+    int max_value_size;                 /* max set value size, larger than 1MB is chunked(KB) */
     int backlog;                        /* listen backlog number */
     int worker_threads;                 /* memcached worker thread number */
+    int event_loops;                    /* event loop threads with SO_REUSEPORT listener(0 is disable) */
     int dispatch_threads;               /* dispatch worker thread number */
+    int backend_io_threads;             /* event driven backend I/O thread number(0 is disable) */
+    int backend_pipeline;               /* outstanding requests per pipelined backend connection(0 is disable) */
+    int breaker_error_rate;             /* error rate(%) to open the circuit breaker(0 is disable) */
+    int breaker_min_requests;           /* minimum requests in the window to open the circuit breaker */
+    int breaker_open_time;              /* time(ms) until the half-open probe */
+    int hedge_percentile;               /* backend get latency percentile to send a hedged get(0 is disable) */
+    int noreply_threads;                /* noreply writer threads(0 is disable) */
+    int noreply_queue_size;             /* noreply queue commands per data store */
+    int client_ops_limit;               /* commands per second per client address(0 is disable) */
+    int client_bytes_limit;             /* request bytes per second per client address(KB, 0 is disable) */
+    int max_inflight;                   /* max dispatching commands, busy error over it(0 is disable) */
+    int slowlog_time;                   /* slow request log threshold(ms, 0 is disable) */
+    int slowlog_size;                   /* slow request log ring buffer entries */
     char error_file[MAX_PATH+1];        /* error file name */
     char output_file[MAX_PATH+1];       /* output file name */
     int datastore_timeout;              /* datastore request timeout(ms) */
@@ -108,6 +225,130 @@ struct dinio_conf_t {
     char friend_file[MAX_PATH+1];       /* dinio server define file name */
 };
 
+/* command line tokens (in-place) */
+struct cmdline_t {
+    int cn;                             /* number of tokens */
+    char* cl[MAX_CMDLINE_TOKENS];       /* token(NUL terminated) */
+    int len[MAX_CMDLINE_TOKENS];        /* token length */
+};
+
+/* request data buffer (reference counted) */
+struct reqbuf_t {
+    volatile long refcount;     /* reference counter */
+    int size;                   /* data block size(include CRLF) */
+    char data[1];               /* data block */
+};
+
+/* client reply entry (pipeline) */
+struct reply_t {
+    struct client_t* client;    /* owner client */
+    struct membuf_t* mb;        /* buffered reply data */
+    int done;                   /* not zero is completed */
+    void (*filter)(struct reply_t*);    /* reply data converter */
+    void* filter_arg;           /* converter argument(free on release) */
+    int streamed;               /* not zero is sent while receiving */
+    int no_stream;              /* not zero is disable streaming */
+    struct reply_t* next;       /* next reply in request order */
+};
+
+/* client connection */
+struct client_t {
+    CS_DEF(critical_section);
+    SOCKET socket;                  /* client socket */
+    int protocol;                   /* PROTOCOL_ASCII or PROTOCOL_BINARY */
+    struct sockaddr_in sockaddr;    /* client address */
+    struct sock_buf_t* sb;          /* socket buffer */
+    void* sock_event;               /* socket event of the owner event loop */
+    int refcount;                   /* reference counter */
+    int close_flag;                 /* not zero is closed */
+    int error_flag;                 /* not zero is send error */
+    int suspend_flag;               /* not zero is suspended receiving */
+    int resume_flag;                /* not zero is resumed receiving */
+    struct reply_t* head;           /* reply queue head */
+    struct reply_t* tail;           /* reply queue tail */
+    int sending;                    /* not zero is sending replies */
+    int drain_wait;                 /* not zero is waiting for all replies */
+#ifdef _WIN32
+    HANDLE drain_cond;              /* all replies sent */
+#else
+    pthread_mutex_t drain_mutex;
+    pthread_cond_t drain_cond;      /* all replies sent */
+#endif
+    void* inflight;                 /* dispatching events (dispatch.c) */
+};
+
+#define MAX_SENDVEC     64  /* max vectors of send_datav() */
+
+/* scatter/gather send vector */
+struct sendvec_t {
+    const char* buf;
+    int len;
+};
+
+/* hot key */
+struct hotkey_t {
+    char key[MAX_MEMCACHED_KEYSIZE+1];
+    struct server_t* server;            /* owning data store server */
+    int64 count;                        /* guaranteed reference count */
+    double rate;                        /* references per second */
+};
+
+/* client admission */
+struct client_stat_t {
+    struct in_addr addr;                /* client address */
+    int64 requests;                     /* admitted commands */
+    int64 throttled;                    /* rejected commands(busy) */
+};
+
+/* slow request */
+struct slowlog_t {
+    int64 time;                         /* completed time(usec) */
+    char cmd[16];                       /* command name */
+    char key[MAX_MEMCACHED_KEYSIZE+1];  /* key(first key of multi get) */
+    char ip[16];                        /* data store address(empty is none or multiple) */
+    int port;                           /* data store port */
+    int64 total_usec;                   /* accepted to completed */
+    int64 queue_usec;                   /* dispatch queue wait */
+    int64 pool_usec;                    /* connection pool wait */
+    int64 backend_usec;                 /* data store round trip */
+    int64 send_usec;                    /* client send */
+    int retries;                        /* executed again on the next server */
+};
+
+/* backend I/O request */
+struct bio_request_t {
+    struct server_t* server;            /* data store server */
+    struct server_socket_t* ss;         /* pooled connection */
+    int cmd_grp;                        /* command group */
+    const char* cmdline;                /* command line(for error log) */
+    struct sendvec_t vec[3];            /* command line, CRLF and data block */
+    int vec_count;
+    int noreply_flag;                   /* not zero is no reply */
+    int stream_size;                    /* get value size relayed by stream(0 is disable) */
+    int (*stream)(struct bio_request_t* req, const char* buf, int len);
+    void (*done)(struct bio_request_t* req, int result);
+    void* arg;                          /* callback argument */
+    struct membuf_t* mb;                /* received reply */
+    int header_len;                     /* reply line length(include CRLF) */
+    int64 send_time;                    /* send started time(usec) */
+    long breaker_probe;                 /* half-open probe token(0 is none) */
+    /* used by backend I/O thread */
+    int state;                          /* send, header, body or stream */
+    int vec_index;                      /* sending vector */
+    int vec_offset;                     /* sent bytes of the vector */
+    int reply_size;                     /* get reply size(include END) */
+    int body_left;                      /* data block bytes to relay */
+    int stream_error;                   /* relay failed(the rest is discarded) */
+    int hedge_usec;                     /* delay of the hedged request(usec) */
+    void (*hedge)(struct bio_request_t* req);   /* send the hedged request(NULL is none) */
+    int64 timeout_tick;                 /* timer wheel tick of timeout(0 is none) */
+    int64 expire_tick;                  /* timer wheel tick of timeout or hedge */
+    struct bio_conn_t* conn;            /* backend connection */
+    struct bio_request_t* queue_next;   /* send or reply queue of the connection */
+    struct bio_request_t* next;         /* timer wheel or submit list */
+    struct bio_request_t* prev;
+};
+
 /* friend server */
 struct friend_t {
     char ip[16];            /* 255.255.255.255 */
@@ -120,6 +361,20 @@ struct friend_t {
         fprintf(stdout, fmt, __VA_ARGS__); \
     }
 
+#ifdef _WIN32
+#define ATOMIC_INC(p)   InterlockedIncrement(p)
+#define ATOMIC_DEC(p)   InterlockedDecrement(p)
+#define ATOMIC_ADD64(p, n)  InterlockedExchangeAdd64(p, n)
+#define MEMORY_BARRIER()    MemoryBarrier()
+#define ATOMIC_CAS(p, o, n) (InterlockedCompareExchange(p, n, o) == (o))
+#else
+#define ATOMIC_INC(p)   __sync_add_and_fetch(p, 1)
+#define ATOMIC_DEC(p)   __sync_sub_and_fetch(p, 1)
+#define ATOMIC_ADD64(p, n)  __sync_add_and_fetch(p, n)
+#define MEMORY_BARRIER()    __sync_synchronize()
+#define ATOMIC_CAS(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#endif
+
 #ifdef _WIN32
 #define get_abspath(abs_path, path, maxlen) \
     _fullpath(abs_path, path, maxlen)
@@ -139,6 +394,16 @@ struct dinio_conf_t* g_conf;  /* read only configure data */
 #endif
 SOCKET g_listen_socket;     /* listen socket */
 
+#ifndef _MAIN
+    extern
+#endif
+SOCKET g_binary_socket;     /* binary protocol listen socket */
+
+#ifndef _MAIN
+    extern
+#endif
+SOCKET g_unix_socket;       /* unix domain listen socket */
+
 #ifndef _MAIN
     extern
 #endif
@@ -152,7 +417,7 @@ int g_trace_mode;           /* not zero is trace mode */
 #ifndef _MAIN
     extern
 #endif
-struct queue_t* g_queue;    /* request queue */
+struct workq_t* g_queue;    /* request queue */
 
 #ifndef _MAIN
     extern
@@ -177,18 +442,13 @@ SOCKET g_informed_socket;     /* informed listen socket */
 #ifndef _MAIN
     extern
 #endif
-struct queue_t* g_informed_queue;    /* informed request queue */
+struct workq_t* g_informed_queue;    /* informed request queue */
 
 #ifndef _MAIN
     extern
 #endif
 void* g_sock_event;         /* socket event */
 
-#ifndef _MAIN
-    extern
-#endif
-struct hash_t* g_sockbuf_hash;
-
 /* prototypes */
 #ifdef __cplusplus
 extern "C" {
@@ -200,6 +460,7 @@ int config(const char* conf_fname);
 /* dinio_server.c */
 void dinio_server(void);
 SOCKET socket_listen(ulong addr, ushort port, int backlog, struct sockaddr_in* sockaddr);
+void event_loop_wakeup(void);
 
 /* dinio_cmd.c */
 void stop_server(void);
@@ -209,12 +470,104 @@ void remove_server(const char* addr, const char* port);
 void unlock_server(const char* addr, const char* port);
 void hash_server(int n, const char* keys[]);
 void import_server(const char* fname);
+void slowlog_server(void);
 
 /* memc_gateway.c */
 int memcached_gateway_start(void);
 int memcached_gateway_event(SOCKET socket, struct sockaddr_in sockaddr);
+void memcached_gateway_request(SOCKET socket);
+SOCKET memcached_listen_socket(void);
+int memcached_queue_count(void);
 void memcached_gateway_end(void);
 
+/* command.c */
+int cmd_tokenize(char* line, struct cmdline_t* cmdl);
+int cmd_lookup(const char* name, int len);
+
+/* near_cache.c */
+int near_cache_initialize(void);
+void near_cache_finalize(void);
+int near_cache_get(const char* key, struct membuf_t* mb);
+void near_cache_fill(const char* buf, int size, int64 version);
+int64 near_cache_version(void);
+void near_cache_invalidate(const char* key, int forward_flag);
+int near_cache_usage(int64* bytes, int64* items);
+
+/* hotkey.c */
+int hotkey_initialize(void);
+void hotkey_finalize(void);
+void hotkey_record(const char* key, struct server_t* server);
+int hotkey_list(struct hotkey_t* keys, int max_keys);
+
+/* admission.c */
+int admission_initialize(void);
+void admission_finalize(void);
+int admission_check(struct in_addr addr, int ops, int bytes);
+int admission_list(struct client_stat_t* list, int max_num);
+int admission_capacity(void);
+
+/* workq.c */
+struct workq_t* workq_initialize(int lane_num);
+void workq_finalize(struct workq_t* q);
+int workq_push(struct workq_t* q, void* data);
+void* workq_pop(struct workq_t* q, int lane_no);
+int workq_count(struct workq_t* q);
+
+/* slowlog.c */
+int slowlog_initialize(void);
+void slowlog_finalize(void);
+void slowlog_record(const struct slowlog_t* log);
+int slowlog_list(struct slowlog_t* list, int max_num);
+int slowlog_capacity(void);
+
+/* backend_io.c */
+int backend_io_initialize(void);
+void backend_io_finalize(void);
+int backend_io_enabled(void);
+int backend_io_pipelined(void);
+int backend_io_submit(struct bio_request_t* req);
+void backend_io_detach_server(struct server_t* server);
+int backend_io_count(void);
+int backend_io_conns(void);
+void backend_io_write_stats(int64* writes, int64* requests, int* batch_max);
+
+/* chunk.c */
+int chunk_enabled(void);
+int chunk_required(struct reqbuf_t* rb);
+struct reqbuf_t* chunk_store(const char* cmdline, struct reqbuf_t* rb, char* mcmdline, int mcmdline_size);
+int chunk_included(struct reply_t* reply);
+void chunk_expand(struct reply_t* reply);
+int64 chunk_lookup(const char* key, int* chunks);
+void chunk_remove(int64 id, int chunks);
+
+/* noreply.c */
+int noreply_initialize(void);
+void noreply_finalize(void);
+int noreply_entry(int cmd_grp, const char* cmdline, const char* key, struct reqbuf_t* rb, struct server_t** server);
+void noreply_sync(const char* key);
+int noreply_queue_count(void);
+
+/* histogram.c */
+void hist_record(struct histogram_t* hist, int64 value);
+int64 hist_percentile(struct histogram_t* hist, double p);
+void latency_record(struct server_t* server, int cmd_grp, int phase, int64 usec);
+struct histogram_t* latency_histogram(struct server_t* server, int cmd_grp, int phase);
+const char* latency_group_name(int cmd_grp);
+const char* latency_phase_name(int phase);
+
+/* stats.c */
+void stats_add(int id, int64 n);
+void stats_request(const char* cmdline, int cn);
+void stats_reply(const char* cmdline, const char* line);
+struct membuf_t* stats_report(const char* arg);
+int stats_initialize(void);
+void stats_finalize(void);
+
+/* memc_binary.c */
+int binary_gateway_start(void);
+unsigned binary_gateway(struct client_t* client, struct in_addr addr);
+void binary_gateway_end(void);
+
 /* server_cmd.c */
 void status_command(SOCKET socket);
 void shutdown_command(SOCKET socket);
@@ -223,9 +576,13 @@ int remove_server_command(SOCKET socket, int cn, const char** cl);
 int unlock_server_command(SOCKET socket, int cn, const char** cl);
 int hash_command(SOCKET socket, int cn, const char** cl);
 int import_command(SOCKET socket, int cn, const char** cl);
+void slowlog_command(SOCKET socket);
 
 /* dispatch.c */
-int dispatch_event_entry(SOCKET csocket, int cmd_grp, const char* cmdline, int cn, const char** cl, int dsize, const char* data);
+int dispatch_event_entry(struct client_t* client, int cmd_grp, const char* cmdline, int cn, const char** cl, struct reqbuf_t* rb);
+int dispatch_reply_entry(struct reply_t* reply, int cmd_grp, const char* cmdline, const char* key, struct reqbuf_t* rb);
+int dispatch_queue_count(void);
+int dispatch_inflight_count(void);
 int dispatch_server_start(void);
 void dispatch_server_end(void);
 int reply_error(SOCKET csocket, const char* msg);
@@ -256,12 +613,41 @@ int friend_add_server(struct friend_t* friend_list, struct server_t* server);
 int friend_remove_server(struct friend_t* friend_list, struct server_t* server);
 int friend_lock_server(struct friend_t* friend_list, struct server_t* server);
 int friend_unlock_server(struct friend_t* friend_list, struct server_t* server);
+int friend_invalidate_keys(struct friend_t* friend_list, int n, const char** keys);
 
 /* informed.c */
 int friend_informed_start(void);
 int friend_informed_event(SOCKET socket, struct sockaddr_in sockaddr);
 void friend_informed_end(void);
 
+/* client.c */
+void client_table_initialize(void);
+void client_table_finalize(void);
+int client_table_put(struct client_t* client);
+struct client_t* client_table_get(SOCKET socket);
+void client_table_remove(struct client_t* client);
+struct client_t* client_create(SOCKET socket, struct sockaddr_in sockaddr);
+struct client_t* client_ref(struct client_t* client);
+void client_release(struct client_t* client);
+void client_close(struct client_t* client);
+int client_suspend(struct client_t* client);
+void client_wait_replies(struct client_t* client);
+struct reply_t* reply_reserve(struct client_t* client);
+int reply_append(struct reply_t* reply, const char* buf, int len);
+int reply_append_error(struct reply_t* reply, const char* msg);
+void reply_complete(struct reply_t* reply);
+int reply_stream_start(struct reply_t* reply);
+int reply_stream(struct reply_t* reply, const char* buf, int len);
+void reply_stream_abort(struct reply_t* reply);
+int client_send(struct client_t* client, const char* buf, int len);
+int client_error(struct client_t* client, const char* msg);
+
+/* reqbuf.c */
+struct reqbuf_t* reqbuf_alloc(int size);
+struct reqbuf_t* reqbuf_ref(struct reqbuf_t* rb);
+void reqbuf_release(struct reqbuf_t* rb);
+int send_datav(SOCKET socket, const struct sendvec_t* vec, int count);
+
 /* lock_server.c */
 int lock_servers(struct server_t* server, struct server_t* oserver);
 void unlock_servers(struct server_t* server, struct server_t* oserver);
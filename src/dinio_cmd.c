@@ -70,6 +70,11 @@ void status_server()
     server_cmd(STATUS_CMD);
 }
 
+void slowlog_server()
+{
+    server_cmd(SLOWLOG_CMD);
+}
+
 void add_server(const char* addr, const char* port, const char* scale_factor)
 {
     char cmd[1024];
@@ -42,6 +42,20 @@
  *    問い合わせはディスパッチスレッドのキューに登録します。
  * 5. ワーカスレッド内でソケットのクローズが行われた場合は
  *    監視対象から外します。
+ * 6. ひとつの接続で複数のコマンドがパイプラインで送信された場合は
+ *    ディスパッチスレッドで並行して実行して、応答はコマンドを
+ *    受信した順番でクライアントへ送信します(client.c)。
+ *
+ * イベントループ(dinio.event_loops)が指定された場合は指定数の
+ * スレッド(メインスレッドを含む)がそれぞれ多重I/Oとリスニング
+ * ソケットを持ちます。リスニングソケットには SO_REUSEPORT を設定して
+ * 同じポートで待ち受けて、カーネルが接続を振り分けます。
+ * 受け付けたクライアントはそのスレッドでコマンドの解析まで行い、
+ * ワーカスレッドのキューを経由しません。
+ * コマンド行やデータブロックが揃っていないコマンドと先行する応答を
+ * 待つ管理コマンドはイベントループを止めないようにワーカスレッドへ
+ * 受け渡します。受信を中断したクライアントの再開もワーカスレッドで
+ * 行います。
  *
  * [main thread]
  *     |
@@ -62,53 +76,259 @@
 
 #include "dinio.h"
 
+#if !defined(WIN32) && defined(SO_REUSEPORT)
+#define USE_EVENT_LOOPS
+#endif
+
+#ifdef USE_EVENT_LOOPS
+#include <fcntl.h>
+
+/* イベントループ */
+struct event_loop_t {
+    void* sock_event;           /* 多重I/O */
+    SOCKET listen_socket;       /* SO_REUSEPORT のリスニングソケット */
+    int wake_pipe[2];           /* 終了を通知するパイプ */
+    pthread_t thread_id;        /* スレッドID(要素0はメインスレッド) */
+};
+
+static struct event_loop_t* loop_list;
+static int loop_count;
+#endif
+
 static int is_shutdown()
 {
     return g_shutdown_flag;
 }
 
-static int sock_event_cb(SOCKET socket)
+/*
+ * クライアントからの接続を受け付けてクライアント構造体を作成します。
+ *
+ * sock_event: クライアントを登録する多重I/O
+ * listen_socket: リスニングソケット
+ * protocol: クライアントのプロトコル(PROTOCOL_ASCII, PROTOCOL_BINARY)
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int accept_client(void* sock_event, SOCKET listen_socket, int protocol)
 {
     struct sockaddr_in sockaddr;
     int n;
     SOCKET client_socket;
+    struct client_t* client;
 
-    if (socket == g_listen_socket) {
-        char sockkey[16];
-        struct sock_buf_t* sockbuf;
+    n = sizeof(struct sockaddr);
+    client_socket = accept(listen_socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
+    if (client_socket < 0)
+        return 0;
+    if (g_shutdown_flag) {
+        SOCKET_CLOSE(client_socket);
+        return -1;
+    }
+    if (listen_socket == g_unix_socket) {
+        /* UNIX ドメインソケットのクライアントはローカルホストとします。*/
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sin_family = AF_INET;
+        sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
 
-        n = sizeof(struct sockaddr);
-        client_socket = accept(g_listen_socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
-        if (client_socket < 0)
+    if (g_trace_mode) {
+        char ip_addr[256];
+
+        mt_inet_ntoa(sockaddr.sin_addr, ip_addr);
+        TRACE("connect from %s, socket=%d ... \n", ip_addr, client_socket);
+    }
+    if (sock_event_add(sock_event, client_socket) < 0) {
+        SOCKET_CLOSE(client_socket);
+        return -1;
+    }
+    /* クライアント構造体(ソケットバッファ)を作成します。*/
+    client = client_create(client_socket, sockaddr);
+    if (client == NULL) {
+        sock_event_delete(sock_event, client_socket);
+        SOCKET_CLOSE(client_socket);
+        return -1;
+    }
+    client->protocol = protocol;
+    client->sock_event = sock_event;
+    if (client_table_put(client) < 0) {
+        sock_event_delete(sock_event, client_socket);
+        client_close(client);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef USE_EVENT_LOOPS
+/* 終了通知のパイプであれば読み捨てて 1 を返します。*/
+static int wake_event(struct event_loop_t* loop, SOCKET socket)
+{
+    char buf[16];
+
+    if (socket != loop->wake_pipe[0])
+        return 0;
+    while (read(loop->wake_pipe[0], buf, sizeof(buf)) == sizeof(buf))
+        ;
+    return 1;
+}
+
+static int event_loop_cb(SOCKET socket)
+{
+    int i;
+
+    for (i = 1; i < loop_count; i++) {
+        if (socket == loop_list[i].listen_socket)
+            return accept_client(loop_list[i].sock_event, socket, PROTOCOL_ASCII);
+        if (wake_event(&loop_list[i], socket))
             return 0;
-        if (g_shutdown_flag) {
-            SOCKET_CLOSE(client_socket);
-            return -1;
-        }
+    }
+    /* リクエストをこのスレッドで処理します。*/
+    memcached_gateway_request(socket);
+    return 0;
+}
 
-        if (g_trace_mode) {
-            char ip_addr[256];
+static void event_loop_thread(void* argv)
+{
+    struct event_loop_t* loop = (struct event_loop_t*)argv;
 
-            mt_inet_ntoa(sockaddr.sin_addr, ip_addr);
-            TRACE("connect from %s, socket=%d ... \n", ip_addr, client_socket);
-        }
-        if (sock_event_add(g_sock_event, client_socket) < 0) {
-            SOCKET_CLOSE(client_socket);
+    sock_event_loop(loop->sock_event, event_loop_cb, is_shutdown);
+}
+
+/* 通知用のパイプを作成して多重I/Oに登録します。*/
+static int wake_pipe_init(struct event_loop_t* loop)
+{
+    if (pipe(loop->wake_pipe) < 0) {
+        err_write("event_loop: pipe() error: %s", strerror(errno));
+        loop->wake_pipe[0] = loop->wake_pipe[1] = -1;
+        return -1;
+    }
+    fcntl(loop->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    return sock_event_add(loop->sock_event, loop->wake_pipe[0]);
+}
+
+/*
+ * イベントループのスレッドを開始します。
+ *
+ * 要素0はメインスレッドの多重I/O(g_sock_event)とリスニングソケット
+ * (g_listen_socket)を使用します。
+ * それ以外のスレッドは SO_REUSEPORT を設定したリスニングソケットと
+ * 多重I/Oを作成します。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int event_loop_start()
+{
+    int i;
+
+    if (g_conf->event_loops < 1)
+        return 0;
+
+    loop_list = (struct event_loop_t*)calloc(g_conf->event_loops, sizeof(struct event_loop_t));
+    if (loop_list == NULL) {
+        err_write("event_loop: no memory.");
+        return -1;
+    }
+    for (i = 0; i < g_conf->event_loops; i++)
+        loop_list[i].wake_pipe[0] = loop_list[i].wake_pipe[1] = -1;
+
+    loop_list[0].sock_event = g_sock_event;
+    loop_list[0].listen_socket = g_listen_socket;
+    if (wake_pipe_init(&loop_list[0]) < 0)
+        return -1;
+    loop_count = 1;
+
+    for (i = 1; i < g_conf->event_loops; i++) {
+        struct event_loop_t* loop = &loop_list[i];
+
+        loop->sock_event = sock_event_create();
+        if (loop->sock_event == NULL)
             return -1;
-        }
-        /* ソケットバッファを作成します。*/
-        sockbuf = sockbuf_alloc(client_socket);
-        if (sockbuf == NULL) {
-            err_write("sock_event_cb: sockbuf_alloc no memory");
-            SOCKET_CLOSE(client_socket);
+        loop->listen_socket = memcached_listen_socket();
+        if (loop->listen_socket == INVALID_SOCKET) {
+            sock_event_close(loop->sock_event);
             return -1;
         }
-        snprintf(sockkey, sizeof(sockkey), "%d", client_socket);
-        if (hash_put(g_sockbuf_hash, sockkey, sockbuf) < 0) {
-            err_write("sock_event_cb: hsh_put failed");
-            SOCKET_CLOSE(client_socket);
+        loop_count++;
+        if (sock_event_add(loop->sock_event, loop->listen_socket) < 0)
+            return -1;
+        if (wake_pipe_init(loop) < 0)
+            return -1;
+        if (pthread_create(&loop->thread_id, NULL, (void*)event_loop_thread, loop) != 0) {
+            err_write("event_loop: pthread_create() error.");
             return -1;
         }
+    }
+    TRACE("%d event loops started.\n", loop_count);
+    return 0;
+}
+
+static void event_loop_end()
+{
+    int i;
+
+    if (loop_list == NULL)
+        return;
+
+    /* イベントループのスレッドの終了を待ちます。*/
+    event_loop_wakeup();
+    for (i = 1; i < loop_count; i++) {
+        struct event_loop_t* loop = &loop_list[i];
+
+        if (loop->thread_id)
+            pthread_join(loop->thread_id, NULL);
+        shutdown(loop->listen_socket, 2);  /* 2: RDWR stop */
+        SOCKET_CLOSE(loop->listen_socket);
+        sock_event_close(loop->sock_event);
+    }
+    for (i = 0; i < loop_count; i++) {
+        if (loop_list[i].wake_pipe[0] >= 0) {
+            close(loop_list[i].wake_pipe[0]);
+            close(loop_list[i].wake_pipe[1]);
+        }
+    }
+    free(loop_list);
+    loop_list = NULL;
+    loop_count = 0;
+}
+#endif
+
+/*
+ * すべてのイベントループを起こして終了を判定させます。
+ *
+ * 戻り値
+ *  なし
+ */
+void event_loop_wakeup()
+{
+#ifdef USE_EVENT_LOOPS
+    int i;
+    const char dummy = 0x30;
+
+    for (i = 0; i < loop_count; i++) {
+        if (loop_list[i].wake_pipe[1] >= 0) {
+            if (write(loop_list[i].wake_pipe[1], &dummy, sizeof(dummy)) < 0)
+                err_write("event_loop: wakeup write error: %s", strerror(errno));
+        }
+    }
+#endif
+}
+
+static int sock_event_cb(SOCKET socket)
+{
+    struct sockaddr_in sockaddr;
+    int n;
+    SOCKET client_socket;
+
+    if (socket == g_listen_socket) {
+        return accept_client(g_sock_event, g_listen_socket, PROTOCOL_ASCII);
+    } else if (g_binary_socket != INVALID_SOCKET && socket == g_binary_socket) {
+        return accept_client(g_sock_event, g_binary_socket, PROTOCOL_BINARY);
+    } else if (g_unix_socket != INVALID_SOCKET && socket == g_unix_socket) {
+        return accept_client(g_sock_event, g_unix_socket, PROTOCOL_ASCII);
     } else if (socket == g_informed_socket) {
         n = sizeof(struct sockaddr);
         client_socket = accept(g_informed_socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
@@ -119,6 +339,13 @@ static int sock_event_cb(SOCKET socket)
             return -1;
         }
         friend_informed_event(client_socket, sockaddr);
+#ifdef USE_EVENT_LOOPS
+    } else if (loop_count > 0) {
+        if (wake_event(&loop_list[0], socket))
+            return 0;
+        /* リクエストをメインスレッドで処理します。*/
+        memcached_gateway_request(socket);
+#endif
     } else {
         n = sizeof(struct sockaddr);
         getpeername(socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
@@ -138,22 +365,25 @@ static int sock_init()
         return -1;
     if (sock_event_add(g_sock_event, g_listen_socket) < 0)
         return -1;
+    if (g_binary_socket != INVALID_SOCKET) {
+        if (sock_event_add(g_sock_event, g_binary_socket) < 0)
+            return -1;
+    }
+    if (g_unix_socket != INVALID_SOCKET) {
+        if (sock_event_add(g_sock_event, g_unix_socket) < 0)
+            return -1;
+    }
     if (g_friend_list) {
         if (sock_event_add(g_sock_event, g_informed_socket) < 0)
             return -1;
     }
-    g_sockbuf_hash = hash_initialize(1031);
-    if (g_sockbuf_hash == NULL) {
-        err_write("dinio_server: hash_initialize failure.");
-        return -1;
-    }
+    client_table_initialize();
     return 0;
 }
 
 static void sock_final()
 {
-    if (g_sockbuf_hash)
-        hash_finalize(g_sockbuf_hash);
+    client_table_finalize();
     if (g_sock_event)
         sock_event_close(g_sock_event);
 }
@@ -181,25 +411,78 @@ void dinio_server()
             return;
     }
 
+    /* 統計情報を初期化します。*/
+    if (stats_initialize() < 0)
+        return;
+
+    /* ニアキャッシュを初期化します。*/
+    if (near_cache_initialize() < 0)
+        return;
+
+    /* ホットキーの検出を初期化します。*/
+    if (hotkey_initialize() < 0)
+        return;
+
+    /* スローログを初期化します。*/
+    if (slowlog_initialize() < 0)
+        return;
+
+    /* コマンドの受け付けの制限を初期化します。*/
+    if (admission_initialize() < 0)
+        return;
+
     /* dispatchを実行するスレッドを開始します。*/
     if (dispatch_server_start() < 0)
         return;
 
+    /* noreply のコマンドを送信するスレッドを開始します。*/
+    if (noreply_initialize() < 0)
+        return;
+
+#ifndef USE_EVENT_LOOPS
+    if (g_conf->event_loops > 0) {
+        err_write("dinio_server: event_loops is not supported on this platform.");
+        g_conf->event_loops = 0;
+    }
+#endif
+
     /* memcachedプロトコルを橋渡しするスレッドを開始します。*/
     if (memcached_gateway_start() < 0)
         return;
 
+    /* memcachedのバイナリプロトコルを受け付けるソケットを作成します。*/
+    if (binary_gateway_start() < 0)
+        goto final;
+
     if (sock_init() < 0)
         goto final;
 
+#ifdef USE_EVENT_LOOPS
+    /* イベントループのスレッドを開始します。*/
+    if (event_loop_start() < 0) {
+        g_shutdown_flag = 1;
+        goto final;
+    }
+#endif
+
     sock_event_loop(g_sock_event, sock_event_cb, is_shutdown);
 
 final:
+#ifdef USE_EVENT_LOOPS
+    /* イベントループのスレッドを終了します。*/
+    event_loop_end();
+#endif
     sock_final();
 
+    /* memcachedのバイナリプロトコルのソケットをクローズします。*/
+    binary_gateway_end();
+
     /* memcachedプロトコルを処理するスレッドを終了します。*/
     memcached_gateway_end();
 
+    /* noreply のコマンドを送信するスレッドを終了します。*/
+    noreply_finalize();
+
     if (g_conf->replication_threads > 0) {
         /* replicationを実行するスレッドを終了します。*/
         replication_server_end();
@@ -208,10 +491,25 @@ final:
     /* dispatchを実行するスレッドを終了します。*/
     dispatch_server_end();
 
+    /* 統計情報を終了します。*/
+    stats_finalize();
+
     /* 分散サーバーからの通知を受けるスレッドを終了します。*/
     if (g_friend_list)
         friend_informed_end();
 
+    /* ニアキャッシュを終了します。*/
+    near_cache_finalize();
+
+    /* ホットキーの検出を終了します。*/
+    hotkey_finalize();
+
+    /* コマンドの受け付けの制限を終了します。*/
+    admission_finalize();
+
+    /* スローログを終了します。*/
+    slowlog_finalize();
+
     /* データストアサーバーを終了します。*/
     ds_close();
 
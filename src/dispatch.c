@@ -28,25 +28,61 @@
 
 #include "dinio.h"
 
+/* スローログに記録する区間毎の処理時間(usec) */
+struct req_timing_t {
+    int64 queue_usec;           /* ディスパッチキューの待ち時間 */
+    int64 pool_usec;            /* プールからソケットを取得するまでの時間 */
+    int64 backend_usec;         /* データストアの応答時間 */
+    int retries;                /* 次のサーバーで再実行した回数 */
+};
+
 struct dispatch_event_t {
-    SOCKET csocket;
+    struct client_t* client;    /* クライアント(NULLの場合は応答なし) */
+    struct reply_t* reply;      /* 応答エントリ(NULLの場合は応答なし) */
     int cmd_grp;
     char cmdline[CMDLINE_SIZE];
     char key[MAX_MEMCACHED_KEYSIZE+1];
     int cn;
-    int dsize;
-    char* data;
+    struct reqbuf_t* rb;
     int noreply_flag;
+    int wait_count;                         /* 完了を待っている先行コマンド数 */
+    struct dispatch_event_t** deps;         /* 完了を待っている後続コマンド */
+    int dep_num;
+    int dep_alloc;
+    struct dispatch_event_t* inflight_next; /* 同じクライアントの実行中コマンド */
+    struct server_t* server;                /* 実行したサーバー(複数の場合はNULL) */
+    int64 nc_version;                       /* 受付時のニアキャッシュの無効化の通番 */
+    struct dispatch_event_t* flight_next;   /* 同じ区分の実行中の get または待機中の get */
+    struct dispatch_event_t* waiters;       /* 応答を共有する後続の get */
+    int flight_closed;                      /* 後続の get を受け付けない */
+    int64 entry_time;                       /* 受け付けた時間(usec) */
+    struct req_timing_t timing;             /* 区間毎の処理時間 */
+    struct server_t* key_server;            /* I/O スレッドで実行したキーのサーバー */
+    int async_tries;                        /* I/O スレッドで実行できる残りのサーバー数 */
+    int chunk_pending;                      /* 応答のマニフェストを値に復元する */
+    int64 async_start;                      /* I/O スレッドの実行でプールを待ち始めた時間 */
+    struct bio_request_t bio;               /* I/O スレッドのリクエスト */
+    struct bio_request_t hedge;             /* レプリカへのヘッジのリクエスト */
+    int hedge_fired;                        /* ヘッジのリクエストを送信した */
+    int hedge_ok;                           /* ヘッジした get の応答が完了した */
+    volatile long hedge_winner;             /* 応答を使用するリクエスト(1: 先行, 2: ヘッジ) */
+    volatile long bio_refs;                 /* ヘッジした get の完了していないリクエスト数 */
 };
 
-static struct queue_t* dispatch_queue;
+#define FLIGHT_STRIPES  64      /* 実行中の get を登録するキーの区分数 */
+#define STREAM_BUF_SIZE 16384   /* データブロックを中継するバッファサイズ */
+#define HEDGE_MIN_SAMPLES 100   /* ヘッジの時間を求める最小の応答時間の件数 */
 
-#ifdef WIN32
-static HANDLE dispatch_queue_cond;
-#else
-static pthread_mutex_t dispatch_queue_mutex;
-static pthread_cond_t dispatch_queue_cond;
-#endif
+/* キー毎の実行中の get(single-flight) */
+struct flight_stripe_t {
+    CS_DEF(critical_section);
+    struct dispatch_event_t* head;
+};
+
+static struct flight_stripe_t flight_stripes[FLIGHT_STRIPES];
+
+static struct workq_t* dispatch_queue;
+static volatile long dispatch_inflight;    /* 処理中の dispatch_event_t 数 */
 
 static int last_error()
 {
@@ -80,9 +116,8 @@ static int ds_datablock_size(SOCKET socket,
                              int* bytes)
 {
     int len;
-    char* tbuf;
-    char** glp;
-    int glc;
+    char tbuf[CMDLINE_SIZE];
+    struct cmdline_t cmdl;
 
     /* VALUE <key> <flags> <bytes> [<cas>]<CRLF> */
     *bytes = -1;
@@ -90,14 +125,10 @@ static int ds_datablock_size(SOCKET socket,
     if (len <= 0)
         return -1;    /* FIN受信 */
 
-    tbuf = (char*)alloca(len+1);
-    strcpy(tbuf, buf);
-    glp = split(tbuf, ' ');
-    if (glp) {
-        glc = list_count((const char**)glp);
-        if (glc > 3)
-            *bytes = atoi(glp[3]);
-        list_free(glp);
+    if (len < (int)sizeof(tbuf)) {
+        memcpy(tbuf, buf, len+1);
+        if (cmd_tokenize(tbuf, &cmdl) > 3)
+            *bytes = atoi(cmdl.cl[3]);
     }
 
     /* <CRLF>を付加したバッファを返します。*/
@@ -116,7 +147,7 @@ static int ds_datablock_recv(SOCKET socket,
     str = recv_str(socket, delim, 1);
     if (str == NULL)
         return -1;
-    if (strlen(str) != bytes) {
+    if ((int)strlen(str) != bytes) {
         recv_free(str);
         return -1;
     }
@@ -125,8 +156,101 @@ static int ds_datablock_recv(SOCKET socket,
     return bytes;
 }
 
-/* サーバーからの応答をクライアントに送信します。*/
-static int client_reply(SOCKET csocket,
+/*
+ * 更新系コマンドの応答が正常か調べます。
+ * NOT_STORED, EXISTS, NOT_FOUND と incr/decr の数値、CLIENT_ERROR は
+ * データストアの正常な応答としてそのままクライアントへ返します。
+ * 他のサーバーで再実行しても結果は変わらないためです。
+ * データストアを更新したかは applied_reply() で調べます。
+ */
+static int valid_update_reply(const char* line)
+{
+    if (line[0] >= '0' && line[0] <= '9')
+        return 1;   /* incr, decr */
+    return (stricmp(line, "STORED") == 0 ||
+            stricmp(line, "NOT_STORED") == 0 ||
+            stricmp(line, "EXISTS") == 0 ||
+            stricmp(line, "NOT_FOUND") == 0 ||
+            strnicmp(line, "CLIENT_ERROR", 12) == 0);
+}
+
+/*
+ * 更新系コマンドと削除コマンドの応答がデータストアを更新したか調べます。
+ * STORED, DELETED と incr/decr の数値の場合のみレプリケーションを行います。
+ */
+static int applied_reply(const char* line)
+{
+    if (line[0] >= '0' && line[0] <= '9')
+        return 1;   /* incr, decr */
+    return (stricmp(line, "STORED") == 0 ||
+            stricmp(line, "DELETED") == 0);
+}
+
+/* 削除コマンドの応答が正常か調べます。*/
+static int valid_delete_reply(const char* line)
+{
+    return (stricmp(line, "DELETED") == 0 ||
+            stricmp(line, "NOT_FOUND") == 0 ||
+            strnicmp(line, "CLIENT_ERROR", 12) == 0);
+}
+
+/*
+ * データブロックを受信しながらクライアントへ送信します。
+ * 大きな値でも最初のバイトを送信するまでの時間と使用メモリが
+ * 値のサイズに依存しないようにします。
+ */
+static int stream_datablock(struct reply_t* reply,
+                            struct server_socket_t* ss,
+                            const char* cmdline,
+                            const char* header,
+                            int header_len,
+                            int bytes)
+{
+    char buf[STREAM_BUF_SIZE];
+    int left;
+
+    /* クライアントの送信エラーは受信を続けて以降の応答を破棄します。*/
+    reply_stream(reply, header, header_len);
+
+    /* <data block><CRLF> */
+    left = bytes + strlen(LINE_DELIMITER);
+    while (left > 0) {
+        int len;
+        int status;
+
+        if (g_conf->datastore_timeout >= 0) {
+            if (! wait_recv_data(ss->socket, g_conf->datastore_timeout)) {
+                err_write("stream_datablock: (%s) %s:%d data store server timeout.",
+                          cmdline, ss->server->ip, ss->server->port);
+                goto abort;
+            }
+        }
+        len = recv_char(ss->socket, buf, (left < (int)sizeof(buf))? left : (int)sizeof(buf), &status);
+        if (len <= 0 || status != 0) {
+            err_write("stream_datablock: (%s) %s:%d recv error[%d].",
+                      cmdline, ss->server->ip, ss->server->port, last_error());
+            goto abort;
+        }
+        reply_stream(reply, buf, len);
+        left -= len;
+    }
+    return 0;
+
+abort:
+    /* 送信済みの応答が不完全なのでクライアントを切断します。*/
+    reply_stream_abort(reply);
+    return -1;
+}
+
+/*
+ * サーバーからの応答をクライアントに送信します。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  データストアを更新しなかった応答(NOT_STORED など)の場合は 1 を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int client_reply(struct reply_t* reply,
                         struct server_socket_t* ss,
                         int cmd_grp,
                         const char* cmdline,
@@ -138,6 +262,7 @@ static int client_reply(SOCKET csocket,
     int len;
     char* delim = LINE_DELIMITER;
     int skip_recv_flag = 0;
+    int relayed = 0;
 
     if (term_word) {
         delim = (char*)alloca(strlen(term_word) + strlen(LINE_DELIMITER) + 1);
@@ -167,7 +292,19 @@ static int client_reply(SOCKET csocket,
                       cmdline, ss->server->ip, ss->server->port, last_error());
             return -1;
         }
-        if (bytes > 0) {
+        if (bytes > 0 && g_conf->stream_size > 0 &&
+            bytes >= g_conf->stream_size * 1024 && reply_stream_start(reply) == 0) {
+            /* 大きな値は受信しながらクライアントへ送信します。*/
+            if (stream_datablock(reply, ss, cmdline, buf, len, bytes) < 0)
+                return -1;
+            if (recv_line(ss->socket, buf, sizeof(buf), delim) < 0) {
+                err_write("client_reply: (%s) %s:%d recv_line(END) error[%d].",
+                          cmdline, ss->server->ip, ss->server->port, last_error());
+                reply_stream_abort(reply);
+                return -1;
+            }
+            stats_add(STATS_GET_HITS, 1);
+        } else if (bytes > 0) {
             char* rbuf;
 
             mb_append(mb, buf, len);
@@ -186,6 +323,9 @@ static int client_reply(SOCKET csocket,
             }
             mb_append(mb, rbuf, bytes);
             free(rbuf);
+            stats_add(STATS_GET_HITS, 1);
+        } else {
+            stats_add(STATS_GET_MISSES, 1);
         }
         /* "END<CRLF>" を受信したので読まないように制御します。 */
         skip_recv_flag = 1;
@@ -203,60 +343,79 @@ static int client_reply(SOCKET csocket,
         }
 
         if (cmd_grp == CMDGRP_SET) {
-            if (strnicmp(buf, "STORED", 6) != 0) {
+            if (! valid_update_reply(buf)) {
                 err_write("client_reply: (%s) %s:%d recv_line(STORED)=%s.",
                            cmdline, ss->server->ip, ss->server->port, buf);
                 return -1;
             }
         } else if (cmd_grp == CMDGRP_DELETE) {
-            if (strnicmp(buf, "DELETED", 7) != 0) {
+            if (! valid_delete_reply(buf)) {
                 err_write("client_reply: (%s) %s:%d recv_line(DELETED)=%s.",
                            cmdline, ss->server->ip, ss->server->port, buf);
                 return -1;
             }
         }
+        if (cmd_grp == CMDGRP_SET || cmd_grp == CMDGRP_DELETE)
+            relayed = ! applied_reply(buf);
+        stats_reply(cmdline, buf);
         if (len > 0)
             mb_append(mb, buf, len);
     }
     if (send_term_word_flag)
         mb_append(mb, delim, strlen(delim));
 
-    /* 結果をクライアントへ送信します。*/
-    if (send_data(csocket, mb->buf, mb->size) < 0) {
-        /* クライアントが終了している可能性があるのでエラーにはしません。*/
-        err_write("client_reply: (%s) %d bytes %s:%d -> %d client send error[%d].",
-                  cmdline, mb->size, ss->server->ip, ss->server->port, csocket, last_error());
+    /* 結果を応答エントリにバッファリングします。
+       応答はリクエストを受信した順番でクライアントへ送信されます。*/
+    if (reply_append(reply, mb->buf, mb->size) < 0) {
+        err_write("client_reply: (%s) %d bytes %s:%d reply no memory.",
+                  cmdline, mb->size, ss->server->ip, ss->server->port);
     }
-    return 0;
+    return relayed;
 }
 
-static int do_command(SOCKET csocket,
+static int do_command(struct reply_t* reply,
                       int cmd_grp,
-                      struct membuf_t* mb,
+                      const struct sendvec_t* vec,
+                      int vec_count,
                       struct server_t* server,
                       const char* cmdline,
                       int noreply_flag,
                       const char* term_word,
-                      int send_term_word_flag)
+                      int send_term_word_flag,
+                      struct req_timing_t* timing)
 {
     int result = -1;
     struct server_socket_t* ss;
+    int64 start_time;
+    int64 send_time;
+    long probe;
+    int relayed = 0;
 
-    /* サーバーの状態をチェックします。*/
+    /* サーバーの状態をチェックします。
+       サーキットブレーカーが OPEN の場合は待たずに次のサーバーで実行します。*/
     if (ds_check_server(server) < 0) {
-        err_write("dispatch_command: %s:%d was locked/inactive.", server->ip, server->port);
+        if (server->breaker_state == BREAKER_CLOSED)
+            err_write("dispatch_command: %s:%d was locked/inactive.", server->ip, server->port);
         return -1;
     }
+    /* noreply は応答を確認できないので HALF_OPEN の試行にしません。*/
+    probe = (noreply_flag)? 0 : ds_breaker_probe(server);
+    start_time = system_time();
 
     /* サーバーのソケットをプールから取得します。*/
     ss = ds_server_socket(server);
+    send_time = system_time();
+    latency_record(server, cmd_grp, LATENCY_POOL, send_time - start_time);
+    if (timing)
+        timing->pool_usec += send_time - start_time;
     if (ss == NULL) {
         err_write("dispatch_command: (%s) ds_server_socket() is NULL.", cmdline);
         goto final;
     }
+    ss->probe = probe;
 
-    /* サーバーにコマンドを送信します。*/
-    if (send_data(ss->socket, mb->buf, mb->size) < 0) {
+    /* サーバーにコマンド行とデータブロックを送信します。*/
+    if (send_datav(ss->socket, vec, vec_count) < 0) {
         err_write("dispatch_command: (%s) %s:%d send error[%d].",
                   cmdline, server->ip, server->port, last_error());
         goto final;
@@ -272,7 +431,7 @@ static int do_command(SOCKET csocket,
         }
 
         /* サーバーから応答を待ってクライアントに送信します。*/
-        result = client_reply(csocket,
+        result = client_reply(reply,
                               ss,
                               cmd_grp,
                               cmdline,
@@ -282,6 +441,7 @@ static int do_command(SOCKET csocket,
         mb_free(mbr);
         if (result < 0)
             goto final;
+        relayed = result;
     }
     result = 0;
 
@@ -289,43 +449,80 @@ final:
     /* サーバーのソケットをプールへ返却します。*/
     if (server && ss)
         ds_release_socket(server, ss, result);
-    return result;
+
+    /* 実行時間を集計します。*/
+    if (server) {
+        int64 end_time = system_time();
+
+        ATOMIC_ADD64(&server->cmd_time, end_time - start_time);
+        if (ss) {
+            latency_record(server, cmd_grp, LATENCY_BACKEND, end_time - send_time);
+            if (timing)
+                timing->backend_usec += end_time - send_time;
+        }
+        if (result < 0)
+            ATOMIC_ADD64(&server->error_count, 1);
+        if (ss == NULL)
+            ds_breaker_record(server, probe, -1);
+    }
+    return (result < 0)? result : relayed;
+}
+
+/* 成功したコマンドの実行数を集計してレプリケーションを実行します。*/
+static void command_success(int cmd_grp, const char* key, struct server_t* key_server)
+{
+    /* コマンド実行数をインクリメントします。*/
+    incl_command(cmd_grp, key_server);
+
+    /* キーの参照頻度を記録します。*/
+    hotkey_record(key, key_server);
+
+    if (g_conf->replications > 0) {
+        if (g_conf->replication_threads > 0) {
+            /* バックエンドのスレッドでレプリケーションを実行します。*/
+            replication_event_entry(key_server, cmd_grp, key);
+        } else {
+            /* レプリケーションを実行します。*/
+            do_replication(key_server, cmd_grp, key);
+        }
+    }
 }
 
-static int do_dispatch(SOCKET csocket,
+static int do_dispatch(struct reply_t* reply,
                        int cmd_grp,
                        const char* cmdline,
                        const char* key,
-                       int dsize,
-                       const char* data,
+                       struct reqbuf_t* rb,
                        int noreply_flag,
                        const char* term_word,
-                       int send_term_word_flag)
+                       int send_term_word_flag,
+                       struct server_t** exec_server,
+                       struct req_timing_t* timing)
 {
-    struct membuf_t* mb;
+    char cmdbuf[CMDLINE_SIZE+sizeof(LINE_DELIMITER)];
+    struct sendvec_t vec[2];
+    int vec_count = 1;
     struct server_t* key_server = NULL;
     struct server_t* server = NULL;
     int retry;
     int result = -1;
 
-    mb = mb_alloc(BUF_SIZE);
-    if (mb == NULL) {
-        err_write("do_dispatch: (%s) mb_alloc() no memory.", cmdline);
-        if (! noreply_flag)
-            reply_error(csocket, "no memory.");
-        return -1;
-    }
-
-    /* コマンドを編集します。*/
-    mb_append(mb, cmdline, strlen(cmdline));
-    /* <CRLF> を付加します。*/
-    mb_append(mb, LINE_DELIMITER, strlen(LINE_DELIMITER));
+    /* コマンド行に <CRLF> を付加します。*/
+    snprintf(cmdbuf, sizeof(cmdbuf), "%s%s", cmdline, LINE_DELIMITER);
+    vec[0].buf = cmdbuf;
+    vec[0].len = strlen(cmdbuf);
 
-    if (dsize > 0) {
-        /* data の最後には <CRLF> が付加されている。*/
-        mb_append(mb, data, dsize);
+    if (rb && rb->size > 0) {
+        /* データブロックはコピーせずにそのまま送信します。
+           データブロックの最後には <CRLF> が付加されている。*/
+        vec[1].buf = rb->data;
+        vec[1].len = rb->size;
+        vec_count = 2;
     }
 
+    /* 送信キューの同じキーの noreply のコマンドを先に送信します。*/
+    noreply_sync(key);
+
     /* キーから該当のサーバーを求めます。*/
     key_server = ds_key_server(key, strlen(key));
     retry = g_conf->replications + 1;
@@ -340,268 +537,1480 @@ static int do_dispatch(SOCKET csocket,
     if (key_server == NULL || key_server->status == DSS_INACTIVE) {
         err_write("do_dispatch: (%s) ds_key_server() is NULL.", cmdline);
         if (! noreply_flag)
-            reply_error(csocket, NULL);
+            reply_append_error(reply, NULL);
         goto final;
     }
 
     server = key_server;
     while (retry > 0) {
         /* コマンドを実行します。*/
-        result = do_command(csocket,
+        result = do_command(reply,
                             cmd_grp,
-                            mb,
+                            vec,
+                            vec_count,
                             server,
                             cmdline,
                             noreply_flag,
                             term_word,
-                            send_term_word_flag);
-        if (result == 0)
+                            send_term_word_flag,
+                            timing);
+        if (result >= 0)
             break;
+        if (reply && reply->streamed) {
+            /* 応答の一部をクライアントへ送信しているので次のサーバーで
+               実行すると応答が重複します。クライアントを切断します。*/
+            reply_stream_abort(reply);
+            goto final;
+        }
         retry--;
         /* エラーの場合は次のサーバーから取得します。*/
         if (retry > 0) {
             server = ds_next_server(server);
             if (server == NULL || server == key_server) {
                 if (! noreply_flag)
-                    reply_error(csocket, NULL);
+                    reply_append_error(reply, NULL);
                 goto final;
             }
+            if (timing)
+                timing->retries++;
         }
     }
 
-    if (result != 0) {
+    if (result < 0) {
         if (! noreply_flag)
-            reply_error(csocket, NULL);
+            reply_append_error(reply, NULL);
         goto final;
     }
 
-    /* コマンド実行数をインクリメントします。*/
-    incl_command(cmd_grp, key_server);
-
-    if (g_conf->replications > 0) {
-        if (g_conf->replication_threads > 0) {
-            /* バックエンドのスレッドでレプリケーションを実行します。*/
-            replication_event_entry(key_server, cmd_grp, key);
-        } else {
-            /* レプリケーションを実行します。*/
-            do_replication(key_server, cmd_grp, key);
-        }
-    }
+    if (exec_server)
+        *exec_server = server;
+    /* NOT_STORED などデータストアを更新しなかった応答は
+       レプリケーションしないでそのままクライアントへ返します。*/
+    if (result == 0)
+        command_success(cmd_grp, key, key_server);
+    result = 0;
 
 final:
-    mb_free(mb);
     return result;
 }
 
-static void dis_ev_free(struct dispatch_event_t* dis_ev)
+/*
+ * MAX_MEMCACHED_DATASIZE を超える set の値を分割して保存した後に
+ * マニフェストを利用者のキーに保存します。
+ */
+static int do_chunked_set(struct dispatch_event_t* dis_ev)
 {
-    if (dis_ev == NULL)
-        return;
+    char cmdline[CMDLINE_SIZE];
+    struct reqbuf_t* mrb;
+    int result;
 
-    if (dis_ev->data)
-        free(dis_ev->data);
-    free(dis_ev);
+    mrb = chunk_store(dis_ev->cmdline, dis_ev->rb, cmdline, sizeof(cmdline));
+    if (mrb == NULL) {
+        if (! dis_ev->noreply_flag)
+            reply_append(dis_ev->reply, "SERVER_ERROR chunk store failure" LINE_DELIMITER,
+                         strlen("SERVER_ERROR chunk store failure" LINE_DELIMITER));
+        return -1;
+    }
+    result = do_dispatch(dis_ev->reply,
+                CMDGRP_SET,
+                cmdline,
+                dis_ev->key,
+                mrb,
+                dis_ev->noreply_flag,
+                NULL,
+                1,
+                &dis_ev->server,
+                &dis_ev->timing);
+    reqbuf_release(mrb);
+    return result;
 }
 
-static void dispatch_thread(void* argv)
+/*
+ * 分割して保存した値を置き換えるコマンドか調べます。
+ * set と delete は以前のマニフェストのチャンクを削除します。
+ */
+static int chunk_replace_command(int cmd_grp, const char* cmdline)
 {
-    /* argv unuse */
-    struct dispatch_event_t* dis_ev;
-
-    while (! g_shutdown_flag) {
-#ifndef WIN32
-        pthread_mutex_lock(&dispatch_queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
-        while (que_empty(dispatch_queue)) {
-#ifdef WIN32
-            WaitForSingleObject(dispatch_queue_cond, INFINITE);
-#else
-            pthread_cond_wait(&dispatch_queue_cond, &dispatch_queue_mutex);
-#endif
-        }
-#ifndef WIN32
-        pthread_mutex_unlock(&dispatch_queue_mutex);
-#endif
-        /* キューからデータを取り出します。*/
-        dis_ev = (struct dispatch_event_t*)que_pop(dispatch_queue);
-        if (dis_ev == NULL)
-            continue;
-
-        /* dispatchを実行します。*/
-        if (dis_ev->cmd_grp == CMDGRP_GET) {
-            if (dis_ev->cn > 2) {
-                int i;
-                char** cl;
-
-                /* key が複数指定されたときは指定された key が
-                   同じデータストアに保存されている保障がないので
-                   別々にコマンドを発行します。 */
-                cl = split(dis_ev->cmdline, ' ');
-                if (cl == NULL) {
-                    err_write("dispatch_thread: no memory");
-                    if (! dis_ev->noreply_flag)
-                        reply_error(dis_ev->csocket, "no memory");
-                    dis_ev_free(dis_ev);
-                    continue;
-                }
-                for (i = 1; i < dis_ev->cn; i++) {
-                    char cmdbuf[CMDLINE_SIZE];
-                    int term_flag = 0;
-
-                    snprintf(cmdbuf, sizeof(cmdbuf), "%s %s", cl[0], cl[i]);
-                    if (i+1 == dis_ev->cn)
-                        term_flag = 1;
-                    do_dispatch(dis_ev->csocket,
-                                dis_ev->cmd_grp,
-                                cmdbuf,
-                                cl[i],
-                                dis_ev->dsize,
-                                dis_ev->data,
-                                dis_ev->noreply_flag,
-                                "END",
-                                term_flag);
-                }
-                list_free(cl);
-            } else {
-                /* single get, gets */
-                do_dispatch(dis_ev->csocket,
-                            dis_ev->cmd_grp,
-                            dis_ev->cmdline,
-                            dis_ev->key,
-                            dis_ev->dsize,
-                            dis_ev->data,
-                            dis_ev->noreply_flag,
-                            "END",
-                            1);
-            }
-        } else {
-            /* other get, gets command */
-            do_dispatch(dis_ev->csocket,
-                        dis_ev->cmd_grp,
-                        dis_ev->cmdline,
-                        dis_ev->key,
-                        dis_ev->dsize,
-                        dis_ev->data,
-                        dis_ev->noreply_flag,
-                        NULL,
-                        1);
-        }
-
-        /* パラメータ領域の解放 */
-        dis_ev_free(dis_ev);
-    }
-
-    /* スレッドを終了します。*/
-#ifdef _WIN32
-    _endthread();
-#endif
+    if (! chunk_enabled())
+        return 0;
+    return (cmd_grp == CMDGRP_DELETE || strncmp(cmdline, "set ", 4) == 0);
 }
 
-static void create_dispatch_threads()
+/* マルチゲットでサーバー毎にまとめたキー */
+struct mget_group_t {
+    struct server_t* server;        /* キーを保持しているサーバー */
+    struct server_socket_t* ss;     /* 送信したソケット(NULLは未送信) */
+    int first;                      /* 先頭のキーの要素番号 */
+    int last;                       /* 最後のキーの要素番号 */
+    int key_num;                    /* キー数 */
+    int64 send_time;                /* 送信を開始した時間 */
+    char cmdline[CMDLINE_SIZE];     /* サーバーへ送信するコマンド行 */
+};
+
+/* key を保持している稼動中のサーバーを求めます。*/
+static struct server_t* active_key_server(const char* key)
 {
-    int i;
+    struct server_t* server;
+    int retry;
 
-    for (i = 0; i < g_conf->dispatch_threads; i++) {
-#ifdef _WIN32
-        uintptr_t thread_id;
-#else
-        pthread_t thread_id;
-#endif
-        /* スレッドを作成します。
-           生成されたスレッドはリクエストキューが空のため、
-           待機状態に入ります。*/
-#ifdef _WIN32
-        thread_id = _beginthread(dispatch_thread, 0, NULL);
-#else
-        pthread_create(&thread_id, NULL, (void*)dispatch_thread, NULL);
-        /* スレッドの使用していた領域を終了時に自動的に解放します。*/
-        pthread_detach(thread_id);
-#endif
+    server = ds_key_server(key, strlen(key));
+    retry = g_conf->replications + 1;
+    while (server && server->status == DSS_INACTIVE) {
+        if (--retry < 1)
+            return NULL;
+        server = ds_next_server(server);
     }
+    return server;
 }
 
-int dispatch_event_entry(SOCKET csocket,
-                         int cmd_grp,
-                         const char* cmdline,
-                         int cn,
-                         const char** cl,
-                         int dsize,
-                         const char* data)
+/*
+ * 複数キーの get コマンドの応答を受信して mb に追加します。
+ * "END<CRLF>" は mb に含めません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int mget_recv(struct server_socket_t* ss,
+                     const char* cmdline,
+                     struct membuf_t* mb,
+                     int* hits)
 {
-    struct dispatch_event_t* dis_ev;
+    char buf[BUF_SIZE];
 
-    /* スレッドへ渡す情報を作成します */
-    dis_ev = (struct dispatch_event_t*)calloc(1, sizeof(struct dispatch_event_t));
-    if (dis_ev == NULL) {
-        err_write("dispatch_event_entry: no memory.");
-        return -1;
-    }
-    dis_ev->csocket = csocket;
-    dis_ev->cmd_grp = cmd_grp;
-    strcpy(dis_ev->cmdline, cmdline);
-    strcpy(dis_ev->key, cl[1]);
-    dis_ev->cn = cn;
-    dis_ev->dsize = dsize;
-    if (data) {
-        dis_ev->data = (char*)malloc(dsize);
-        if (dis_ev->data == NULL) {
-            err_write("dispatch_event_entry: no memory.");
-            dis_ev_free(dis_ev);
+    *hits = 0;
+
+    if (g_conf->datastore_timeout >= 0) {
+        /* サーバーからの応答を指定ミリ秒待ちます。*/
+        if (! wait_recv_data(ss->socket, g_conf->datastore_timeout)) {
+            err_write("mget_recv: (%s) %s:%d data store server timeout.",
+                      cmdline, ss->server->ip, ss->server->port);
             return -1;
         }
-        memcpy(dis_ev->data, data, dsize);
     }
-    dis_ev->noreply_flag = noreply(cn, cl);
 
-    /* dispatch情報をキューイング(push)します。*/
-    que_push(dispatch_queue, dis_ev);
+    while (1) {
+        char tbuf[CMDLINE_SIZE];
+        struct cmdline_t cmdl;
+        int len;
+        int bytes;
+        char* dbuf;
+        int status;
 
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(dispatch_queue_cond);
-#else
-    pthread_mutex_lock(&dispatch_queue_mutex);
-    pthread_cond_signal(&dispatch_queue_cond);
-    pthread_mutex_unlock(&dispatch_queue_mutex);
-#endif
+        /* VALUE <key> <flags> <bytes> [<cas>]<CRLF>
+           <data block><CRLF>
+           ...
+           END<CRLF> */
+        len = recv_line(ss->socket, buf, sizeof(buf), LINE_DELIMITER);
+        if (len < 0) {
+            err_write("mget_recv: (%s) %s:%d recv_line() error[%d].",
+                      cmdline, ss->server->ip, ss->server->port, last_error());
+            return -1;
+        }
+        if (strcmp(buf, "END") == 0)
+            break;
+
+        if (len >= (int)sizeof(tbuf)) {
+            err_write("mget_recv: (%s) %s:%d illegal reply.",
+                      cmdline, ss->server->ip, ss->server->port);
+            return -1;
+        }
+        memcpy(tbuf, buf, len+1);
+        if (cmd_tokenize(tbuf, &cmdl) < 4 || strcmp(cmdl.cl[0], "VALUE") != 0) {
+            err_write("mget_recv: (%s) %s:%d illegal reply=%s.",
+                      cmdline, ss->server->ip, ss->server->port, buf);
+            return -1;
+        }
+        bytes = atoi(cmdl.cl[3]) + strlen(LINE_DELIMITER);
+
+        dbuf = (char*)malloc(bytes);
+        if (dbuf == NULL) {
+            err_write("mget_recv: (%s) %s:%d no memory %d bytes.",
+                      cmdline, ss->server->ip, ss->server->port, bytes);
+            return -1;
+        }
+        if (recv_nchar(ss->socket, dbuf, bytes, &status) != bytes) {
+            err_write("mget_recv: (%s) %s:%d recv data error[%d].",
+                      cmdline, ss->server->ip, ss->server->port, last_error());
+            free(dbuf);
+            return -1;
+        }
+        mb_append(mb, buf, len);
+        mb_append(mb, LINE_DELIMITER, strlen(LINE_DELIMITER));
+        mb_append(mb, dbuf, bytes);
+        free(dbuf);
+        (*hits)++;
+    }
     return 0;
 }
 
-int dispatch_server_start()
+/*
+ * get コマンドのキーがニアキャッシュに存在する場合は
+ * 応答エントリに追加します。
+ *
+ * 戻り値
+ *  ニアキャッシュから応答した場合は 1 を返します。
+ *  それ以外はゼロを返します。
+ */
+static int near_cache_lookup(struct reply_t* reply, const char* cmdline, const char* key)
 {
-    /* メッセージキューの作成 */
-    dispatch_queue = que_initialize();
-    if (dispatch_queue == NULL)
-        return -1;
-    TRACE("%s initialized.\n", "dispatch queue");
+    if (g_conf->near_cache_size < 1 || reply == NULL)
+        return 0;
+    /* gets は <cas> が必要なので対象外です。*/
+    if (cmdline[3] != ' ')
+        return 0;
 
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    dispatch_queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&dispatch_queue_mutex, NULL);
-    pthread_cond_init(&dispatch_queue_cond, NULL);
-#endif
-
-    /* ワーカースレッドを生成します。 */
-    create_dispatch_threads();
-    return 0;
+    if (reply->mb == NULL) {
+        /* データストアの応答でも使用されます。*/
+        reply->mb = mb_alloc(BUF_SIZE);
+        if (reply->mb == NULL)
+            return 0;
+    }
+    if (! near_cache_get(key, reply->mb))
+        return 0;
+    stats_add(STATS_GET_HITS, 1);
+    return 1;
 }
 
-void dispatch_server_end()
+/*
+ * 複数キーの get, gets を実行します。
+ *
+ * キーを保持しているサーバー毎にまとめて複数キーのコマンドとして
+ * すべてのサーバーへ先に送信してから応答を受信します。
+ * サーバーの応答はひとつの応答にまとめて最後に "END<CRLF>" を
+ * 付加します。
+ * サーバーでエラーになった場合はそのサーバーのキーをひとつずつ
+ * レプリケーション先のサーバーも含めて再実行します。
+ */
+static void do_multi_get(struct dispatch_event_t* dis_ev)
 {
-    if (dispatch_queue != NULL) {
-        que_finalize(dispatch_queue);
-        TRACE("%s terminated.\n", "dispatch queue");
+    char tbuf[CMDLINE_SIZE];
+    struct cmdline_t cmdl;
+    struct mget_group_t groups[MAX_CMDLINE_TOKENS];
+    int key_next[MAX_CMDLINE_TOKENS];
+    int group_num = 0;
+    int i, g;
+    int64 start_time;
+
+    if (dis_ev->noreply_flag)
+        return;
+
+    /* dis_ev->cmdline は実行中の競合判定で参照されるので
+       コピーを分割します。*/
+    strcpy(tbuf, dis_ev->cmdline);
+    cmd_tokenize(tbuf, &cmdl);
+
+    /* キーを保持しているサーバー毎にまとめます。*/
+    for (i = 1; i < cmdl.cn; i++) {
+        struct server_t* server;
+
+        /* get はニアキャッシュから応答します。*/
+        if (near_cache_lookup(dis_ev->reply, dis_ev->cmdline, cmdl.cl[i]))
+            continue;
+
+        noreply_sync(cmdl.cl[i]);
+        server = active_key_server(cmdl.cl[i]);
+        if (server == NULL) {
+            err_write("do_multi_get: (%s) ds_key_server() is NULL.", cmdl.cl[i]);
+            continue;
+        }
+        for (g = 0; g < group_num; g++) {
+            if (groups[g].server == server)
+                break;
+        }
+        if (g == group_num) {
+            groups[g].server = server;
+            groups[g].ss = NULL;
+            groups[g].first = i;
+            groups[g].key_num = 0;
+            group_num++;
+        } else {
+            key_next[groups[g].last] = i;
+        }
+        groups[g].last = i;
+        groups[g].key_num++;
+        key_next[i] = 0;
     }
 
-#ifdef WIN32
-    CloseHandle(dispatch_queue_cond);
-#else
-    pthread_cond_destroy(&dispatch_queue_cond);
-    pthread_mutex_destroy(&dispatch_queue_mutex);
-#endif
+    /* サーバー毎のコマンドを送信します。*/
+    start_time = system_time();
+    for (g = 0; g < group_num; g++) {
+        struct mget_group_t* grp = &groups[g];
+        struct sendvec_t vec[2];
+        char* p;
+        int len;
+        long probe;
+
+        p = grp->cmdline;
+        len = snprintf(p, sizeof(grp->cmdline), "%s", cmdl.cl[0]);
+        for (i = grp->first; i > 0; i = key_next[i])
+            len += snprintf(p+len, sizeof(grp->cmdline)-len, " %s", cmdl.cl[i]);
+
+        if (ds_check_server(grp->server) < 0) {
+            if (grp->server->breaker_state == BREAKER_CLOSED)
+                err_write("do_multi_get: %s:%d was locked/inactive.", grp->server->ip, grp->server->port);
+            continue;
+        }
+        probe = ds_breaker_probe(grp->server);
+        grp->ss = ds_server_socket(grp->server);
+        grp->send_time = system_time();
+        latency_record(grp->server, CMDGRP_GET, LATENCY_POOL, grp->send_time - start_time);
+        /* 送信はサーバー毎に順に行うので最後に取得した時間とします。*/
+        dis_ev->timing.pool_usec = grp->send_time - start_time;
+        if (grp->ss == NULL) {
+            err_write("do_multi_get: (%s) ds_server_socket() is NULL.", grp->cmdline);
+            ds_breaker_record(grp->server, probe, -1);
+            continue;
+        }
+        grp->ss->probe = probe;
+        vec[0].buf = p;
+        vec[0].len = len;
+        vec[1].buf = LINE_DELIMITER;
+        vec[1].len = strlen(LINE_DELIMITER);
+        if (send_datav(grp->ss->socket, vec, 2) < 0) {
+            err_write("do_multi_get: (%s) %s:%d send error[%d].",
+                      grp->cmdline, grp->server->ip, grp->server->port, last_error());
+            ds_release_socket(grp->server, grp->ss, -1);
+            grp->ss = NULL;
+        }
+    }
+
+    /* サーバー毎の応答を受信してまとめます。*/
+    for (g = 0; g < group_num; g++) {
+        struct mget_group_t* grp = &groups[g];
+        int result = -1;
+        int hits = 0;
+
+        if (grp->ss) {
+            struct membuf_t* mb;
+            int64 end_time;
+
+            mb = mb_alloc(BUF_SIZE);
+            if (mb == NULL) {
+                err_write("do_multi_get: mb_alloc() no memory.");
+            } else {
+                result = mget_recv(grp->ss, grp->cmdline, mb, &hits);
+                if (result == 0 && mb->size > 0)
+                    reply_append(dis_ev->reply, mb->buf, mb->size);
+                mb_free(mb);
+            }
+            ds_release_socket(grp->server, grp->ss, result);
+
+            /* 実行時間はキー毎のコマンドとして集計します。*/
+            end_time = system_time();
+            ATOMIC_ADD64(&grp->server->cmd_time, (end_time - start_time) * grp->key_num);
+            latency_record(grp->server, CMDGRP_GET, LATENCY_BACKEND, end_time - grp->send_time);
+            /* 応答時間はサーバー毎の最大値とします。*/
+            if (end_time - grp->send_time > dis_ev->timing.backend_usec)
+                dis_ev->timing.backend_usec = end_time - grp->send_time;
+            if (result < 0)
+                ATOMIC_ADD64(&grp->server->error_count, 1);
+        }
+
+        if (result == 0) {
+            for (i = grp->first; i > 0; i = key_next[i]) {
+                incl_command(CMDGRP_GET, grp->server);
+                hotkey_record(cmdl.cl[i], grp->server);
+            }
+            stats_add(STATS_GET_HITS, hits);
+            stats_add(STATS_GET_MISSES, grp->key_num - hits);
+        } else {
+            /* キー毎に次のサーバーも含めて再実行します。*/
+            for (i = grp->first; i > 0; i = key_next[i]) {
+                char cmdbuf[CMDLINE_SIZE];
+
+                snprintf(cmdbuf, sizeof(cmdbuf), "%s %s", cmdl.cl[0], cmdl.cl[i]);
+                do_dispatch(dis_ev->reply,
+                            CMDGRP_GET,
+                            cmdbuf,
+                            cmdl.cl[i],
+                            NULL,
+                            0,
+                            "END",
+                            0,
+                            NULL,
+                            &dis_ev->timing);
+                dis_ev->timing.retries++;
+            }
+        }
+    }
+
+    reply_append(dis_ev->reply, "END" LINE_DELIMITER, strlen("END" LINE_DELIMITER));
+}
+
+static void dis_ev_free(struct dispatch_event_t* dis_ev)
+{
+    if (dis_ev == NULL)
+        return;
+
+    if (dis_ev->rb)
+        reqbuf_release(dis_ev->rb);
+    if (dis_ev->deps)
+        free(dis_ev->deps);
+    free(dis_ev);
+    ATOMIC_DEC(&dispatch_inflight);
+}
+
+static void dispatch_push(struct dispatch_event_t* dis_ev)
+{
+    /* dispatch情報をキューイング(push)します。*/
+    workq_push(dispatch_queue, dis_ev);
+}
+
+/* コマンドの対象に key が含まれているか調べます。*/
+static int has_key(struct dispatch_event_t* dis_ev, const char* key)
+{
+    const char* p;
+    int keylen;
+
+    if (dis_ev->cn <= 2)
+        return (strcmp(dis_ev->key, key) == 0);
+
+    /* get <key> <key1> ... */
+    keylen = strlen(key);
+    p = strchr(dis_ev->cmdline, ' ');
+    while (p) {
+        while (*p == ' ')
+            p++;
+        if (strncmp(p, key, keylen) == 0 && (p[keylen] == ' ' || p[keylen] == '\0'))
+            return 1;
+        p = strchr(p, ' ');
+    }
+    return 0;
+}
+
+/* 同じキーを対象にして実行順序を守る必要があるか調べます。*/
+static int is_conflict(struct dispatch_event_t* ev1, struct dispatch_event_t* ev2)
+{
+    if (ev1->cmd_grp == CMDGRP_GET && ev2->cmd_grp == CMDGRP_GET)
+        return 0;   /* 参照同士は並行して実行できます。*/
+    if (ev1->cmd_grp == CMDGRP_GET)
+        return has_key(ev1, ev2->key);
+    if (ev2->cmd_grp == CMDGRP_GET)
+        return has_key(ev2, ev1->key);
+    return (strcmp(ev1->key, ev2->key) == 0);
+}
+
+static int add_dependent(struct dispatch_event_t* dis_ev, struct dispatch_event_t* dep_ev)
+{
+    if (dis_ev->dep_num >= dis_ev->dep_alloc) {
+        int n;
+        struct dispatch_event_t** deps;
+
+        n = (dis_ev->dep_alloc > 0)? dis_ev->dep_alloc * 2 : 4;
+        deps = (struct dispatch_event_t**)realloc(dis_ev->deps, n * sizeof(struct dispatch_event_t*));
+        if (deps == NULL)
+            return -1;
+        dis_ev->deps = deps;
+        dis_ev->dep_alloc = n;
+    }
+    dis_ev->deps[dis_ev->dep_num++] = dep_ev;
+    return 0;
+}
+
+/*
+ * 同じクライアントの実行中コマンドに登録します。
+ *
+ * パイプラインで送信されたコマンドは並行して実行されますが、
+ * 同じキーを更新するコマンドが先行している場合は
+ * 先行するコマンドが完了するまで実行を遅らせます。
+ *
+ * 戻り値
+ *  完了を待つ先行コマンドの数を返します。
+ */
+static int inflight_add(struct dispatch_event_t* dis_ev)
+{
+    struct client_t* client = dis_ev->client;
+    struct dispatch_event_t* ev;
+    struct dispatch_event_t* last = NULL;
+    int wait_count = 0;
+
+    CS_START(&client->critical_section);
+    ev = (struct dispatch_event_t*)client->inflight;
+    while (ev) {
+        if (is_conflict(ev, dis_ev)) {
+            if (add_dependent(ev, dis_ev) == 0)
+                wait_count++;
+        }
+        last = ev;
+        ev = ev->inflight_next;
+    }
+    dis_ev->wait_count = wait_count;
+    dis_ev->inflight_next = NULL;
+    if (last)
+        last->inflight_next = dis_ev;
+    else
+        client->inflight = dis_ev;
+    CS_END(&client->critical_section);
+    return wait_count;
+}
+
+/* 実行中コマンドから削除して後続のコマンドを実行可能にします。*/
+static void inflight_remove(struct dispatch_event_t* dis_ev)
+{
+    struct client_t* client = dis_ev->client;
+    struct dispatch_event_t* ev;
+    struct dispatch_event_t* prev = NULL;
+    int i;
+
+    CS_START(&client->critical_section);
+    ev = (struct dispatch_event_t*)client->inflight;
+    while (ev) {
+        if (ev == dis_ev) {
+            if (prev)
+                prev->inflight_next = ev->inflight_next;
+            else
+                client->inflight = ev->inflight_next;
+            break;
+        }
+        prev = ev;
+        ev = ev->inflight_next;
+    }
+    for (i = 0; i < dis_ev->dep_num; i++) {
+        if (--dis_ev->deps[i]->wait_count == 0)
+            dispatch_push(dis_ev->deps[i]);
+    }
+    dis_ev->dep_num = 0;
+    CS_END(&client->critical_section);
+}
+
+static struct flight_stripe_t* flight_stripe(const char* key)
+{
+    return &flight_stripes[ch_hash(key, strlen(key)) % FLIGHT_STRIPES];
+}
+
+/*
+ * 同じキーの get がデータストアへ問い合わせ中の場合は
+ * 後続の get として登録して応答を共有します。
+ * 問い合わせ中の get がない場合は実行する get として登録します。
+ *
+ * 戻り値
+ *  後続の get として登録した場合は 1 を返します。
+ *  実行する get として登録した場合はゼロを返します。
+ */
+static int flight_join(struct dispatch_event_t* dis_ev)
+{
+    struct flight_stripe_t* stripe;
+    struct dispatch_event_t* ev;
+    int result = 0;
+
+    stripe = flight_stripe(dis_ev->key);
+    CS_START(&stripe->critical_section);
+    ev = stripe->head;
+    while (ev) {
+        if (! ev->flight_closed && strcmp(ev->cmdline, dis_ev->cmdline) == 0)
+            break;
+        ev = ev->flight_next;
+    }
+    if (ev) {
+        dis_ev->flight_next = ev->waiters;
+        ev->waiters = dis_ev;
+        result = 1;
+    } else {
+        dis_ev->flight_next = stripe->head;
+        stripe->head = dis_ev;
+    }
+    CS_END(&stripe->critical_section);
+    return result;
+}
+
+/*
+ * 更新コマンドを受け付けたとき、および更新が完了したときに
+ * そのキーの問い合わせ中の get に後続の get を登録しないようにします。
+ * 更新後に受け付けた get が更新前の値を共有しないためです。
+ */
+static void flight_close(const char* key)
+{
+    struct flight_stripe_t* stripe;
+    struct dispatch_event_t* ev;
+
+    stripe = flight_stripe(key);
+    CS_START(&stripe->critical_section);
+    ev = stripe->head;
+    while (ev) {
+        if (strcmp(ev->key, key) == 0)
+            ev->flight_closed = 1;
+        ev = ev->flight_next;
+    }
+    CS_END(&stripe->critical_section);
+}
+
+/* 実行した get を削除して後続の get を返します。*/
+static struct dispatch_event_t* flight_leave(struct dispatch_event_t* dis_ev)
+{
+    struct flight_stripe_t* stripe;
+    struct dispatch_event_t* ev;
+    struct dispatch_event_t* prev = NULL;
+    struct dispatch_event_t* waiters;
+
+    stripe = flight_stripe(dis_ev->key);
+    CS_START(&stripe->critical_section);
+    ev = stripe->head;
+    while (ev) {
+        if (ev == dis_ev) {
+            if (prev)
+                prev->flight_next = ev->flight_next;
+            else
+                stripe->head = ev->flight_next;
+            break;
+        }
+        prev = ev;
+        ev = ev->flight_next;
+    }
+    waiters = dis_ev->waiters;
+    dis_ev->waiters = NULL;
+    CS_END(&stripe->critical_section);
+    return waiters;
+}
+
+static void dispatch_done(struct dispatch_event_t* dis_ev);
+
+/* 実行した get の応答を後続の get に複写して応答を完了します。*/
+static void flight_done(struct dispatch_event_t* dis_ev)
+{
+    struct dispatch_event_t* waiters;
+    struct membuf_t* mb;
+
+    waiters = flight_leave(dis_ev);
+    mb = dis_ev->reply->mb;
+    while (waiters) {
+        struct dispatch_event_t* ev = waiters;
+
+        waiters = ev->flight_next;
+        if (dis_ev->reply->streamed) {
+            /* 値を送信済みで共有できないので受信した値を保持して
+               実行するように再度キューイングします。*/
+            ev->reply->no_stream = 1;
+            dispatch_push(ev);
+            continue;
+        }
+        if (mb && mb->size > 0) {
+            reply_append(ev->reply, mb->buf, mb->size);
+            if (strncmp(mb->buf, "VALUE ", 6) == 0)
+                stats_add(STATS_GET_HITS, 1);
+            else if (strncmp(mb->buf, "END", 3) == 0)
+                stats_add(STATS_GET_MISSES, 1);
+        } else {
+            reply_append_error(ev->reply, NULL);
+        }
+        ev->server = dis_ev->server;
+        stats_add(STATS_GET_COALESCED, 1);
+        dispatch_done(ev);
+    }
+}
+
+/* 処理時間が dinio.slowlog_time を超えたリクエストを記録します。*/
+static void slowlog_check(struct dispatch_event_t* dis_ev, int64 end_time, int64 send_usec)
+{
+    struct slowlog_t log;
+    const char* p;
+    int len;
+
+    if (g_conf->slowlog_time < 1)
+        return;
+    if (end_time - dis_ev->entry_time < (int64)g_conf->slowlog_time * 1000)
+        return;
+
+    memset(&log, 0, sizeof(log));
+    log.time = end_time;
+    p = strchr(dis_ev->cmdline, ' ');
+    len = (p)? (int)(p - dis_ev->cmdline) : (int)strlen(dis_ev->cmdline);
+    if (len >= (int)sizeof(log.cmd))
+        len = sizeof(log.cmd) - 1;
+    memcpy(log.cmd, dis_ev->cmdline, len);
+    strcpy(log.key, dis_ev->key);
+    if (dis_ev->server) {
+        strcpy(log.ip, dis_ev->server->ip);
+        log.port = dis_ev->server->port;
+    }
+    log.total_usec = end_time - dis_ev->entry_time;
+    log.queue_usec = dis_ev->timing.queue_usec;
+    log.pool_usec = dis_ev->timing.pool_usec;
+    log.backend_usec = dis_ev->timing.backend_usec;
+    log.send_usec = send_usec;
+    log.retries = dis_ev->timing.retries;
+    slowlog_record(&log);
+}
+
+/* コマンドの応答を完了して後続のコマンドを実行可能にします。*/
+static void dispatch_done(struct dispatch_event_t* dis_ev)
+{
+    struct client_t* client = dis_ev->client;
+    int64 end_time = system_time();
+    int64 send_usec = 0;
+
+    if (client) {
+        int64 start_time = end_time;
+
+        /* 応答キューの先頭から完了した応答をクライアントへ送信します。*/
+        reply_complete(dis_ev->reply);
+        end_time = system_time();
+        send_usec = end_time - start_time;
+        latency_record(dis_ev->server, dis_ev->cmd_grp, LATENCY_SEND, send_usec);
+        inflight_remove(dis_ev);
+    }
+    slowlog_check(dis_ev, end_time, send_usec);
+    /* ヘッジした get は両方のリクエストが完了するまで解放しません。*/
+    if (! dis_ev->hedge_fired || ATOMIC_DEC(&dis_ev->bio_refs) == 0)
+        dis_ev_free(dis_ev);
+    if (client)
+        client_release(client);
+}
+
+/* コマンドの実行後の処理を行って応答を完了します。*/
+static void command_finish(struct dispatch_event_t* dis_ev)
+{
+    if (dis_ev->cmd_grp == CMDGRP_GET) {
+        /* 同じキーの get に応答を複写します。*/
+        if (dis_ev->cn <= 2 && dis_ev->reply)
+            flight_done(dis_ev);
+        /* get の応答をニアキャッシュに登録します。*/
+        if (g_conf->near_cache_size > 0 && dis_ev->reply && dis_ev->reply->mb &&
+            ! dis_ev->reply->streamed && dis_ev->cmdline[3] == ' ')
+            near_cache_fill(dis_ev->reply->mb->buf, dis_ev->reply->mb->size, dis_ev->nc_version);
+    } else {
+        /* 更新が完了したキーのニアキャッシュを無効化します。*/
+        near_cache_invalidate(dis_ev->key, 1);
+        /* 更新の完了前に問い合わせを開始した get の応答を
+           更新後に実行する get と共有しません。*/
+        flight_close(dis_ev->key);
+    }
+
+    /* 応答を完了してパラメータ領域を解放します。*/
+    dispatch_done(dis_ev);
+}
+
+/*
+ * コマンドを I/O スレッドで実行できるか調べます。
+ * 分割して保存する set と、ディスパッチスレッドで実行する
+ * レプリケーションはデータストアの応答を待つため対象外です。
+ * get の応答がマニフェストの場合はディスパッチスレッドで値を復元します。
+ */
+static int async_command(struct dispatch_event_t* dis_ev)
+{
+    if (! backend_io_enabled())
+        return 0;
+    if (dis_ev->cmd_grp == CMDGRP_GET)
+        return (dis_ev->cn == 2 && dis_ev->reply);
+    if (dis_ev->cmd_grp == CMDGRP_SET && chunk_required(dis_ev->rb))
+        return 0;
+    return (g_conf->replications < 1 || g_conf->replication_threads > 0);
+}
+
+/*
+ * リクエストの応答をクライアントへの応答として使用できるか調べます。
+ * ヘッジした get は最初に呼び出したリクエストの応答を使用します。
+ */
+static int hedge_claim(struct dispatch_event_t* dis_ev, struct bio_request_t* req)
+{
+    long id = (req == &dis_ev->hedge)? 2 : 1;
+
+    if (ATOMIC_CAS(&dis_ev->hedge_winner, 0, id))
+        return 1;
+    return (dis_ev->hedge_winner == id);
+}
+
+/* I/O スレッドで受信した大きな値をクライアントへ中継します。*/
+static int async_stream(struct bio_request_t* req, const char* buf, int len)
+{
+    struct dispatch_event_t* dis_ev = (struct dispatch_event_t*)req->arg;
+
+    /* ヘッジした get は先に受信した応答だけを中継します。
+       他方のリクエストで完了した応答エントリは解放されているので
+       応答エントリを参照する前に調べます。*/
+    if (! hedge_claim(dis_ev, req))
+        return -1;
+    if (! dis_ev->reply->streamed) {
+        /* 最初に呼び出されるのは VALUE の行です。*/
+        if (reply_stream_start(dis_ev->reply) < 0)
+            return -1;
+    }
+    return reply_stream(dis_ev->reply, buf, len);
+}
+
+/*
+ * I/O スレッドで受信した応答を調べて応答エントリに追加します。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  データストアを更新しなかった応答(NOT_STORED など)の場合は 1 を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int async_reply(struct dispatch_event_t* dis_ev, struct bio_request_t* req)
+{
+    struct membuf_t* mb = req->mb;
+    char line[BUF_SIZE];
+    int len;
+
+    if (dis_ev->cmd_grp == CMDGRP_GET) {
+        if (dis_ev->reply->streamed) {
+            stats_add(STATS_GET_HITS, 1);
+            reply_append(dis_ev->reply, "END" LINE_DELIMITER, strlen("END" LINE_DELIMITER));
+        } else if (mb->size > 6 && memcmp(mb->buf, "VALUE ", 6) == 0) {
+            stats_add(STATS_GET_HITS, 1);
+            reply_append(dis_ev->reply, mb->buf, mb->size);
+        } else {
+            stats_add(STATS_GET_MISSES, 1);
+            reply_append(dis_ev->reply, "END" LINE_DELIMITER, strlen("END" LINE_DELIMITER));
+        }
+        return 0;
+    }
+
+    len = req->header_len - strlen(LINE_DELIMITER);
+    if (len < 0 || len >= (int)sizeof(line))
+        return -1;
+    memcpy(line, mb->buf, len);
+    line[len] = '\0';
+    if (dis_ev->cmd_grp == CMDGRP_SET) {
+        if (! valid_update_reply(line)) {
+            err_write("async_reply: (%s) %s:%d recv_line(STORED)=%s.",
+                      dis_ev->cmdline, req->server->ip, req->server->port, line);
+            return -1;
+        }
+    } else if (dis_ev->cmd_grp == CMDGRP_DELETE) {
+        if (! valid_delete_reply(line)) {
+            err_write("async_reply: (%s) %s:%d recv_line(DELETED)=%s.",
+                      dis_ev->cmdline, req->server->ip, req->server->port, line);
+            return -1;
+        }
+    }
+    stats_reply(dis_ev->cmdline, line);
+    reply_append(dis_ev->reply, mb->buf, req->header_len);
+    return ! applied_reply(line);
+}
+
+/*
+ * I/O スレッドからコマンドの完了を通知されるコールバック関数です。
+ * エラーの場合は次のサーバーで再実行するために再度キューイングします。
+ *
+ * ヘッジした get は先に成功したリクエストの応答で完了します。
+ * 後から完了したリクエストの応答は読み捨てて、両方のリクエストが
+ * 完了した時点でパラメータ領域を解放します。
+ */
+static void async_done(struct bio_request_t* req, int result)
+{
+    struct dispatch_event_t* dis_ev = (struct dispatch_event_t*)req->arg;
+    struct server_t* server = req->server;
+    int64 end_time;
+    int used = 1;
+    int relayed = 0;
+
+    if (result == 0 && ! req->noreply_flag) {
+        if (dis_ev->hedge_fired && ! hedge_claim(dis_ev, req)) {
+            used = 0;
+        } else {
+            result = async_reply(dis_ev, req);
+            if (result > 0) {
+                relayed = 1;
+                result = 0;
+            }
+        }
+    }
+    mb_free(req->mb);
+    req->mb = NULL;
+
+    /* サーバーのソケットをプールへ返却します。*/
+    if (req->ss) {
+        ds_release_socket(server, req->ss, result);
+        req->ss = NULL;
+    } else {
+        ds_breaker_record(server, req->breaker_probe, result);
+    }
+
+    /* 実行時間を集計します。*/
+    end_time = system_time();
+    ATOMIC_ADD64(&server->cmd_time, end_time - dis_ev->async_start);
+    latency_record(server, dis_ev->cmd_grp, LATENCY_BACKEND, end_time - req->send_time);
+
+    if (dis_ev->hedge_fired) {
+        if (result == 0 && used) {
+            dis_ev->hedge_ok = 1;
+            if (req == &dis_ev->hedge)
+                stats_add(STATS_HEDGE_WINS, 1);
+        } else {
+            if (result < 0)
+                ATOMIC_ADD64(&server->error_count, 1);
+            /* 他方のリクエストの完了を待ちます。*/
+            if (ATOMIC_DEC(&dis_ev->bio_refs) > 0)
+                return;
+            if (dis_ev->hedge_ok) {
+                /* 先に完了したリクエストで応答済みです。*/
+                dis_ev_free(dis_ev);
+                return;
+            }
+            /* 両方のリクエストがエラーになりました。*/
+            dis_ev->hedge_fired = 0;
+            dis_ev->async_tries = 0;
+            result = -1;
+            if (dis_ev->reply && dis_ev->reply->streamed)
+                reply_stream_abort(dis_ev->reply);
+            else
+                reply_append_error(dis_ev->reply, NULL);
+            command_finish(dis_ev);
+            return;
+        }
+    }
+    dis_ev->timing.backend_usec += end_time - req->send_time;
+
+    if (result < 0) {
+        ATOMIC_ADD64(&server->error_count, 1);
+        if (dis_ev->reply && dis_ev->reply->streamed) {
+            /* 送信済みの応答が不完全なのでクライアントを切断します。*/
+            reply_stream_abort(dis_ev->reply);
+        } else if (dis_ev->async_tries > 0 && ! g_shutdown_flag) {
+            dispatch_push(dis_ev);
+            return;
+        } else if (! dis_ev->noreply_flag) {
+            reply_append_error(dis_ev->reply, NULL);
+        }
+    } else {
+        dis_ev->server = server;
+        /* NOT_STORED などの応答はレプリケーションしません。*/
+        if (! relayed)
+            command_success(dis_ev->cmd_grp, dis_ev->key, dis_ev->key_server);
+        if (dis_ev->cmd_grp == CMDGRP_GET && chunk_included(dis_ev->reply)) {
+            /* チャンクの取得はデータストアの応答を待つので
+               ディスパッチスレッドで値を復元します。*/
+            dis_ev->chunk_pending = 1;
+            dispatch_push(dis_ev);
+            return;
+        }
+    }
+    command_finish(dis_ev);
+}
+
+/*
+ * ヘッジのリクエストを送信するまでの時間(マイクロ秒)を求めます。
+ * キーのサーバーへの最初の get だけが対象で、サーバーの get の応答時間の
+ * dinio.hedge_percentile パーセンタイルとします。
+ * 応答を待つリクエストが接続を占有しないパイプライン接続が必要です。
+ *
+ * 戻り値
+ *  ヘッジする場合は時間を返します。
+ *  ヘッジしない場合は -1 を返します。
+ */
+static int hedge_delay(struct dispatch_event_t* dis_ev, struct server_t* server)
+{
+    struct histogram_t* hist;
+
+    if (g_conf->hedge_percentile < 1 || g_conf->replications < 1 ||
+        dis_ev->cmd_grp != CMDGRP_GET || ! backend_io_pipelined())
+        return -1;
+    if (server != dis_ev->key_server || dis_ev->timing.retries > 0)
+        return -1;
+    hist = latency_histogram(server, CMDGRP_GET, LATENCY_BACKEND);
+    if (hist == NULL || hist->count < HEDGE_MIN_SAMPLES)
+        return -1;
+    return (int)hist_percentile(hist, g_conf->hedge_percentile / 100.0);
+}
+
+static void async_hedge(struct bio_request_t* req);
+
+/*
+ * サーバーのソケットを取得して I/O スレッドに登録します。
+ * パイプライン接続を使用する場合はプールからソケットを取得しません。
+ * noreply のコマンドは応答を読まないのでプールのソケットで送信します。
+ */
+static int async_send(struct dispatch_event_t* dis_ev,
+                      struct bio_request_t* req,
+                      struct server_t* server)
+{
+    struct server_socket_t* ss = NULL;
+    int64 send_time;
+    long probe;
+
+    if (req == &dis_ev->bio)
+        dis_ev->async_start = system_time();
+    /* noreply は応答を確認できないので HALF_OPEN の試行にしません。*/
+    probe = (dis_ev->noreply_flag)? 0 : ds_breaker_probe(server);
+
+    if (dis_ev->noreply_flag || ! backend_io_pipelined()) {
+        /* サーバーのソケットをプールから取得します。*/
+        ss = ds_server_socket(server);
+        send_time = system_time();
+        latency_record(server, dis_ev->cmd_grp, LATENCY_POOL, send_time - dis_ev->async_start);
+        dis_ev->timing.pool_usec += send_time - dis_ev->async_start;
+        if (ss == NULL) {
+            err_write("async_submit: (%s) ds_server_socket() is NULL.", dis_ev->cmdline);
+            ATOMIC_ADD64(&server->error_count, 1);
+            ds_breaker_record(server, probe, -1);
+            return -1;
+        }
+        ss->probe = probe;
+    } else {
+        send_time = system_time();
+    }
+
+    /* データブロックはコピーせずにそのまま送信します。*/
+    req->server = server;
+    req->ss = ss;
+    req->cmd_grp = dis_ev->cmd_grp;
+    req->cmdline = dis_ev->cmdline;
+    req->vec[0].buf = dis_ev->cmdline;
+    req->vec[0].len = strlen(dis_ev->cmdline);
+    req->vec[1].buf = LINE_DELIMITER;
+    req->vec[1].len = strlen(LINE_DELIMITER);
+    req->vec_count = 2;
+    if (dis_ev->rb && dis_ev->rb->size > 0) {
+        req->vec[2].buf = dis_ev->rb->data;
+        req->vec[2].len = dis_ev->rb->size;
+        req->vec_count = 3;
+    }
+    req->noreply_flag = dis_ev->noreply_flag;
+    req->stream_size = (dis_ev->cmd_grp == CMDGRP_GET)? g_conf->stream_size * 1024 : 0;
+    req->stream = async_stream;
+    req->done = async_done;
+    req->arg = dis_ev;
+    req->send_time = send_time;
+    req->breaker_probe = (ss)? 0 : probe;
+    req->hedge = NULL;
+    if (req == &dis_ev->bio) {
+        req->hedge_usec = hedge_delay(dis_ev, server);
+        if (req->hedge_usec >= 0)
+            req->hedge = async_hedge;
+    }
+
+    if (backend_io_submit(req) < 0) {
+        if (ss) {
+            /* 送信していないので試行の結果にはしません。*/
+            ss->probe = 0;
+            ds_release_socket(server, ss, 0);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 応答が dinio.hedge_percentile の時間を過ぎても届かない get を
+ * レプリカのサーバーへも送信します。I/O スレッドから呼び出されます。
+ * I/O スレッドを待たせないように、ロック中のサーバーやサーキット
+ * ブレーカーが閉じていないサーバーには送信しません。
+ */
+static void async_hedge(struct bio_request_t* req)
+{
+    struct dispatch_event_t* dis_ev = (struct dispatch_event_t*)req->arg;
+    struct server_t* server;
+
+    /* 中継を開始した応答は切り替えません。*/
+    if (dis_ev->hedge_winner != 0)
+        return;
+    server = ds_next_server(req->server);
+    if (server == NULL || server == req->server ||
+        server->status != DSS_ACTIVE || server->breaker_state != BREAKER_CLOSED)
+        return;
+
+    /* 先行のリクエストは同じスレッドで処理されるので完了していません。*/
+    dis_ev->bio_refs = 2;
+    dis_ev->hedge_ok = 0;
+    dis_ev->hedge_fired = 1;
+    if (async_send(dis_ev, &dis_ev->hedge, server) < 0) {
+        dis_ev->hedge_fired = 0;
+        dis_ev->bio_refs = 0;
+        return;
+    }
+    stats_add(STATS_HEDGED_GETS, 1);
+}
+
+/* サーバーの状態をチェックして I/O スレッドに登録します。*/
+static int async_submit(struct dispatch_event_t* dis_ev, struct server_t* server)
+{
+    /* サーバーの状態をチェックします。*/
+    if (ds_check_server(server) < 0) {
+        if (server->breaker_state == BREAKER_CLOSED)
+            err_write("async_submit: %s:%d was locked/inactive.", server->ip, server->port);
+        return -1;
+    }
+    return async_send(dis_ev, &dis_ev->bio, server);
+}
+
+/*
+ * コマンドを I/O スレッドで実行します。
+ * I/O スレッドでエラーになったコマンドは次のサーバーから実行します。
+ *
+ * 戻り値
+ *  I/O スレッドに登録した場合はゼロを返します。
+ *  実行できるサーバーがない場合はエラーの応答を追加して -1 を返します。
+ */
+static int do_async(struct dispatch_event_t* dis_ev)
+{
+    struct server_t* server;
+
+    if (dis_ev->key_server == NULL) {
+        /* 送信キューの同じキーの noreply のコマンドを先に送信します。*/
+        noreply_sync(dis_ev->key);
+
+        server = active_key_server(dis_ev->key);
+        if (server == NULL) {
+            err_write("do_async: (%s) ds_key_server() is NULL.", dis_ev->cmdline);
+            goto error;
+        }
+        dis_ev->key_server = server;
+        dis_ev->async_tries = g_conf->replications + 1;
+    } else {
+        /* エラーの場合は次のサーバーから取得します。*/
+        server = ds_next_server(dis_ev->bio.server);
+        if (server == NULL || server == dis_ev->key_server)
+            goto error;
+        dis_ev->timing.retries++;
+        dis_ev->hedge_winner = 0;
+    }
+
+    while (dis_ev->async_tries > 0) {
+        dis_ev->async_tries--;
+        if (async_submit(dis_ev, server) == 0)
+            return 0;
+        if (dis_ev->async_tries > 0) {
+            server = ds_next_server(server);
+            if (server == NULL || server == dis_ev->key_server)
+                break;
+            dis_ev->timing.retries++;
+        }
+    }
+
+error:
+    if (! dis_ev->noreply_flag)
+        reply_append_error(dis_ev->reply, NULL);
+    return -1;
+}
+
+static void dispatch_thread(void* argv)
+{
+    /* argv: レーン番号 */
+    int lane_no = (int)(long)argv;
+    struct dispatch_event_t* dis_ev;
+
+    while (! g_shutdown_flag) {
+        /* キューからデータを取り出します。
+           データが入るまで待機します。*/
+        dis_ev = (struct dispatch_event_t*)workq_pop(dispatch_queue, lane_no);
+        if (dis_ev == NULL)
+            break;  /* キューの終了 */
+
+        if (dis_ev->chunk_pending) {
+            /* I/O スレッドで受信したマニフェストを値に復元します。*/
+            dis_ev->chunk_pending = 0;
+            chunk_expand(dis_ev->reply);
+            command_finish(dis_ev);
+            continue;
+        }
+        if (dis_ev->key_server) {
+            /* I/O スレッドでエラーになったコマンドを再実行します。*/
+            if (do_async(dis_ev) < 0)
+                command_finish(dis_ev);
+            continue;
+        }
+        dis_ev->timing.queue_usec = system_time() - dis_ev->entry_time;
+
+        /* dispatchを実行します。*/
+        if (dis_ev->cmd_grp == CMDGRP_GET) {
+            if (dis_ev->cn > 2) {
+                /* key が複数指定されたときはサーバー毎にまとめて
+                   コマンドを発行します。*/
+                do_multi_get(dis_ev);
+                /* 分割して保存した値を復元します。*/
+                chunk_expand(dis_ev->reply);
+            } else {
+                /* single get, gets */
+                if (dis_ev->reply) {
+                    /* 送信キューの同じキーの noreply のコマンドを先に送信してから
+                       問い合わせ中の get を探します。*/
+                    noreply_sync(dis_ev->key);
+                    /* 同じキーの get が問い合わせ中の場合は応答を共有します。*/
+                    if (flight_join(dis_ev))
+                        continue;
+                }
+                if (async_command(dis_ev)) {
+                    /* 応答は I/O スレッドで完了します。*/
+                    if (do_async(dis_ev) == 0)
+                        continue;
+                } else {
+                    do_dispatch(dis_ev->reply,
+                                dis_ev->cmd_grp,
+                                dis_ev->cmdline,
+                                dis_ev->key,
+                                dis_ev->rb,
+                                dis_ev->noreply_flag,
+                                "END",
+                                1,
+                                &dis_ev->server,
+                                &dis_ev->timing);
+                    /* 分割して保存した値を復元します。*/
+                    chunk_expand(dis_ev->reply);
+                }
+            }
+        } else {
+            int64 chunk_id = 0;
+            int chunks = 0;
+            int result;
+
+            /* 分割して保存した値を置き換える場合は以前のチャンクを求めます。*/
+            if (chunk_replace_command(dis_ev->cmd_grp, dis_ev->cmdline)) {
+                noreply_sync(dis_ev->key);
+                chunk_id = chunk_lookup(dis_ev->key, &chunks);
+            }
+            if (dis_ev->cmd_grp == CMDGRP_SET && chunk_required(dis_ev->rb)) {
+                /* 大きな値は分割して保存します。*/
+                result = do_chunked_set(dis_ev);
+            } else if (chunk_id == 0 && async_command(dis_ev)) {
+                /* 応答は I/O スレッドで完了します。*/
+                if (do_async(dis_ev) == 0)
+                    continue;
+                result = -1;
+            } else {
+                /* other get, gets command */
+                result = do_dispatch(dis_ev->reply,
+                            dis_ev->cmd_grp,
+                            dis_ev->cmdline,
+                            dis_ev->key,
+                            dis_ev->rb,
+                            dis_ev->noreply_flag,
+                            NULL,
+                            1,
+                            &dis_ev->server,
+                            &dis_ev->timing);
+            }
+            /* 置き換えたマニフェストのチャンクを削除します。*/
+            if (chunk_id && result == 0)
+                chunk_remove(chunk_id, chunks);
+        }
+
+        /* 実行後の処理を行って応答を完了します。*/
+        command_finish(dis_ev);
+    }
+
+    /* スレッドを終了します。*/
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+static void create_dispatch_threads()
+{
+    int i;
+
+    for (i = 0; i < g_conf->dispatch_threads; i++) {
+#ifdef _WIN32
+        uintptr_t thread_id;
+#else
+        pthread_t thread_id;
+#endif
+        /* スレッドを作成します。
+           生成されたスレッドはリクエストキューが空のため、
+           待機状態に入ります。*/
+#ifdef _WIN32
+        thread_id = _beginthread(dispatch_thread, 0, (void*)(long)i);
+#else
+        pthread_create(&thread_id, NULL, (void*)dispatch_thread, (void*)(long)i);
+        /* スレッドの使用していた領域を終了時に自動的に解放します。*/
+        pthread_detach(thread_id);
+#endif
+    }
+}
+
+static int event_entry(struct client_t* client,
+                       struct reply_t* reply,
+                       int noreply_flag,
+                       int cmd_grp,
+                       const char* cmdline,
+                       int cn,
+                       const char* key,
+                       struct reqbuf_t* rb)
+{
+    struct dispatch_event_t* dis_ev;
+
+    if (cmd_grp == CMDGRP_GET) {
+        /* ひとつのキーの get はニアキャッシュにあればそのまま応答します。*/
+        if (cn == 2 && near_cache_lookup(reply, cmdline, key)) {
+            stats_request(cmdline, cn);
+            reply_append(reply, "END" LINE_DELIMITER, strlen("END" LINE_DELIMITER));
+            reply_complete(reply);
+            return 0;
+        }
+    } else {
+        /* 更新系のコマンドはニアキャッシュのキーを無効化します。*/
+        near_cache_invalidate(key, 0);
+        /* 問い合わせ中の get の応答を後続の get と共有しません。*/
+        flight_close(key);
+
+        /* noreply の更新コマンドはディスパッチキューを経由しないで
+           データストア毎の送信キューに登録します。
+           同じクライアントのコマンドが実行中の場合は追い越さないように
+           ディスパッチキューに登録します。
+           以前のチャンクを削除する set, delete もディスパッチキューに登録します。*/
+        if (noreply_flag && reply == NULL && ! chunk_required(rb) &&
+            ! chunk_replace_command(cmd_grp, cmdline) &&
+            (client == NULL || client->inflight == NULL)) {
+            struct server_t* server;
+
+            if (noreply_entry(cmd_grp, cmdline, key, rb, &server) == 0) {
+                stats_request(cmdline, cn);
+                incl_command(cmd_grp, server);
+                hotkey_record(key, server);
+                return 0;
+            }
+        }
+    }
+
+    /* スレッドへ渡す情報を作成します */
+    dis_ev = (struct dispatch_event_t*)calloc(1, sizeof(struct dispatch_event_t));
+    if (dis_ev == NULL) {
+        err_write("dispatch_event_entry: no memory.");
+        reqbuf_release(rb);
+        if (reply) {
+            reply_append_error(reply, "no memory.");
+            reply_complete(reply);
+        }
+        return -1;
+    }
+    ATOMIC_INC(&dispatch_inflight);
+    stats_request(cmdline, cn);
+
+    dis_ev->cmd_grp = cmd_grp;
+    strcpy(dis_ev->cmdline, cmdline);
+    strcpy(dis_ev->key, key);
+    dis_ev->cn = cn;
+    /* データブロックのバッファは呼び出し元から引き継ぎます。*/
+    dis_ev->rb = rb;
+    dis_ev->noreply_flag = noreply_flag;
+    dis_ev->reply = reply;
+    dis_ev->nc_version = near_cache_version();
+    dis_ev->entry_time = system_time();
+
+    if (client) {
+        dis_ev->client = client_ref(client);
+
+        /* 同じキーの先行コマンドが実行中の場合は完了後に
+           キューイングされます。*/
+        if (inflight_add(dis_ev) > 0)
+            return 0;
+    }
+    dispatch_push(dis_ev);
+    return 0;
+}
+
+/*
+ * コマンドをディスパッチスレッドのキューに登録します。
+ *
+ * client: クライアント構造体のポインタ(NULLの場合は応答なし)
+ * cmd_grp: コマンドグループ
+ * cmdline: コマンド行
+ * cn: コマンド行の要素数
+ * cl: コマンド行の要素
+ * rb: データブロックのバッファ(所有権は引き継がれます)
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int dispatch_event_entry(struct client_t* client,
+                         int cmd_grp,
+                         const char* cmdline,
+                         int cn,
+                         const char** cl,
+                         struct reqbuf_t* rb)
+{
+    struct reply_t* reply = NULL;
+    int noreply_flag;
+
+    noreply_flag = noreply(cn, cl);
+    if (client && ! noreply_flag) {
+        /* 応答の順番を守るために応答エントリを予約します。*/
+        reply = reply_reserve(client);
+        if (reply == NULL) {
+            reqbuf_release(rb);
+            return -1;
+        }
+    }
+    return event_entry(client, reply, noreply_flag, cmd_grp, cmdline, cn, cl[1], rb);
+}
+
+/*
+ * 予約済みの応答エントリを指定してキーひとつのコマンドを
+ * ディスパッチスレッドのキューに登録します。
+ * 応答エントリの応答データは reply->filter で変換できます。
+ *
+ * reply: 応答エントリのポインタ
+ * cmd_grp: コマンドグループ
+ * cmdline: コマンド行
+ * key: キー
+ * rb: データブロックのバッファ(所有権は引き継がれます)
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int dispatch_reply_entry(struct reply_t* reply,
+                         int cmd_grp,
+                         const char* cmdline,
+                         const char* key,
+                         struct reqbuf_t* rb)
+{
+    return event_entry(reply->client, reply, 0, cmd_grp, cmdline, 2, key, rb);
+}
+
+/*
+ * ディスパッチキューの数を返します。
+ *
+ * 戻り値
+ *  ディスパッチキューの件数を返します。
+ */
+int dispatch_queue_count()
+{
+    if (dispatch_queue == NULL)
+        return 0;
+    return workq_count(dispatch_queue);
+}
+
+/*
+ * 受け付けてから完了していないコマンド数を返します。
+ * 同じキーの先行コマンドの完了を待っているコマンドも含みます。
+ *
+ * 戻り値
+ *  処理中のコマンド数を返します。
+ */
+int dispatch_inflight_count()
+{
+    return (int)dispatch_inflight;
+}
+
+int dispatch_server_start()
+{
+    int i;
+
+    /* メッセージキューの作成 */
+    dispatch_queue = workq_initialize(g_conf->dispatch_threads);
+    if (dispatch_queue == NULL)
+        return -1;
+    TRACE("%s initialized.\n", "dispatch queue");
+
+    /* データストアとの送受信を行う I/O スレッドを開始します。*/
+    if (backend_io_initialize() < 0)
+        return -1;
+
+    for (i = 0; i < FLIGHT_STRIPES; i++)
+        CS_INIT(&flight_stripes[i].critical_section);
+
+    /* ワーカースレッドを生成します。 */
+    create_dispatch_threads();
+    return 0;
+}
+
+void dispatch_server_end()
+{
+    int i;
+
+    if (dispatch_queue != NULL) {
+        workq_finalize(dispatch_queue);
+        dispatch_queue = NULL;
+        TRACE("%s terminated.\n", "dispatch queue");
+    }
+
+    /* I/O スレッドで実行中のコマンドはエラーとして完了します。*/
+    backend_io_finalize();
+
+    for (i = 0; i < FLIGHT_STRIPES; i++)
+        CS_DELETE(&flight_stripes[i].critical_section);
 }
 
 int reply_error(SOCKET csocket, const char* msg)
@@ -359,6 +359,9 @@ int ds_detach_server(struct server_t* server)
     /* コンシステントハッシュからサーバーを削除します。*/
     ch_remove_server(g_dss->ch, server);
 
+    /* I/O スレッドのパイプライン接続を切断します。*/
+    backend_io_detach_server(server);
+
     /* サーバーを削除します。*/
     s_index = server_index(server);
     if (s_index < 0)
@@ -493,11 +496,155 @@ void ds_unlock_server(struct server_t* server)
     CS_END(&server->critical_section);
 }
 
+/*
+ * サーキットブレーカーがリクエストを許可するか調べます。
+ * OPEN になってから dinio.breaker_open_time を経過した場合は
+ * HALF_OPEN としてひとつのリクエストだけを試行として許可します。
+ * 試行のトークンは ds_breaker_probe() でコマンドに渡されます。
+ * 試行の結果が記録されないまま同じ時間を経過した場合は次の試行を許可します。
+ */
+static int breaker_allow(struct server_t* server)
+{
+    int64 now;
+    int result = -1;
+
+    if (server->breaker_state == BREAKER_CLOSED)
+        return 0;
+
+    now = system_time();
+    CS_START(&server->critical_section);
+    if (server->breaker_state == BREAKER_CLOSED) {
+        result = 0;
+    } else if (now - server->breaker_time >= (int64)g_conf->breaker_open_time * 1000) {
+        server->breaker_state = BREAKER_HALF_OPEN;
+        server->breaker_time = now;
+        server->breaker_probe++;
+        server->breaker_grant = 1;
+        result = 0;
+    }
+    CS_END(&server->critical_section);
+    return result;
+}
+
+/*
+ * HALF_OPEN の試行として許可されたコマンドのトークンを取得します。
+ * ds_check_server() が許可した後にクライアントのコマンドを送信する
+ * ときに呼び出して、最初に呼び出したコマンドだけがトークンを受け取ります。
+ * トークンは ds_breaker_record() にコマンドの結果と一緒に渡します。
+ *
+ * server: サーバー構造体のポインタ
+ *
+ * 戻り値
+ *  試行のトークンを返します。
+ *  試行ではない場合はゼロを返します。
+ */
+long ds_breaker_probe(struct server_t* server)
+{
+    if (server->breaker_state != BREAKER_HALF_OPEN)
+        return 0;
+    if (! ATOMIC_CAS(&server->breaker_grant, 1, 0))
+        return 0;
+    return server->breaker_probe;
+}
+
+/*
+ * コマンドの結果をサーキットブレーカーに記録します。
+ * BREAKER_WINDOW 秒の間のエラー(タイムアウトを含む)の割合が
+ * dinio.breaker_error_rate 以上になると OPEN にします。
+ * OPEN の間は ds_check_server() がエラーを返すので、データストアの
+ * 応答を待たずに次のサーバーで実行されます。
+ * HALF_OPEN の試行が成功すると CLOSED に戻ります。
+ *
+ * server: サーバー構造体のポインタ
+ * probe: ds_breaker_probe() で取得した試行のトークン(ゼロは試行ではない)
+ * result: コマンドの結果(ゼロは正常、ゼロ以外はエラー)
+ *
+ * 戻り値
+ *  なし
+ */
+void ds_breaker_record(struct server_t* server, long probe, int result)
+{
+    int64 now;
+
+    if (g_conf->breaker_error_rate < 1 || server == NULL)
+        return;
+
+    now = system_time();
+    if (server->breaker_state != BREAKER_CLOSED) {
+        /* OPEN になる前に送信したコマンドやレプリケーションなど
+           試行のトークンを持たないコマンドの結果は無視します。*/
+        if (probe == 0)
+            return;
+        CS_START(&server->critical_section);
+        if (server->breaker_state == BREAKER_HALF_OPEN && probe == server->breaker_probe) {
+            server->breaker_grant = 0;
+            if (result == 0) {
+                server->breaker_state = BREAKER_CLOSED;
+                server->breaker_window = now;
+                server->breaker_requests = 0;
+                server->breaker_errors = 0;
+                TRACE("circuit breaker closed %s:%d\n", server->ip, server->port);
+            } else {
+                server->breaker_state = BREAKER_OPEN;
+                server->breaker_time = now;
+            }
+        }
+        CS_END(&server->critical_section);
+        return;
+    }
+
+    if (now - server->breaker_window > (int64)BREAKER_WINDOW * 1000000) {
+        CS_START(&server->critical_section);
+        if (now - server->breaker_window > (int64)BREAKER_WINDOW * 1000000) {
+            server->breaker_window = now;
+            server->breaker_requests = 0;
+            server->breaker_errors = 0;
+        }
+        CS_END(&server->critical_section);
+    }
+
+    ATOMIC_INC(&server->breaker_requests);
+    if (result != 0) {
+        long errors = ATOMIC_INC(&server->breaker_errors);
+        long requests = server->breaker_requests;
+
+        if (requests >= g_conf->breaker_min_requests &&
+            errors * 100 >= (long)g_conf->breaker_error_rate * requests) {
+            CS_START(&server->critical_section);
+            if (server->breaker_state == BREAKER_CLOSED) {
+                server->breaker_state = BREAKER_OPEN;
+                server->breaker_time = now;
+                server->breaker_trips++;
+                err_write("circuit breaker opened %s:%d errors=%ld/%ld.",
+                          server->ip, server->port, errors, requests);
+            }
+            CS_END(&server->critical_section);
+        }
+    }
+}
+
+/*
+ * サーキットブレーカーの状態を文字列で返します。
+ *
+ * server: サーバー構造体のポインタ
+ *
+ * 戻り値
+ *  状態の文字列を返します。
+ */
+const char* ds_breaker_state(struct server_t* server)
+{
+    if (server->breaker_state == BREAKER_OPEN)
+        return "open";
+    if (server->breaker_state == BREAKER_HALF_OPEN)
+        return "half-open";
+    return "closed";
+}
+
 /*
  * サーバーの状態をチェックします。
  * ロックされていた場合は ACTIVE になるまで指定された時間待ちます。
  * 最大待ち時間（秒）は dinio.lock_wait_time で指定します。
- * INACTIVE の場合はエラーになります。
+ * INACTIVE の場合とサーキットブレーカーが OPEN の場合はエラーになります。
  *
  * server: サーバー構造体のポインタ
  *
@@ -511,7 +658,7 @@ int ds_check_server(struct server_t* server)
     int stime = 1;
 
     if (server->status == DSS_ACTIVE)
-        return 0;
+        return breaker_allow(server);
     if (server->status == DSS_INACTIVE)
         return -1;
 
@@ -523,7 +670,7 @@ int ds_check_server(struct server_t* server)
     wait_time = g_conf->lock_wait_time;
     do {
         if (server->status == DSS_ACTIVE)
-            return 0;
+            return breaker_allow(server);
         /* sleep 1 second */
         sleep(stime);
     } while (--wait_time > 0);
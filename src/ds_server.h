@@ -36,6 +36,29 @@
 #define DSS_INACTIVE   2
 #define DSS_LOCKED     3
 
+/* circuit breaker state */
+#define BREAKER_CLOSED      0
+#define BREAKER_OPEN        1
+#define BREAKER_HALF_OPEN   2
+
+#define BREAKER_WINDOW  10      /* error rate window(sec) */
+
+/* latency histogram */
+#define HIST_SUB_BITS   4       /* sub buckets per power of two(2^4) */
+#define HIST_BUCKETS    448     /* 0 - 2^31 usec */
+
+#define LATENCY_GROUPS  3       /* CMDGRP_SET, CMDGRP_GET, CMDGRP_DELETE */
+#define LATENCY_POOL    0       /* wait for pool connection */
+#define LATENCY_BACKEND 1       /* data store round trip */
+#define LATENCY_SEND    2       /* send reply to client */
+#define LATENCY_PHASES  3
+
+struct histogram_t {
+    int64 count;                    /* number of recorded values */
+    int64 sum;                      /* total of recorded values(usec) */
+    int64 bucket[HIST_BUCKETS];     /* log-linear buckets */
+};
+
 /* physical server info */
 struct server_t {
     CS_DEF(critical_section);
@@ -47,6 +70,17 @@ struct server_t {
     int64 set_count;        /* count of execute set command */
     int64 get_count;        /* count of execute get command */
     int64 del_count;        /* count of execute delete command */
+    int64 error_count;      /* count of command error */
+    int64 cmd_time;         /* total command execute time(usec) */
+    struct histogram_t latency[LATENCY_GROUPS][LATENCY_PHASES];  /* [cmd_grp-1][phase] */
+    int breaker_state;              /* circuit breaker state */
+    int64 breaker_time;             /* time of open or half-open probe(usec) */
+    int64 breaker_window;           /* start time of error rate window(usec) */
+    volatile long breaker_requests; /* requests in the window */
+    volatile long breaker_errors;   /* errors and timeouts in the window */
+    int64 breaker_trips;            /* count of circuit breaker opened */
+    long breaker_probe;             /* token of the half-open probe */
+    volatile long breaker_grant;    /* probe allowed but not taken by a command */
 };
 
 /* data-store server info */
@@ -61,6 +95,7 @@ struct ds_server_t {
 struct server_socket_t {
     struct server_t* server;
     SOCKET socket;
+    long probe;             /* half-open probe token of the command(0 is none) */
 };
 
 /* prototypes */
@@ -80,6 +115,9 @@ struct server_t* ds_key_server(const char* key, int keysize);
 void ds_lock_server(struct server_t* server);
 void ds_unlock_server(struct server_t* server);
 int ds_check_server(struct server_t* server);
+long ds_breaker_probe(struct server_t* server);
+void ds_breaker_record(struct server_t* server, long probe, int result);
+const char* ds_breaker_state(struct server_t* server);
 
 /* ds_check.c */
 void ds_active_check_thread(void* argv);
@@ -193,20 +193,18 @@ static int make_command(unsigned char cmd, struct server_t* server, char* buf)
     return p - buf;
 }
 
-static int friend_command(int cmd,
-                          struct friend_t* friend_list,
-                          struct server_t* server)
+static int friend_send(int cmd,
+                       struct friend_t* friend_list,
+                       const char* cmdbuf,
+                       int len)
 {
     struct friend_t* fsvr;
 
-    if (friend_list == NULL)
-        return 0;
-
     fsvr = friend_list;
     while (fsvr->ip[0]) {
         SOCKET socket;
-        char cmdbuf[256];
-        int len;
+        char ack;
+        int status;
 
         /* コネクションを作成します。*/
         socket = sock_connect_server(fsvr->ip, fsvr->port);
@@ -216,46 +214,56 @@ static int friend_command(int cmd,
             continue;
         }
 
-        /* 送信するコマンドを作成します。*/
-        len = make_command((unsigned char)cmd, server, cmdbuf);
-        if (len > 0) {
-            char ack;
-            int status;
-
-            /* 分散サーバーにコマンドを送信します。*/
-            if (send_data(socket, cmdbuf, len) < 0) {
-                SOCKET_CLOSE(socket);
-                err_write("friend_command(%d): send error %s:%d.",
-                          cmd, fsvr->ip, fsvr->port);
-                return -1;
-            }
-            /* 応答を確認します。*/
-            if (! wait_recv_data(socket, FRIEND_WAIT_TIME)) {
-                SOCKET_CLOSE(socket);
-                err_write("friend_command(%d): timeout %s:%d.",
-                          cmd, fsvr->ip, fsvr->port);
-                return -1;
-            }
-            /* Ackを受信します。*/
-            if (recv_nchar(socket, &ack, sizeof(char), &status) != sizeof(char)) {
-                SOCKET_CLOSE(socket);
-                err_write("friend_command(%d): ack recv error %s:%d.",
-                          cmd, fsvr->ip, fsvr->port);
-                return -1;
-            }
-            if (ack != FRIEND_ACK) {
-                SOCKET_CLOSE(socket);
-                err_write("friend_command(%d): ack error(%c) %s:%d.",
-                          cmd, ack, fsvr->ip, fsvr->port);
-                return -1;
-            }
+        /* 分散サーバーにコマンドを送信します。*/
+        if (send_data(socket, cmdbuf, len) < 0) {
+            SOCKET_CLOSE(socket);
+            err_write("friend_command(%d): send error %s:%d.",
+                      cmd, fsvr->ip, fsvr->port);
+            return -1;
+        }
+        /* 応答を確認します。*/
+        if (! wait_recv_data(socket, FRIEND_WAIT_TIME)) {
             SOCKET_CLOSE(socket);
+            err_write("friend_command(%d): timeout %s:%d.",
+                      cmd, fsvr->ip, fsvr->port);
+            return -1;
         }
+        /* Ackを受信します。*/
+        if (recv_nchar(socket, &ack, sizeof(char), &status) != sizeof(char)) {
+            SOCKET_CLOSE(socket);
+            err_write("friend_command(%d): ack recv error %s:%d.",
+                      cmd, fsvr->ip, fsvr->port);
+            return -1;
+        }
+        if (ack != FRIEND_ACK) {
+            SOCKET_CLOSE(socket);
+            err_write("friend_command(%d): ack error(%c) %s:%d.",
+                      cmd, ack, fsvr->ip, fsvr->port);
+            return -1;
+        }
+        SOCKET_CLOSE(socket);
         fsvr++;
     }
     return 0;
 }
 
+static int friend_command(int cmd,
+                          struct friend_t* friend_list,
+                          struct server_t* server)
+{
+    char cmdbuf[256];
+    int len;
+
+    if (friend_list == NULL)
+        return 0;
+
+    /* 送信するコマンドを作成します。*/
+    len = make_command((unsigned char)cmd, server, cmdbuf);
+    if (len < 1)
+        return 0;
+    return friend_send(cmd, friend_list, cmdbuf, len);
+}
+
 /*
  * 分散サーバーのすべてにデータストアサーバーの追加コマンドを送信します。
  *
@@ -322,3 +330,52 @@ int friend_unlock_server(struct friend_t* friend_list, struct server_t* server)
     return friend_command(FRIEND_UNLOCK_SERVER, friend_list, server);
 }
 
+/*
+ * 分散サーバーのすべてにニアキャッシュのキーの無効化コマンドを送信します。
+ *
+ * +--------+----------+-----------+--------+-----------+-----+
+ * | cmd(1) | count(2) | keylen(1) | key(n) | keylen(1) | ... |
+ * +--------+----------+-----------+--------+-----------+-----+
+ *
+ * friend_list: 分散サーバーリストのポインタ
+ * n: キー数
+ * keys: キーの配列
+ *
+ * 戻り値
+ *  成功するとゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int friend_invalidate_keys(struct friend_t* friend_list, int n, const char** keys)
+{
+    char* cmdbuf;
+    char* p;
+    unsigned char cmd = FRIEND_INVALIDATE_KEYS;
+    unsigned short count = (unsigned short)n;
+    int i;
+    int result;
+
+    if (friend_list == NULL || n < 1)
+        return 0;
+
+    cmdbuf = (char*)malloc(sizeof(cmd) + sizeof(count) + n * (MAX_MEMCACHED_KEYSIZE + 1));
+    if (cmdbuf == NULL) {
+        err_write("friend_invalidate_keys: no memory.");
+        return -1;
+    }
+    p = cmdbuf;
+    memcpy(p, &cmd, sizeof(cmd));
+    p += sizeof(cmd);
+    memcpy(p, &count, sizeof(count));
+    p += sizeof(count);
+    for (i = 0; i < n; i++) {
+        unsigned char len = (unsigned char)strlen(keys[i]);
+
+        memcpy(p, &len, sizeof(len));
+        p += sizeof(len);
+        memcpy(p, keys[i], len);
+        p += len;
+    }
+    result = friend_send(cmd, friend_list, cmdbuf, p - cmdbuf);
+    free(cmdbuf);
+    return result;
+}
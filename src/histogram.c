@@ -0,0 +1,219 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * 応答時間のヒストグラムを記録します。
+ *
+ * HDR Histogram と同様に2のべき乗毎の区間を16個のバケットに分割した
+ * 対数線形のバケットに記録します。値の誤差は最大で約6%になります。
+ * 16未満の値はそのままバケットの番号になります。
+ * 記録する値の単位はマイクロ秒で 2^31 以上は最後のバケットに
+ * 記録されます。
+ *
+ * 記録はアトミックな加算のみで行うのでロックは使用しません。
+ * パーセンタイルは記録中のバケットから算出するため近似値になります。
+ *
+ * ヒストグラムはデータストア毎とすべてのデータストアの合計を
+ * コマンドグループ(set, get, delete)と以下の区間毎に記録します。
+ *  pool    : コネクションプールからソケットを取得するまでの待ち時間
+ *  backend : データストアへ送信して応答を受信するまでの時間
+ *  send    : クライアントへ応答を送信する時間
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+
+static const char* group_names[LATENCY_GROUPS] = { "set", "get", "delete" };
+static const char* phase_names[LATENCY_PHASES] = { "pool", "backend", "send" };
+
+/* すべてのデータストアの合計 */
+static struct histogram_t total_latency[LATENCY_GROUPS][LATENCY_PHASES];
+
+/* 値の最上位ビットの位置を返します。*/
+static int msb_pos(int64 v)
+{
+    int n = 0;
+
+    if (v >> 32) { v >>= 32; n += 32; }
+    if (v >> 16) { v >>= 16; n += 16; }
+    if (v >> 8)  { v >>= 8;  n += 8; }
+    if (v >> 4)  { v >>= 4;  n += 4; }
+    if (v >> 2)  { v >>= 2;  n += 2; }
+    if (v >> 1)  { n += 1; }
+    return n;
+}
+
+static int bucket_index(int64 value)
+{
+    int msb;
+    int index;
+
+    if (value < HIST_SUB_COUNT)
+        return (value < 0)? 0 : (int)value;
+
+    msb = msb_pos(value);
+    index = (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+            (int)((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+    if (index >= HIST_BUCKETS)
+        index = HIST_BUCKETS - 1;
+    return index;
+}
+
+/* バケットに含まれる最大値を返します。*/
+static int64 bucket_upper(int index)
+{
+    int shift;
+    int64 lower;
+
+    if (index < HIST_SUB_COUNT)
+        return index;
+    shift = index / HIST_SUB_COUNT - 1;
+    lower = (int64)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return lower + ((int64)1 << shift) - 1;
+}
+
+/*
+ * ヒストグラムに値を記録します。
+ *
+ * hist: ヒストグラム構造体のポインタ
+ * value: 記録する値
+ *
+ * 戻り値
+ *  なし
+ */
+void hist_record(struct histogram_t* hist, int64 value)
+{
+    ATOMIC_ADD64(&hist->bucket[bucket_index(value)], 1);
+    ATOMIC_ADD64(&hist->sum, value);
+    ATOMIC_ADD64(&hist->count, 1);
+}
+
+/*
+ * ヒストグラムからパーセンタイル値を求めます。
+ *
+ * hist: ヒストグラム構造体のポインタ
+ * p: パーセンタイル(0.5, 0.99 など)
+ *
+ * 戻り値
+ *  値が含まれるバケットの最大値を返します。
+ *  記録がない場合はゼロを返します。
+ */
+int64 hist_percentile(struct histogram_t* hist, double p)
+{
+    int64 count = 0;
+    int64 target;
+    int64 n = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        count += hist->bucket[i];
+    if (count == 0)
+        return 0;
+
+    target = (int64)(count * p);
+    if (target < 1)
+        target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        n += hist->bucket[i];
+        if (n >= target)
+            return bucket_upper(i);
+    }
+    return bucket_upper(HIST_BUCKETS - 1);
+}
+
+/*
+ * データストアのコマンドの応答時間を記録します。
+ * データストア毎と合計のヒストグラムに記録されます。
+ *
+ * server: サーバー構造体のポインタ(NULLの場合は合計のみ)
+ * cmd_grp: コマンドグループ
+ * phase: 区間(LATENCY_POOL, LATENCY_BACKEND, LATENCY_SEND)
+ * usec: 時間(マイクロ秒)
+ *
+ * 戻り値
+ *  なし
+ */
+void latency_record(struct server_t* server, int cmd_grp, int phase, int64 usec)
+{
+    if (cmd_grp < 1 || cmd_grp > LATENCY_GROUPS)
+        return;
+    if (server)
+        hist_record(&server->latency[cmd_grp-1][phase], usec);
+    hist_record(&total_latency[cmd_grp-1][phase], usec);
+}
+
+/*
+ * 応答時間のヒストグラムを返します。
+ *
+ * server: サーバー構造体のポインタ(NULLの場合は合計)
+ * cmd_grp: コマンドグループ
+ * phase: 区間(LATENCY_POOL, LATENCY_BACKEND, LATENCY_SEND)
+ *
+ * 戻り値
+ *  ヒストグラム構造体のポインタを返します。
+ *  コマンドグループが不正な場合は NULL を返します。
+ */
+struct histogram_t* latency_histogram(struct server_t* server, int cmd_grp, int phase)
+{
+    if (cmd_grp < 1 || cmd_grp > LATENCY_GROUPS)
+        return NULL;
+    if (server)
+        return &server->latency[cmd_grp-1][phase];
+    return &total_latency[cmd_grp-1][phase];
+}
+
+/*
+ * コマンドグループの表示名を返します。
+ *
+ * cmd_grp: コマンドグループ
+ *
+ * 戻り値
+ *  表示名("set", "get", "delete")を返します。
+ */
+const char* latency_group_name(int cmd_grp)
+{
+    if (cmd_grp < 1 || cmd_grp > LATENCY_GROUPS)
+        return "";
+    return group_names[cmd_grp-1];
+}
+
+/*
+ * 区間の表示名を返します。
+ *
+ * phase: 区間(LATENCY_POOL, LATENCY_BACKEND, LATENCY_SEND)
+ *
+ * 戻り値
+ *  表示名("pool", "backend", "send")を返します。
+ */
+const char* latency_phase_name(int phase)
+{
+    if (phase < 0 || phase >= LATENCY_PHASES)
+        return "";
+    return phase_names[phase];
+}
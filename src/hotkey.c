@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * データストアへ送信したキーの参照頻度から頻繁に参照されている
+ * キー(ホットキー)を検出します。
+ *
+ * すべてのキーの参照回数を count-min sketch で近似して、
+ * 参照回数の多いキーだけを space-saving アルゴリズムで追跡します。
+ * 追跡するキー数は dinio.hotkeys の HK_TRACK_FACTOR 倍です。
+ *
+ * sketch のカウンタはロックを使用せずに加算します(競合は近似値として
+ * 許容します)。推定値が追跡中の最小の参照回数に満たないキーは
+ * ロックを取得しないので大部分のリクエストの負荷は加算のみです。
+ *
+ * HK_WINDOW_TIME 秒毎に追跡中のキーの毎秒の参照回数を算出して、
+ * sketch と参照回数を半減します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define HK_SKETCH_WIDTH     4096
+#define HK_SKETCH_DEPTH     4
+#define HK_TRACK_FACTOR     4       /* 表示するキー数に対する追跡するキー数の倍率 */
+#define HK_WINDOW_TIME      10      /* 参照頻度を算出する期間(秒) */
+
+/* 追跡中のキー */
+struct hk_entry_t {
+    unsigned int hash;
+    int64 count;                    /* 推定の参照回数 */
+    int64 error;                    /* 置き換えた時点の誤差 */
+    int64 hits;                     /* 現在の期間の参照回数 */
+    double rate;                    /* 前回の期間の毎秒の参照回数 */
+    struct server_t* server;        /* キーを保持しているサーバー */
+    char key[MAX_MEMCACHED_KEYSIZE+1];
+};
+
+static unsigned int* hk_sketch;
+static struct hk_entry_t* hk_entries;
+static int hk_capacity;
+static int hk_count;
+static int64 hk_min_count;          /* 追跡中のキーの最小の参照回数 */
+static int64 hk_window_start;       /* 現在の期間の開始時間(usec) */
+static CS_DEF(hk_lock);
+
+static unsigned int* sketch_counter(unsigned int hash, int depth)
+{
+    unsigned int h2 = (hash >> 16) | (hash << 16);
+
+    return &hk_sketch[depth * HK_SKETCH_WIDTH + ((hash + depth * h2) & (HK_SKETCH_WIDTH - 1))];
+}
+
+/* キーの参照を加算して推定の参照回数を返します。*/
+static int64 sketch_increment(unsigned int hash)
+{
+    int i;
+    unsigned int est = 0xffffffff;
+
+    for (i = 0; i < HK_SKETCH_DEPTH; i++) {
+        unsigned int* p = sketch_counter(hash, i);
+        unsigned int n = ++(*p);
+
+        if (n < est)
+            est = n;
+    }
+    return est;
+}
+
+static void update_min_count()
+{
+    int i;
+    int64 min_count = 0;
+
+    if (hk_count >= hk_capacity) {
+        min_count = hk_entries[0].count;
+        for (i = 1; i < hk_count; i++) {
+            if (hk_entries[i].count < min_count)
+                min_count = hk_entries[i].count;
+        }
+    }
+    hk_min_count = min_count;
+}
+
+/* 期間が経過した場合は参照頻度を算出して参照回数を半減します。
+   hk_lock を取得して呼び出します。*/
+static void window_update(int64 now)
+{
+    int64 elapsed;
+    int i;
+
+    elapsed = now - hk_window_start;
+    if (elapsed < (int64)HK_WINDOW_TIME * 1000000)
+        return;
+
+    for (i = 0; i < hk_count; i++) {
+        struct hk_entry_t* e = &hk_entries[i];
+
+        e->rate = (double)e->hits * 1000000.0 / (double)elapsed;
+        e->hits = 0;
+        e->count /= 2;
+        e->error /= 2;
+    }
+    for (i = 0; i < HK_SKETCH_WIDTH * HK_SKETCH_DEPTH; i++)
+        hk_sketch[i] >>= 1;
+    update_min_count();
+    hk_window_start = now;
+}
+
+static struct hk_entry_t* find_entry(unsigned int hash, const char* key)
+{
+    int i;
+
+    for (i = 0; i < hk_count; i++) {
+        if (hk_entries[i].hash == hash && strcmp(hk_entries[i].key, key) == 0)
+            return &hk_entries[i];
+    }
+    return NULL;
+}
+
+static struct hk_entry_t* min_entry()
+{
+    int i;
+    struct hk_entry_t* e = &hk_entries[0];
+
+    for (i = 1; i < hk_count; i++) {
+        if (hk_entries[i].count < e->count)
+            e = &hk_entries[i];
+    }
+    return e;
+}
+
+/*
+ * データストアへ送信したキーの参照を記録します。
+ *
+ * key: キー
+ * server: キーを保持しているサーバー
+ *
+ * 戻り値
+ *  なし
+ */
+void hotkey_record(const char* key, struct server_t* server)
+{
+    unsigned int hash;
+    int64 est;
+    struct hk_entry_t* e;
+
+    if (hk_entries == NULL)
+        return;
+
+    hash = ch_hash(key, strlen(key));
+    est = sketch_increment(hash);
+    if (est < hk_min_count)
+        return;
+
+    CS_START(&hk_lock);
+    window_update(system_time());
+
+    e = find_entry(hash, key);
+    if (e) {
+        e->count++;
+        e->hits++;
+        e->server = server;
+    } else if (est >= hk_min_count) {
+        if (hk_count < hk_capacity) {
+            e = &hk_entries[hk_count++];
+            e->error = 0;
+        } else {
+            /* 最も参照回数の少ないキーと置き換えます。*/
+            e = min_entry();
+            e->error = e->count;
+        }
+        e->hash = hash;
+        e->count = (est > e->error)? est : e->error + 1;
+        e->hits = 1;
+        e->rate = 0;
+        e->server = server;
+        strncpy(e->key, key, MAX_MEMCACHED_KEYSIZE);
+        e->key[MAX_MEMCACHED_KEYSIZE] = '\0';
+    }
+    update_min_count();
+    CS_END(&hk_lock);
+}
+
+static int hotkey_compare(const void* p1, const void* p2)
+{
+    const struct hotkey_t* k1 = (const struct hotkey_t*)p1;
+    const struct hotkey_t* k2 = (const struct hotkey_t*)p2;
+
+    if (k1->count == k2->count)
+        return 0;
+    return (k1->count > k2->count)? -1 : 1;
+}
+
+/*
+ * 参照回数の多い順にホットキーを求めます。
+ * 毎秒の参照回数は前回の期間の値です。
+ * 最初の期間では現在までの値を算出します。
+ *
+ * keys: ホットキーを設定する配列
+ * max_keys: 配列の要素数
+ *
+ * 戻り値
+ *  設定したキー数を返します。
+ */
+int hotkey_list(struct hotkey_t* keys, int max_keys)
+{
+    struct hotkey_t* list;
+    int64 now;
+    int64 elapsed;
+    int n;
+    int i;
+
+    if (hk_entries == NULL || max_keys < 1)
+        return 0;
+
+    list = (struct hotkey_t*)malloc(hk_capacity * sizeof(struct hotkey_t));
+    if (list == NULL) {
+        err_write("hotkey: no memory.");
+        return 0;
+    }
+
+    CS_START(&hk_lock);
+    now = system_time();
+    window_update(now);
+    elapsed = now - hk_window_start;
+    n = hk_count;
+    for (i = 0; i < n; i++) {
+        struct hk_entry_t* e = &hk_entries[i];
+
+        strcpy(list[i].key, e->key);
+        list[i].server = e->server;
+        list[i].count = e->count - e->error;
+        if (e->rate > 0 || elapsed <= 0)
+            list[i].rate = e->rate;
+        else
+            list[i].rate = (double)e->hits * 1000000.0 / (double)elapsed;
+    }
+    CS_END(&hk_lock);
+
+    qsort(list, n, sizeof(struct hotkey_t), hotkey_compare);
+    if (n > max_keys)
+        n = max_keys;
+    memcpy(keys, list, n * sizeof(struct hotkey_t));
+    free(list);
+    return n;
+}
+
+/*
+ * ホットキーの検出を初期化します。
+ * dinio.hotkeys がゼロの場合は何もしません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int hotkey_initialize()
+{
+    if (g_conf->hotkeys < 1)
+        return 0;
+
+    hk_sketch = (unsigned int*)calloc(HK_SKETCH_WIDTH * HK_SKETCH_DEPTH, sizeof(unsigned int));
+    if (hk_sketch == NULL) {
+        err_write("hotkey: sketch no memory.");
+        return -1;
+    }
+    hk_capacity = g_conf->hotkeys * HK_TRACK_FACTOR;
+    hk_count = 0;
+    hk_min_count = 0;
+    hk_window_start = system_time();
+    CS_INIT(&hk_lock);
+
+    hk_entries = (struct hk_entry_t*)calloc(hk_capacity, sizeof(struct hk_entry_t));
+    if (hk_entries == NULL) {
+        err_write("hotkey: no memory.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * ホットキーの検出を終了します。
+ *
+ * 戻り値
+ *  なし
+ */
+void hotkey_finalize()
+{
+    if (hk_entries) {
+        struct hk_entry_t* entries = hk_entries;
+
+        hk_entries = NULL;
+        free(entries);
+        CS_DELETE(&hk_lock);
+    }
+    if (hk_sketch) {
+        free(hk_sketch);
+        hk_sketch = NULL;
+    }
+}
@@ -37,6 +37,7 @@
  *   FRIEND_REMOVE_SERVER  2
  *   FRIEND_LOCK_SERVER    3
  *   FRIEND_UNLOCK_SERVER  4
+ *   FRIEND_INVALIDATE_KEYS 5 (ニアキャッシュのキーの無効化)
  * iplen(1byte)
  *   後続のipアドレスのバイト数
  * ip(nbyte)
@@ -46,6 +47,11 @@
  * scale-factor(2byte)
  *   仮想ノード数
  *
+ * FRIEND_INVALIDATE_KEYS の場合は cmd の後に以下が続きます。
+ * +----------+-----------+--------+-----------+-----+
+ * | count(2) | keylen(1) | key(n) | keylen(1) | ... |
+ * +----------+-----------+--------+-----------+-----+
+ *
  * 処理が正常に終了した場合はFRIEND_ACK('A')を送信します。
  * それ以外はFREIEND_REJECT('R')を送信します。
  *
@@ -57,13 +63,6 @@
 
 #include "dinio.h"
 
-#ifdef WIN32
-static HANDLE informed_queue_cond;
-#else
-static pthread_mutex_t informed_queue_mutex;
-static pthread_cond_t informed_queue_cond;
-#endif
-
 static int informed_add_server(const char* ip, int port, int scale_factor)
 {
     struct server_t* server;
@@ -76,6 +75,41 @@ static int informed_add_server(const char* ip, int port, int scale_factor)
     return 0;
 }
 
+static int informed_invalidate_keys(SOCKET socket)
+{
+    int status;
+    unsigned short count;
+    int i;
+
+    /* count(2)を受信します。*/
+    count = (unsigned short)recv_short(socket, &status);
+    if (status != 0) {
+        err_write("informed_command: count recv error.");
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        unsigned char keylen;
+        char key[MAX_MEMCACHED_KEYSIZE+1];
+
+        /* keylen(1)を受信します。*/
+        if (recv_nchar(socket, (char*)&keylen, sizeof(keylen), &status) != sizeof(keylen)) {
+            err_write("informed_command: keylen recv error.");
+            return -1;
+        }
+        /* key(n)を受信します。*/
+        if (recv_nchar(socket, key, keylen, &status) != keylen) {
+            err_write("informed_command: key recv error.");
+            return -1;
+        }
+        key[keylen] = '\0';
+
+        /* 通知されたキーは再通知しません。*/
+        near_cache_invalidate(key, 0);
+    }
+    return 0;
+}
+
 static int informed_command(SOCKET socket, struct in_addr addr)
 {
     int result = 0;
@@ -92,6 +126,13 @@ static int informed_command(SOCKET socket, struct in_addr addr)
         return -1;
     }
 
+    if (cmd == FRIEND_INVALIDATE_KEYS) {
+        result = informed_invalidate_keys(socket);
+        if (result < 0)
+            return -1;
+        goto reply;
+    }
+
     /* iplen(1)を受信します。*/
     if (recv_nchar(socket, (char*)&iplen, sizeof(iplen), &status) != sizeof(iplen)) {
         err_write("informed_command: iplen recv error.");
@@ -148,6 +189,7 @@ static int informed_command(SOCKET socket, struct in_addr addr)
         }
     }
 
+reply:
     /* 応答データの送信 */
     rch = (result == 0)? FRIEND_ACK : FRIEND_REJECT;
     if (send_data(socket, &rch, sizeof(char)) < 0) {
@@ -165,24 +207,11 @@ static void informed_thread(void* argv)
     struct in_addr addr;
 
     while (! g_shutdown_flag) {
-#ifndef WIN32
-        pthread_mutex_lock(&informed_queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
-        while (que_empty(g_informed_queue)) {
-#ifdef WIN32
-            WaitForSingleObject(informed_queue_cond, INFINITE);
-#else
-            pthread_cond_wait(&informed_queue_cond, &informed_queue_mutex);
-#endif
-        }
-#ifndef WIN32
-        pthread_mutex_unlock(&informed_queue_mutex);
-#endif
-        /* キューからデータを取り出します。*/
-        th_args = (struct thread_args_t*)que_pop(g_informed_queue);
+        /* キューからデータを取り出します。
+           データが入るまで待機します。*/
+        th_args = (struct thread_args_t*)workq_pop(g_informed_queue, 0);
         if (th_args == NULL)
-            continue;
+            break;  /* キューの終了 */
 
         addr = th_args->sockaddr.sin_addr;
         socket = th_args->client_socket;
@@ -237,16 +266,7 @@ int friend_informed_event(SOCKET socket, struct sockaddr_in sockaddr)
     th_args->sockaddr = sockaddr;
 
     /* リクエストされた情報をキューイング(push)します。*/
-    que_push(g_informed_queue, th_args);
-
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(informed_queue_cond);
-#else
-    pthread_mutex_lock(&informed_queue_mutex);
-    pthread_cond_signal(&informed_queue_cond);
-    pthread_mutex_unlock(&informed_queue_mutex);
-#endif
+    workq_push(g_informed_queue, th_args);
     return 0;
 }
 
@@ -256,7 +276,7 @@ int friend_informed_start()
     char ip_addr[256];
 
     /* メッセージキューの作成 */
-    g_informed_queue = que_initialize();
+    g_informed_queue = workq_initialize(1);
     if (g_informed_queue == NULL)
         return -1;
     TRACE("%s initialized.\n", "informed queue");
@@ -276,14 +296,6 @@ int friend_informed_start()
     TRACE("%s port: %d on %s listening ... %d thread\n",
         PROGRAM_NAME, g_conf->informed_port, ip_addr, 1);
 
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    informed_queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&informed_queue_mutex, NULL);
-    pthread_cond_init(&informed_queue_cond, NULL);
-#endif
-
     /* ワーカースレッドを生成します。 */
     create_worker_thread();
     return 0;
@@ -296,14 +308,8 @@ void friend_informed_end()
         SOCKET_CLOSE(g_informed_socket);
     }
     if (g_informed_queue != NULL) {
-        que_finalize(g_informed_queue);
+        workq_finalize(g_informed_queue);
+        g_informed_queue = NULL;
         TRACE("%s terminated.\n", "informed queue");
     }
-
-#ifdef WIN32
-    CloseHandle(informed_queue_cond);
-#else
-    pthread_cond_destroy(&informed_queue_cond);
-    pthread_mutex_destroy(&informed_queue_mutex);
-#endif
 }
@@ -43,11 +43,12 @@
 #define ACT_UNLOCK_SERVER  5
 #define ACT_HASH           6
 #define ACT_IMPORT         7
+#define ACT_SLOWLOG        8
 
 static char* conf_file = NULL;  /* config file name */
 static int action = ACT_START;  /* ACT_START, ACT_STOP, ACT_STATUS,
                                    ACT_ADD_SERVER, ACT_REMOVE_SERVER,
-                                   ACT_HASH, ACT_IMPORT */
+                                   ACT_HASH, ACT_IMPORT, ACT_SLOWLOG */
 
 static char* arg_addr = NULL;
 static char* arg_port = "11211";
@@ -78,6 +79,7 @@ static void usage()
     fprintf(stdout, "  -unlock ip-addr port[11211]\n");
     fprintf(stdout, "  [-start]\n");
     fprintf(stdout, "  -status\n");
+    fprintf(stdout, "  -slowlog\n");
     fprintf(stdout, "  -stop\n");
     fprintf(stdout, "  -hash key ...\n");
     fprintf(stdout, "  -import /path/filename\n");
@@ -127,6 +129,8 @@ static int startup()
     /* グローバル変数の初期化 */
     g_listen_socket = INVALID_SOCKET;
     g_informed_socket = INVALID_SOCKET;
+    g_binary_socket = INVALID_SOCKET;
+    g_unix_socket = INVALID_SOCKET;
 
     /* 割り込み処理用のクリティカルセクション初期化 */
     CS_INIT(&shutdown_lock);
@@ -187,6 +191,8 @@ static int parse(int argc, char* argv[])
             action = ACT_STOP;
         } else if (strcmp("-status", argv[i]) == 0) {
             action = ACT_STATUS;
+        } else if (strcmp("-slowlog", argv[i]) == 0) {
+            action = ACT_SLOWLOG;
         } else if (strcmp("-add", argv[i]) == 0 ||
                    strcmp("-remove", argv[i]) == 0 ||
                    strcmp("-unlock", argv[i]) == 0) {
@@ -273,6 +279,27 @@ static int parse_config()
     g_conf->replication_threads = DEFAULT_REPLICATION_THREADS;
     g_conf->replication_delay_time = DEFAULT_REPLICATION_DELAY_TIME;
     g_conf->informed_port = DEFAULT_INFORMED_PORT;
+    g_conf->binary_port = DEFAULT_BINARY_PORT;
+    g_conf->event_loops = DEFAULT_EVENT_LOOPS;
+    g_conf->near_cache_size = DEFAULT_NEAR_CACHE_SIZE;
+    g_conf->near_cache_ttl = DEFAULT_NEAR_CACHE_TTL;
+    g_conf->hotkeys = DEFAULT_HOTKEYS;
+    g_conf->stream_size = DEFAULT_STREAM_SIZE;
+    g_conf->max_value_size = DEFAULT_MAX_VALUE_SIZE;
+    g_conf->unix_socket_mode = DEFAULT_UNIX_SOCKET_MODE;
+    g_conf->noreply_threads = DEFAULT_NOREPLY_THREADS;
+    g_conf->noreply_queue_size = DEFAULT_NOREPLY_QUEUE_SIZE;
+    g_conf->client_ops_limit = DEFAULT_CLIENT_OPS_LIMIT;
+    g_conf->client_bytes_limit = DEFAULT_CLIENT_BYTES_LIMIT;
+    g_conf->max_inflight = DEFAULT_MAX_INFLIGHT;
+    g_conf->slowlog_time = DEFAULT_SLOWLOG_TIME;
+    g_conf->slowlog_size = DEFAULT_SLOWLOG_SIZE;
+    g_conf->backend_io_threads = DEFAULT_BACKEND_IO_THREADS;
+    g_conf->backend_pipeline = DEFAULT_BACKEND_PIPELINE;
+    g_conf->breaker_error_rate = DEFAULT_BREAKER_ERROR_RATE;
+    g_conf->breaker_min_requests = DEFAULT_BREAKER_MIN_REQUESTS;
+    g_conf->breaker_open_time = DEFAULT_BREAKER_OPEN_TIME;
+    g_conf->hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
 
     /* コンフィグファイル名がパラメータで指定されていない場合は
        デフォルトのファイル名を使用します。*/
@@ -364,6 +391,8 @@ int main(int argc, char* argv[])
         hash_server(arg_keyc, (const char**)arg_keys);
     else if (action == ACT_IMPORT)
         import_server(arg_impfile);
+    else if (action == ACT_SLOWLOG)
+        slowlog_server();
 
     /* 後処理 */
     cleanup();
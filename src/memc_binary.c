@@ -0,0 +1,803 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * memcached のバイナリプロトコルを処理します。
+ *
+ * dinio.binary_port で指定されたポートでバイナリプロトコルの
+ * リクエストを受け付けます。
+ * リクエストは固定長(24バイト)のヘッダーで始まります。
+ *
+ * +--------+--------+---------+--------+----------+---------+
+ * |magic(1)|opcode(1)|keylen(2)|extlen(1)|datatype(1)|vbucket(2)|
+ * +--------+--------+---------+--------+----------+---------+
+ * |bodylen(4)       |opaque(4)          |cas(8)              |
+ * +-----------------+-------------------+--------------------+
+ * |<extras>(extlen)|<key>(keylen)|<value>(bodylen-extlen-keylen)|
+ *
+ * データストアへは ASCII プロトコルのコマンドに変換して
+ * ディスパッチスレッドから送信します。
+ * キーのサーバー決定とレプリケーションは ASCII プロトコルと同じです。
+ * データストアからの応答はクライアントへ送信する前に
+ * 応答エントリのフィルタ(binary_reply_filter)でバイナリに変換されます。
+ *
+ * getq, getkq などの quiet コマンドは成功(getq は not found)の場合に
+ * 応答を送信しません。
+ * 複数の getkq の後に noop を送信すると見つかったキーの応答と
+ * noop の応答のみが順番に返されます。
+ *
+ * incr/decr の initial 値は使用されません。キーが存在しない場合は
+ * Key not found を返します。
+ * flush など未対応のコマンドは Unknown command を返します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define BIN_REQ_MAGIC       0x80
+#define BIN_RES_MAGIC       0x81
+#define BIN_HEADER_SIZE     24
+
+/* opcode */
+#define BIN_CMD_GET         0x00
+#define BIN_CMD_SET         0x01
+#define BIN_CMD_ADD         0x02
+#define BIN_CMD_REPLACE     0x03
+#define BIN_CMD_DELETE      0x04
+#define BIN_CMD_INCREMENT   0x05
+#define BIN_CMD_DECREMENT   0x06
+#define BIN_CMD_QUIT        0x07
+#define BIN_CMD_FLUSH       0x08
+#define BIN_CMD_GETQ        0x09
+#define BIN_CMD_NOOP        0x0a
+#define BIN_CMD_VERSION     0x0b
+#define BIN_CMD_GETK        0x0c
+#define BIN_CMD_GETKQ       0x0d
+#define BIN_CMD_APPEND      0x0e
+#define BIN_CMD_PREPEND     0x0f
+#define BIN_CMD_STAT        0x10
+#define BIN_CMD_SETQ        0x11
+#define BIN_CMD_ADDQ        0x12
+#define BIN_CMD_REPLACEQ    0x13
+#define BIN_CMD_DELETEQ     0x14
+#define BIN_CMD_INCREMENTQ  0x15
+#define BIN_CMD_DECREMENTQ  0x16
+#define BIN_CMD_QUITQ       0x17
+#define BIN_CMD_APPENDQ     0x19
+#define BIN_CMD_PREPENDQ    0x1a
+
+/* response status */
+#define BIN_STAT_SUCCESS            0x0000
+#define BIN_STAT_KEY_ENOENT         0x0001
+#define BIN_STAT_KEY_EEXISTS        0x0002
+#define BIN_STAT_E2BIG              0x0003
+#define BIN_STAT_EINVAL             0x0004
+#define BIN_STAT_NOT_STORED         0x0005
+#define BIN_STAT_DELTA_BADVAL       0x0006
+#define BIN_STAT_UNKNOWN_COMMAND    0x0081
+#define BIN_STAT_ENOMEM             0x0082
+#define BIN_STAT_INTERNAL           0x0084
+#define BIN_STAT_EBUSY              0x0085
+
+/* 応答の変換に必要なリクエスト情報 */
+struct binary_req_t {
+    unsigned char opcode;       /* リクエストの opcode */
+    int quiet;                  /* quiet コマンド */
+    int with_key;               /* 応答にキーを含める(getk, getkq) */
+    char opaque[4];             /* リクエストの opaque(そのまま返します) */
+    int keylen;
+    char key[MAX_MEMCACHED_KEYSIZE+1];
+};
+
+static unsigned int get_uint32(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+           ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+static int64 get_int64(const unsigned char* p)
+{
+    return ((int64)get_uint32(p) << 32) | (int64)get_uint32(p+4);
+}
+
+static void set_uint16(unsigned char* p, unsigned short v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static void set_uint32(unsigned char* p, unsigned int v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void set_int64(unsigned char* p, int64 v)
+{
+    set_uint32(p, (unsigned int)(v >> 32));
+    set_uint32(p+4, (unsigned int)v);
+}
+
+static int is_quiet(unsigned char opcode)
+{
+    switch (opcode) {
+        case BIN_CMD_GETQ:
+        case BIN_CMD_GETKQ:
+        case BIN_CMD_SETQ:
+        case BIN_CMD_ADDQ:
+        case BIN_CMD_REPLACEQ:
+        case BIN_CMD_DELETEQ:
+        case BIN_CMD_INCREMENTQ:
+        case BIN_CMD_DECREMENTQ:
+        case BIN_CMD_QUITQ:
+        case BIN_CMD_APPENDQ:
+        case BIN_CMD_PREPENDQ:
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * 応答パケットをバッファに追加します。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int bin_response(struct membuf_t* mb,
+                        unsigned char opcode,
+                        const char* opaque,
+                        unsigned short status,
+                        int64 cas,
+                        const char* ext, int extlen,
+                        const char* key, int keylen,
+                        const char* val, int vallen)
+{
+    unsigned char hdr[BIN_HEADER_SIZE];
+
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = BIN_RES_MAGIC;
+    hdr[1] = opcode;
+    set_uint16(&hdr[2], (unsigned short)keylen);
+    hdr[4] = (unsigned char)extlen;
+    set_uint16(&hdr[6], status);
+    set_uint32(&hdr[8], (unsigned int)(extlen + keylen + vallen));
+    memcpy(&hdr[12], opaque, 4);
+    set_int64(&hdr[16], cas);
+
+    if (mb_append(mb, (char*)hdr, sizeof(hdr)) < 0)
+        return -1;
+    if (extlen > 0 && mb_append(mb, ext, extlen) < 0)
+        return -1;
+    if (keylen > 0 && mb_append(mb, key, keylen) < 0)
+        return -1;
+    if (vallen > 0 && mb_append(mb, val, vallen) < 0)
+        return -1;
+    return 0;
+}
+
+/* 応答パケットをクライアントへ送信します。*/
+static int bin_send(struct client_t* client,
+                    unsigned char opcode,
+                    const char* opaque,
+                    unsigned short status,
+                    const char* val)
+{
+    struct membuf_t* mb;
+    int result;
+
+    mb = mb_alloc(BIN_HEADER_SIZE + 256);
+    if (mb == NULL) {
+        err_write("binary_gateway: mb_alloc() no memory.");
+        return -1;
+    }
+    bin_response(mb, opcode, opaque, status, 0, NULL, 0, NULL, 0,
+                 val, (val)? strlen(val) : 0);
+    result = client_send(client, mb->buf, mb->size);
+    mb_free(mb);
+    return result;
+}
+
+/* ステータスに対応するエラーメッセージを返します。*/
+static const char* status_message(unsigned short status)
+{
+    switch (status) {
+        case BIN_STAT_KEY_ENOENT:
+            return "Not found";
+        case BIN_STAT_KEY_EEXISTS:
+            return "Data exists for key.";
+        case BIN_STAT_E2BIG:
+            return "Too large.";
+        case BIN_STAT_EINVAL:
+            return "Invalid arguments";
+        case BIN_STAT_NOT_STORED:
+            return "Not stored.";
+        case BIN_STAT_DELTA_BADVAL:
+            return "Non-numeric server-side value for incr or decr";
+        case BIN_STAT_UNKNOWN_COMMAND:
+            return "Unknown command";
+        case BIN_STAT_ENOMEM:
+            return "Out of memory";
+        case BIN_STAT_EBUSY:
+            return "Busy";
+    }
+    return "Internal error";
+}
+
+/* バッファの先頭行(CRLFを含まない)の長さを返します。*/
+static int first_line(const char* buf, int size)
+{
+    int i;
+
+    for (i = 0; i+1 < size; i++) {
+        if (buf[i] == '\r' && buf[i+1] == '\n')
+            return i;
+    }
+    return -1;
+}
+
+/* "VALUE <key> <flags> <bytes> <cas>" の応答を変換します。*/
+static unsigned short get_response(struct binary_req_t* req,
+                                   const char* buf,
+                                   int size,
+                                   struct membuf_t* mb)
+{
+    char line[BUF_SIZE];
+    char* tok[5];
+    char* p;
+    int n = 0;
+    int len;
+    int bytes;
+    unsigned char flags[4];
+
+    len = first_line(buf, size);
+    if (len < 0 || len >= (int)sizeof(line))
+        return BIN_STAT_INTERNAL;
+    memcpy(line, buf, len);
+    line[len] = '\0';
+
+    p = line;
+    while (n < 5 && p) {
+        tok[n++] = p;
+        p = strchr(p, ' ');
+        if (p)
+            *p++ = '\0';
+    }
+    if (n < 4)
+        return BIN_STAT_INTERNAL;
+    bytes = atoi(tok[3]);
+    if (len + 2 + bytes > size)
+        return BIN_STAT_INTERNAL;
+
+    set_uint32(flags, (unsigned int)strtoul(tok[2], NULL, 10));
+    bin_response(mb, req->opcode, req->opaque, BIN_STAT_SUCCESS,
+                 (n > 4)? (int64)strtoull(tok[4], NULL, 10) : 0,
+                 (char*)flags, sizeof(flags),
+                 req->key, (req->with_key)? req->keylen : 0,
+                 buf + len + 2, bytes);
+    return BIN_STAT_SUCCESS;
+}
+
+/* 更新系コマンドの応答行をステータスに変換します。*/
+static unsigned short update_status(struct binary_req_t* req, const char* line)
+{
+    if (stricmp(line, "STORED") == 0 || stricmp(line, "DELETED") == 0)
+        return BIN_STAT_SUCCESS;
+    if (stricmp(line, "NOT_STORED") == 0) {
+        if (req->opcode == BIN_CMD_ADD || req->opcode == BIN_CMD_ADDQ)
+            return BIN_STAT_KEY_EEXISTS;
+        if (req->opcode == BIN_CMD_REPLACE || req->opcode == BIN_CMD_REPLACEQ)
+            return BIN_STAT_KEY_ENOENT;
+        return BIN_STAT_NOT_STORED;
+    }
+    if (stricmp(line, "EXISTS") == 0)
+        return BIN_STAT_KEY_EEXISTS;
+    if (stricmp(line, "NOT_FOUND") == 0)
+        return BIN_STAT_KEY_ENOENT;
+    if (strnicmp(line, "CLIENT_ERROR", 12) == 0) {
+        if (strstr(line, "non-numeric"))
+            return BIN_STAT_DELTA_BADVAL;
+        return BIN_STAT_EINVAL;
+    }
+    return BIN_STAT_INTERNAL;
+}
+
+/*
+ * データストアからの ASCII プロトコルの応答をバイナリプロトコルの
+ * 応答に変換します。
+ * reply_complete() から呼び出されます。
+ */
+static void binary_reply_filter(struct reply_t* reply)
+{
+    struct binary_req_t* req;
+    struct membuf_t* res;
+    const char* buf = "";
+    int size = 0;
+    unsigned short status = BIN_STAT_INTERNAL;
+    int send_flag = 1;
+
+    req = (struct binary_req_t*)reply->filter_arg;
+    if (reply->mb) {
+        buf = reply->mb->buf;
+        size = reply->mb->size;
+    }
+
+    res = mb_alloc(BIN_HEADER_SIZE + size + 64);
+    if (res == NULL) {
+        err_write("binary_reply_filter: mb_alloc() no memory.");
+        return;
+    }
+
+    if (size > 6 && strncmp(buf, "VALUE ", 6) == 0) {
+        /* get, getq, getk, getkq */
+        status = get_response(req, buf, size, res);
+        if (status == BIN_STAT_SUCCESS)
+            send_flag = 0;
+    } else {
+        char line[256];
+        int len;
+
+        len = first_line(buf, size);
+        if (len < 0)
+            len = 0;
+        if (len >= (int)sizeof(line))
+            len = sizeof(line) - 1;
+        memcpy(line, buf, len);
+        line[len] = '\0';
+
+        if (strcmp(line, "END") == 0) {
+            /* キーが見つからない。*/
+            status = BIN_STAT_KEY_ENOENT;
+            if (req->opcode == BIN_CMD_GETQ || req->opcode == BIN_CMD_GETKQ) {
+                /* quiet の get は応答しません。*/
+                mb_free(res);
+                res = NULL;
+                send_flag = 0;
+            }
+        } else if (line[0] >= '0' && line[0] <= '9') {
+            unsigned char val[8];
+
+            /* incr, decr */
+            set_int64(val, (int64)strtoull(line, NULL, 10));
+            if (! req->quiet)
+                bin_response(res, req->opcode, req->opaque, BIN_STAT_SUCCESS, 0,
+                             NULL, 0, NULL, 0, (char*)val, sizeof(val));
+            send_flag = 0;
+        } else {
+            status = update_status(req, line);
+            if (status == BIN_STAT_SUCCESS) {
+                if (! req->quiet)
+                    bin_response(res, req->opcode, req->opaque, BIN_STAT_SUCCESS, 0,
+                                 NULL, 0, NULL, 0, NULL, 0);
+                send_flag = 0;
+            }
+        }
+    }
+
+    if (send_flag) {
+        const char* msg;
+
+        /* エラー応答(quiet コマンドでもエラーは応答します。)*/
+        msg = status_message(status);
+        bin_response(res, req->opcode, req->opaque, status, 0,
+                     NULL, 0,
+                     req->key, (req->with_key)? req->keylen : 0,
+                     msg, strlen(msg));
+    }
+
+    if (reply->mb)
+        mb_free(reply->mb);
+    if (res && res->size == 0) {
+        mb_free(res);
+        res = NULL;
+    }
+    reply->mb = res;
+}
+
+/* 受信データを読み捨てます。*/
+static int bin_skip(struct sock_buf_t* sb, int size)
+{
+    char buf[BUF_SIZE];
+    int status;
+
+    while (size > 0) {
+        int n;
+        int len;
+
+        n = (size > (int)sizeof(buf))? (int)sizeof(buf) : size;
+        len = sockbuf_nchar(sb, buf, n, &status);
+        if (len != n)
+            return -1;
+        size -= n;
+    }
+    return 0;
+}
+
+/* ASCII プロトコルのキーとして使用できるか調べます。*/
+static int valid_key(const char* key, int keylen)
+{
+    int i;
+
+    if (keylen < 1 || keylen > MAX_MEMCACHED_KEYSIZE)
+        return 0;
+    for (i = 0; i < keylen; i++) {
+        if ((unsigned char)key[i] <= ' ' || key[i] == 0x7f)
+            return 0;
+    }
+    return 1;
+}
+
+/* stat: ASCII の stats 応答を stat パケットの並びに変換します。
+ * キーに servers, latency, queues を指定できます。*/
+static int stat_command(struct client_t* client, const char* opaque, const char* key)
+{
+    struct membuf_t* stats;
+    struct membuf_t* mb;
+    const char* p;
+    int rest;
+    int result;
+
+    stats = stats_report((*key)? key : NULL);
+    if (stats == NULL)
+        return bin_send(client, BIN_CMD_STAT, opaque, BIN_STAT_KEY_ENOENT, status_message(BIN_STAT_KEY_ENOENT));
+
+    mb = mb_alloc(stats->size + 1024);
+    if (mb == NULL) {
+        mb_free(stats);
+        return bin_send(client, BIN_CMD_STAT, opaque, BIN_STAT_ENOMEM, status_message(BIN_STAT_ENOMEM));
+    }
+
+    p = stats->buf;
+    rest = stats->size;
+    while (rest > 0) {
+        int len;
+        const char* name;
+        const char* val;
+        int namelen;
+
+        len = first_line(p, rest);
+        if (len < 0)
+            break;
+        /* STAT <name> <value> */
+        if (len > 5 && strncmp(p, "STAT ", 5) == 0) {
+            name = p + 5;
+            val = memchr(name, ' ', len - 5);
+            if (val) {
+                namelen = val - name;
+                val++;
+                bin_response(mb, BIN_CMD_STAT, opaque, BIN_STAT_SUCCESS, 0,
+                             NULL, 0, name, namelen, val, (p + len) - val);
+            }
+        }
+        p += len + 2;
+        rest -= len + 2;
+    }
+    /* キーと値が空のパケットで終了します。*/
+    bin_response(mb, BIN_CMD_STAT, opaque, BIN_STAT_SUCCESS, 0, NULL, 0, NULL, 0, NULL, 0);
+
+    result = client_send(client, mb->buf, mb->size);
+    mb_free(mb);
+    mb_free(stats);
+    return result;
+}
+
+/* データストアへ送信するコマンドをディスパッチします。*/
+static int dispatch_command(struct client_t* client,
+                            struct binary_req_t* req,
+                            int cmd_grp,
+                            const char* cmdline,
+                            struct reqbuf_t* rb)
+{
+    struct binary_req_t* arg;
+    struct reply_t* reply;
+
+    arg = (struct binary_req_t*)malloc(sizeof(struct binary_req_t));
+    if (arg == NULL) {
+        err_write("binary_gateway: no memory.");
+        reqbuf_release(rb);
+        return bin_send(client, req->opcode, req->opaque, BIN_STAT_ENOMEM, status_message(BIN_STAT_ENOMEM));
+    }
+    memcpy(arg, req, sizeof(struct binary_req_t));
+
+    /* 応答の順番を守るために応答エントリを予約します。*/
+    reply = reply_reserve(client);
+    if (reply == NULL) {
+        free(arg);
+        reqbuf_release(rb);
+        return -1;
+    }
+    reply->filter = binary_reply_filter;
+    reply->filter_arg = arg;
+    return dispatch_reply_entry(reply, cmd_grp, cmdline, req->key, rb);
+}
+
+/*
+ * バイナリプロトコルのリクエストをひとつ受信して処理します。
+ *
+ * client: クライアント構造体のポインタ
+ * addr: クライアントのアドレス
+ *
+ * 戻り値
+ *  処理状態(STAT_FIN, STAT_CLOSE)を返します。
+ */
+unsigned binary_gateway(struct client_t* client, struct in_addr addr)
+{
+    struct sock_buf_t* sb = client->sb;
+    unsigned char hdr[BIN_HEADER_SIZE];
+    unsigned char ext[256];
+    struct binary_req_t req;
+    int extlen;
+    unsigned int bodylen;
+    int vallen;
+    int64 cas;
+    int status;
+    char cmdline[CMDLINE_SIZE];
+    struct reqbuf_t* rb = NULL;
+
+    /* ヘッダーを受信します。*/
+    if (sockbuf_nchar(sb, (char*)hdr, sizeof(hdr), &status) != sizeof(hdr))
+        return STAT_FIN|STAT_CLOSE;    /* FIN受信 */
+    if (hdr[0] != BIN_REQ_MAGIC) {
+        char ip_addr[256];
+
+        mt_inet_ntoa(addr, ip_addr);
+        err_write("binary_gateway: illegal magic 0x%02x from %s.", hdr[0], ip_addr);
+        return STAT_CLOSE;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.opcode = hdr[1];
+    req.quiet = is_quiet(req.opcode);
+    req.with_key = (req.opcode == BIN_CMD_GETK || req.opcode == BIN_CMD_GETKQ);
+    memcpy(req.opaque, &hdr[12], 4);
+    req.keylen = ((int)hdr[2] << 8) | hdr[3];
+    extlen = hdr[4];
+    bodylen = get_uint32(&hdr[8]);
+    cas = get_int64(&hdr[16]);
+
+    if (bodylen < (unsigned int)(extlen + req.keylen)) {
+        err_write("binary_gateway: illegal body length %u.", bodylen);
+        return STAT_CLOSE;
+    }
+    vallen = bodylen - extlen - req.keylen;
+    stats_add(STATS_BYTES_READ, sizeof(hdr) + bodylen);
+
+    /* extras と key を受信します。*/
+    if (extlen > 0) {
+        if (sockbuf_nchar(sb, (char*)ext, extlen, &status) != extlen)
+            return STAT_FIN|STAT_CLOSE;
+    }
+    if (req.keylen > MAX_MEMCACHED_KEYSIZE || vallen > MAX_MEMCACHED_DATASIZE) {
+        if (bin_skip(sb, req.keylen + vallen) < 0)
+            return STAT_FIN|STAT_CLOSE;
+        bin_send(client, req.opcode, req.opaque,
+                 (vallen > MAX_MEMCACHED_DATASIZE)? BIN_STAT_E2BIG : BIN_STAT_EINVAL,
+                 status_message((vallen > MAX_MEMCACHED_DATASIZE)? BIN_STAT_E2BIG : BIN_STAT_EINVAL));
+        return 0;
+    }
+    if (req.keylen > 0) {
+        if (sockbuf_nchar(sb, req.key, req.keylen, &status) != req.keylen)
+            return STAT_FIN|STAT_CLOSE;
+    }
+    req.key[req.keylen] = '\0';
+
+    switch (req.opcode) {
+        case BIN_CMD_SET:
+        case BIN_CMD_SETQ:
+        case BIN_CMD_ADD:
+        case BIN_CMD_ADDQ:
+        case BIN_CMD_REPLACE:
+        case BIN_CMD_REPLACEQ:
+        case BIN_CMD_APPEND:
+        case BIN_CMD_APPENDQ:
+        case BIN_CMD_PREPEND:
+        case BIN_CMD_PREPENDQ:
+            /* データブロックを直接ディスパッチ用のバッファに受信します。*/
+            rb = reqbuf_alloc(vallen + strlen(LINE_DELIMITER));
+            if (rb == NULL) {
+                if (bin_skip(sb, vallen) < 0)
+                    return STAT_FIN|STAT_CLOSE;
+                bin_send(client, req.opcode, req.opaque, BIN_STAT_ENOMEM, status_message(BIN_STAT_ENOMEM));
+                return 0;
+            }
+            if (vallen > 0) {
+                if (sockbuf_nchar(sb, rb->data, vallen, &status) != vallen) {
+                    reqbuf_release(rb);
+                    return STAT_FIN|STAT_CLOSE;
+                }
+            }
+            memcpy(&rb->data[vallen], LINE_DELIMITER, strlen(LINE_DELIMITER));
+            break;
+        default:
+            if (vallen > 0) {
+                if (bin_skip(sb, vallen) < 0)
+                    return STAT_FIN|STAT_CLOSE;
+            }
+            break;
+    }
+
+    switch (req.opcode) {
+        case BIN_CMD_NOOP:
+            bin_send(client, req.opcode, req.opaque, BIN_STAT_SUCCESS, NULL);
+            return 0;
+        case BIN_CMD_VERSION:
+            bin_send(client, req.opcode, req.opaque, BIN_STAT_SUCCESS, PROGRAM_VERSION);
+            return 0;
+        case BIN_CMD_QUIT:
+            bin_send(client, req.opcode, req.opaque, BIN_STAT_SUCCESS, NULL);
+            return STAT_CLOSE;
+        case BIN_CMD_QUITQ:
+            return STAT_CLOSE;
+        case BIN_CMD_STAT:
+            stat_command(client, req.opaque, req.key);
+            return 0;
+        case BIN_CMD_GET:
+        case BIN_CMD_GETQ:
+        case BIN_CMD_GETK:
+        case BIN_CMD_GETKQ:
+        case BIN_CMD_SET:
+        case BIN_CMD_SETQ:
+        case BIN_CMD_ADD:
+        case BIN_CMD_ADDQ:
+        case BIN_CMD_REPLACE:
+        case BIN_CMD_REPLACEQ:
+        case BIN_CMD_APPEND:
+        case BIN_CMD_APPENDQ:
+        case BIN_CMD_PREPEND:
+        case BIN_CMD_PREPENDQ:
+        case BIN_CMD_DELETE:
+        case BIN_CMD_DELETEQ:
+        case BIN_CMD_INCREMENT:
+        case BIN_CMD_INCREMENTQ:
+        case BIN_CMD_DECREMENT:
+        case BIN_CMD_DECREMENTQ:
+            break;
+        default:
+            bin_send(client, req.opcode, req.opaque, BIN_STAT_UNKNOWN_COMMAND,
+                     status_message(BIN_STAT_UNKNOWN_COMMAND));
+            return 0;
+    }
+
+    /* データストアへ送信するコマンドの受け付けを制限します。*/
+    if (admission_check(addr, 1, sizeof(hdr) + bodylen) < 0) {
+        reqbuf_release(rb);
+        bin_send(client, req.opcode, req.opaque, BIN_STAT_EBUSY, status_message(BIN_STAT_EBUSY));
+        return 0;
+    }
+
+    if (! valid_key(req.key, req.keylen)) {
+        reqbuf_release(rb);
+        bin_send(client, req.opcode, req.opaque, BIN_STAT_EINVAL, status_message(BIN_STAT_EINVAL));
+        return 0;
+    }
+
+    /* ASCII プロトコルのコマンドに変換します。*/
+    switch (req.opcode) {
+        case BIN_CMD_GET:
+        case BIN_CMD_GETQ:
+        case BIN_CMD_GETK:
+        case BIN_CMD_GETKQ:
+            snprintf(cmdline, sizeof(cmdline), "gets %s", req.key);
+            dispatch_command(client, &req, CMDGRP_GET, cmdline, NULL);
+            break;
+        case BIN_CMD_SET:
+        case BIN_CMD_SETQ:
+        case BIN_CMD_ADD:
+        case BIN_CMD_ADDQ:
+        case BIN_CMD_REPLACE:
+        case BIN_CMD_REPLACEQ: {
+            const char* cmd;
+            unsigned int flags;
+            unsigned int exptime;
+
+            if (extlen != 8) {
+                reqbuf_release(rb);
+                bin_send(client, req.opcode, req.opaque, BIN_STAT_EINVAL, status_message(BIN_STAT_EINVAL));
+                break;
+            }
+            flags = get_uint32(ext);
+            exptime = get_uint32(ext+4);
+            if (req.opcode == BIN_CMD_ADD || req.opcode == BIN_CMD_ADDQ)
+                cmd = "add";
+            else if (req.opcode == BIN_CMD_REPLACE || req.opcode == BIN_CMD_REPLACEQ)
+                cmd = "replace";
+            else
+                cmd = "set";
+            if (cas != 0 && *cmd == 's')
+                snprintf(cmdline, sizeof(cmdline), "cas %s %u %u %d %lld",
+                         req.key, flags, exptime, vallen, cas);
+            else
+                snprintf(cmdline, sizeof(cmdline), "%s %s %u %u %d",
+                         cmd, req.key, flags, exptime, vallen);
+            dispatch_command(client, &req, CMDGRP_SET, cmdline, rb);
+            break;
+        }
+        case BIN_CMD_APPEND:
+        case BIN_CMD_APPENDQ:
+        case BIN_CMD_PREPEND:
+        case BIN_CMD_PREPENDQ:
+            snprintf(cmdline, sizeof(cmdline), "%s %s 0 0 %d",
+                     (req.opcode == BIN_CMD_APPEND || req.opcode == BIN_CMD_APPENDQ)? "append" : "prepend",
+                     req.key, vallen);
+            dispatch_command(client, &req, CMDGRP_SET, cmdline, rb);
+            break;
+        case BIN_CMD_DELETE:
+        case BIN_CMD_DELETEQ:
+            snprintf(cmdline, sizeof(cmdline), "delete %s", req.key);
+            dispatch_command(client, &req, CMDGRP_DELETE, cmdline, NULL);
+            break;
+        case BIN_CMD_INCREMENT:
+        case BIN_CMD_INCREMENTQ:
+        case BIN_CMD_DECREMENT:
+        case BIN_CMD_DECREMENTQ:
+            if (extlen != 20) {
+                bin_send(client, req.opcode, req.opaque, BIN_STAT_EINVAL, status_message(BIN_STAT_EINVAL));
+                break;
+            }
+            snprintf(cmdline, sizeof(cmdline), "%s %s %llu",
+                     (req.opcode == BIN_CMD_INCREMENT || req.opcode == BIN_CMD_INCREMENTQ)? "incr" : "decr",
+                     req.key, (unsigned long long)get_int64(ext));
+            dispatch_command(client, &req, CMDGRP_SET, cmdline, NULL);
+            break;
+    }
+    return 0;
+}
+
+int binary_gateway_start()
+{
+    struct sockaddr_in sockaddr;
+    char ip_addr[256];
+
+    if (g_conf->binary_port == 0)
+        return 0;
+
+    /* バイナリプロトコルのリスニングソケットの作成 */
+    g_binary_socket = sock_listen(INADDR_ANY,
+                                  g_conf->binary_port,
+                                  g_conf->backlog,
+                                  &sockaddr);
+    if (g_binary_socket == INVALID_SOCKET)
+        return -1;  /* error */
+
+    /* 自分自身の IPアドレスを取得します。*/
+    sock_local_addr(ip_addr);
+
+    /* スターティングメッセージの表示 */
+    TRACE("%s binary port: %d on %s listening ...\n",
+        PROGRAM_NAME, g_conf->binary_port, ip_addr);
+    return 0;
+}
+
+void binary_gateway_end()
+{
+    if (g_binary_socket != INVALID_SOCKET) {
+        shutdown(g_binary_socket, 2);  /* 2: RDWR stop */
+        SOCKET_CLOSE(g_binary_socket);
+    }
+}
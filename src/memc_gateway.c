@@ -28,38 +28,10 @@
 
 #include "dinio.h"
 
-#define CMD_SET           1   /* データの保存(キーが存在している場合は置換) */
-#define CMD_ADD           2   /* データの保存(キーが既に存在しない場合のみ) */
-#define CMD_REPLACE       3   /* データの保存(キーが既に存在する場合のみ) */
-#define CMD_APPEND        4   /* 値への後方追加 */
-#define CMD_PREPEND       5   /* 値への前方追加 */
-#define CMD_CAS           6   /* データの保存(バージョン排他制御) */
-#define CMD_GET           7   /* データの取得 */
-#define CMD_GETS          8   /* データの取得(バージョン付き) */
-#define CMD_DELETE        9   /* データの削除 */
-#define CMD_INCR          10  /* 値への加算 */
-#define CMD_DECR          11  /* 値への減算 */
-#define CMD_STATS         12  /* 各種ステータスを表示 */
-#define CMD_VERSION       13  /* バージョンを表示 */
-#define CMD_VERBOSITY     14  /* 動作確認 */
-#define CMD_QUIT          30  /* 終了(コネクション切断) */
-#define CMD_STATUS        100 /* ステータス確認 */
-#define CMD_SHUTDOWN      110 /* 終了(シャットダウン) */
-#define CMD_ADDSERVER     120 /* データストア追加 */
-#define CMD_REMOVESERVER  121 /* データストア削除 */
-#define CMD_UNLOCKSERVER  122 /* データストアロック解除 */
-#define CMD_HASHSERVER    130 /* キーのサーバー算出 */
-#define CMD_IMPORTDATA    131 /* データのインポート */
-
-#define STAT_FIN       0x01
-#define STAT_CLOSE     0x02
-#define STAT_SHUTDOWN  0x04
-
-#ifdef WIN32
-static HANDLE memcached_queue_cond;
-#else
-static pthread_mutex_t memcached_queue_mutex;
-static pthread_cond_t memcached_queue_cond;
+#ifndef WIN32
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #endif
 
 static int noreply(int n, const char** p)
@@ -69,57 +41,6 @@ static int noreply(int n, const char** p)
     return 0;
 }
 
-static int parse_command(const char* str)
-{
-    if (stricmp(str, "set") == 0)
-        return CMD_SET;
-    if (stricmp(str, "get") == 0)
-        return CMD_GET;
-    if (stricmp(str, "delete") == 0)
-        return CMD_DELETE;
-    if (stricmp(str, "gets") == 0)
-        return CMD_GETS;
-    if (stricmp(str, "cas") == 0)
-        return CMD_CAS;
-    if (stricmp(str, "add") == 0)
-        return CMD_ADD;
-    if (stricmp(str, "replace") == 0)
-        return CMD_REPLACE;
-    if (stricmp(str, "append") == 0)
-        return CMD_APPEND;
-    if (stricmp(str, "prepend") == 0)
-        return CMD_PREPEND;
-    if (stricmp(str, "incr") == 0)
-        return CMD_INCR;
-    if (stricmp(str, "decr") == 0)
-        return CMD_DECR;
-    if (stricmp(str, "stats") == 0)
-        return CMD_STATS;
-    if (stricmp(str, "version") == 0)
-        return CMD_VERSION;
-    if (stricmp(str, "verbosity") == 0)
-        return CMD_VERBOSITY;
-    if (stricmp(str, "quit") == 0)
-        return CMD_QUIT;
-
-    if (strcmp(str, SHUTDOWN_CMD) == 0)
-        return CMD_SHUTDOWN;
-    if (strcmp(str, STATUS_CMD) == 0)
-        return CMD_STATUS;
-    if (strcmp(str, ADDSERVER_CMD) == 0)
-        return CMD_ADDSERVER;
-    if (strcmp(str, REMOVESERVER_CMD) == 0)
-        return CMD_REMOVESERVER;
-    if (strcmp(str, UNLOCKSERVER_CMD) == 0)
-        return CMD_UNLOCKSERVER;
-    if (strcmp(str, HASHSERVER_CMD) == 0)
-        return CMD_HASHSERVER;
-    if (strcmp(str, IMPORTDATA_CMD) == 0)
-        return CMD_IMPORTDATA;
-
-    return -1;
-}
-
 static void dust_recv_buffer(struct sock_buf_t* sb)
 {
     int end_flag = 0;
@@ -134,8 +55,9 @@ static void dust_recv_buffer(struct sock_buf_t* sb)
     }
 }
 
-static int datablock_recv(struct sock_buf_t* sb, char* buf, int bytes, int noreply_flag)
+static int datablock_recv(struct client_t* client, char* buf, int bytes, int noreply_flag)
 {
+    struct sock_buf_t* sb = client->sb;
     int bufsize;
     int len;
     int line_flag;
@@ -159,102 +81,130 @@ static int datablock_recv(struct sock_buf_t* sb, char* buf, int bytes, int norep
             char msg[256];
 
             snprintf(msg, sizeof(msg), "<data block> size error, bytes=%d", bytes);
-            reply_error(sb->socket, msg);
+            client_error(client, msg);
         }
         return -1;
     }
     return 0;
 }
 
+/*
+ * データブロックをデータストアへ送信するバッファに受信します。
+ * バッファはデータストアへ送信されるまでコピーされずに
+ * 引き渡されます。
+ *
+ * client: クライアント構造体のポインタ
+ * dsize: データブロックのバイト数
+ * noreply_flag: エラーを応答しない場合は 1
+ *
+ * 戻り値
+ *  CRLF を付加したバッファを返します。
+ *  エラーの場合は NULL を返します。
+ */
+static struct reqbuf_t* datablock_reqbuf(struct client_t* client, int dsize, int noreply_flag)
+{
+    struct reqbuf_t* rb;
+
+    rb = reqbuf_alloc(dsize + strlen(LINE_DELIMITER) + 1);
+    if (rb == NULL) {
+        if (! noreply_flag)
+            client_error(client, "data recv no memory.");
+        return NULL;
+    }
+    /* データブロックを受信します。*/
+    if (datablock_recv(client, rb->data, dsize, noreply_flag) < 0) {
+        reqbuf_release(rb);
+        return NULL;
+    }
+    /* CRLF を付加します。*/
+    memcpy(&rb->data[dsize], LINE_DELIMITER, strlen(LINE_DELIMITER));
+    rb->size = dsize + strlen(LINE_DELIMITER);
+    stats_add(STATS_BYTES_READ, rb->size);
+    return rb;
+}
+
+/* コマンドで受け付けるデータブロックの最大サイズを返します。*/
+static int max_datasize(const char* cmd)
+{
+    /* set は MAX_MEMCACHED_DATASIZE を超える値を分割して保存します。*/
+    if (stricmp(cmd, "set") == 0 && g_conf->max_value_size * 1024 > MAX_MEMCACHED_DATASIZE)
+        return g_conf->max_value_size * 1024;
+    return MAX_MEMCACHED_DATASIZE;
+}
+
 /* set <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int set_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int set_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     int dsize;
-    int bytes = 0;
-    char* data = NULL;
-    int result;
+    struct reqbuf_t* rb = NULL;
 
     if (cn < 5 || cn > 6) {
         if (! noreply(cn, cl))
-            reply_error(sb->socket, "illegal parameter.");
+            client_error(client, "illegal parameter.");
         return -1;
     }
 
     dsize = atoi(cl[4]);
-    if (dsize > MAX_MEMCACHED_DATASIZE) {
+    if (dsize > max_datasize(cl[0])) {
         if (! noreply(cn, cl))
-            reply_error(sb->socket, "data size too large.");
+            client_error(client, "data size too large.");
         return -1;
     }
 
     if (dsize > 0) {
-        /* データブロックを受信します。*/
-        bytes = dsize + strlen(LINE_DELIMITER);
-        data = (char*)malloc(bytes+1);
-        if (data == NULL) {
-            err_write("set_command: no memory bytes=%d.", bytes);
-            if (! noreply(cn, cl))
-                reply_error(sb->socket, "data recv no memory.");
+        rb = datablock_reqbuf(client, dsize, noreply(cn, cl));
+        if (rb == NULL)
             return -1;
-        }
-        if (datablock_recv(sb, data, dsize, noreply(cn, cl)) < 0) {
-            free(data);
-            return 0;
-        }
-        /* CRLF + '\0' を付加します。*/
-        memcpy(&data[dsize], LINE_DELIMITER, sizeof(LINE_DELIMITER));
     }
-    result = dispatch_event_entry(sb->socket, CMDGRP_SET, cmdline, cn, cl, bytes, data);
-    if (data)
-        free(data);
-    return result;
+    /* バッファの所有権は dispatch_event_entry() に移ります。*/
+    return dispatch_event_entry(client, CMDGRP_SET, cmdline, cn, cl, rb);
 }
 
 /* add <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int add_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int add_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
-    return set_command(sb, cmdline, cn, cl);
+    return set_command(client, cmdline, cn, cl);
 }
 
 /* replace <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int replace_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int replace_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
-    return set_command(sb, cmdline, cn, cl);
+    return set_command(client, cmdline, cn, cl);
 }
 
 /* append <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int append_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int append_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
-    return set_command(sb, cmdline, cn, cl);
+    return set_command(client, cmdline, cn, cl);
 }
 
 /* prepend <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int prepend_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int prepend_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
-    return set_command(sb, cmdline, cn, cl);
+    return set_command(client, cmdline, cn, cl);
 }
 
 /* cas <key> <flags> <exptime> <bytes> <cas unqiue> [noreply]
  * <data block>
  */
-static int cas_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int cas_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     if (cn < 6) {
         if (! noreply(cn, cl))
-            reply_error(sb->socket, "illegal parameter.");
+            client_error(client, "illegal parameter.");
         return -1;
     }
-    return set_command(sb, cmdline, cn, cl);
+    return set_command(client, cmdline, cn, cl);
 }
 
 /* get <key[ key1 key2 ...]>
@@ -263,12 +213,12 @@ static int cas_command(struct sock_buf_t* sb, const char* cmdline, int cn, const
  * ...
  * END
  */
-static int get_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int get_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     if (cn < 2)
-        return reply_error(sb->socket, "illegal parameter.");
+        return client_error(client, "illegal parameter.");
 
-    return dispatch_event_entry(sb->socket, CMDGRP_GET, cmdline, cn, cl, 0, NULL);
+    return dispatch_event_entry(client, CMDGRP_GET, cmdline, cn, cl, NULL);
 }
 
 /* gets <key[ key1 key2 ...]>
@@ -277,164 +227,65 @@ static int get_command(struct sock_buf_t* sb, const char* cmdline, int cn, const
  * ...
  * END
  */
-static int gets_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int gets_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     if (cn < 2)
-        return reply_error(sb->socket, "illegal parameter.");
+        return client_error(client, "illegal parameter.");
 
-    return dispatch_event_entry(sb->socket, CMDGRP_GET, cmdline, cn, cl, 0, NULL);
+    return dispatch_event_entry(client, CMDGRP_GET, cmdline, cn, cl, NULL);
 }
 
 /* delete <key> [<time>] [noreply]
  */
-static int delete_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int delete_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     if (cn < 2 || cn > 4) {
         if (! noreply(cn, cl))
-            reply_error(sb->socket, "illegal parameter.");
+            client_error(client, "illegal parameter.");
         return -1;
     }
-    return dispatch_event_entry(sb->socket, CMDGRP_DELETE, cmdline, cn, cl, 0, NULL);
+    return dispatch_event_entry(client, CMDGRP_DELETE, cmdline, cn, cl, NULL);
 }
 
 /* incr <key> <value> [noreply]
  */
-static int incr_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int incr_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     if (cn < 3 || cn > 4) {
         if (! noreply(cn, cl))
-            reply_error(sb->socket, "illegal parameter.");
+            client_error(client, "illegal parameter.");
         return -1;
     }
-    return dispatch_event_entry(sb->socket, CMDGRP_SET, cmdline, cn, cl, 0, NULL);
+    return dispatch_event_entry(client, CMDGRP_SET, cmdline, cn, cl, NULL);
 }
 
 /* decr <key> <value> [noreply]
  */
-static int decr_command(struct sock_buf_t* sb, const char* cmdline, int cn, const char** cl)
+static int decr_command(struct client_t* client, const char* cmdline, int cn, const char** cl)
 {
     if (cn < 3 || cn > 4) {
         if (! noreply(cn, cl))
-            reply_error(sb->socket, "illegal parameter.");
+            client_error(client, "illegal parameter.");
         return -1;
     }
-    return dispatch_event_entry(sb->socket, CMDGRP_SET, cmdline, cn, cl, 0, NULL);
+    return dispatch_event_entry(client, CMDGRP_SET, cmdline, cn, cl, NULL);
 }
 
-/* stats
+/* stats [servers|latency|queues]
  */
-static int stats_command(SOCKET socket)
+static int stats_command(struct client_t* client, int cn, const char** cl)
 {
     struct membuf_t* mb;
-    char str[256];
-    int pid;
-    int64 nowtime;
-    unsigned int nowsec;
-    int i;
-    int64 set_count = 0;
-    int64 get_count = 0;
-
-    mb = mb_alloc(1024);
-    if (mb == NULL) {
-        err_write("memc_gateway: stats no memory.");
-        snprintf(str, sizeof(str), "%s%sEND%s", "no memory.", LINE_DELIMITER, LINE_DELIMITER);
-        if (send_data(socket, str, strlen(str)) < 0) {
-            err_write("memc_gateway: stats send error.");
-            return -1;
-        }
-    }
 
-    nowtime = system_time();
-    nowsec = system_seconds();
-    pid = getpid();
-
-    for (i = 0; i < g_dss->num_server; i++) {
-        set_count += g_dss->server_list[i]->set_count;
-        get_count += g_dss->server_list[i]->get_count;
-    }
-
-    snprintf(str, sizeof(str), "STAT pid %d%s", pid, LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT uptime %u%s", (nowsec - (unsigned int)(g_start_time/1000000)), LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT time %u%s", nowsec, LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT version %s%s", PROGRAM_VERSION, LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT pointer_size %u%s", (unsigned int)sizeof(void*), LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT rusage_user %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT rusage_system %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT curr_connections %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT total_connections %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT connection_structures %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT cmd_get %lld%s", get_count, LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT cmd_set %lld%s", set_count, LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT cmd_flush %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT get_hits %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT get_misses %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT delete_misses %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT delete_hits %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT incr_misses %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT incr_hits %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT decr_misses %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT decr_hits %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT cas_misses %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT cas_hits %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT cas_badval %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT auth_cmds %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT auth_errors %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT bytes_read %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT bytes_written %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT limit_maxbytes %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT accepting_conns %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT listen_disabled_num %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT threads %d%s", g_conf->worker_threads, LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT conn_yields %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT bytes %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT curr_items %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT total_items %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT evictions %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-    snprintf(str, sizeof(str), "STAT reclaimed %s%s", "N/A", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
-
-    snprintf(str, sizeof(str), "END%s", LINE_DELIMITER);
-    mb_append(mb, str, strlen(str));
+    if (cn > 2)
+        return client_error(client, "illegal parameter.");
+
+    mb = stats_report((cn == 2)? cl[1] : NULL);
+    if (mb == NULL)
+        return client_error(client, "illegal parameter.");
 
     /* 応答データ */
-    if (send_data(socket, mb->buf, mb->size) < 0)
+    if (client_send(client, mb->buf, mb->size) < 0)
         err_write("memc_gateway: stats send error.");
     mb_free(mb);
     return 0;
@@ -442,14 +293,14 @@ static int stats_command(SOCKET socket)
 
 /* version
  */
-static int version_command(SOCKET socket)
+static int version_command(struct client_t* client)
 {
     char verstr[256];
 
     snprintf(verstr, sizeof(verstr), "%s%s", PROGRAM_VERSION, LINE_DELIMITER);
 
     /* 応答データ */
-    if (send_data(socket, verstr, strlen(verstr)) < 0) {
+    if (client_send(client, verstr, strlen(verstr)) < 0) {
         err_write("memc_gateway: version send error.");
         return -1;
     }
@@ -458,20 +309,553 @@ static int version_command(SOCKET socket)
 
 /* verbosity
  */
-static int verbosity_command(SOCKET socket)
+static int verbosity_command(struct client_t* client)
 {
     char str[256];
 
     snprintf(str, sizeof(str), "OK%s", LINE_DELIMITER);
 
     /* 応答データ */
-    if (send_data(socket, str, strlen(str)) < 0) {
+    if (client_send(client, str, strlen(str)) < 0) {
         err_write("memc_gateway: verbosity send error.");
         return -1;
     }
     return 0;
 }
 
+/*
+ * meta コマンド(mg, ms, md, ma, mn)
+ *
+ * meta コマンドは従来のコマンドに変換してデータストアへ送信します。
+ * データストアの応答は応答エントリのフィルタ(meta_reply_filter)で
+ * meta コマンドの応答に変換されます。
+ * q フラグの応答(mg の EN や ms の HD)はゲートウェイで省略するので
+ * mn で終端したパイプラインでは必要な応答だけが送信されます。
+ */
+#define META_OPAQUE_SIZE    32
+
+struct meta_req_t {
+    int cmd;                            /* CMD_META_xxx */
+    int quiet;                          /* q: 成功(mg は EN)を応答しない */
+    int value;                          /* v: 値を応答する */
+    char retflags[16];                  /* 応答に返すフラグ(k, O, f, s, c) */
+    char opaque[META_OPAQUE_SIZE+1];    /* O: そのまま返す値 */
+    unsigned int flags;                 /* F: クライアントフラグ */
+    int exptime;                        /* T: 有効期限 */
+    char cas[24];                       /* C: 比較する cas unique */
+    char delta[24];                     /* D: 加減算する値 */
+    char mode;                          /* M: モード */
+    char key[MAX_MEMCACHED_KEYSIZE+1];
+};
+
+static int numeric(const char* str)
+{
+    if (*str == '\0')
+        return 0;
+    while (*str) {
+        if (*str < '0' || *str > '9')
+            return 0;
+        str++;
+    }
+    return 1;
+}
+
+/* meta コマンドのフラグを解析します。
+   accept に含まれないフラグはエラー(-1)になります。*/
+static int meta_parse(struct meta_req_t* req,
+                      int cn,
+                      const char** cl,
+                      int start,
+                      const char* accept)
+{
+    int i;
+
+    for (i = start; i < cn; i++) {
+        char f = cl[i][0];
+        const char* val = &cl[i][1];
+
+        if (strchr(accept, f) == NULL)
+            return -1;
+        switch (f) {
+            case 'q':
+                req->quiet = 1;
+                break;
+            case 'v':
+                req->value = 1;
+                break;
+            case 'k':
+            case 'f':
+            case 's':
+            case 'c':
+                if (strchr(req->retflags, f) == NULL)
+                    strncat(req->retflags, &f, 1);
+                break;
+            case 'O':
+                if (strlen(val) > META_OPAQUE_SIZE)
+                    return -1;
+                strcpy(req->opaque, val);
+                if (strchr(req->retflags, f) == NULL)
+                    strncat(req->retflags, &f, 1);
+                break;
+            case 'F':
+                if (! numeric(val))
+                    return -1;
+                req->flags = (unsigned int)strtoul(val, NULL, 10);
+                break;
+            case 'T':
+                if (! numeric((*val == '-')? val+1 : val))
+                    return -1;
+                req->exptime = atoi(val);
+                break;
+            case 'C':
+            case 'D':
+                if (! numeric(val) || strlen(val) >= sizeof(req->cas))
+                    return -1;
+                strcpy((f == 'C')? req->cas : req->delta, val);
+                break;
+            case 'M':
+                if (strlen(val) != 1)
+                    return -1;
+                req->mode = (*val >= 'a' && *val <= 'z')? *val - 'a' + 'A' : *val;
+                break;
+        }
+    }
+    return 0;
+}
+
+/* 応答コードと応答に返すフラグを出力します。
+   item_flag が 0 の場合は k と O のみ出力します。*/
+static void meta_header(struct membuf_t* res,
+                        struct meta_req_t* req,
+                        const char* code,
+                        int item_flag,
+                        const char* flags,
+                        const char* bytes,
+                        const char* cas)
+{
+    const char* p;
+    char buf[64];
+
+    mb_append(res, code, strlen(code));
+    for (p = req->retflags; *p; p++) {
+        if (*p == 'k') {
+            mb_append(res, " k", 2);
+            mb_append(res, req->key, strlen(req->key));
+        } else if (*p == 'O') {
+            mb_append(res, " O", 2);
+            mb_append(res, req->opaque, strlen(req->opaque));
+        } else if (item_flag) {
+            const char* v = (*p == 'f')? flags : (*p == 's')? bytes : cas;
+
+            if (v) {
+                snprintf(buf, sizeof(buf), " %c%s", *p, v);
+                mb_append(res, buf, strlen(buf));
+            }
+        }
+    }
+    mb_append(res, LINE_DELIMITER, strlen(LINE_DELIMITER));
+}
+
+/* mg: VALUE <key> <flags> <bytes> [<cas unique>] の応答を変換します。*/
+static int meta_get_response(struct meta_req_t* req,
+                             const char* buf,
+                             int size,
+                             int len,
+                             struct membuf_t* res)
+{
+    char line[CMDLINE_SIZE];
+    struct cmdline_t cmdl;
+    const char* data;
+    int bytes;
+
+    if (len >= (int)sizeof(line))
+        return -1;
+    memcpy(line, buf, len);
+    line[len] = '\0';
+    if (cmd_tokenize(line, &cmdl) < 4)
+        return -1;
+    bytes = atoi(cmdl.cl[3]);
+    data = buf + len + strlen(LINE_DELIMITER);
+    if (bytes < 0 || (data - buf) + bytes > size)
+        return -1;
+
+    if (req->value) {
+        char code[32];
+
+        snprintf(code, sizeof(code), "VA %d", bytes);
+        meta_header(res, req, code, 1, cmdl.cl[2], cmdl.cl[3], (cmdl.cn > 4)? cmdl.cl[4] : NULL);
+        mb_append(res, data, bytes);
+        mb_append(res, LINE_DELIMITER, strlen(LINE_DELIMITER));
+    } else
+        meta_header(res, req, "HD", 1, cmdl.cl[2], cmdl.cl[3], (cmdl.cn > 4)? cmdl.cl[4] : NULL);
+    return 0;
+}
+
+/*
+ * データストアからの応答を meta コマンドの応答に変換します。
+ * reply_complete() から呼び出されます。
+ * 変換できない応答(エラー)はそのまま応答します。
+ */
+static void meta_reply_filter(struct reply_t* reply)
+{
+    struct meta_req_t* req;
+    struct membuf_t* res;
+    const char* buf = "";
+    const char* p;
+    int size = 0;
+    int len;
+    int done = 1;
+
+    req = (struct meta_req_t*)reply->filter_arg;
+    if (reply->mb) {
+        buf = reply->mb->buf;
+        size = reply->mb->size;
+    }
+
+    p = memchr(buf, '\n', size);
+    len = (p)? (p - buf) : size;
+    if (len > 0 && buf[len-1] == '\r')
+        len--;
+
+    res = mb_alloc(size + 256);
+    if (res == NULL) {
+        err_write("meta_reply_filter: mb_alloc() no memory.");
+        return;
+    }
+
+#define LINE_IS(s)  (len == strlen(s) && strncmp(buf, s, len) == 0)
+    if (req->cmd == CMD_META_GET) {
+        if (len > 6 && strncmp(buf, "VALUE ", 6) == 0)
+            done = (meta_get_response(req, buf, size, len, res) == 0);
+        else if (LINE_IS("END")) {
+            if (! req->quiet)
+                meta_header(res, req, "EN", 0, NULL, NULL, NULL);
+        } else
+            done = 0;
+    } else if (req->cmd == CMD_META_SET) {
+        if (LINE_IS("STORED")) {
+            if (! req->quiet)
+                meta_header(res, req, "HD", 0, NULL, NULL, NULL);
+        } else if (LINE_IS("NOT_STORED"))
+            meta_header(res, req, "NS", 0, NULL, NULL, NULL);
+        else if (LINE_IS("EXISTS"))
+            meta_header(res, req, "EX", 0, NULL, NULL, NULL);
+        else if (LINE_IS("NOT_FOUND"))
+            meta_header(res, req, "NF", 0, NULL, NULL, NULL);
+        else
+            done = 0;
+    } else if (req->cmd == CMD_META_DELETE) {
+        if (LINE_IS("DELETED") || LINE_IS("NOT_FOUND")) {
+            if (! req->quiet)
+                meta_header(res, req, (buf[0] == 'D')? "HD" : "NF", 0, NULL, NULL, NULL);
+        } else
+            done = 0;
+    } else if (req->cmd == CMD_META_ARITHMETIC) {
+        if (len > 0 && buf[0] >= '0' && buf[0] <= '9') {
+            if (req->value) {
+                char code[32];
+
+                snprintf(code, sizeof(code), "VA %d", len);
+                meta_header(res, req, code, 0, NULL, NULL, NULL);
+                mb_append(res, buf, len);
+                mb_append(res, LINE_DELIMITER, strlen(LINE_DELIMITER));
+            } else if (! req->quiet)
+                meta_header(res, req, "HD", 0, NULL, NULL, NULL);
+        } else if (LINE_IS("NOT_FOUND"))
+            meta_header(res, req, "NF", 0, NULL, NULL, NULL);
+        else
+            done = 0;
+    } else
+        done = 0;
+#undef LINE_IS
+
+    if (! done) {
+        /* エラー応答はそのまま送信します。*/
+        mb_free(res);
+        return;
+    }
+    if (reply->mb)
+        mb_free(reply->mb);
+    if (res->size == 0) {
+        mb_free(res);
+        res = NULL;
+    }
+    reply->mb = res;
+}
+
+/* meta コマンドをデータストアへ送信するコマンドとしてディスパッチします。*/
+static int meta_dispatch(struct client_t* client,
+                         struct meta_req_t* req,
+                         int cmd_grp,
+                         const char* cmdline,
+                         struct reqbuf_t* rb)
+{
+    struct meta_req_t* arg;
+    struct reply_t* reply;
+
+    arg = (struct meta_req_t*)malloc(sizeof(struct meta_req_t));
+    if (arg == NULL) {
+        err_write("memc_gateway: meta no memory.");
+        reqbuf_release(rb);
+        return client_error(client, "no memory.");
+    }
+    memcpy(arg, req, sizeof(struct meta_req_t));
+
+    /* 応答の順番を守るために応答エントリを予約します。*/
+    reply = reply_reserve(client);
+    if (reply == NULL) {
+        free(arg);
+        reqbuf_release(rb);
+        return -1;
+    }
+    reply->filter = meta_reply_filter;
+    reply->filter_arg = arg;
+    return dispatch_reply_entry(reply, cmd_grp, cmdline, req->key, rb);
+}
+
+/* meta コマンドの要求を初期化してキーを設定します。*/
+static int meta_init(struct meta_req_t* req, int cmd, int cn, const char** cl)
+{
+    memset(req, 0, sizeof(struct meta_req_t));
+    req->cmd = cmd;
+    if (cn < 2 || strlen(cl[1]) > MAX_MEMCACHED_KEYSIZE)
+        return -1;
+    strcpy(req->key, cl[1]);
+    return 0;
+}
+
+/* mg <key> <flags>*
+ * VA <size> <flags>*
+ * <data block>
+ * HD <flags>* | EN
+ */
+static int mg_command(struct client_t* client, int cn, const char** cl)
+{
+    struct meta_req_t req;
+    char cmdline[CMDLINE_SIZE];
+
+    if (meta_init(&req, CMD_META_GET, cn, cl) < 0)
+        return client_error(client, "illegal parameter.");
+    if (meta_parse(&req, cn, cl, 2, "qvkfscO") < 0)
+        return client_error(client, "illegal parameter.");
+
+    /* cas unique を返す場合は gets で取得します。*/
+    snprintf(cmdline, sizeof(cmdline), "%s %s",
+             (strchr(req.retflags, 'c'))? "gets" : "get", req.key);
+    return meta_dispatch(client, &req, CMDGRP_GET, cmdline, NULL);
+}
+
+/* ms <key> <datalen> <flags>*
+ * <data block>
+ * HD <flags>* | NS | EX | NF
+ */
+static int ms_command(struct client_t* client, int cn, const char** cl)
+{
+    struct meta_req_t req;
+    char cmdline[CMDLINE_SIZE];
+    const char* cmd;
+    int dsize;
+    struct reqbuf_t* rb = NULL;
+
+    if (meta_init(&req, CMD_META_SET, cn, cl) < 0 || cn < 3 || ! numeric(cl[2]))
+        return client_error(client, "illegal parameter.");
+
+    dsize = atoi(cl[2]);
+    if (dsize > max_datasize("set"))
+        return client_error(client, "data size too large.");
+    if (dsize > 0) {
+        /* フラグの誤りでもデータブロックは受信します。*/
+        rb = datablock_reqbuf(client, dsize, 0);
+        if (rb == NULL)
+            return -1;
+    }
+
+    if (meta_parse(&req, cn, cl, 3, "qkOFTCM") < 0) {
+        reqbuf_release(rb);
+        return client_error(client, "illegal parameter.");
+    }
+    switch (req.mode) {
+        case 0:
+        case 'S':
+            cmd = (req.cas[0])? "cas" : "set";
+            break;
+        case 'E':
+            cmd = "add";
+            break;
+        case 'A':
+            cmd = "append";
+            break;
+        case 'P':
+            cmd = "prepend";
+            break;
+        case 'R':
+            cmd = "replace";
+            break;
+        default:
+            cmd = NULL;
+            break;
+    }
+    if (cmd == NULL || (req.cas[0] && strcmp(cmd, "cas") != 0) ||
+        (dsize > MAX_MEMCACHED_DATASIZE && strcmp(cmd, "set") != 0)) {
+        reqbuf_release(rb);
+        return client_error(client, "illegal parameter.");
+    }
+
+    snprintf(cmdline, sizeof(cmdline), "%s %s %u %d %d%s%s",
+             cmd, req.key, req.flags, req.exptime, dsize,
+             (req.cas[0])? " " : "", req.cas);
+    return meta_dispatch(client, &req, CMDGRP_SET, cmdline, rb);
+}
+
+/* md <key> <flags>*
+ * HD <flags>* | NF
+ */
+static int md_command(struct client_t* client, int cn, const char** cl)
+{
+    struct meta_req_t req;
+    char cmdline[CMDLINE_SIZE];
+
+    if (meta_init(&req, CMD_META_DELETE, cn, cl) < 0)
+        return client_error(client, "illegal parameter.");
+    if (meta_parse(&req, cn, cl, 2, "qkO") < 0)
+        return client_error(client, "illegal parameter.");
+
+    snprintf(cmdline, sizeof(cmdline), "delete %s", req.key);
+    return meta_dispatch(client, &req, CMDGRP_DELETE, cmdline, NULL);
+}
+
+/* ma <key> <flags>*
+ * VA <size> <flags>*
+ * <number>
+ * HD <flags>* | NF
+ */
+static int ma_command(struct client_t* client, int cn, const char** cl)
+{
+    struct meta_req_t req;
+    char cmdline[CMDLINE_SIZE];
+    const char* cmd;
+
+    if (meta_init(&req, CMD_META_ARITHMETIC, cn, cl) < 0)
+        return client_error(client, "illegal parameter.");
+    if (meta_parse(&req, cn, cl, 2, "qvkODM") < 0)
+        return client_error(client, "illegal parameter.");
+
+    if (req.mode == 0 || req.mode == 'I' || req.mode == '+')
+        cmd = "incr";
+    else if (req.mode == 'D' || req.mode == '-')
+        cmd = "decr";
+    else
+        return client_error(client, "illegal parameter.");
+
+    snprintf(cmdline, sizeof(cmdline), "%s %s %s",
+             cmd, req.key, (req.delta[0])? req.delta : "1");
+    return meta_dispatch(client, &req, CMDGRP_SET, cmdline, NULL);
+}
+
+/* mn
+ * MN
+ */
+static int mn_command(struct client_t* client)
+{
+    /* 先行するコマンドの応答の後に送信されます。*/
+    return client_send(client, "MN" LINE_DELIMITER, strlen("MN" LINE_DELIMITER));
+}
+
+/* データブロック(CRLFを含む)を読み捨てます。*/
+static int datablock_skip(struct sock_buf_t* sb, int bytes)
+{
+    char buf[BUF_SIZE];
+    int size;
+    int status;
+
+    size = bytes + strlen(LINE_DELIMITER);
+    while (size > 0) {
+        int n;
+
+        n = (size > (int)sizeof(buf))? (int)sizeof(buf) : size;
+        if (sockbuf_nchar(sb, buf, n, &status) != n)
+            return -1;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * データストアへ送信するコマンドの受け付けの制限で使用する
+ * コマンド数とデータブロックのバイト数を求めます。
+ *
+ * cmd: コマンド
+ * cn: コマンド行の要素数
+ * cl: コマンド行の要素
+ * ops: コマンド数が設定されます
+ * dsize: データブロックのバイト数が設定されます
+ *
+ * 戻り値
+ *  制限の対象となるコマンドの場合はゼロを返します。
+ *  対象外のコマンドやパラメータに誤りがある場合は -1 を返します。
+ */
+static int admission_size(int cmd, int cn, const char** cl, int* ops, int* dsize)
+{
+    *ops = 1;
+    *dsize = 0;
+    switch (cmd) {
+        case CMD_SET:
+        case CMD_ADD:
+        case CMD_REPLACE:
+        case CMD_APPEND:
+        case CMD_PREPEND:
+        case CMD_CAS:
+            if (cn < 5 || cn > 7)
+                return -1;
+            *dsize = atoi(cl[4]);
+            break;
+        case CMD_META_SET:
+            if (cn < 3 || ! numeric(cl[2]))
+                return -1;
+            *dsize = atoi(cl[2]);
+            break;
+        case CMD_GET:
+        case CMD_GETS:
+            if (cn < 2)
+                return -1;
+            *ops = cn - 1;
+            break;
+        case CMD_DELETE:
+        case CMD_INCR:
+        case CMD_DECR:
+        case CMD_META_GET:
+        case CMD_META_DELETE:
+        case CMD_META_ARITHMETIC:
+            if (cn < 2)
+                return -1;
+            break;
+        default:
+            return -1;
+    }
+    /* ms は ms_command() と同じく set の最大サイズで判定します。*/
+    if (*dsize < 0 || *dsize > max_datasize((cmd == CMD_META_SET)? "set" : cl[0]))
+        return -1;
+    return 0;
+}
+
+/*
+ * 受け付けの制限を超えたコマンドに "SERVER_ERROR busy" を応答します。
+ * データブロックは読み捨てます。
+ * noreply のコマンドは応答しません。
+ */
+static int busy_command(struct client_t* client, int cn, const char** cl, int dsize)
+{
+    if (dsize > 0) {
+        if (datablock_skip(client->sb, dsize) < 0)
+            return -1;
+        stats_add(STATS_BYTES_READ, dsize + strlen(LINE_DELIMITER));
+    }
+    if (noreply(cn, cl))
+        return 0;
+    return client_send(client, "SERVER_ERROR busy" LINE_DELIMITER,
+                       strlen("SERVER_ERROR busy" LINE_DELIMITER));
+}
+
 static int cmdline_recv(struct sock_buf_t* sb, char* buf, int size, int* line_flag)
 {
     int len;
@@ -487,18 +871,22 @@ static int cmdline_recv(struct sock_buf_t* sb, char* buf, int size, int* line_fl
     return len;
 }
 
-static unsigned command_gateway(struct sock_buf_t* sb,
+static unsigned command_gateway(struct client_t* client,
                                 struct in_addr addr)
 {
+    struct sock_buf_t* sb = client->sb;
     unsigned stat = 0;
     int result = 0;
     int len;
     char buf[BUF_SIZE];
     char cmdbuf[CMDLINE_SIZE];
     int line_flag;
-    char** clp;
+    struct cmdline_t cmdl;
+    const char** clp;
     int cc;
     int cmd;
+    int ops;
+    int dsize;
 
     /* コマンド行を受信します。*/
     len = cmdline_recv(sb, buf, sizeof(buf), &line_flag);
@@ -510,82 +898,108 @@ static unsigned command_gateway(struct sock_buf_t* sb,
         return STAT_FIN|STAT_CLOSE;    /* FIN受信 */
     }
     if (! line_flag) {
-        reply_error(sb->socket, NULL);
+        client_error(client, NULL);
         return 0;
     }
-    if (strlen(buf) > CMDLINE_SIZE) {
-        reply_error(sb->socket, NULL);
+    stats_add(STATS_BYTES_READ, len + strlen(LINE_DELIMITER));
+    if (strlen(buf) >= CMDLINE_SIZE) {
+        client_error(client, NULL);
         return 0;
     }
+    /* データストアへ送信するコマンド行を保存します。*/
     strcpy(cmdbuf, buf);
     TRACE("request command: %s ...", buf);
 
-    clp = split(buf, ' ');
-    if (clp == NULL) {
-        reply_error(sb->socket, NULL);
+    /* コマンド行をバッファ上で要素に分割します。*/
+    cc = cmd_tokenize(buf, &cmdl);
+    if (cc <= 0) {
+        client_error(client, NULL);
         return 0;
     }
-    cc = list_count((const char**)clp);
-    if (cc <= 0) {
-        list_free(clp);
-        reply_error(sb->socket, NULL);
+    clp = (const char**)cmdl.cl;
+
+    cmd = cmd_lookup(cmdl.cl[0], cmdl.len[0]);
+
+    /* データストアへ送信するコマンドの受け付けを制限します。*/
+    if (admission_size(cmd, cc, clp, &ops, &dsize) == 0 &&
+        admission_check(addr, ops, len + dsize) < 0) {
+        if (busy_command(client, cc, clp, dsize) < 0)
+            return STAT_FIN|STAT_CLOSE;
         return 0;
     }
 
-    cmd = parse_command(trim(clp[0]));
     switch (cmd) {
         case CMD_SET:
-            result = set_command(sb, cmdbuf, cc, (const char**)clp);
+            result = set_command(client, cmdbuf, cc, clp);
             break;
         case CMD_ADD:
-            result = add_command(sb, cmdbuf, cc, (const char**)clp);
+            result = add_command(client, cmdbuf, cc, clp);
             break;
         case CMD_REPLACE:
-            result = replace_command(sb, cmdbuf, cc, (const char**)clp);
+            result = replace_command(client, cmdbuf, cc, clp);
             break;
         case CMD_APPEND:
-            result = append_command(sb, cmdbuf, cc, (const char**)clp);
+            result = append_command(client, cmdbuf, cc, clp);
             break;
         case CMD_PREPEND:
-            result = prepend_command(sb, cmdbuf, cc, (const char**)clp);
+            result = prepend_command(client, cmdbuf, cc, clp);
             break;
         case CMD_CAS:
-            result = cas_command(sb, cmdbuf, cc, (const char**)clp);
+            result = cas_command(client, cmdbuf, cc, clp);
             break;
         case CMD_GET:
-            result = get_command(sb, cmdbuf, cc, (const char**)clp);
+            result = get_command(client, cmdbuf, cc, clp);
             break;
         case CMD_GETS:
-            result = gets_command(sb, cmdbuf, cc, (const char**)clp);
+            result = gets_command(client, cmdbuf, cc, clp);
             break;
         case CMD_DELETE:
-            result = delete_command(sb, cmdbuf, cc, (const char**)clp);
+            result = delete_command(client, cmdbuf, cc, clp);
             break;
         case CMD_INCR:
-            result = incr_command(sb, cmdbuf, cc, (const char**)clp);
+            result = incr_command(client, cmdbuf, cc, clp);
             break;
         case CMD_DECR:
-            result = decr_command(sb, cmdbuf, cc, (const char**)clp);
+            result = decr_command(client, cmdbuf, cc, clp);
             break;
         case CMD_STATS:
-            result = stats_command(sb->socket);
+            result = stats_command(client, cc, clp);
             break;
         case CMD_VERSION:
-            result = version_command(sb->socket);
+            result = version_command(client);
             break;
         case CMD_VERBOSITY:
-            result = verbosity_command(sb->socket);
+            result = verbosity_command(client);
+            break;
+        case CMD_META_GET:
+            result = mg_command(client, cc, clp);
+            break;
+        case CMD_META_SET:
+            result = ms_command(client, cc, clp);
+            break;
+        case CMD_META_DELETE:
+            result = md_command(client, cc, clp);
+            break;
+        case CMD_META_ARITHMETIC:
+            result = ma_command(client, cc, clp);
+            break;
+        case CMD_META_NOOP:
+            result = mn_command(client);
             break;
         case CMD_QUIT:
             stat = STAT_CLOSE;
             break;
         case CMD_SHUTDOWN:
         case CMD_STATUS:
+        case CMD_SLOWLOG:
         case CMD_ADDSERVER:
         case CMD_REMOVESERVER:
         case CMD_UNLOCKSERVER: {
             char ip_addr[256];
 
+            /* ソケットへ直接応答するので先行する応答の送信を待ちます。*/
+            client_wait_replies(client);
+
             mt_inet_ntoa(addr, ip_addr);
             if (strcmp(ip_addr, "127.0.0.1") == 0) {
                 if (cmd == CMD_SHUTDOWN) {
@@ -593,12 +1007,14 @@ static unsigned command_gateway(struct sock_buf_t* sb,
                     stat |= STAT_SHUTDOWN;
                 } else if (cmd == CMD_STATUS)
                     status_command(sb->socket);
+                else if (cmd == CMD_SLOWLOG)
+                    slowlog_command(sb->socket);
                 else if (cmd == CMD_ADDSERVER)
-                    result = add_server_command(sb->socket, cc, (const char**)clp);
+                    result = add_server_command(sb->socket, cc, clp);
                 else if (cmd == CMD_REMOVESERVER)
-                    result = remove_server_command(sb->socket, cc, (const char**)clp);
+                    result = remove_server_command(sb->socket, cc, clp);
                 else if (cmd == CMD_UNLOCKSERVER)
-                    result = unlock_server_command(sb->socket, cc, (const char**)clp);
+                    result = unlock_server_command(sb->socket, cc, clp);
             } else {
                 if (reply_error(sb->socket, "illegal command.") < 0)
                     result = -1;
@@ -607,19 +1023,20 @@ static unsigned command_gateway(struct sock_buf_t* sb,
             break;
         }
         case CMD_HASHSERVER:
-            result = hash_command(sb->socket, cc, (const char**)clp);
+            client_wait_replies(client);
+            result = hash_command(sb->socket, cc, clp);
             break;
         case CMD_IMPORTDATA:
-            result = import_command(sb->socket, cc, (const char**)clp);
+            client_wait_replies(client);
+            result = import_command(sb->socket, cc, clp);
             break;
         default: {
             /* エラー応答データ */
-            if (reply_error(sb->socket, "illegal command.") < 0)
+            if (client_error(client, "illegal command.") < 0)
                 result = -1;
             break;
         }
     }
-    list_free(clp);
     return stat;
 }
 
@@ -628,6 +1045,11 @@ static void break_signal()
     SOCKET c_socket;
     const char dummy = 0x30;
 
+    if (g_conf->event_loops > 0) {
+        /* すべてのイベントループを起こします。*/
+        event_loop_wakeup();
+        return;
+    }
     c_socket = sock_connect_server("127.0.0.1", g_conf->port_no);
     if (c_socket == INVALID_SOCKET) {
         err_write("break_signal: can't open socket: %s", strerror(errno));
@@ -637,114 +1059,258 @@ static void break_signal()
     SOCKET_CLOSE(c_socket);
 }
 
-static struct sock_buf_t* socket_buffer(SOCKET socket)
+static struct client_t* socket_client(SOCKET socket)
 {
-    struct sock_buf_t* sb;
-    char sockkey[16];
+    struct client_t* client;
 
-    snprintf(sockkey, sizeof(sockkey), "%d", socket);
-    sb = (struct sock_buf_t*)hash_get(g_sockbuf_hash, sockkey);
-    if (sb == NULL) {
-        err_write("socket_buffer: not found hash key=%d", socket);
+    client = client_table_get(socket);
+    if (client == NULL) {
+        err_write("socket_client: not found socket=%d", socket);
         return NULL;
     }
-    if (sb->socket != socket) {
-        err_write("socket_buffer: illegal socket %d -> %d", socket, sb->socket);
+    if (client->socket != socket) {
+        err_write("socket_client: illegal socket %d -> %d", socket, client->socket);
         return NULL;
     }
-    return sb;
+    return client;
 }
 
-static void socket_cleanup(struct sock_buf_t* sb)
+static void socket_cleanup(struct client_t* client)
 {
-    char sockkey[16];
-
-    sock_event_delete(g_sock_event, sb->socket);
+    sock_event_delete(client->sock_event, client->socket);
+    client_table_remove(client);
 
-    shutdown(sb->socket, 2);  /* 2: RDWR stop */
-    SOCKET_CLOSE(sb->socket);
-
-    snprintf(sockkey, sizeof(sockkey), "%d", sb->socket);
-    if (hash_delete(g_sockbuf_hash, sockkey) < 0)
-        err_write("socket_cleanup: hash_delete fail, key=%s", sockkey);
-    sockbuf_free(sb);
+    /* 実行中のコマンドが存在する場合はすべての応答を送信した後に
+       ソケットがクローズされます。*/
+    client_close(client);
 }
 
-static void memcached_gateway_thread(void* argv)
+/* カーネルの受信バッファにあるバイト数を返します。*/
+static int recv_pending(SOCKET socket)
 {
-    /* argv unuse */
-    struct thread_args_t* th_args;
-    SOCKET socket;
-    struct in_addr addr;
-    struct sock_buf_t* sb;
-    int stat;
-    int end_flag;
-
-    while (! g_shutdown_flag) {
-#ifndef WIN32
-        pthread_mutex_lock(&memcached_queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
-        while (que_empty(g_queue)) {
 #ifdef WIN32
-            WaitForSingleObject(memcached_queue_cond, INFINITE);
+    u_long n = 0;
+
+    if (ioctlsocket(socket, FIONREAD, &n) != 0)
+        return 0;
+    return (int)n;
 #else
-            pthread_cond_wait(&memcached_queue_cond, &memcached_queue_mutex);
-#endif
-        }
-#ifndef WIN32
-        pthread_mutex_unlock(&memcached_queue_mutex);
+    int n = 0;
+
+    if (ioctl(socket, FIONREAD, &n) < 0)
+        return 0;
+    return n;
 #endif
-        /* キューからデータを取り出します。*/
-        th_args = (struct thread_args_t*)que_pop(g_queue);
-        if (th_args == NULL)
-            continue;
+}
+
+/*
+ * イベントループのスレッドでブロックしないで次のコマンドを
+ * 処理できるか調べます。
+ *
+ * コマンド行とデータブロックがソケットバッファとカーネルの
+ * 受信バッファにすべて揃っている場合に処理できると判定します。
+ * 先行する応答の送信を待つ管理コマンドは処理できないと判定します。
+ * 受信データは読み出さないで参照します。
+ *
+ * client: クライアント構造体のポインタ
+ *
+ * 戻り値
+ *  処理できる場合は 1 を返します。
+ *  ワーカスレッドで処理する場合はゼロを返します。
+ */
+static int inline_ready(struct client_t* client)
+{
+    struct sock_buf_t* sb = client->sb;
+    char buf[BUF_SIZE];
+    int avail;
+    int len;
+    char* p;
+    struct cmdline_t cmdl;
+    int cc;
+    int cmd;
+    int ops;
+    int dsize;
 
-        addr = th_args->sockaddr.sin_addr;
-        socket = th_args->client_socket;
+    avail = sb->cur_size + recv_pending(client->socket);
+    len = (sb->cur_size < (int)sizeof(buf))? sb->cur_size : (int)sizeof(buf);
+    memcpy(buf, sb->cur_ptr, len);
+    if (len < (int)sizeof(buf) && avail > len) {
+        int n;
 
-        sb = socket_buffer(socket);
-        if (sb == NULL)
-            continue;
+        n = recv(client->socket, buf + len, sizeof(buf) - len, MSG_PEEK);
+        if (n > 0)
+            len += n;
+    }
 
-        do {
-            end_flag = 0;
-            /* コマンドを受信して処理します。*/
-            /* 'quit'コマンドが入力されると STAT_CLOSE が真になります。*/
-            /* 'shutdown'コマンドが入力されると STAT_SHUTDOWN と
-                STAT_CLOSE が真になります。*/
-            stat = command_gateway(sb, addr);
-
-            if (stat & STAT_CLOSE) {
-                /* ソケットをクローズします。*/
-                if (g_trace_mode) {
-                    char ip_addr[256];
-
-                    mt_inet_ntoa(addr, ip_addr);
-                    TRACE("disconnect to %s, socket=%d, done.\n", ip_addr, sb->socket);
-                }
-                /* ソケットをクローズします。*/
-                socket_cleanup(sb);
-                end_flag = 1;
-            }
+    if (client->protocol == PROTOCOL_BINARY) {
+        unsigned int bodylen;
 
-            if (! end_flag) {
-                if (sb->cur_size < 1)
-                    end_flag = 1;
+        /* ヘッダ(24バイト)の全体長でリクエスト全体が揃っているか判定します。*/
+        if (len < 24)
+            return 0;
+        bodylen = ((unsigned int)(unsigned char)buf[8] << 24) |
+                  ((unsigned int)(unsigned char)buf[9] << 16) |
+                  ((unsigned int)(unsigned char)buf[10] << 8) |
+                  (unsigned int)(unsigned char)buf[11];
+        return ((unsigned int)avail >= 24 + bodylen);
+    }
+
+    p = memchr(buf, '\n', len);
+    if (p == NULL)
+        return 0;   /* コマンド行が揃っていません。*/
+    len = (int)(p - buf) + 1;
+    *p = '\0';
+    if (p > buf && *(p - 1) == '\r')
+        *(p - 1) = '\0';
+
+    cc = cmd_tokenize(buf, &cmdl);
+    if (cc <= 0)
+        return 1;
+    cmd = cmd_lookup(cmdl.cl[0], cmdl.len[0]);
+
+    switch (cmd) {
+        case CMD_SET:
+        case CMD_ADD:
+        case CMD_REPLACE:
+        case CMD_APPEND:
+        case CMD_PREPEND:
+        case CMD_CAS:
+        case CMD_META_SET:
+            /* パラメータに誤りがある場合の読み捨てはワーカスレッドで行います。*/
+            if (admission_size(cmd, cc, (const char**)cmdl.cl, &ops, &dsize) < 0)
+                return 0;
+            return (avail >= len + dsize + (int)strlen(LINE_DELIMITER));
+        case CMD_SHUTDOWN:
+        case CMD_STATUS:
+        case CMD_SLOWLOG:
+        case CMD_ADDSERVER:
+        case CMD_REMOVESERVER:
+        case CMD_UNLOCKSERVER:
+        case CMD_HASHSERVER:
+        case CMD_IMPORTDATA:
+            return 0;
+        default:
+            break;
+    }
+    return 1;
+}
+
+/*
+ * クライアントから受信したコマンドを処理します。
+ *
+ * ソケットバッファが空になるか、実行中のコマンドが多くなって
+ * 受信を中断するまで続けてコマンドを処理します。
+ *
+ * client: クライアント構造体のポインタ
+ * inline_flag: イベントループのスレッドで処理する場合は 1
+ *              イベント通知を無効にしないで処理するため、
+ *              受信を中断する場合のみ無効にします。
+ *              ブロックせずに処理できないコマンドはワーカスレッドへ
+ *              受け渡します。
+ *
+ * 戻り値
+ *  なし
+ */
+static void gateway_request(struct client_t* client, int inline_flag)
+{
+    SOCKET socket = client->socket;
+    struct in_addr addr = client->sockaddr.sin_addr;
+    struct sock_buf_t* sb = client->sb;
+    int stat = 0;
+    int end_flag;
+    int suspend_flag = 0;
+    int handoff_flag = 0;
+
+    do {
+        end_flag = 0;
+        if (inline_flag && ! inline_ready(client)) {
+            /* データブロックの受信や応答待ちでイベントループを
+               止めないようにワーカスレッドで処理します。*/
+            handoff_flag = 1;
+            break;
+        }
+        /* コマンドを受信して処理します。*/
+        /* 'quit'コマンドが入力されると STAT_CLOSE が真になります。*/
+        /* 'shutdown'コマンドが入力されると STAT_SHUTDOWN と
+            STAT_CLOSE が真になります。*/
+        if (client->protocol == PROTOCOL_BINARY)
+            stat = binary_gateway(client, addr);
+        else
+            stat = command_gateway(client, addr);
+
+        if (stat & STAT_CLOSE) {
+            /* ソケットをクローズします。*/
+            if (g_trace_mode) {
+                char ip_addr[256];
+
+                mt_inet_ntoa(addr, ip_addr);
+                TRACE("disconnect to %s, socket=%d, done.\n", ip_addr, socket);
             }
-        } while (! end_flag);
+            /* ソケットをクローズします。*/
+            socket_cleanup(client);
+            end_flag = 1;
+        }
 
-        if (! (stat & STAT_CLOSE)) {
+        if (! end_flag) {
+            if (client_suspend(client)) {
+                /* 実行中のコマンドが多いので受信を中断します。
+                   応答が送信されて実行中のコマンドが少なくなった
+                   時点で再開されます。*/
+                suspend_flag = 1;
+                end_flag = 1;
+            } else if (sb->cur_size < 1)
+                end_flag = 1;
+        }
+    } while (! end_flag);
+
+    if (! (stat & STAT_CLOSE)) {
+        if (inline_flag) {
+            if (suspend_flag || handoff_flag)
+                sock_event_disable(client->sock_event, socket);
+            if (handoff_flag)
+                memcached_gateway_event(socket, client->sockaddr);
+        } else if (! suspend_flag) {
             /* コマンド処理が終了したのでイベント通知を有効にします。*/
-            sock_event_enable(g_sock_event, sb->socket);
+            sock_event_enable(client->sock_event, socket);
         }
+    }
+
+    if (stat & STAT_SHUTDOWN) {
+        g_shutdown_flag = 1;
+        break_signal();
+    }
+}
+
+static void memcached_gateway_thread(void* argv)
+{
+    /* argv: レーン番号 */
+    int lane_no = (int)(long)argv;
+    struct thread_args_t* th_args;
+    struct client_t* client;
+
+    while (! g_shutdown_flag) {
+        /* キューからデータを取り出します。
+           データが入るまで待機します。*/
+        th_args = (struct thread_args_t*)workq_pop(g_queue, lane_no);
+        if (th_args == NULL)
+            break;  /* キューの終了 */
+
+        client = socket_client(th_args->client_socket);
         /* パラメータ領域の解放 */
         free(th_args);
+        if (client == NULL)
+            continue;
 
-        if (stat & STAT_SHUTDOWN) {
-            g_shutdown_flag = 1;
-            break_signal();
+        if (client->resume_flag) {
+            /* 中断していたコマンドの受信を再開します。*/
+            client->resume_flag = 0;
+            if (client->sb->cur_size < 1) {
+                sock_event_enable(client->sock_event, client->socket);
+                continue;
+            }
         }
+
+        gateway_request(client, 0);
     }
 
     /* スレッドを終了します。*/
@@ -767,15 +1333,159 @@ static void create_worker_thread()
            生成されたスレッドはリクエストキューが空のため、
            待機状態に入ります。*/
 #ifdef _WIN32
-        thread_id = _beginthread(memcached_gateway_thread, 0, NULL);
+        thread_id = _beginthread(memcached_gateway_thread, 0, (void*)(long)i);
 #else
-        pthread_create(&thread_id, NULL, (void*)memcached_gateway_thread, NULL);
+        pthread_create(&thread_id, NULL, (void*)memcached_gateway_thread, (void*)(long)i);
         /* スレッドの使用していた領域を終了時に自動的に解放します。*/
         pthread_detach(thread_id);
 #endif
     }
 }
 
+/*
+ * ワーカースレッドのキューの数を返します。
+ *
+ * 戻り値
+ *  キューの件数を返します。
+ */
+int memcached_queue_count()
+{
+    if (g_queue == NULL)
+        return 0;
+    return workq_count(g_queue);
+}
+
+/*
+ * クライアントのリクエストを呼び出したスレッドで処理します。
+ * イベントループ(dinio.event_loops)のスレッドから呼び出されて
+ * ワーカスレッドへの受け渡しを行いません。
+ *
+ * socket: クライアントのソケット
+ *
+ * 戻り値
+ *  なし
+ */
+void memcached_gateway_request(SOCKET socket)
+{
+    struct client_t* client;
+
+    client = socket_client(socket);
+    if (client == NULL)
+        return;
+    gateway_request(client, 1);
+}
+
+/*
+ * リッスンソケットを作成します。
+ *
+ * イベントループ(dinio.event_loops)が有効な場合は SO_REUSEPORT を
+ * 設定して同じポートに複数のソケットを作成できるようにします。
+ * カーネルが接続をソケット毎に振り分けます。
+ *
+ * 戻り値
+ *  ソケットを返します。
+ *  エラーの場合は INVALID_SOCKET を返します。
+ */
+SOCKET memcached_listen_socket()
+{
+    struct sockaddr_in sockaddr;
+#ifdef SO_REUSEPORT
+    SOCKET listen_socket;
+    int on = 1;
+
+    if (g_conf->event_loops < 1)
+        return sock_listen(INADDR_ANY, g_conf->port_no, g_conf->backlog, &sockaddr);
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        err_write("memcached_listen_socket: can't open socket: %s", strerror(errno));
+        return INVALID_SOCKET;
+    }
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)) < 0) {
+        err_write("memcached_listen_socket: SO_REUSEPORT: %s", strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    sockaddr.sin_port = htons(g_conf->port_no);
+    if (bind(listen_socket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+        err_write("memcached_listen_socket: bind error port=%d: %s", g_conf->port_no, strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+    if (listen(listen_socket, g_conf->backlog) < 0) {
+        err_write("memcached_listen_socket: listen error: %s", strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+    return listen_socket;
+#else
+    return sock_listen(INADDR_ANY, g_conf->port_no, g_conf->backlog, &sockaddr);
+#endif
+}
+
+/*
+ * dinio.unix_socket のパスに UNIX ドメインソケットを作成して
+ * リッスンします。
+ * 同じホストのクライアントは TCP を経由しないで接続できます。
+ * パスに残っているソケットファイルは削除してから作成します。
+ * ソケットファイルのパーミッションは dinio.unix_socket_mode です。
+ *
+ * 戻り値
+ *  ソケットを返します。
+ *  エラーの場合は INVALID_SOCKET を返します。
+ */
+static SOCKET unix_listen_socket()
+{
+#ifdef WIN32
+    err_write("memcached_gateway: unix_socket is not supported on this platform.");
+    return INVALID_SOCKET;
+#else
+    SOCKET listen_socket;
+    struct sockaddr_un sockaddr;
+
+    if (strlen(g_conf->unix_socket) >= sizeof(sockaddr.sun_path)) {
+        err_write("memcached_gateway: unix_socket path too long: %s", g_conf->unix_socket);
+        return INVALID_SOCKET;
+    }
+
+    listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        err_write("unix_listen_socket: can't open socket: %s", strerror(errno));
+        return INVALID_SOCKET;
+    }
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    strcpy(sockaddr.sun_path, g_conf->unix_socket);
+    unlink(g_conf->unix_socket);
+    if (bind(listen_socket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+        err_write("unix_listen_socket: bind error %s: %s", g_conf->unix_socket, strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+    /* 接続できるユーザーをファイルのパーミッション
+       (dinio.unix_socket_mode)で制限します。*/
+    if (chmod(g_conf->unix_socket, (mode_t)g_conf->unix_socket_mode) < 0) {
+        err_write("unix_listen_socket: chmod error %s: %s", g_conf->unix_socket, strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        unlink(g_conf->unix_socket);
+        return INVALID_SOCKET;
+    }
+    if (listen(listen_socket, g_conf->backlog) < 0) {
+        err_write("unix_listen_socket: listen error: %s", strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        unlink(g_conf->unix_socket);
+        return INVALID_SOCKET;
+    }
+    return listen_socket;
+#endif
+}
+
 int memcached_gateway_event(SOCKET socket, struct sockaddr_in sockaddr)
 {
     struct thread_args_t* th_args;
@@ -791,35 +1501,22 @@ int memcached_gateway_event(SOCKET socket, struct sockaddr_in sockaddr)
     th_args->sockaddr = sockaddr;
 
     /* リクエストされた情報をキューイング(push)します。*/
-    que_push(g_queue, th_args);
-
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(memcached_queue_cond);
-#else
-    pthread_mutex_lock(&memcached_queue_mutex);
-    pthread_cond_signal(&memcached_queue_cond);
-    pthread_mutex_unlock(&memcached_queue_mutex);
-#endif
+    workq_push(g_queue, th_args);
     return 0;
 }
 
 int memcached_gateway_start()
 {
-    struct sockaddr_in sockaddr;
     char ip_addr[256];
 
     /* メッセージキューの作成 */
-    g_queue = que_initialize();
+    g_queue = workq_initialize(g_conf->worker_threads);
     if (g_queue == NULL)
         return -1;
     TRACE("%s initialized.\n", "event queue");
 
     /* イベントリスニングソケットの作成 */
-    g_listen_socket = sock_listen(INADDR_ANY,
-                                  g_conf->port_no,
-                                  g_conf->backlog,
-                                  &sockaddr);
+    g_listen_socket = memcached_listen_socket();
     if (g_listen_socket == INVALID_SOCKET)
         return -1;  /* error */
 
@@ -830,13 +1527,13 @@ int memcached_gateway_start()
     TRACE("%s port: %d on %s listening ... %d threads\n",
         PROGRAM_NAME, g_conf->port_no, ip_addr, g_conf->worker_threads);
 
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    memcached_queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&memcached_queue_mutex, NULL);
-    pthread_cond_init(&memcached_queue_cond, NULL);
-#endif
+    if (g_conf->unix_socket[0]) {
+        /* UNIX ドメインソケットの作成 */
+        g_unix_socket = unix_listen_socket();
+        if (g_unix_socket == INVALID_SOCKET)
+            return -1;  /* error */
+        TRACE("%s unix socket: %s listening ...\n", PROGRAM_NAME, g_conf->unix_socket);
+    }
 
     /* ワーカースレッドを生成します。 */
     create_worker_thread();
@@ -849,16 +1546,16 @@ void memcached_gateway_end()
         shutdown(g_listen_socket, 2);  /* 2: RDWR stop */
         SOCKET_CLOSE(g_listen_socket);
     }
+    if (g_unix_socket != INVALID_SOCKET) {
+        SOCKET_CLOSE(g_unix_socket);
+#ifndef WIN32
+        unlink(g_conf->unix_socket);
+#endif
+    }
 
     if (g_queue != NULL) {
-        que_finalize(g_queue);
+        workq_finalize(g_queue);
+        g_queue = NULL;
         TRACE("%s terminated.\n", "event queue");
     }
-
-#ifdef WIN32
-    CloseHandle(memcached_queue_cond);
-#else
-    pthread_cond_destroy(&memcached_queue_cond);
-    pthread_mutex_destroy(&memcached_queue_mutex);
-#endif
 }
@@ -0,0 +1,656 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * ゲートウェイ内のニアキャッシュです。
+ *
+ * 参照の多いキーの get の応答("VALUE <key> <flags> <bytes><CRLF>
+ * <data block><CRLF>")をメモリに保持してデータストアへ問い合わせずに
+ * 応答します。gets は <cas> が必要なためキャッシュを使用しません。
+ *
+ * 使用するメモリは dinio.near_cache_size(KB) までに制限されます。
+ * キャッシュは NC_SHARDS 個に分割してそれぞれを LRU で管理します。
+ *
+ * 登録は TinyLFU と同様にキーの参照頻度で判定します。
+ * 参照頻度は 4ビットのカウンタの count-min sketch で近似して、
+ * 参照回数が一定数に達した時点ですべてのカウンタを半分にします。
+ *  ・空きがある場合は参照頻度が NC_ADMIT_FREQ 以上のキーを登録します。
+ *  ・空きがない場合は LRU の最後のキーより参照頻度が高い場合のみ
+ *    追い出して登録します。
+ *
+ * キャッシュは dinio.near_cache_ttl(ms) で期限切れになります。
+ * set, delete, incr, decr などの更新系のコマンドではキーを無効化します。
+ * 無効化はコマンドの受付時とデータストアの更新完了時に行います。
+ * 更新中に実行された get の応答を登録しないように、get の受付時の
+ * 無効化の通番より後にキーが無効化されている場合は登録しません。
+ *
+ * 分散サーバー(dinio.friend_file)が定義されている場合は、
+ * 更新完了時の無効化を informed ポートで分散サーバーへ通知します。
+ * 通知はバックエンドのスレッドでまとめて送信されます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define NC_SHARDS           16
+#define NC_SKETCH_DEPTH     4
+#define NC_COUNTER_MAX      15
+#define NC_ADMIT_FREQ       2       /* 空きがある場合に登録する最小の参照頻度 */
+#define NC_AVG_ENTRY_SIZE   128     /* テーブルサイズを決めるエントリの平均サイズ */
+#define NC_STRIPES          1024    /* 無効化の通番を記録するキーの区分数 */
+#define NC_FORWARD_KEYS     256     /* 一度に通知するキー数 */
+
+/* キャッシュエントリ */
+struct nc_entry_t {
+    struct nc_entry_t* hash_next;
+    struct nc_entry_t* lru_prev;
+    struct nc_entry_t* lru_next;
+    unsigned int hash;
+    int64 expire_time;              /* 期限(usec) */
+    int size;                       /* 使用メモリのバイト数 */
+    int keylen;
+    int blocklen;
+    char* key;
+    char* block;                    /* VALUE行とデータブロック */
+};
+
+/* 分割したキャッシュ */
+struct nc_shard_t {
+    CS_DEF(critical_section);
+    struct nc_entry_t** buckets;
+    unsigned int bucket_mask;
+    struct nc_entry_t* lru_head;    /* 最後に参照したエントリ */
+    struct nc_entry_t* lru_tail;    /* 最も古いエントリ */
+    int64 bytes;
+    int64 max_bytes;
+    int64 items;
+};
+
+static struct nc_shard_t* nc_shards;
+
+/* 参照頻度(count-min sketch) */
+static unsigned char* nc_sketch;
+static unsigned int nc_sketch_mask;
+static int nc_sketch_samples;
+static int nc_sketch_limit;
+static CS_DEF(nc_sketch_lock);
+
+/* 無効化の通番 */
+static int64 nc_sequence;
+static int64 nc_stripes[NC_STRIPES];
+
+/* 分散サーバーへの無効化の通知 */
+static struct queue_t* nc_forward_queue;
+#ifdef WIN32
+static HANDLE nc_forward_cond;
+#else
+static pthread_mutex_t nc_forward_mutex;
+static pthread_cond_t nc_forward_cond;
+#endif
+
+static unsigned int pow2_size(int64 n, unsigned int min_size)
+{
+    unsigned int size = min_size;
+
+    while (size < n && size < 0x40000000)
+        size <<= 1;
+    return size;
+}
+
+static void sketch_reset()
+{
+    unsigned int i;
+    unsigned int n;
+
+    CS_START(&nc_sketch_lock);
+    if (nc_sketch_samples >= nc_sketch_limit) {
+        n = (nc_sketch_mask + 1) * NC_SKETCH_DEPTH;
+        for (i = 0; i < n; i++)
+            nc_sketch[i] >>= 1;
+        nc_sketch_samples /= 2;
+    }
+    CS_END(&nc_sketch_lock);
+}
+
+static unsigned char* sketch_counter(unsigned int hash, int depth)
+{
+    unsigned int h2 = (hash >> 16) | (hash << 16);
+
+    return &nc_sketch[depth * (nc_sketch_mask + 1) + ((hash + depth * h2) & nc_sketch_mask)];
+}
+
+/* キーの参照を記録します。カウンタの競合は近似値として許容します。*/
+static void sketch_increment(unsigned int hash)
+{
+    int i;
+
+    for (i = 0; i < NC_SKETCH_DEPTH; i++) {
+        unsigned char* p = sketch_counter(hash, i);
+
+        if (*p < NC_COUNTER_MAX)
+            (*p)++;
+    }
+    if (++nc_sketch_samples >= nc_sketch_limit)
+        sketch_reset();
+}
+
+static int sketch_estimate(unsigned int hash)
+{
+    int i;
+    int freq = NC_COUNTER_MAX;
+
+    for (i = 0; i < NC_SKETCH_DEPTH; i++) {
+        int n = *sketch_counter(hash, i);
+
+        if (n < freq)
+            freq = n;
+    }
+    return freq;
+}
+
+static struct nc_shard_t* key_shard(unsigned int hash)
+{
+    return &nc_shards[(hash >> 24) % NC_SHARDS];
+}
+
+static struct nc_entry_t* shard_find(struct nc_shard_t* shard,
+                                     unsigned int hash,
+                                     const char* key,
+                                     int keylen)
+{
+    struct nc_entry_t* entry;
+
+    entry = shard->buckets[hash & shard->bucket_mask];
+    while (entry) {
+        if (entry->hash == hash && entry->keylen == keylen &&
+            memcmp(entry->key, key, keylen) == 0)
+            return entry;
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct nc_shard_t* shard, struct nc_entry_t* entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+}
+
+static void lru_push(struct nc_shard_t* shard, struct nc_entry_t* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->lru_prev = entry;
+    else
+        shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+static void shard_remove(struct nc_shard_t* shard, struct nc_entry_t* entry)
+{
+    struct nc_entry_t** pp;
+
+    pp = &shard->buckets[entry->hash & shard->bucket_mask];
+    while (*pp) {
+        if (*pp == entry) {
+            *pp = entry->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->size;
+    shard->items--;
+    free(entry);
+}
+
+/*
+ * ニアキャッシュからキーの応答データを取得します。
+ * キーの参照頻度も記録されます。
+ *
+ * key: キー
+ * mb: 応答データを追加するバッファ
+ *
+ * 戻り値
+ *  キャッシュに存在した場合は 1 を返します。
+ *  存在しない場合はゼロを返します。
+ */
+int near_cache_get(const char* key, struct membuf_t* mb)
+{
+    struct nc_shard_t* shard;
+    struct nc_entry_t* entry;
+    unsigned int hash;
+    int keylen;
+    int hit = 0;
+
+    if (nc_shards == NULL)
+        return 0;
+
+    keylen = strlen(key);
+    hash = ch_hash(key, keylen);
+    sketch_increment(hash);
+
+    shard = key_shard(hash);
+    CS_START(&shard->critical_section);
+    entry = shard_find(shard, hash, key, keylen);
+    if (entry) {
+        if (entry->expire_time < system_time()) {
+            /* 期限切れ */
+            shard_remove(shard, entry);
+        } else {
+            lru_unlink(shard, entry);
+            lru_push(shard, entry);
+            hit = (mb_append(mb, entry->block, entry->blocklen) >= 0);
+        }
+    }
+    CS_END(&shard->critical_section);
+
+    stats_add(hit? STATS_NEAR_CACHE_HITS : STATS_NEAR_CACHE_MISSES, 1);
+    return hit;
+}
+
+static void near_cache_put(const char* key,
+                           int keylen,
+                           const char* block,
+                           int blocklen,
+                           int64 version)
+{
+    struct nc_shard_t* shard;
+    struct nc_entry_t* entry;
+    unsigned int hash;
+    int size;
+    int freq;
+    int64 now;
+
+    hash = ch_hash(key, keylen);
+    if (nc_stripes[hash % NC_STRIPES] > version)
+        return;     /* 問い合わせ中に無効化された */
+
+    /* 参照頻度の低いキーは登録しません。*/
+    freq = sketch_estimate(hash);
+    if (freq < NC_ADMIT_FREQ)
+        return;
+
+    shard = key_shard(hash);
+    size = sizeof(struct nc_entry_t) + keylen + 1 + blocklen;
+    if (size > shard->max_bytes / 8)
+        return;
+
+    now = system_time();
+    CS_START(&shard->critical_section);
+    if (nc_stripes[hash % NC_STRIPES] > version)
+        goto final;
+    if (shard_find(shard, hash, key, keylen))
+        goto final;     /* 期限は延長しません。*/
+
+    while (shard->bytes + size > shard->max_bytes) {
+        struct nc_entry_t* victim = shard->lru_tail;
+
+        if (victim == NULL)
+            break;
+        /* 追い出すキーより参照頻度が高い場合のみ登録します。*/
+        if (victim->expire_time >= now && sketch_estimate(victim->hash) >= freq)
+            goto final;
+        shard_remove(shard, victim);
+        stats_add(STATS_NEAR_CACHE_EVICTIONS, 1);
+    }
+
+    entry = (struct nc_entry_t*)malloc(size);
+    if (entry == NULL) {
+        err_write("near_cache: no memory %d bytes.", size);
+        goto final;
+    }
+    entry->hash = hash;
+    entry->expire_time = now + (int64)g_conf->near_cache_ttl * 1000;
+    entry->size = size;
+    entry->keylen = keylen;
+    entry->blocklen = blocklen;
+    entry->key = (char*)entry + sizeof(struct nc_entry_t);
+    memcpy(entry->key, key, keylen);
+    entry->key[keylen] = '\0';
+    entry->block = entry->key + keylen + 1;
+    memcpy(entry->block, block, blocklen);
+
+    entry->hash_next = shard->buckets[hash & shard->bucket_mask];
+    shard->buckets[hash & shard->bucket_mask] = entry;
+    lru_push(shard, entry);
+    shard->bytes += size;
+    shard->items++;
+
+final:
+    CS_END(&shard->critical_section);
+}
+
+/*
+ * get コマンドの応答データに含まれるキーをニアキャッシュに登録します。
+ *
+ * buf: 応答データ("VALUE ..." の繰り返し)
+ * size: 応答データのバイト数
+ * version: get を受け付けた時点の near_cache_version() の値
+ *
+ * 戻り値
+ *  なし
+ */
+void near_cache_fill(const char* buf, int size, int64 version)
+{
+    const char* p = buf;
+    const char* end = buf + size;
+
+    if (nc_shards == NULL)
+        return;
+
+    while (end - p > 6 && memcmp(p, "VALUE ", 6) == 0) {
+        char tbuf[CMDLINE_SIZE];
+        struct cmdline_t cmdl;
+        const char* eol;
+        int linelen;
+        int blocklen;
+
+        for (eol = p; eol < end - 1; eol++) {
+            if (eol[0] == '\r' && eol[1] == '\n')
+                break;
+        }
+        linelen = eol - p;
+        if (eol >= end - 1 || linelen >= (int)sizeof(tbuf))
+            break;
+        memcpy(tbuf, p, linelen);
+        tbuf[linelen] = '\0';
+
+        /* VALUE <key> <flags> <bytes> */
+        if (cmd_tokenize(tbuf, &cmdl) != 4)
+            break;
+        blocklen = linelen + 2 + atoi(cmdl.cl[3]) + 2;
+        if (blocklen > end - p)
+            break;
+        near_cache_put(cmdl.cl[1], cmdl.len[1], p, blocklen, version);
+        p += blocklen;
+    }
+}
+
+/*
+ * 現在の無効化の通番を返します。
+ * get の受付時に取得して near_cache_fill() に渡します。
+ *
+ * 戻り値
+ *  無効化の通番を返します。
+ */
+int64 near_cache_version()
+{
+    return nc_sequence;
+}
+
+/*
+ * ニアキャッシュのキーを無効化します。
+ *
+ * key: キー
+ * forward_flag: 分散サーバーへ通知する場合は 1
+ *
+ * 戻り値
+ *  なし
+ */
+void near_cache_invalidate(const char* key, int forward_flag)
+{
+    struct nc_shard_t* shard;
+    struct nc_entry_t* entry;
+    unsigned int hash;
+    int keylen;
+
+    if (nc_shards == NULL)
+        return;
+
+    keylen = strlen(key);
+    hash = ch_hash(key, keylen);
+
+    /* 通番を更新してから削除することで問い合わせ中の get の
+       応答が登録されないようにします。*/
+    ATOMIC_ADD64(&nc_sequence, 1);
+    nc_stripes[hash % NC_STRIPES] = nc_sequence;
+
+    shard = key_shard(hash);
+    CS_START(&shard->critical_section);
+    entry = shard_find(shard, hash, key, keylen);
+    if (entry)
+        shard_remove(shard, entry);
+    CS_END(&shard->critical_section);
+
+    if (forward_flag && nc_forward_queue) {
+        char* fkey;
+
+        fkey = strdup(key);
+        if (fkey == NULL) {
+            err_write("near_cache: no memory.");
+            return;
+        }
+        que_push(nc_forward_queue, fkey);
+#ifdef WIN32
+        SetEvent(nc_forward_cond);
+#else
+        pthread_mutex_lock(&nc_forward_mutex);
+        pthread_cond_signal(&nc_forward_cond);
+        pthread_mutex_unlock(&nc_forward_mutex);
+#endif
+    }
+}
+
+/*
+ * ニアキャッシュの使用量を取得します。
+ *
+ * bytes: 使用メモリのバイト数が設定される領域のポインタ
+ * items: キー数が設定される領域のポインタ
+ *
+ * 戻り値
+ *  ニアキャッシュが有効な場合は 1 を返します。
+ *  無効な場合はゼロを返します。
+ */
+int near_cache_usage(int64* bytes, int64* items)
+{
+    int i;
+
+    *bytes = 0;
+    *items = 0;
+    if (nc_shards == NULL)
+        return 0;
+
+    for (i = 0; i < NC_SHARDS; i++) {
+        CS_START(&nc_shards[i].critical_section);
+        *bytes += nc_shards[i].bytes;
+        *items += nc_shards[i].items;
+        CS_END(&nc_shards[i].critical_section);
+    }
+    return 1;
+}
+
+static void forward_thread(void* argv)
+{
+    char* keys[NC_FORWARD_KEYS];
+
+    (void)argv;     /* argv unuse */
+    while (! g_shutdown_flag) {
+        int n = 0;
+        int i;
+
+#ifndef WIN32
+        pthread_mutex_lock(&nc_forward_mutex);
+#endif
+        /* キューにデータが入るまで待機します。*/
+        while (que_empty(nc_forward_queue)) {
+#ifdef WIN32
+            WaitForSingleObject(nc_forward_cond, INFINITE);
+#else
+            pthread_cond_wait(&nc_forward_cond, &nc_forward_mutex);
+#endif
+        }
+#ifndef WIN32
+        pthread_mutex_unlock(&nc_forward_mutex);
+#endif
+        /* キューにあるキーをまとめて通知します。*/
+        while (n < NC_FORWARD_KEYS) {
+            keys[n] = (char*)que_pop(nc_forward_queue);
+            if (keys[n] == NULL)
+                break;
+            n++;
+        }
+        if (n > 0)
+            friend_invalidate_keys(g_friend_list, n, (const char**)keys);
+        for (i = 0; i < n; i++)
+            free(keys[i]);
+    }
+
+    /* スレッドを終了します。*/
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+static int forward_start()
+{
+#ifdef _WIN32
+    uintptr_t thread_id;
+#else
+    pthread_t thread_id;
+#endif
+
+    nc_forward_queue = que_initialize();
+    if (nc_forward_queue == NULL)
+        return -1;
+#ifdef WIN32
+    nc_forward_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+    thread_id = _beginthread(forward_thread, 0, NULL);
+#else
+    pthread_mutex_init(&nc_forward_mutex, NULL);
+    pthread_cond_init(&nc_forward_cond, NULL);
+    pthread_create(&thread_id, NULL, (void*)forward_thread, NULL);
+    /* スレッドの使用していた領域を終了時に自動的に解放します。*/
+    pthread_detach(thread_id);
+#endif
+    return 0;
+}
+
+/*
+ * ニアキャッシュを初期化します。
+ * dinio.near_cache_size がゼロの場合は何もしません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int near_cache_initialize()
+{
+    int64 max_bytes;
+    unsigned int buckets;
+    unsigned int width;
+    int i;
+
+    if (g_conf->near_cache_size < 1)
+        return 0;
+
+    max_bytes = (int64)g_conf->near_cache_size * 1024;
+    buckets = pow2_size(max_bytes / NC_AVG_ENTRY_SIZE / NC_SHARDS, 64);
+    width = pow2_size(max_bytes / NC_AVG_ENTRY_SIZE, 1024);
+
+    nc_sketch = (unsigned char*)calloc(width * NC_SKETCH_DEPTH, sizeof(unsigned char));
+    if (nc_sketch == NULL) {
+        err_write("near_cache: sketch no memory.");
+        return -1;
+    }
+    nc_sketch_mask = width - 1;
+    nc_sketch_samples = 0;
+    nc_sketch_limit = width * 10;
+    CS_INIT(&nc_sketch_lock);
+
+    nc_shards = (struct nc_shard_t*)calloc(NC_SHARDS, sizeof(struct nc_shard_t));
+    if (nc_shards == NULL) {
+        err_write("near_cache: no memory.");
+        return -1;
+    }
+    for (i = 0; i < NC_SHARDS; i++) {
+        struct nc_shard_t* shard = &nc_shards[i];
+
+        shard->buckets = (struct nc_entry_t**)calloc(buckets, sizeof(struct nc_entry_t*));
+        if (shard->buckets == NULL) {
+            err_write("near_cache: no memory.");
+            return -1;
+        }
+        shard->bucket_mask = buckets - 1;
+        shard->max_bytes = max_bytes / NC_SHARDS;
+        CS_INIT(&shard->critical_section);
+    }
+
+    /* 分散サーバーへ無効化を通知するスレッドを開始します。*/
+    if (g_friend_list) {
+        if (forward_start() < 0)
+            return -1;
+    }
+    TRACE("near cache %dKB initialized.\n", g_conf->near_cache_size);
+    return 0;
+}
+
+/*
+ * ニアキャッシュを終了します。
+ *
+ * 戻り値
+ *  なし
+ */
+void near_cache_finalize()
+{
+    int i;
+
+    if (nc_shards) {
+        struct nc_shard_t* shards = nc_shards;
+
+        nc_shards = NULL;
+        for (i = 0; i < NC_SHARDS; i++) {
+            while (shards[i].lru_head)
+                shard_remove(&shards[i], shards[i].lru_head);
+            free(shards[i].buckets);
+            CS_DELETE(&shards[i].critical_section);
+        }
+        free(shards);
+    }
+    if (nc_sketch) {
+        free(nc_sketch);
+        nc_sketch = NULL;
+        CS_DELETE(&nc_sketch_lock);
+    }
+    if (nc_forward_queue) {
+        que_finalize(nc_forward_queue);
+        nc_forward_queue = NULL;
+#ifdef WIN32
+        CloseHandle(nc_forward_cond);
+#else
+        pthread_cond_destroy(&nc_forward_cond);
+        pthread_mutex_destroy(&nc_forward_mutex);
+#endif
+    }
+}
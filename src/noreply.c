@@ -0,0 +1,625 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * 応答を返さない(noreply)更新コマンドをデータストアへ送信します。
+ *
+ * noreply のコマンドはディスパッチキューを経由しないで
+ * データストア毎の送信キューに登録されます。
+ * 送信スレッド(dinio.noreply_threads)は送信キューに溜まった
+ * コマンドを最大 NR_MAX_BATCH 件まとめて send_datav() で送信します。
+ * まとめたコマンドの最後に応答を返すコマンド(NR_BARRIER_CMD)を付加して、
+ * その応答を受信した時点で送信が完了したとします。
+ * ひとつの送信キューを同時に送信するスレッドはひとつなので
+ * 同じデータストアへのコマンドの順番は守られます。
+ *
+ * 送信キューの件数は dinio.noreply_queue_size が上限です。
+ * 上限に達した場合は送信キューに登録しないで
+ * ディスパッチキューから送信します(noreply_overflows)。
+ * 送信できなかったコマンドは次のサーバーへ送信して、
+ * それでも送信できなかった場合は破棄します(noreply_drops)。
+ *
+ * 送信キューのコマンドと同じキーの後続のコマンドは
+ * noreply_sync() で送信を待ってからデータストアへ送信されます。
+ * 送信キューはキーのハッシュ値毎に最後に登録したコマンドの通番を
+ * 保持しているので、送信キューのコマンドを走査せずに待機する通番を求めます。
+ * ハッシュ値が衝突した場合は異なるキーのコマンドの送信も待機します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#define NR_MAX_BATCH    (MAX_SENDVEC / 2 - 1)   /* 一度に送信するコマンド数 */
+#define NR_BARRIER_CMD  "version"               /* 送信したコマンドの処理を確認するコマンド */
+#define NR_WAIT_TIME    1000                /* 送信を待つ間隔(usec) */
+#define NR_SYNC_SLOTS   4096                /* 送信キュー毎の通番の索引数 */
+
+/* 送信キューのコマンド */
+struct nr_item_t {
+    int64 seq;                      /* 登録順の通番 */
+    int cmd_grp;
+    unsigned int hash;              /* キーのハッシュ値 */
+    struct server_t* server;        /* キーを保持しているサーバー */
+    struct reqbuf_t* rb;            /* データブロック(NULLはなし) */
+    char key[MAX_MEMCACHED_KEYSIZE+1];
+    char cmdline[CMDLINE_SIZE+sizeof(LINE_DELIMITER)];
+};
+
+/* データストア毎の送信キュー */
+struct nr_queue_t {
+    char ip[16];
+    int port;
+    SOCKET socket;                  /* 送信専用のソケット */
+    struct nr_item_t* items;        /* リングバッファ */
+    int head;                       /* 先頭の要素番号 */
+    int count;                      /* 送信が完了していない件数 */
+    int sending;                    /* 先頭から送信中の件数 */
+    volatile int64 done_seq;        /* 送信が完了した通番 */
+    int64 last_seq[NR_SYNC_SLOTS];  /* キーのハッシュ値毎の最後に登録した通番 */
+};
+
+static struct nr_queue_t** nr_queues;
+static int nr_queue_num;
+static volatile int nr_pending;     /* 送信が完了していない件数の合計 */
+static volatile int nr_running;     /* 実行中の送信スレッド数 */
+static int nr_stop;
+static int64 nr_seq;
+static CS_DEF(nr_lock);
+
+#ifdef WIN32
+static HANDLE nr_cond;
+#else
+static pthread_mutex_t nr_mutex;
+static pthread_cond_t nr_cond;
+#endif
+
+static void nr_sleep()
+{
+#ifdef WIN32
+    Sleep(NR_WAIT_TIME / 1000);
+#else
+    usleep(NR_WAIT_TIME);
+#endif
+}
+
+static void nr_signal()
+{
+#ifdef WIN32
+    SetEvent(nr_cond);
+#else
+    pthread_mutex_lock(&nr_mutex);
+    pthread_cond_broadcast(&nr_cond);
+    pthread_mutex_unlock(&nr_mutex);
+#endif
+}
+
+/* 送信キューの通番までの送信が完了するまで待機します。*/
+static void nr_wait_done(struct nr_queue_t* q, int64 seq)
+{
+#ifdef WIN32
+    int64 start_time = system_time();
+
+    while (q->done_seq < seq) {
+        if (system_time() - start_time > (int64)g_conf->datastore_timeout * 1000)
+            break;
+        WaitForSingleObject(nr_cond, NR_WAIT_TIME / 1000 + 1);
+    }
+#else
+    struct timeval now;
+    struct timespec timeout;
+    int64 usec;
+
+    gettimeofday(&now, NULL);
+    usec = (int64)now.tv_usec + (int64)g_conf->datastore_timeout * 1000;
+    timeout.tv_sec = now.tv_sec + (time_t)(usec / 1000000);
+    timeout.tv_nsec = (long)(usec % 1000000) * 1000;
+
+    pthread_mutex_lock(&nr_mutex);
+    while (q->done_seq < seq) {
+        if (pthread_cond_timedwait(&nr_cond, &nr_mutex, &timeout) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&nr_mutex);
+#endif
+}
+
+/* サーバーの送信キューを求めます。存在しない場合は作成します。
+   nr_lock を取得して呼び出します。*/
+static struct nr_queue_t* nr_queue(struct server_t* server)
+{
+    struct nr_queue_t* q;
+    int i;
+
+    for (i = 0; i < nr_queue_num; i++) {
+        q = nr_queues[i];
+        if (q->port == server->port && strcmp(q->ip, server->ip) == 0)
+            return q;
+    }
+    if (nr_queue_num >= MAX_SERVER_NUM)
+        return NULL;
+
+    q = (struct nr_queue_t*)calloc(1, sizeof(struct nr_queue_t));
+    if (q == NULL) {
+        err_write("noreply: no memory.");
+        return NULL;
+    }
+    q->items = (struct nr_item_t*)malloc(g_conf->noreply_queue_size * sizeof(struct nr_item_t));
+    if (q->items == NULL) {
+        err_write("noreply: queue no memory.");
+        free(q);
+        return NULL;
+    }
+    strcpy(q->ip, server->ip);
+    q->port = server->port;
+    q->socket = INVALID_SOCKET;
+    q->done_seq = nr_seq;
+    nr_queues[nr_queue_num++] = q;
+    return q;
+}
+
+/* 送信できるコマンドがある送信キューを求めて送信中にします。*/
+static struct nr_queue_t* nr_ready()
+{
+    struct nr_queue_t* q = NULL;
+    int i;
+
+    CS_START(&nr_lock);
+    for (i = 0; i < nr_queue_num; i++) {
+        if (nr_queues[i]->count > 0 && nr_queues[i]->sending == 0) {
+            q = nr_queues[i];
+            q->sending = (q->count > NR_MAX_BATCH)? NR_MAX_BATCH : q->count;
+            break;
+        }
+    }
+    CS_END(&nr_lock);
+    return q;
+}
+
+/* 送信できるコマンドがある送信キューが存在する場合は 1 を返します。*/
+static int nr_has_ready()
+{
+    int i;
+
+    for (i = 0; i < nr_queue_num; i++) {
+        if (nr_queues[i]->count > 0 && nr_queues[i]->sending == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* NR_BARRIER_CMD の応答を受信します。
+   先行するコマンドのエラー応答は読み捨てます。*/
+static int nr_barrier(SOCKET socket, const char* ip, int port)
+{
+    char buf[BUF_SIZE];
+
+    while (1) {
+        if (! wait_recv_data(socket, g_conf->datastore_timeout)) {
+            err_write("noreply: %s:%d recv timeout.", ip, port);
+            return -1;
+        }
+        if (recv_line(socket, buf, sizeof(buf), LINE_DELIMITER) < 0) {
+            err_write("noreply: %s:%d recv error.", ip, port);
+            return -1;
+        }
+        if (strncmp(buf, "VERSION", 7) == 0)
+            break;
+    }
+    return 0;
+}
+
+/* 送信中のコマンドをデータストアへ送信します。*/
+static int nr_send(struct nr_queue_t* q, int n)
+{
+    struct sendvec_t vec[MAX_SENDVEC];
+    int vec_count = 0;
+    int i;
+
+    if (q->socket == INVALID_SOCKET) {
+        q->socket = sock_connect_server(q->ip, q->port);
+        if (q->socket == INVALID_SOCKET) {
+            err_write("noreply: %s:%d can't connect.", q->ip, q->port);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        struct nr_item_t* item = &q->items[(q->head + i) % g_conf->noreply_queue_size];
+
+        vec[vec_count].buf = item->cmdline;
+        vec[vec_count].len = strlen(item->cmdline);
+        vec_count++;
+        if (item->rb && item->rb->size > 0) {
+            vec[vec_count].buf = item->rb->data;
+            vec[vec_count].len = item->rb->size;
+            vec_count++;
+        }
+    }
+    vec[vec_count].buf = NR_BARRIER_CMD LINE_DELIMITER;
+    vec[vec_count].len = strlen(NR_BARRIER_CMD LINE_DELIMITER);
+    vec_count++;
+
+    if (send_datav(q->socket, vec, vec_count) < 0) {
+        err_write("noreply: %s:%d send error.", q->ip, q->port);
+        SOCKET_CLOSE(q->socket);
+        q->socket = INVALID_SOCKET;
+        return -1;
+    }
+    if (nr_barrier(q->socket, q->ip, q->port) < 0) {
+        SOCKET_CLOSE(q->socket);
+        q->socket = INVALID_SOCKET;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 送信できなかったコマンドをキーを保持している次のサーバーへ送信します。
+ * ディスパッチスレッドの再実行と同じく dinio.replications のサーバーまで試行します。
+ *
+ * 戻り値
+ *  送信できた場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int nr_retry(struct nr_item_t* item)
+{
+    struct server_t* server = item->server;
+    int retry;
+
+    for (retry = g_conf->replications; retry > 0; retry--) {
+        struct server_socket_t* ss;
+        struct sendvec_t vec[3];
+        int vec_count = 0;
+        long probe;
+        int result;
+
+        server = ds_next_server(server);
+        if (server == NULL || server == item->server)
+            break;
+        if (ds_check_server(server) < 0)
+            continue;
+        probe = ds_breaker_probe(server);
+        ss = ds_server_socket(server);
+        if (ss == NULL) {
+            ATOMIC_ADD64(&server->error_count, 1);
+            ds_breaker_record(server, probe, -1);
+            continue;
+        }
+        ss->probe = probe;
+
+        vec[vec_count].buf = item->cmdline;
+        vec[vec_count].len = strlen(item->cmdline);
+        vec_count++;
+        if (item->rb && item->rb->size > 0) {
+            vec[vec_count].buf = item->rb->data;
+            vec[vec_count].len = item->rb->size;
+            vec_count++;
+        }
+        vec[vec_count].buf = NR_BARRIER_CMD LINE_DELIMITER;
+        vec[vec_count].len = strlen(NR_BARRIER_CMD LINE_DELIMITER);
+        vec_count++;
+
+        result = send_datav(ss->socket, vec, vec_count);
+        if (result < 0)
+            err_write("noreply: %s:%d send error.", server->ip, server->port);
+        else
+            result = nr_barrier(ss->socket, server->ip, server->port);
+        if (result < 0)
+            ATOMIC_ADD64(&server->error_count, 1);
+        ds_release_socket(server, ss, result);
+        if (result == 0)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * 送信が完了したコマンドを送信キューから取り除きます。
+ * 送信できなかった場合はコマンド毎に次のサーバーへ送信して、
+ * 送信できなかったコマンドを破棄します(noreply_drops)。
+ */
+static void nr_done(struct nr_queue_t* q, int n, int result)
+{
+    int writes = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct nr_item_t* item = &q->items[(q->head + i) % g_conf->noreply_queue_size];
+        int item_result = result;
+
+        if (result < 0) {
+            ATOMIC_ADD64(&item->server->error_count, 1);
+            item_result = nr_retry(item);
+        }
+        if (item_result == 0) {
+            writes++;
+            /* 次のサーバーへ送信した場合は複製先へ書き込んでいるので
+               レプリケーションしません。*/
+            if (result == 0 && g_conf->replications > 0) {
+                if (g_conf->replication_threads > 0)
+                    replication_event_entry(item->server, item->cmd_grp, item->key);
+                else
+                    do_replication(item->server, item->cmd_grp, item->key);
+            }
+            /* 更新したキーのニアキャッシュを無効化します。*/
+            near_cache_invalidate(item->key, 1);
+        } else {
+            err_write("noreply: %s:%d send failed, dropped (%s).",
+                      item->server->ip, item->server->port, item->key);
+        }
+        reqbuf_release(item->rb);
+    }
+    stats_add(STATS_NOREPLY_WRITES, writes);
+    if (writes < n)
+        stats_add(STATS_NOREPLY_DROPS, n - writes);
+
+    CS_START(&nr_lock);
+    q->done_seq = q->items[(q->head + n - 1) % g_conf->noreply_queue_size].seq;
+    q->head = (q->head + n) % g_conf->noreply_queue_size;
+    q->count -= n;
+    q->sending = 0;
+    nr_pending -= n;
+    CS_END(&nr_lock);
+
+    /* noreply_sync() で待機しているスレッドを再開します。*/
+    nr_signal();
+}
+
+static void noreply_thread(void* argv)
+{
+    struct nr_queue_t* q;
+
+    (void)argv;     /* argv unuse */
+    while (1) {
+        q = nr_ready();
+        if (q) {
+            int n = q->sending;
+
+            nr_done(q, n, nr_send(q, n));
+            continue;
+        }
+        if (nr_stop)
+            break;
+#ifdef WIN32
+        WaitForSingleObject(nr_cond, NR_WAIT_TIME / 1000 + 1);
+#else
+        pthread_mutex_lock(&nr_mutex);
+        /* 送信キューにコマンドが登録されるまで待機します。*/
+        while (! nr_has_ready() && ! nr_stop)
+            pthread_cond_wait(&nr_cond, &nr_mutex);
+        pthread_mutex_unlock(&nr_mutex);
+#endif
+    }
+    ATOMIC_DEC(&nr_running);
+
+    /* スレッドを終了します。*/
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+/*
+ * noreply の更新コマンドを送信キューに登録します。
+ * キーを保持しているサーバーが稼動中でない場合と送信キューが一杯の場合は
+ * 登録しないので呼び出し元がディスパッチキューに登録します。
+ *
+ * cmd_grp: コマンドグループ
+ * cmdline: コマンド行
+ * key: キー
+ * rb: データブロックのバッファ(登録した場合は所有権は引き継がれます)
+ * server: キーを保持しているサーバーが設定される領域
+ *
+ * 戻り値
+ *  登録した場合はゼロを返します。
+ *  登録しない場合は 1 を返します。
+ */
+int noreply_entry(int cmd_grp,
+                  const char* cmdline,
+                  const char* key,
+                  struct reqbuf_t* rb,
+                  struct server_t** server)
+{
+    struct server_t* key_server;
+    struct nr_queue_t* q;
+    struct nr_item_t* item;
+
+    if (nr_queues == NULL || nr_stop)
+        return 1;
+
+    key_server = ds_key_server(key, strlen(key));
+    if (key_server == NULL || key_server->status != DSS_ACTIVE)
+        return 1;
+
+    CS_START(&nr_lock);
+    q = nr_queue(key_server);
+    if (q == NULL) {
+        CS_END(&nr_lock);
+        return 1;
+    }
+    if (q->count >= g_conf->noreply_queue_size) {
+        CS_END(&nr_lock);
+        /* 送信キューが一杯の場合は待たずにディスパッチキューから送信します。*/
+        stats_add(STATS_NOREPLY_OVERFLOWS, 1);
+        return 1;
+    }
+
+    item = &q->items[(q->head + q->count) % g_conf->noreply_queue_size];
+    item->seq = ++nr_seq;
+    item->cmd_grp = cmd_grp;
+    item->hash = ch_hash(key, strlen(key));
+    item->server = key_server;
+    item->rb = rb;
+    strcpy(item->key, key);
+    snprintf(item->cmdline, sizeof(item->cmdline), "%s%s", cmdline, LINE_DELIMITER);
+    q->last_seq[item->hash % NR_SYNC_SLOTS] = item->seq;
+    q->count++;
+    nr_pending++;
+    CS_END(&nr_lock);
+
+    nr_signal();
+    *server = key_server;
+    return 0;
+}
+
+/*
+ * 送信キューに同じキーのコマンドが存在する場合は送信が
+ * 完了するまで待機します。
+ * noreply のコマンドの後に送信されたコマンドが追い越さないように
+ * データストアへ送信する前に呼び出します。
+ *
+ * key: キー
+ *
+ * 戻り値
+ *  なし
+ */
+void noreply_sync(const char* key)
+{
+    struct nr_queue_t* wq = NULL;
+    int64 seq = 0;
+    int slot;
+    int i;
+
+    if (nr_pending < 1)
+        return;
+
+    slot = ch_hash(key, strlen(key)) % NR_SYNC_SLOTS;
+    CS_START(&nr_lock);
+    for (i = 0; i < nr_queue_num; i++) {
+        struct nr_queue_t* q = nr_queues[i];
+
+        if (q->last_seq[slot] > q->done_seq && q->last_seq[slot] > seq) {
+            wq = q;
+            seq = q->last_seq[slot];
+        }
+    }
+    CS_END(&nr_lock);
+
+    if (wq)
+        nr_wait_done(wq, seq);
+}
+
+/*
+ * 送信キューの件数を返します。
+ *
+ * 戻り値
+ *  送信が完了していないコマンドの件数を返します。
+ */
+int noreply_queue_count()
+{
+    return nr_pending;
+}
+
+/*
+ * noreply の送信スレッドを開始します。
+ * dinio.noreply_threads がゼロの場合は何もしません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int noreply_initialize()
+{
+    int i;
+
+    if (g_conf->noreply_threads < 1 || g_conf->noreply_queue_size < 1)
+        return 0;
+
+    nr_queues = (struct nr_queue_t**)calloc(MAX_SERVER_NUM, sizeof(struct nr_queue_t*));
+    if (nr_queues == NULL) {
+        err_write("noreply: no memory.");
+        return -1;
+    }
+    nr_queue_num = 0;
+    nr_pending = 0;
+    nr_stop = 0;
+    nr_seq = 0;
+    CS_INIT(&nr_lock);
+#ifdef WIN32
+    nr_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&nr_mutex, NULL);
+    pthread_cond_init(&nr_cond, NULL);
+#endif
+
+    for (i = 0; i < g_conf->noreply_threads; i++) {
+#ifdef _WIN32
+        uintptr_t thread_id;
+#else
+        pthread_t thread_id;
+#endif
+        ATOMIC_INC(&nr_running);
+#ifdef _WIN32
+        thread_id = _beginthread(noreply_thread, 0, NULL);
+#else
+        pthread_create(&thread_id, NULL, (void*)noreply_thread, NULL);
+        /* スレッドの使用していた領域を終了時に自動的に解放します。*/
+        pthread_detach(thread_id);
+#endif
+    }
+    TRACE("%d noreply threads started.\n", g_conf->noreply_threads);
+    return 0;
+}
+
+/*
+ * 送信キューのコマンドをすべて送信してから送信スレッドを終了します。
+ *
+ * 戻り値
+ *  なし
+ */
+void noreply_finalize()
+{
+    int i;
+
+    if (nr_queues == NULL)
+        return;
+
+    nr_stop = 1;
+    while (nr_running > 0) {
+        nr_signal();
+        nr_sleep();
+    }
+
+    for (i = 0; i < nr_queue_num; i++) {
+        struct nr_queue_t* q = nr_queues[i];
+
+        if (q->socket != INVALID_SOCKET)
+            SOCKET_CLOSE(q->socket);
+        free(q->items);
+        free(q);
+    }
+    free(nr_queues);
+    nr_queues = NULL;
+    nr_queue_num = 0;
+
+    CS_DELETE(&nr_lock);
+#ifdef WIN32
+    CloseHandle(nr_cond);
+#else
+    pthread_cond_destroy(&nr_cond);
+    pthread_mutex_destroy(&nr_mutex);
+#endif
+}
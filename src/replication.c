@@ -62,14 +62,7 @@ struct replication_event_t {
     char key[MAX_MEMCACHED_KEYSIZE+1];
 };
 
-static struct queue_t* replication_queue;
-
-#ifdef WIN32
-static HANDLE replication_queue_cond;
-#else
-static pthread_mutex_t replication_queue_mutex;
-static pthread_cond_t replication_queue_cond;
-#endif
+static struct workq_t* replication_queue;
 
 /*
  * レプリケーションを実行します。
@@ -109,6 +102,7 @@ int do_replication(struct server_t* org_server,
         /* サーバーのソケットをプールから取得します。*/
         org_ss = ds_server_socket(org_server);
         if (org_ss) {
+            org_ss->probe = ds_breaker_probe(org_server);
             /* サーバーから更新データを取得します。*/
             datablock = bget_command(org_ss, key, &dbsize);
             if (datablock == NULL) {
@@ -153,6 +147,7 @@ int do_replication(struct server_t* org_server,
 
         if (cmd_grp == CMDGRP_SET) {
             /* サーバーのデータを更新します。*/
+            ss->probe = ds_breaker_probe(server);
             result = bset_command(ss, key, dbsize, datablock);
         } else if (cmd_grp == CMDGRP_DELETE) {
             /* noreply を付加した delete コマンドを送信します。*/
@@ -175,28 +170,16 @@ final:
 
 static void replication_thread(void* argv)
 {
-    /* argv unuse */
+    /* argv: レーン番号 */
+    int lane_no = (int)(long)argv;
     struct replication_event_t* rep_ev;
 
     while (! g_shutdown_flag) {
-#ifndef WIN32
-        pthread_mutex_lock(&replication_queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
-        while (que_empty(replication_queue)) {
-#ifdef WIN32
-            WaitForSingleObject(replication_queue_cond, INFINITE);
-#else
-            pthread_cond_wait(&replication_queue_cond, &replication_queue_mutex);
-#endif
-        }
-#ifndef WIN32
-        pthread_mutex_unlock(&replication_queue_mutex);
-#endif
-        /* キューからデータを取り出します。*/
-        rep_ev = (struct replication_event_t*)que_pop(replication_queue);
+        /* キューからデータを取り出します。
+           データが入るまで待機します。*/
+        rep_ev = (struct replication_event_t*)workq_pop(replication_queue, lane_no);
         if (rep_ev == NULL)
-            continue;
+            break;  /* キューの終了 */
 
         /* レプリケーションの開始を遅延させます。*/
         if (g_conf->replication_delay_time > 0) {
@@ -234,9 +217,9 @@ static void create_replication_threads()
            生成されたスレッドはリクエストキューが空のため、
            待機状態に入ります。*/
 #ifdef _WIN32
-        thread_id = _beginthread(replication_thread, 0, NULL);
+        thread_id = _beginthread(replication_thread, 0, (void*)(long)i);
 #else
-        pthread_create(&thread_id, NULL, (void*)replication_thread, NULL);
+        pthread_create(&thread_id, NULL, (void*)replication_thread, (void*)(long)i);
         /* スレッドの使用していた領域を終了時に自動的に解放します。*/
         pthread_detach(thread_id);
 #endif
@@ -254,7 +237,7 @@ int replication_queue_count()
 {
     if (replication_queue == NULL)
         return 0;
-    return que_count(replication_queue);
+    return workq_count(replication_queue);
 }
 
 int replication_event_entry(struct server_t* org_server,
@@ -277,16 +260,7 @@ int replication_event_entry(struct server_t* org_server,
     strcpy(rep_ev->key, key);
 
     /* レプリケーション情報をキューイング(push)します。*/
-    que_push(replication_queue, rep_ev);
-
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(replication_queue_cond);
-#else
-    pthread_mutex_lock(&replication_queue_mutex);
-    pthread_cond_signal(&replication_queue_cond);
-    pthread_mutex_unlock(&replication_queue_mutex);
-#endif
+    workq_push(replication_queue, rep_ev);
     return 0;
 }
 
@@ -296,19 +270,11 @@ int replication_server_start()
         return 0;
 
     /* メッセージキューの作成 */
-    replication_queue = que_initialize();
+    replication_queue = workq_initialize(g_conf->replication_threads);
     if (replication_queue == NULL)
         return -1;
     TRACE("%s initialized.\n", "replication queue");
 
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    replication_queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&replication_queue_mutex, NULL);
-    pthread_cond_init(&replication_queue_cond, NULL);
-#endif
-
     /* ワーカースレッドを生成します。 */
     create_replication_threads();
     return 0;
@@ -320,14 +286,8 @@ void replication_server_end()
         return;
 
     if (replication_queue != NULL) {
-        que_finalize(replication_queue);
+        workq_finalize(replication_queue);
+        replication_queue = NULL;
         TRACE("%s terminated.\n", "replication queue");
     }
-
-#ifdef WIN32
-    CloseHandle(replication_queue_cond);
-#else
-    pthread_cond_destroy(&replication_queue_cond);
-    pthread_mutex_destroy(&replication_queue_mutex);
-#endif
 }
@@ -0,0 +1,186 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * クライアントから受信したデータブロックを保持するバッファです。
+ *
+ * データブロックはクライアントのソケットバッファから一度だけ
+ * このバッファに受信され、ディスパッチスレッドを経由して
+ * データストアへの送信まで同じ領域が引き渡されます。
+ * ゲートウェイの内部でデータブロックがコピーされることはありません。
+ *
+ * バッファは参照カウントで管理されます。
+ * reqbuf_alloc() で確保された時点の参照カウントは 1 になります。
+ * 参照を追加する場合は reqbuf_ref() を呼び出して、
+ * 不要になった時点で reqbuf_release() を呼び出します。
+ * 参照カウントがゼロになった時点で領域が解放されます。
+ *
+ * データストアへの送信はコマンド行とデータブロックを
+ * send_datav() でまとめて(scatter/gather)送信します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+#ifndef WIN32
+#include <sys/uio.h>
+#include <poll.h>
+#endif
+
+/*
+ * データブロック用のバッファを確保します。
+ *
+ * size: データブロックのバイト数
+ *
+ * 戻り値
+ *  バッファ構造体のポインタを返します。
+ *  メモリ不足の場合は NULL を返します。
+ */
+struct reqbuf_t* reqbuf_alloc(int size)
+{
+    struct reqbuf_t* rb;
+
+    rb = (struct reqbuf_t*)malloc(sizeof(struct reqbuf_t) + size);
+    if (rb == NULL) {
+        err_write("reqbuf_alloc: no memory size=%d.", size);
+        return NULL;
+    }
+    rb->refcount = 1;
+    rb->size = size;
+    return rb;
+}
+
+/*
+ * バッファの参照カウントをインクリメントします。
+ *
+ * rb: バッファ構造体のポインタ
+ *
+ * 戻り値
+ *  バッファ構造体のポインタを返します。
+ */
+struct reqbuf_t* reqbuf_ref(struct reqbuf_t* rb)
+{
+    if (rb)
+        ATOMIC_INC(&rb->refcount);
+    return rb;
+}
+
+/*
+ * バッファの参照カウントをデクリメントします。
+ * 参照カウントがゼロになった場合は領域を解放します。
+ *
+ * rb: バッファ構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void reqbuf_release(struct reqbuf_t* rb)
+{
+    if (rb == NULL)
+        return;
+    if (ATOMIC_DEC(&rb->refcount) == 0)
+        free(rb);
+}
+
+/*
+ * 複数の領域をまとめてソケットへ送信します。
+ * 領域はひとつのバッファに連結されることなく送信されます。
+ *
+ * socket: ソケット
+ * vec: 送信領域の配列
+ * count: 配列の要素数(最大 MAX_SENDVEC)
+ *
+ * 戻り値
+ *  送信したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+int send_datav(SOCKET socket, const struct sendvec_t* vec, int count)
+{
+#ifdef WIN32
+    int i;
+    int total = 0;
+
+    for (i = 0; i < count; i++) {
+        if (vec[i].len < 1)
+            continue;
+        if (send_data(socket, vec[i].buf, vec[i].len) < 0)
+            return -1;
+        total += vec[i].len;
+    }
+    return total;
+#else
+    struct iovec iov[MAX_SENDVEC];
+    struct iovec* iovp = iov;
+    int n = 0;
+    int i;
+    int total = 0;
+
+    if (count > MAX_SENDVEC) {
+        err_write("send_datav: too many vector count=%d.", count);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (vec[i].len < 1)
+            continue;
+        iov[n].iov_base = (void*)vec[i].buf;
+        iov[n].iov_len = vec[i].len;
+        total += vec[i].len;
+        n++;
+    }
+
+    while (n > 0) {
+        ssize_t len;
+
+        len = writev(socket, iovp, n);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* 送信バッファが空くまで待機します。*/
+                struct pollfd pfd;
+
+                pfd.fd = socket;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        /* 送信済みの領域を進めます。*/
+        while (n > 0 && len >= (ssize_t)iovp->iov_len) {
+            len -= iovp->iov_len;
+            iovp++;
+            n--;
+        }
+        if (n > 0 && len > 0) {
+            iovp->iov_base = (char*)iovp->iov_base + len;
+            iovp->iov_len -= len;
+        }
+    }
+    return total;
+#endif
+}
@@ -130,6 +130,7 @@ void status_command(SOCKET socket)
     char stimebuf[128];
     int i;
     int rep_n;
+    int latency_header = 0;
 
     mbuf = mb_alloc(1024);
     if (mbuf == NULL) {
@@ -162,6 +163,82 @@ void status_command(SOCKET socket)
         mb_append(mbuf, buf, strlen(buf));
     }
 
+    /* サーキットブレーカー */
+    if (g_conf->breaker_error_rate > 0) {
+        strcpy(buf, "\nBreaker IP------------- PORT  STATE----- #req #err #trips\n");
+        mb_append(mbuf, buf, strlen(buf));
+        for (i = 0; i < g_dss->num_server; i++) {
+            struct server_t* server;
+
+            server = g_dss->server_list[i];
+            snprintf(buf, sizeof(buf), "        %-15s %5u  %-10s %4ld %4ld %6lld\n",
+                     server->ip,
+                     server->port,
+                     ds_breaker_state(server),
+                     server->breaker_requests,
+                     server->breaker_errors,
+                     server->breaker_trips);
+            mb_append(mbuf, buf, strlen(buf));
+        }
+    }
+
+    /* データストアの応答時間(マイクロ秒) */
+    for (i = 0; i < g_dss->num_server; i++) {
+        struct server_t* server;
+        int grp;
+
+        server = g_dss->server_list[i];
+        for (grp = CMDGRP_SET; grp <= CMDGRP_DELETE; grp++) {
+            struct histogram_t* hist;
+
+            hist = latency_histogram(server, grp, LATENCY_BACKEND);
+            if (hist == NULL || hist->count == 0)
+                continue;
+            if (! latency_header) {
+                strcpy(buf, "\nLatency IP------------- PORT  CMD    p50(us)  p90(us)  p99(us) p999(us)\n");
+                mb_append(mbuf, buf, strlen(buf));
+                latency_header = 1;
+            }
+            snprintf(buf, sizeof(buf), "        %-15s %5u  %-6s %8lld %8lld %8lld %8lld\n",
+                     server->ip,
+                     server->port,
+                     latency_group_name(grp),
+                     hist_percentile(hist, 0.5),
+                     hist_percentile(hist, 0.9),
+                     hist_percentile(hist, 0.99),
+                     hist_percentile(hist, 0.999));
+            mb_append(mbuf, buf, strlen(buf));
+        }
+    }
+
+    /* ホットキー */
+    if (g_conf->hotkeys > 0) {
+        struct hotkey_t* keys;
+
+        keys = (struct hotkey_t*)malloc(g_conf->hotkeys * sizeof(struct hotkey_t));
+        if (keys) {
+            int n;
+
+            n = hotkey_list(keys, g_conf->hotkeys);
+            if (n > 0) {
+                strcpy(buf, "\nHotKey IP------------- PORT  #count---- rate(/s)-- KEY\n");
+                mb_append(mbuf, buf, strlen(buf));
+            }
+            for (i = 0; i < n; i++) {
+                char kbuf[MAX_MEMCACHED_KEYSIZE+128];
+
+                snprintf(kbuf, sizeof(kbuf), "       %-15s %5u  %10lld %10.1f %s\n",
+                         (keys[i].server)? keys[i].server->ip : "-",
+                         (keys[i].server)? keys[i].server->port : 0,
+                         keys[i].count,
+                         keys[i].rate,
+                         keys[i].key);
+                mb_append(mbuf, kbuf, strlen(kbuf));
+            }
+            free(keys);
+        }
+    }
+
     /* レプリケーション情報 */
     rep_n = replication_queue_count();
     if (rep_n > 0) {
@@ -176,6 +253,71 @@ void status_command(SOCKET socket)
     mb_free(mbuf);
 }
 
+/*
+ * ./dinio -slowlog
+ *
+ * 処理時間が dinio.slowlog_time を超えたリクエストを新しい順に表示します。
+ */
+void slowlog_command(SOCKET socket)
+{
+    struct membuf_t* mbuf;
+    struct slowlog_t* logs = NULL;
+    char buf[256];
+    int n = 0;
+    int i;
+
+    mbuf = mb_alloc(1024);
+    if (mbuf == NULL) {
+        reply_error(socket, "no memory.");
+        return;
+    }
+
+    if (slowlog_capacity() > 0) {
+        logs = (struct slowlog_t*)malloc(slowlog_capacity() * sizeof(struct slowlog_t));
+        if (logs)
+            n = slowlog_list(logs, slowlog_capacity());
+    }
+
+    snprintf(buf, sizeof(buf), "slow requests over %d ms, %d recorded.\n",
+             g_conf->slowlog_time, n);
+    mb_append(mbuf, buf, strlen(buf));
+    if (n > 0) {
+        strcpy(buf, "Time--------------- CMD---- total(us) queue(us)  pool(us) backend(us)  send(us) RETRY SERVER-------------- KEY\n");
+        mb_append(mbuf, buf, strlen(buf));
+    }
+    for (i = 0; i < n; i++) {
+        struct slowlog_t* log = &logs[i];
+        char tbuf[128];
+        char sbuf[32];
+        char kbuf[MAX_MEMCACHED_KEYSIZE+256];
+
+        if (log->ip[0])
+            snprintf(sbuf, sizeof(sbuf), "%s:%d", log->ip, log->port);
+        else
+            strcpy(sbuf, "-");
+        snprintf(kbuf, sizeof(kbuf), "%-19s %-7s %9lld %9lld %9lld %11lld %9lld %5d %-21s %s\n",
+                 get_local_datetime(log->time, tbuf, sizeof(tbuf)),
+                 log->cmd,
+                 log->total_usec,
+                 log->queue_usec,
+                 log->pool_usec,
+                 log->backend_usec,
+                 log->send_usec,
+                 log->retries,
+                 sbuf,
+                 log->key);
+        mb_append(mbuf, kbuf, strlen(kbuf));
+    }
+    if (logs)
+        free(logs);
+
+    mb_append(mbuf, LINE_DELIMITER, strlen(LINE_DELIMITER));
+
+    if (send_data(socket, mbuf->buf, mbuf->size) < 0)
+        err_write("slowlog_command: send error: %s", strerror(errno));
+    mb_free(mbuf);
+}
+
 /*
  * ./dinio -shutdown
  *
@@ -453,13 +595,17 @@ final:
     return result;
 }
 
-static int valid_import_command(const char* cmd)
+static int valid_import_command(const char* cmd, int len)
 {
-    return (strcmp(cmd, "set") == 0 ||
-            strcmp(cmd, "add") == 0 ||
-            strcmp(cmd, "replace") == 0 ||
-            strcmp(cmd, "append") == 0 ||
-            strcmp(cmd, "prepend") == 0);
+    switch (cmd_lookup(cmd, len)) {
+        case CMD_SET:
+        case CMD_ADD:
+        case CMD_REPLACE:
+        case CMD_APPEND:
+        case CMD_PREPEND:
+            return 1;
+    }
+    return 0;
 }
 
 static int remove_last_crlf(char* datap)
@@ -499,7 +645,9 @@ int import_command(SOCKET socket, int cn, const char** cl)
     char* datap = NULL;
     char cmdbuf[CMDLINE_SIZE];
     char* cmd_line[6]; /* cmd key flags exptime bytes noreply */
+    struct cmdline_t cmdl;
     int bytes;
+    struct reqbuf_t* rb;
     char cbytes[16];
     char err_msg[256];
     int count = 0;
@@ -533,24 +681,14 @@ int import_command(SOCKET socket, int cn, const char** cl)
     cmd_line[5] = "noreply";
     while (fgets(buf, sizeof(buf), fp) != NULL) {
         int i;
-        char** list;
         int len;
 
         lineno++;
-        if (strlen(buf) == 0)
+        if (remove_last_crlf(buf) == 0)
             continue;
 
         /* コマンド行 */
-        list = split(buf, ' ');
-        if (list == NULL) {
-            snprintf(err_msg, sizeof(err_msg),
-                     "no memory: %s.%s", cl[1], LINE_DELIMITER);
-            send_data(socket, err_msg, strlen(err_msg));
-            result = -1;
-            break;
-        }
-        if (list_count((const char**)list) != 4) {
-            list_free(list);
+        if (cmd_tokenize(buf, &cmdl) != 4) {
             snprintf(err_msg, sizeof(err_msg),
                      "illegal file format: %s line=%d.%s", cl[1], lineno, LINE_DELIMITER);
             send_data(socket, err_msg, strlen(err_msg));
@@ -559,10 +697,9 @@ int import_command(SOCKET socket, int cn, const char** cl)
         }
 
         for (i = 0; i < 4; i++)
-            cmd_line[i] = trim(list[i]);
+            cmd_line[i] = cmdl.cl[i];
 
-        if (! valid_import_command(cmd_line[0])) {
-            list_free(list);
+        if (! valid_import_command(cmdl.cl[0], cmdl.len[0])) {
             snprintf(err_msg, sizeof(err_msg),
                      "illegal command error: %s line=%d.%s", cl[0], lineno, LINE_DELIMITER);
             send_data(socket, err_msg, strlen(err_msg));
@@ -572,7 +709,6 @@ int import_command(SOCKET socket, int cn, const char** cl)
 
         /* データブロック行 */
         if (fgets(datap, MAX_MEMCACHED_DATASIZE, fp) == NULL) {
-            list_free(list);
             snprintf(err_msg, sizeof(err_msg),
                      "data block error: %s line=%d.%s", cl[0], lineno, LINE_DELIMITER);
             send_data(socket, err_msg, strlen(err_msg));
@@ -588,20 +724,29 @@ int import_command(SOCKET socket, int cn, const char** cl)
         snprintf(cmdbuf, sizeof(cmdbuf), "%s %s %s %s %s %s",
                  cmd_line[0], cmd_line[1], cmd_line[2], cmd_line[3], cmd_line[4], cmd_line[5]);
 
+        /* データブロックをディスパッチ用のバッファに設定します。*/
+        rb = reqbuf_alloc(bytes);
+        if (rb == NULL) {
+            snprintf(err_msg, sizeof(err_msg),
+                     "no memory: %s line=%d.%s", cl[1], lineno, LINE_DELIMITER);
+            send_data(socket, err_msg, strlen(err_msg));
+            result = -1;
+            break;
+        }
+        memcpy(rb->data, datap, bytes);
+
         /* データストアに挿入します。*/
-        if (dispatch_event_entry(socket,
+        if (dispatch_event_entry(NULL,
                                  CMDGRP_SET,
                                  cmdbuf,
-                                 6, (const char**)cl,
-                                 bytes, datap) < 0) {
-            list_free(list);
+                                 6, (const char**)cmd_line,
+                                 rb) < 0) {
             snprintf(err_msg, sizeof(err_msg),
                      "command dispatch error: %s line=%d.%s", cl[0], lineno, LINE_DELIMITER);
             send_data(socket, err_msg, strlen(err_msg));
             result = -1;
             break;
         }
-        list_free(list);
         lineno++;
         count++;
     }
@@ -0,0 +1,166 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * 処理時間が dinio.slowlog_time を超えたリクエストを記録します。
+ *
+ * 記録は dinio.slowlog_size 件の固定長のリングバッファに
+ * ロックを使用せずに書き込みます。書き込む位置は通番をアトミックに
+ * 加算して決め、古い記録から上書きします。
+ *
+ * スロットの通番は書き込み中はゼロにして、書き込みが完了した時点で
+ * 通番を設定します。読み込みはコピーの前後で通番が変わっていない
+ * スロットだけを採用するので、書き込み中の記録は読み捨てられます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+
+struct sl_slot_t {
+    volatile long seq;          /* 書き込んだ通番(ゼロは書き込み中) */
+    struct slowlog_t log;
+};
+
+static struct sl_slot_t* sl_ring;
+static int sl_size;
+static volatile long sl_seq;    /* 最後に割り当てた通番 */
+
+static struct sl_slot_t* ring_slot(long seq)
+{
+    return &sl_ring[(unsigned long)(seq - 1) % sl_size];
+}
+
+/*
+ * 処理時間が閾値を超えたリクエストを記録します。
+ *
+ * log: リクエストの記録
+ *
+ * 戻り値
+ *  なし
+ */
+void slowlog_record(const struct slowlog_t* log)
+{
+    struct sl_slot_t* slot;
+    long seq;
+
+    if (sl_ring == NULL)
+        return;
+
+    seq = ATOMIC_INC(&sl_seq);
+    slot = ring_slot(seq);
+    slot->seq = 0;
+    MEMORY_BARRIER();
+    memcpy(&slot->log, log, sizeof(struct slowlog_t));
+    MEMORY_BARRIER();
+    slot->seq = seq;
+}
+
+/*
+ * 記録されているリクエストを新しい順に求めます。
+ *
+ * list: 記録を設定する配列
+ * max_num: 配列の要素数
+ *
+ * 戻り値
+ *  設定した記録数を返します。
+ */
+int slowlog_list(struct slowlog_t* list, int max_num)
+{
+    long last;
+    long seq;
+    int n = 0;
+
+    if (sl_ring == NULL)
+        return 0;
+
+    last = sl_seq;
+    for (seq = last; seq > 0 && seq > last - sl_size && n < max_num; seq--) {
+        struct sl_slot_t* slot = ring_slot(seq);
+
+        if (slot->seq != seq)
+            continue;
+        MEMORY_BARRIER();
+        memcpy(&list[n], &slot->log, sizeof(struct slowlog_t));
+        MEMORY_BARRIER();
+        if (slot->seq != seq)
+            continue;   /* コピー中に上書きされた */
+        n++;
+    }
+    return n;
+}
+
+/*
+ * 記録できるリクエスト数を返します。
+ *
+ * 戻り値
+ *  記録数を返します。記録しない場合はゼロを返します。
+ */
+int slowlog_capacity()
+{
+    if (sl_ring == NULL)
+        return 0;
+    return sl_size;
+}
+
+/*
+ * スローログを初期化します。
+ * dinio.slowlog_time または dinio.slowlog_size がゼロの場合は何もしません。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int slowlog_initialize()
+{
+    if (g_conf->slowlog_time < 1 || g_conf->slowlog_size < 1)
+        return 0;
+
+    sl_ring = (struct sl_slot_t*)calloc(g_conf->slowlog_size, sizeof(struct sl_slot_t));
+    if (sl_ring == NULL) {
+        err_write("slowlog: no memory.");
+        return -1;
+    }
+    sl_size = g_conf->slowlog_size;
+    sl_seq = 0;
+    return 0;
+}
+
+/*
+ * スローログを終了します。
+ *
+ * 戻り値
+ *  なし
+ */
+void slowlog_finalize()
+{
+    if (sl_ring) {
+        struct sl_slot_t* ring = sl_ring;
+
+        sl_ring = NULL;
+        free(ring);
+    }
+}
@@ -0,0 +1,627 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * memcached 互換の統計情報を収集します。
+ *
+ * カウンタはスレッド毎のスロットに分けて加算します。
+ * スロットはスレッドが最初に加算したときに割り当てられて、
+ * キャッシュラインを共有しないように配置されます。
+ * スレッド数がスロット数を超えた場合はスロットを共有するため
+ * 加算はアトミックに行います。
+ * 統計値はすべてのスロットを合計して求めます。
+ *
+ * stats コマンドでは以下の引数を指定できます。
+ *  (なし)   : memcached と同じ項目
+ *             bytes, curr_items などのデータ量はデータストアの
+ *             stats を合計した値になります。
+ *  servers  : データストア毎の状態とコマンド数
+ *  latency  : データストア毎のコマンドの応答時間
+ *             コマンドグループと区間(pool, backend, send)毎の
+ *             p50, p90, p99, p999 をマイクロ秒で返します。
+ *  queues   : 内部キューの件数
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dinio.h"
+#include <stdarg.h>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#define STATS_SLOTS         64
+#define STATS_SLOT_SIZE     ((STATS_COUNTERS + 7) / 8 * 8)  /* 64バイトの倍数になるカウンタ数 */
+
+struct stats_slot_t {
+    int64 counter[STATS_SLOT_SIZE];
+};
+
+static struct stats_slot_t stats_slots[STATS_SLOTS];
+static volatile long slot_seq;
+
+#ifdef WIN32
+static DWORD slot_key;
+#else
+static pthread_key_t slot_key;
+#endif
+
+/* データストアの stats から合計する項目 */
+static const char* backend_stat_names[] = {
+    "bytes",
+    "curr_items",
+    "total_items",
+    "evictions",
+    "reclaimed",
+    "limit_maxbytes",
+    NULL
+};
+
+#define BACKEND_STATS  6
+
+/* 呼び出したスレッドのスロットを返します。*/
+static struct stats_slot_t* current_slot()
+{
+    long n;
+
+#ifdef WIN32
+    n = (long)(intptr_t)TlsGetValue(slot_key);
+#else
+    n = (long)(intptr_t)pthread_getspecific(slot_key);
+#endif
+    if (n == 0) {
+        n = ATOMIC_INC(&slot_seq);
+#ifdef WIN32
+        TlsSetValue(slot_key, (void*)(intptr_t)n);
+#else
+        pthread_setspecific(slot_key, (void*)(intptr_t)n);
+#endif
+    }
+    return &stats_slots[(n - 1) % STATS_SLOTS];
+}
+
+/*
+ * 統計カウンタに加算します。
+ *
+ * id: カウンタ(STATS_xxx)
+ * n: 加算する値(負の値も指定できます)
+ *
+ * 戻り値
+ *  なし
+ */
+void stats_add(int id, int64 n)
+{
+    struct stats_slot_t* slot;
+
+    slot = current_slot();
+    ATOMIC_ADD64(&slot->counter[id], n);
+}
+
+static int64 stats_get(int id)
+{
+    int64 n = 0;
+    int i;
+
+    for (i = 0; i < STATS_SLOTS; i++)
+        n += stats_slots[i].counter[id];
+    return n;
+}
+
+static int first_token_cmd(const char* cmdline)
+{
+    int len;
+
+    len = strcspn(cmdline, " ");
+    return cmd_lookup(cmdline, len);
+}
+
+/*
+ * ディスパッチするコマンドのコマンド数を加算します。
+ *
+ * cmdline: コマンド行
+ * cn: コマンド行の要素数
+ *
+ * 戻り値
+ *  なし
+ */
+void stats_request(const char* cmdline, int cn)
+{
+    switch (first_token_cmd(cmdline)) {
+        case CMD_GET:
+        case CMD_GETS:
+            stats_add(STATS_CMD_GET, cn - 1);
+            break;
+        case CMD_SET:
+        case CMD_ADD:
+        case CMD_REPLACE:
+        case CMD_APPEND:
+        case CMD_PREPEND:
+        case CMD_CAS:
+            stats_add(STATS_CMD_SET, 1);
+            break;
+    }
+}
+
+/*
+ * データストアからの更新系コマンドの応答から hit/miss を加算します。
+ *
+ * cmdline: コマンド行
+ * line: データストアの応答行
+ *
+ * 戻り値
+ *  なし
+ */
+void stats_reply(const char* cmdline, const char* line)
+{
+    int num_flag;
+
+    num_flag = (line[0] >= '0' && line[0] <= '9');
+    switch (first_token_cmd(cmdline)) {
+        case CMD_DELETE:
+            if (stricmp(line, "DELETED") == 0)
+                stats_add(STATS_DELETE_HITS, 1);
+            else if (stricmp(line, "NOT_FOUND") == 0)
+                stats_add(STATS_DELETE_MISSES, 1);
+            break;
+        case CMD_INCR:
+            if (num_flag)
+                stats_add(STATS_INCR_HITS, 1);
+            else if (stricmp(line, "NOT_FOUND") == 0)
+                stats_add(STATS_INCR_MISSES, 1);
+            break;
+        case CMD_DECR:
+            if (num_flag)
+                stats_add(STATS_DECR_HITS, 1);
+            else if (stricmp(line, "NOT_FOUND") == 0)
+                stats_add(STATS_DECR_MISSES, 1);
+            break;
+        case CMD_CAS:
+            if (stricmp(line, "STORED") == 0)
+                stats_add(STATS_CAS_HITS, 1);
+            else if (stricmp(line, "EXISTS") == 0)
+                stats_add(STATS_CAS_BADVAL, 1);
+            else if (stricmp(line, "NOT_FOUND") == 0)
+                stats_add(STATS_CAS_MISSES, 1);
+            break;
+    }
+}
+
+static void stat_append(struct membuf_t* mb, const char* fmt, ...)
+{
+    char str[512];
+    va_list argptr;
+
+    va_start(argptr, fmt);
+    vsnprintf(str, sizeof(str), fmt, argptr);
+    va_end(argptr);
+    mb_append(mb, str, strlen(str));
+    mb_append(mb, LINE_DELIMITER, strlen(LINE_DELIMITER));
+}
+
+static int64 str_int64(const char* str)
+{
+    int64 n = 0;
+
+    while (*str >= '0' && *str <= '9')
+        n = n * 10 + (*str++ - '0');
+    return n;
+}
+
+/*
+ * データストアの stats から backend_stat_names の値を取得します。
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int backend_stats(struct server_t* server, int64* vals)
+{
+    struct server_socket_t* ss;
+    char cmd[16];
+    int result = -1;
+
+    if (ds_check_server(server) < 0)
+        return -1;
+    ss = ds_server_socket(server);
+    if (ss == NULL)
+        return -1;
+    ss->probe = ds_breaker_probe(server);
+
+    snprintf(cmd, sizeof(cmd), "stats%s", LINE_DELIMITER);
+    if (send_data(ss->socket, cmd, strlen(cmd)) < 0)
+        goto final;
+    if (g_conf->datastore_timeout >= 0) {
+        if (! wait_recv_data(ss->socket, g_conf->datastore_timeout))
+            goto final;
+    }
+
+    /* STAT <name> <value><CRLF>
+       ...
+       END<CRLF> */
+    while (1) {
+        char buf[BUF_SIZE];
+        struct cmdline_t cmdl;
+        int i;
+
+        if (recv_line(ss->socket, buf, sizeof(buf), LINE_DELIMITER) < 0)
+            goto final;
+        if (strcmp(buf, "END") == 0)
+            break;
+        if (cmd_tokenize(buf, &cmdl) != 3 || strcmp(cmdl.cl[0], "STAT") != 0)
+            goto final;     /* stats をサポートしていない */
+        for (i = 0; backend_stat_names[i]; i++) {
+            if (strcmp(cmdl.cl[1], backend_stat_names[i]) == 0) {
+                vals[i] = str_int64(cmdl.cl[2]);
+                break;
+            }
+        }
+    }
+    result = 0;
+
+final:
+    ds_release_socket(server, ss, result);
+    return result;
+}
+
+static const char* server_status(struct server_t* server)
+{
+    switch (server->status) {
+        case DSS_PREPARE:
+            return "PREPARE";
+        case DSS_ACTIVE:
+            return "ACTIVE";
+        case DSS_INACTIVE:
+            return "INACTIVE";
+        case DSS_LOCKED:
+            return "LOCKED";
+    }
+    return "UNKNOWN";
+}
+
+static void general_stats(struct membuf_t* mb)
+{
+    unsigned int nowsec;
+    int i;
+    int64 vals[BACKEND_STATS];
+    int backends = 0;
+    int64 get_hits;
+    int64 get_misses;
+
+    nowsec = system_seconds();
+    get_hits = stats_get(STATS_GET_HITS);
+    get_misses = stats_get(STATS_GET_MISSES);
+
+    /* データストアのデータ量を合計します。*/
+    memset(vals, 0, sizeof(vals));
+    for (i = 0; i < g_dss->num_server; i++) {
+        int64 sv[BACKEND_STATS];
+        int j;
+
+        memset(sv, 0, sizeof(sv));
+        if (backend_stats(g_dss->server_list[i], sv) < 0)
+            continue;
+        for (j = 0; j < BACKEND_STATS; j++)
+            vals[j] += sv[j];
+        backends++;
+    }
+
+    stat_append(mb, "STAT pid %d", getpid());
+    stat_append(mb, "STAT uptime %u", (nowsec - (unsigned int)(g_start_time/1000000)));
+    stat_append(mb, "STAT time %u", nowsec);
+    stat_append(mb, "STAT version %s", PROGRAM_VERSION);
+    stat_append(mb, "STAT pointer_size %u", (unsigned int)sizeof(void*) * 8);
+#ifdef WIN32
+    stat_append(mb, "STAT rusage_user %s", "N/A");
+    stat_append(mb, "STAT rusage_system %s", "N/A");
+#else
+    {
+        struct rusage usage;
+
+        getrusage(RUSAGE_SELF, &usage);
+        stat_append(mb, "STAT rusage_user %ld.%06ld",
+                    (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec);
+        stat_append(mb, "STAT rusage_system %ld.%06ld",
+                    (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec);
+    }
+#endif
+    stat_append(mb, "STAT curr_connections %lld", stats_get(STATS_CURR_CONNECTIONS));
+    stat_append(mb, "STAT total_connections %lld", stats_get(STATS_TOTAL_CONNECTIONS));
+    stat_append(mb, "STAT connection_structures %lld", stats_get(STATS_CURR_CONNECTIONS));
+    stat_append(mb, "STAT cmd_get %lld", stats_get(STATS_CMD_GET));
+    stat_append(mb, "STAT cmd_set %lld", stats_get(STATS_CMD_SET));
+    stat_append(mb, "STAT cmd_flush %d", 0);
+    stat_append(mb, "STAT get_hits %lld", get_hits);
+    stat_append(mb, "STAT get_misses %lld", get_misses);
+    stat_append(mb, "STAT get_coalesced %lld", stats_get(STATS_GET_COALESCED));
+    stat_append(mb, "STAT hedged_gets %lld", stats_get(STATS_HEDGED_GETS));
+    stat_append(mb, "STAT hedge_wins %lld", stats_get(STATS_HEDGE_WINS));
+    stat_append(mb, "STAT hedge_rate %.2f",
+                (stats_get(STATS_CMD_GET) > 0)?
+                stats_get(STATS_HEDGED_GETS) * 100.0 / stats_get(STATS_CMD_GET) : 0.0);
+    stat_append(mb, "STAT delete_misses %lld", stats_get(STATS_DELETE_MISSES));
+    stat_append(mb, "STAT delete_hits %lld", stats_get(STATS_DELETE_HITS));
+    stat_append(mb, "STAT incr_misses %lld", stats_get(STATS_INCR_MISSES));
+    stat_append(mb, "STAT incr_hits %lld", stats_get(STATS_INCR_HITS));
+    stat_append(mb, "STAT decr_misses %lld", stats_get(STATS_DECR_MISSES));
+    stat_append(mb, "STAT decr_hits %lld", stats_get(STATS_DECR_HITS));
+    stat_append(mb, "STAT cas_misses %lld", stats_get(STATS_CAS_MISSES));
+    stat_append(mb, "STAT cas_hits %lld", stats_get(STATS_CAS_HITS));
+    stat_append(mb, "STAT cas_badval %lld", stats_get(STATS_CAS_BADVAL));
+    stat_append(mb, "STAT auth_cmds %d", 0);
+    stat_append(mb, "STAT auth_errors %d", 0);
+    stat_append(mb, "STAT bytes_read %lld", stats_get(STATS_BYTES_READ));
+    stat_append(mb, "STAT bytes_written %lld", stats_get(STATS_BYTES_WRITTEN));
+    stat_append(mb, "STAT accepting_conns %d", 1);
+    stat_append(mb, "STAT listen_disabled_num %d", 0);
+    stat_append(mb, "STAT threads %d", g_conf->worker_threads);
+    stat_append(mb, "STAT conn_yields %lld", stats_get(STATS_CONN_YIELDS));
+    stat_append(mb, "STAT noreply_writes %lld", stats_get(STATS_NOREPLY_WRITES));
+    stat_append(mb, "STAT noreply_overflows %lld", stats_get(STATS_NOREPLY_OVERFLOWS));
+    stat_append(mb, "STAT noreply_drops %lld", stats_get(STATS_NOREPLY_DROPS));
+    stat_append(mb, "STAT throttled %lld", stats_get(STATS_THROTTLED));
+
+    /* ニアキャッシュ */
+    if (g_conf->near_cache_size > 0) {
+        int64 nc_bytes = 0;
+        int64 nc_items = 0;
+
+        near_cache_usage(&nc_bytes, &nc_items);
+        stat_append(mb, "STAT near_cache_hits %lld", stats_get(STATS_NEAR_CACHE_HITS));
+        stat_append(mb, "STAT near_cache_misses %lld", stats_get(STATS_NEAR_CACHE_MISSES));
+        stat_append(mb, "STAT near_cache_evictions %lld", stats_get(STATS_NEAR_CACHE_EVICTIONS));
+        stat_append(mb, "STAT near_cache_bytes %lld", nc_bytes);
+        stat_append(mb, "STAT near_cache_items %lld", nc_items);
+        stat_append(mb, "STAT near_cache_limit_maxbytes %lld", (int64)g_conf->near_cache_size * 1024);
+    }
+
+    /* データストアの合計 */
+    for (i = 0; backend_stat_names[i]; i++) {
+        if (backends > 0)
+            stat_append(mb, "STAT %s %lld", backend_stat_names[i], vals[i]);
+        else
+            stat_append(mb, "STAT %s %s", backend_stat_names[i], "N/A");
+    }
+}
+
+static void servers_stats(struct membuf_t* mb)
+{
+    int i;
+
+    for (i = 0; i < g_dss->num_server; i++) {
+        struct server_t* server;
+        int64 vals[BACKEND_STATS];
+        int j;
+
+        server = g_dss->server_list[i];
+        stat_append(mb, "STAT %s:%d:status %s", server->ip, server->port, server_status(server));
+        stat_append(mb, "STAT %s:%d:scale_factor %d", server->ip, server->port, server->scale_factor);
+        stat_append(mb, "STAT %s:%d:cmd_set %lld", server->ip, server->port, server->set_count);
+        stat_append(mb, "STAT %s:%d:cmd_get %lld", server->ip, server->port, server->get_count);
+        stat_append(mb, "STAT %s:%d:cmd_delete %lld", server->ip, server->port, server->del_count);
+        stat_append(mb, "STAT %s:%d:errors %lld", server->ip, server->port, server->error_count);
+        stat_append(mb, "STAT %s:%d:breaker %s", server->ip, server->port, ds_breaker_state(server));
+        stat_append(mb, "STAT %s:%d:breaker_trips %lld", server->ip, server->port, server->breaker_trips);
+
+        memset(vals, 0, sizeof(vals));
+        if (backend_stats(server, vals) == 0) {
+            for (j = 0; backend_stat_names[j]; j++)
+                stat_append(mb, "STAT %s:%d:%s %lld",
+                            server->ip, server->port, backend_stat_names[j], vals[j]);
+        }
+    }
+}
+
+/* 記録があるヒストグラムのパーセンタイル値を追加します。*/
+static void histogram_stats(struct membuf_t* mb, const char* prefix, struct server_t* server)
+{
+    int grp, phase;
+
+    for (grp = CMDGRP_SET; grp <= CMDGRP_DELETE; grp++) {
+        for (phase = 0; phase < LATENCY_PHASES; phase++) {
+            struct histogram_t* hist;
+            char name[256];
+
+            hist = latency_histogram(server, grp, phase);
+            if (hist == NULL || hist->count == 0)
+                continue;
+            snprintf(name, sizeof(name), "%s:%s:%s",
+                     prefix, latency_group_name(grp), latency_phase_name(phase));
+            stat_append(mb, "STAT %s:count %lld", name, hist->count);
+            stat_append(mb, "STAT %s:p50 %lld", name, hist_percentile(hist, 0.5));
+            stat_append(mb, "STAT %s:p90 %lld", name, hist_percentile(hist, 0.9));
+            stat_append(mb, "STAT %s:p99 %lld", name, hist_percentile(hist, 0.99));
+            stat_append(mb, "STAT %s:p999 %lld", name, hist_percentile(hist, 0.999));
+        }
+    }
+}
+
+static void latency_stats(struct membuf_t* mb)
+{
+    int i;
+
+    histogram_stats(mb, "total", NULL);
+
+    for (i = 0; i < g_dss->num_server; i++) {
+        struct server_t* server;
+        int64 count;
+        char prefix[256];
+
+        server = g_dss->server_list[i];
+        count = server->set_count + server->get_count + server->del_count + server->error_count;
+        stat_append(mb, "STAT %s:%d:commands %lld", server->ip, server->port, count);
+        stat_append(mb, "STAT %s:%d:avg_usec %lld", server->ip, server->port,
+                    (count > 0)? server->cmd_time / count : 0);
+
+        snprintf(prefix, sizeof(prefix), "%s:%d", server->ip, server->port);
+        histogram_stats(mb, prefix, server);
+    }
+}
+
+static void hotkeys_stats(struct membuf_t* mb)
+{
+    struct hotkey_t* keys;
+    int n, i;
+
+    if (g_conf->hotkeys < 1)
+        return;
+    keys = (struct hotkey_t*)malloc(g_conf->hotkeys * sizeof(struct hotkey_t));
+    if (keys == NULL) {
+        err_write("stats: no memory.");
+        return;
+    }
+    n = hotkey_list(keys, g_conf->hotkeys);
+    for (i = 0; i < n; i++) {
+        stat_append(mb, "STAT hotkey:%d:key %s", i+1, keys[i].key);
+        if (keys[i].server)
+            stat_append(mb, "STAT hotkey:%d:server %s:%d", i+1, keys[i].server->ip, keys[i].server->port);
+        stat_append(mb, "STAT hotkey:%d:count %lld", i+1, keys[i].count);
+        stat_append(mb, "STAT hotkey:%d:rate %.1f", i+1, keys[i].rate);
+    }
+    free(keys);
+}
+
+static void clients_stats(struct membuf_t* mb)
+{
+    struct client_stat_t* list;
+    int max_num;
+    int n, i;
+
+    max_num = admission_capacity();
+    if (max_num < 1)
+        return;
+    list = (struct client_stat_t*)malloc(max_num * sizeof(struct client_stat_t));
+    if (list == NULL) {
+        err_write("stats: no memory.");
+        return;
+    }
+    n = admission_list(list, max_num);
+    for (i = 0; i < n; i++) {
+        char ip_addr[256];
+
+        mt_inet_ntoa(list[i].addr, ip_addr);
+        stat_append(mb, "STAT client:%s:requests %lld", ip_addr, list[i].requests);
+        stat_append(mb, "STAT client:%s:throttled %lld", ip_addr, list[i].throttled);
+    }
+    free(list);
+}
+
+static void queues_stats(struct membuf_t* mb)
+{
+    int64 writes;
+    int64 requests;
+    int batch_max;
+
+    stat_append(mb, "STAT worker_queue %d", memcached_queue_count());
+    stat_append(mb, "STAT dispatch_queue %d", dispatch_queue_count());
+    stat_append(mb, "STAT noreply_queue %d", noreply_queue_count());
+    stat_append(mb, "STAT replication_queue %d", replication_queue_count());
+    stat_append(mb, "STAT clients %lld", stats_get(STATS_CURR_CONNECTIONS));
+    stat_append(mb, "STAT inflight %d", dispatch_inflight_count());
+    stat_append(mb, "STAT backend_io %d", backend_io_count());
+    stat_append(mb, "STAT backend_conns %d", backend_io_conns());
+
+    backend_io_write_stats(&writes, &requests, &batch_max);
+    stat_append(mb, "STAT backend_writes %lld", writes);
+    stat_append(mb, "STAT backend_write_requests %lld", requests);
+    stat_append(mb, "STAT backend_writes_per_request %.2f",
+                (requests > 0)? (double)writes / requests : 0.0);
+    stat_append(mb, "STAT backend_write_batch_avg %.2f",
+                (writes > 0)? (double)requests / writes : 0.0);
+    stat_append(mb, "STAT backend_write_batch_max %d", batch_max);
+}
+
+/*
+ * stats コマンドの応答データ("STAT <name> <value>" の行と "END")を
+ * 作成します。
+ * バイナリプロトコルの stat コマンドでも使用されます。
+ *
+ * arg: stats の引数(NULLの場合は引数なし)
+ *
+ * 戻り値
+ *  応答データのバッファを返します。
+ *  引数が不正な場合やメモリ不足の場合は NULL を返します。
+ */
+struct membuf_t* stats_report(const char* arg)
+{
+    struct membuf_t* mb;
+
+    if (arg && strcmp(arg, "servers") != 0 &&
+               strcmp(arg, "latency") != 0 &&
+               strcmp(arg, "queues") != 0 &&
+               strcmp(arg, "hotkeys") != 0 &&
+               strcmp(arg, "clients") != 0)
+        return NULL;
+
+    mb = mb_alloc(2048);
+    if (mb == NULL) {
+        err_write("stats: no memory.");
+        return NULL;
+    }
+
+    if (arg == NULL)
+        general_stats(mb);
+    else if (strcmp(arg, "servers") == 0)
+        servers_stats(mb);
+    else if (strcmp(arg, "latency") == 0)
+        latency_stats(mb);
+    else if (strcmp(arg, "hotkeys") == 0)
+        hotkeys_stats(mb);
+    else if (strcmp(arg, "clients") == 0)
+        clients_stats(mb);
+    else
+        queues_stats(mb);
+
+    mb_append(mb, "END", 3);
+    mb_append(mb, LINE_DELIMITER, strlen(LINE_DELIMITER));
+    return mb;
+}
+
+int stats_initialize()
+{
+#ifdef WIN32
+    slot_key = TlsAlloc();
+    if (slot_key == TLS_OUT_OF_INDEXES) {
+        err_write("stats: TlsAlloc() failure.");
+        return -1;
+    }
+#else
+    if (pthread_key_create(&slot_key, NULL) != 0) {
+        err_write("stats: pthread_key_create() failure.");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void stats_finalize()
+{
+#ifdef WIN32
+    TlsFree(slot_key);
+#else
+    pthread_key_delete(slot_key);
+#endif
+}
@@ -0,0 +1,429 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * ワーカースレッドへ処理を受け渡すキューです。
+ *
+ * キューはスレッド毎のレーン(固定長のリングバッファ)で構成され、
+ * 登録(workq_push)はレーンを順番に選んでロックを使用せずに
+ * 追加します。取り出し(workq_pop)は自分のレーンが空の場合は
+ * 他のスレッドのレーンから取り出します(work stealing)。
+ * 他のスレッドからも取り出すのでレーンは複数の登録と複数の取り出しに
+ * 対応したリングバッファ(要素毎の通番で状態を判定します)です。
+ * すべてのレーンが一杯の場合はロックを使用するリストに追加します。
+ *
+ * 取り出す要素がない場合はしばらくスピンしてから待機します。
+ * スピンの回数はスピン中に取り出せた場合は増やし、待機した場合は
+ * 減らします。登録では待機しているスレッドがいる場合だけ通知するので
+ * 処理中のスレッドが多い場合はロックを取得しません。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#include "dinio.h"
+
+#define WQ_LANE_SIZE    1024    /* レーンの要素数(2のべき乗) */
+#define WQ_SPIN_MIN     4       /* 待機するまでの最小のスピン回数 */
+#define WQ_SPIN_MAX     256     /* 待機するまでの最大のスピン回数 */
+#define WQ_WAIT_TIME    1000    /* 終了を待つ間隔(usec) */
+#define WQ_END_WAIT     3000    /* 終了を待つ最大時間(ms) */
+
+struct wq_cell_t {
+    volatile long seq;          /* 要素の通番 */
+    void* data;
+};
+
+/* スレッド毎のレーン */
+struct wq_lane_t {
+    struct wq_cell_t* cells;
+    volatile long head;         /* 取り出す位置 */
+    char pad1[64];
+    volatile long tail;         /* 追加する位置 */
+    char pad2[64];
+    volatile long spin;         /* 待機するまでのスピン回数 */
+};
+
+struct workq_t {
+    struct wq_lane_t* lanes;
+    int lane_num;
+    volatile long next;         /* 次に追加するレーン */
+    struct queue_t* overflow;   /* レーンが一杯の場合のリスト */
+    volatile long overflow_count;
+    volatile long sleepers;     /* 待機中のスレッド数 */
+    volatile long active;       /* workq_pop() を実行中のスレッド数 */
+    volatile int stop;
+#ifdef WIN32
+    HANDLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
+static void wq_relax()
+{
+#ifdef WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static void wq_sleep()
+{
+#ifdef WIN32
+    Sleep(WQ_WAIT_TIME / 1000);
+#else
+    usleep(WQ_WAIT_TIME);
+#endif
+}
+
+static void wq_signal(struct workq_t* q)
+{
+#ifdef WIN32
+    SetEvent(q->cond);
+#else
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+#endif
+}
+
+static int lane_push(struct wq_lane_t* lane, void* data)
+{
+    struct wq_cell_t* cell;
+    long pos;
+    long dif;
+
+    pos = lane->tail;
+    for (;;) {
+        cell = &lane->cells[(unsigned long)pos & (WQ_LANE_SIZE - 1)];
+        dif = (long)((unsigned long)cell->seq - (unsigned long)pos);
+        if (dif == 0) {
+            if (ATOMIC_CAS(&lane->tail, pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            return -1;  /* full */
+        }
+        pos = lane->tail;
+    }
+    cell->data = data;
+    MEMORY_BARRIER();
+    cell->seq = pos + 1;
+    return 0;
+}
+
+static void* lane_pop(struct wq_lane_t* lane)
+{
+    struct wq_cell_t* cell;
+    long pos;
+    long dif;
+    void* data;
+
+    pos = lane->head;
+    for (;;) {
+        cell = &lane->cells[(unsigned long)pos & (WQ_LANE_SIZE - 1)];
+        dif = (long)((unsigned long)cell->seq - (unsigned long)(pos + 1));
+        if (dif == 0) {
+            if (ATOMIC_CAS(&lane->head, pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            return NULL;    /* empty */
+        }
+        pos = lane->head;
+    }
+    MEMORY_BARRIER();
+    data = cell->data;
+    MEMORY_BARRIER();
+    cell->seq = pos + WQ_LANE_SIZE;
+    return data;
+}
+
+/* 自分のレーン、他のスレッドのレーン、一杯の場合のリストの順に取り出します。*/
+static void* try_pop(struct workq_t* q, int lane_no)
+{
+    void* data;
+    int i;
+
+    for (i = 0; i < q->lane_num; i++) {
+        data = lane_pop(&q->lanes[(lane_no + i) % q->lane_num]);
+        if (data)
+            return data;
+    }
+    if (q->overflow_count > 0) {
+        data = que_pop(q->overflow);
+        if (data) {
+            ATOMIC_DEC(&q->overflow_count);
+            return data;
+        }
+    }
+    return NULL;
+}
+
+/* 取り出す要素が登録されるか終了するまで待機します。*/
+static void* park(struct workq_t* q, int lane_no)
+{
+    void* data;
+
+#ifndef WIN32
+    pthread_mutex_lock(&q->mutex);
+#endif
+    ATOMIC_INC(&q->sleepers);
+    /* 待機中の数を加算した後に登録されていないことを確認します。*/
+    data = try_pop(q, lane_no);
+    if (data == NULL && ! q->stop) {
+#ifdef WIN32
+        WaitForSingleObject(q->cond, INFINITE);
+#else
+        pthread_cond_wait(&q->cond, &q->mutex);
+#endif
+    }
+    ATOMIC_DEC(&q->sleepers);
+#ifndef WIN32
+    pthread_mutex_unlock(&q->mutex);
+#endif
+    return data;
+}
+
+/*
+ * キューに要素を登録します。
+ *
+ * q: キュー構造体のポインタ
+ * data: 要素
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int workq_push(struct workq_t* q, void* data)
+{
+    long start;
+    int i;
+    int result = -1;
+
+    start = ATOMIC_INC(&q->next);
+    for (i = 0; i < q->lane_num; i++) {
+        if (lane_push(&q->lanes[(unsigned long)(start + i) % q->lane_num], data) == 0) {
+            result = 0;
+            break;
+        }
+    }
+    if (result < 0) {
+        /* すべてのレーンが一杯の場合はリストに追加します。*/
+        if (que_push(q->overflow, data) < 0) {
+            err_write("workq: que_push() failure.");
+            return -1;
+        }
+        ATOMIC_INC(&q->overflow_count);
+    }
+
+    /* 追加した後に待機中のスレッドを確認します。*/
+    MEMORY_BARRIER();
+    if (q->sleepers > 0)
+        wq_signal(q);
+    return 0;
+}
+
+/*
+ * キューから要素を取り出します。
+ * 要素が登録されていない場合は登録されるまで待機します。
+ *
+ * q: キュー構造体のポインタ
+ * lane_no: 呼び出したスレッドのレーン番号
+ *
+ * 戻り値
+ *  要素を返します。
+ *  キューが終了した場合は NULL を返します。
+ */
+void* workq_pop(struct workq_t* q, int lane_no)
+{
+    struct wq_lane_t* lane;
+    void* data = NULL;
+
+    ATOMIC_INC(&q->active);
+    lane_no %= q->lane_num;
+    lane = &q->lanes[lane_no];
+    while (! q->stop) {
+        long i;
+
+        for (i = 0; i < lane->spin; i++) {
+            data = try_pop(q, lane_no);
+            if (data)
+                break;
+            wq_relax();
+        }
+        if (data) {
+            /* スピン中に取り出せたのでスピン回数を増やします。*/
+            if (i > 0 && lane->spin < WQ_SPIN_MAX)
+                lane->spin *= 2;
+            break;
+        }
+        /* 待機するのでスピン回数を減らします。*/
+        if (lane->spin > WQ_SPIN_MIN)
+            lane->spin /= 2;
+        data = park(q, lane_no);
+        if (data)
+            break;
+    }
+    ATOMIC_DEC(&q->active);
+    return data;
+}
+
+/*
+ * キューに登録されている要素数を返します。
+ *
+ * q: キュー構造体のポインタ
+ *
+ * 戻り値
+ *  要素数を返します。
+ */
+int workq_count(struct workq_t* q)
+{
+    long n = 0;
+    int i;
+
+    if (q == NULL)
+        return 0;
+    for (i = 0; i < q->lane_num; i++)
+        n += (long)((unsigned long)q->lanes[i].tail - (unsigned long)q->lanes[i].head);
+    n += q->overflow_count;
+    return (n > 0)? (int)n : 0;
+}
+
+/*
+ * キューを作成します。
+ *
+ * lane_num: レーン数(取り出すスレッド数)
+ *
+ * 戻り値
+ *  キュー構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct workq_t* workq_initialize(int lane_num)
+{
+    struct workq_t* q;
+    int i, j;
+
+    if (lane_num < 1)
+        lane_num = 1;
+
+    q = (struct workq_t*)calloc(1, sizeof(struct workq_t));
+    if (q == NULL) {
+        err_write("workq: no memory.");
+        return NULL;
+    }
+    q->lanes = (struct wq_lane_t*)calloc(lane_num, sizeof(struct wq_lane_t));
+    if (q->lanes == NULL) {
+        err_write("workq: lane no memory.");
+        free(q);
+        return NULL;
+    }
+    q->lane_num = lane_num;
+    for (i = 0; i < lane_num; i++) {
+        struct wq_lane_t* lane = &q->lanes[i];
+
+        lane->cells = (struct wq_cell_t*)calloc(WQ_LANE_SIZE, sizeof(struct wq_cell_t));
+        if (lane->cells == NULL) {
+            err_write("workq: cell no memory.");
+            workq_finalize(q);
+            return NULL;
+        }
+        for (j = 0; j < WQ_LANE_SIZE; j++)
+            lane->cells[j].seq = j;
+        lane->spin = WQ_SPIN_MIN;
+    }
+    q->overflow = que_initialize();
+    if (q->overflow == NULL) {
+        workq_finalize(q);
+        return NULL;
+    }
+
+#ifdef WIN32
+    q->cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+#endif
+    return q;
+}
+
+/*
+ * キューを終了します。
+ * 待機しているスレッドは workq_pop() から NULL で戻ります。
+ * 取り出されていない要素は解放しません。
+ *
+ * q: キュー構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void workq_finalize(struct workq_t* q)
+{
+    int i;
+    int wait_time = 0;
+
+    if (q == NULL)
+        return;
+
+    if (q->overflow) {
+        q->stop = 1;
+        MEMORY_BARRIER();
+        while (q->active > 0) {
+            if (wait_time >= WQ_END_WAIT * 1000) {
+                /* 戻らないスレッドがあるので領域を解放しません。*/
+                err_write("workq: %d threads not terminated.", (int)q->active);
+                return;
+            }
+#ifdef WIN32
+            SetEvent(q->cond);
+#else
+            pthread_mutex_lock(&q->mutex);
+            pthread_cond_broadcast(&q->cond);
+            pthread_mutex_unlock(&q->mutex);
+#endif
+            wq_sleep();
+            wait_time += WQ_WAIT_TIME;
+        }
+#ifdef WIN32
+        CloseHandle(q->cond);
+#else
+        pthread_cond_destroy(&q->cond);
+        pthread_mutex_destroy(&q->mutex);
+#endif
+        que_finalize(q->overflow);
+    }
+
+    for (i = 0; i < q->lane_num; i++) {
+        if (q->lanes[i].cells)
+            free(q->lanes[i].cells);
+    }
+    free(q->lanes);
+    free(q);
+}
@@ -32,6 +32,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "nestalib.h"
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
 
 #define CMD_GET    1
 #define CMD_SET    2
@@ -46,6 +49,7 @@ struct thread_args_t {
 static char* _cmd = "get";
 static char* _ip = "127.0.0.1";
 static int _port = 11211;
+static char* _unix_path = NULL;
 static int _threads = 1;
 static int _st_num = 0;
 static int _end_num = 1;
@@ -61,6 +65,7 @@ static void usage()
     printf("    -c command { [get] | set | delete }\n");
     printf("    -a server address [127.0.0.1]\n");
     printf("    -p server port number [11211]\n");
+    printf("    -u unix domain socket path\n");
     printf("    -t number of thread [1]\n");
     printf("    -n number of command [1]\n");
     printf("    -s start number [0]\n");
@@ -83,6 +88,9 @@ static int args(int argc, char* argv[])
         } else if (strcmp(argv[i], "-p") == 0) {
             if (++i < argc)
                 _port = atoi(argv[i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            if (++i < argc)
+                _unix_path = argv[i];
         } else if (strcmp(argv[i], "-t") == 0) {
             if (++i < argc)
                 _threads = atoi(argv[i]);
@@ -105,6 +113,31 @@ static int args(int argc, char* argv[])
     return 0;
 }
 
+static SOCKET connect_server()
+{
+#ifndef _WIN32
+    if (_unix_path) {
+        SOCKET c_socket;
+        struct sockaddr_un sockaddr;
+
+        if (strlen(_unix_path) >= sizeof(sockaddr.sun_path))
+            return INVALID_SOCKET;
+        c_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (c_socket == INVALID_SOCKET)
+            return INVALID_SOCKET;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sun_family = AF_UNIX;
+        strcpy(sockaddr.sun_path, _unix_path);
+        if (connect(c_socket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+            SOCKET_CLOSE(c_socket);
+            return INVALID_SOCKET;
+        }
+        return c_socket;
+    }
+#endif
+    return sock_connect_server(_ip, _port);
+}
+
 static int read_data(SOCKET socket)
 {
     while (1) {
@@ -232,9 +265,12 @@ static void do_thread(void* argv)
         return;
     }
 
-    socket = sock_connect_server(_ip, _port);
+    socket = connect_server();
     if (socket == INVALID_SOCKET) {
-        printf("%s:%d can't connect server.\n", _ip, _port);
+        if (_unix_path)
+            printf("%s can't connect server.\n", _unix_path);
+        else
+            printf("%s:%d can't connect server.\n", _ip, _port);
         return;
     }
 
@@ -272,6 +308,8 @@ static void do_thread(void* argv)
     cur_utime = system_time();
     elapsed_utime = cur_utime - _start_utime;
     printf("[%d] %d completed. time:%lld(usec)\n", tno, i-_st_num, elapsed_utime);
+    if (i > _st_num)
+        printf("[%d] %lld(usec) per command.\n", tno, elapsed_utime / (i-_st_num));
 
     quit_command(socket);
     if (data)
@@ -292,9 +330,14 @@ int main(int argc, char* argv[])
         usage();
         return 0;
     }
-    printf("[-c %s -a %s -p %d -t %d -s %d -n %d -l %d %s]\n",
-           _cmd, _ip, _port, _threads, _st_num, (_end_num - _st_num), _dsize,
-           ((_noreply)? "-noreply" : ""));
+    if (_unix_path)
+        printf("[-c %s -u %s -t %d -s %d -n %d -l %d %s]\n",
+               _cmd, _unix_path, _threads, _st_num, (_end_num - _st_num), _dsize,
+               ((_noreply)? "-noreply" : ""));
+    else
+        printf("[-c %s -a %s -p %d -t %d -s %d -n %d -l %d %s]\n",
+               _cmd, _ip, _port, _threads, _st_num, (_end_num - _st_num), _dsize,
+               ((_noreply)? "-noreply" : ""));
 
     sock_initialize();
 
@@ -0,0 +1,577 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * dinio の動作を確認するテストです。
+ * 起動している dinio に接続してテストケースを実行します。
+ * 失敗したテストケースがある場合は終了コードに 1 を返します。
+ */
+#ifdef _WIN32
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nestalib.h"
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#define FLIGHT_READERS  8
+#define FLIGHT_UPDATES  20
+#define CHUNK_DATASIZE  (2500*1024)
+#define SLOW_KEYS       40
+#define SLOW_DATASIZE   (100*1024)
+#define SLOW_TIMEOUT    2   /* sec */
+
+static char* _case = "all";
+static char* _ip = "127.0.0.1";
+static int _port = 11211;
+static char* _unix_path = NULL;
+
+static volatile int _stop_flag = 0;
+
+static void usage()
+{
+    printf("proxy_test [option]\n");
+    printf("  [option]\n");
+    printf("    -c test case { [all] | flight | chunk | slow | unix }\n");
+    printf("    -a server address [127.0.0.1]\n");
+    printf("    -p server port number [11211]\n");
+    printf("    -u unix domain socket path\n");
+}
+
+static int args(int argc, char* argv[])
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            if (++i < argc)
+                _case = argv[i];
+        } else if (strcmp(argv[i], "-a") == 0) {
+            if (++i < argc)
+                _ip = argv[i];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            if (++i < argc)
+                _port = atoi(argv[i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            if (++i < argc)
+                _unix_path = argv[i];
+        } else
+            return -1;
+    }
+    return 0;
+}
+
+static SOCKET connect_server()
+{
+#ifndef _WIN32
+    if (_unix_path) {
+        SOCKET c_socket;
+        struct sockaddr_un sockaddr;
+
+        if (strlen(_unix_path) >= sizeof(sockaddr.sun_path))
+            return INVALID_SOCKET;
+        c_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (c_socket == INVALID_SOCKET)
+            return INVALID_SOCKET;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sun_family = AF_UNIX;
+        strcpy(sockaddr.sun_path, _unix_path);
+        if (connect(c_socket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+            SOCKET_CLOSE(c_socket);
+            return INVALID_SOCKET;
+        }
+        return c_socket;
+    }
+#endif
+    return sock_connect_server(_ip, _port);
+}
+
+static int send_command(SOCKET socket, const char* cmd)
+{
+    if (send_data(socket, cmd, strlen(cmd)) < 0) {
+        printf("send cmd error %s", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static int expect_line(SOCKET socket, const char* expect)
+{
+    char buf[1024];
+
+    if (recv_line(socket, buf, sizeof(buf), "\r\n") < 0) {
+        printf("recv_line() : error\n");
+        return -1;
+    }
+    if (strcmp(buf, expect) != 0) {
+        printf("unexpected reply [%s] expected [%s]\n", buf, expect);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * get の応答を受信します。
+ *
+ * 戻り値
+ *  値の長さを返します。キーがない場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int recv_value(SOCKET socket, char* data, int size)
+{
+    char buf[1024];
+    char key[256];
+    int flags;
+    int bytes;
+    int status;
+
+    data[0] = '\0';
+    if (recv_line(socket, buf, sizeof(buf), "\r\n") < 0)
+        return -1;
+    if (strcmp(buf, "END") == 0)
+        return 0;
+    if (sscanf(buf, "VALUE %255s %d %d", key, &flags, &bytes) != 3) {
+        printf("unexpected reply [%s]\n", buf);
+        return -1;
+    }
+    if (bytes + 2 > size) {
+        printf("value too large %d\n", bytes);
+        return -1;
+    }
+    recv_nchar(socket, data, bytes + 2, &status);   /* add CR/LF */
+    if (status != 0)
+        return -1;
+    data[bytes] = '\0';
+    if (expect_line(socket, "END") < 0)
+        return -1;
+    return bytes;
+}
+
+static void flight_reader(void* argv)
+{
+    const char* key = (const char*)argv;
+    SOCKET socket;
+    char cmd[128];
+    char data[1024];
+
+    socket = connect_server();
+    if (socket == INVALID_SOCKET)
+        return;
+    snprintf(cmd, sizeof(cmd), "get %s\r\n", key);
+    while (! _stop_flag) {
+        if (send_command(socket, cmd) < 0)
+            break;
+        if (recv_value(socket, data, sizeof(data)) < 0)
+            break;
+    }
+    SOCKET_CLOSE(socket);
+}
+
+/*
+ * 他のクライアントの get が問い合わせ中のキーに
+ * set と get をパイプラインで送信して get が更新後の値を返すことを確認します。
+ */
+static int flight_test()
+{
+    const char* key = "proxy_test_flight";
+    SOCKET socket;
+    char cmd[256];
+    char data[1024];
+    char value[16];
+    int result = 0;
+    int i;
+#ifdef _WIN32
+    uintptr_t thread_ids[FLIGHT_READERS];
+#else
+    pthread_t thread_ids[FLIGHT_READERS];
+#endif
+
+    socket = connect_server();
+    if (socket == INVALID_SOCKET) {
+        printf("can't connect server.\n");
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "set %s 0 0 6\r\nold000\r\n", key);
+    if (send_command(socket, cmd) < 0 || expect_line(socket, "STORED") < 0) {
+        SOCKET_CLOSE(socket);
+        return -1;
+    }
+
+    /* 同じキーの get を繰り返すクライアントを起動します。*/
+    _stop_flag = 0;
+    for (i = 0; i < FLIGHT_READERS; i++) {
+#ifdef _WIN32
+        thread_ids[i] = _beginthread(flight_reader, 0, (void*)key);
+#else
+        pthread_create(&thread_ids[i], NULL, (void*)flight_reader, (void*)key);
+#endif
+    }
+
+    for (i = 0; i < FLIGHT_UPDATES; i++) {
+        int len;
+
+        snprintf(value, sizeof(value), "new%03d", i);
+        snprintf(cmd, sizeof(cmd), "set %s 0 0 6\r\n%s\r\nget %s\r\n", key, value, key);
+        if (send_command(socket, cmd) < 0 || expect_line(socket, "STORED") < 0) {
+            result = -1;
+            break;
+        }
+        len = recv_value(socket, data, sizeof(data));
+        if (len < 0 || strcmp(data, value) != 0) {
+            printf("get after set: [%s] expected [%s]\n", (len > 0)? data : "", value);
+            result = -1;
+            break;
+        }
+    }
+
+    _stop_flag = 1;
+    for (i = 0; i < FLIGHT_READERS; i++) {
+#ifdef _WIN32
+        WaitForSingleObject((HANDLE)thread_ids[i], INFINITE);
+#else
+        void* status;
+        pthread_join(thread_ids[i], &status);
+#endif
+    }
+    SOCKET_CLOSE(socket);
+    return result;
+}
+
+/* 非同期のレプリケーションが完了するまで待機します。*/
+static void wait_replication()
+{
+#ifdef _WIN32
+    Sleep(1000);
+#else
+    sleep(1);
+#endif
+}
+
+/*
+ * stats の curr_items を取得します。
+ * dinio はすべてのデータストアの curr_items の合計を返します。
+ *
+ * 戻り値
+ *  curr_items を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int64 curr_items(SOCKET socket)
+{
+    char buf[1024];
+    int64 items = -1;
+
+    if (send_command(socket, "stats\r\n") < 0)
+        return -1;
+    while (1) {
+        if (recv_line(socket, buf, sizeof(buf), "\r\n") < 0)
+            return -1;
+        if (strcmp(buf, "END") == 0)
+            break;
+        if (strncmp(buf, "STAT curr_items ", 16) == 0)
+            items = atoll(&buf[16]);
+    }
+    return items;
+}
+
+static int set_large_value(SOCKET socket, const char* key, char* data, int dsize, char c)
+{
+    char cmd[256];
+
+    snprintf(cmd, sizeof(cmd), "set %s 0 0 %d\r\n", key, dsize);
+    memset(data, c, dsize);
+    memcpy(data+dsize, "\r\n", 2);
+    if (send_command(socket, cmd) < 0)
+        return -1;
+    if (send_data(socket, data, dsize+2) < 0) {  /* add CR/LF */
+        printf("send data error %s", cmd);
+        return -1;
+    }
+    return expect_line(socket, "STORED");
+}
+
+/*
+ * dinio.max_value_size で分割して保存した値を set で置き換えた場合と
+ * delete で削除した場合に以前のチャンクが削除されることを確認します。
+ */
+static int chunk_test()
+{
+    const char* key = "proxy_test_chunk";
+    SOCKET socket;
+    char cmd[256];
+    char* data;
+    int64 base_items, items;
+    int result = -1;
+
+    socket = connect_server();
+    if (socket == INVALID_SOCKET) {
+        printf("can't connect server.\n");
+        return -1;
+    }
+    data = (char*)malloc(CHUNK_DATASIZE+2);  /* append data area CR/LF */
+    if (data == NULL) {
+        printf("no memory\n");
+        SOCKET_CLOSE(socket);
+        return -1;
+    }
+
+    snprintf(cmd, sizeof(cmd), "delete %s\r\n", key);
+    if (send_command(socket, cmd) < 0 || recv_line(socket, data, 1024, "\r\n") < 0)
+        goto final;
+    wait_replication();
+    base_items = curr_items(socket);
+
+    if (set_large_value(socket, key, data, CHUNK_DATASIZE, 'a') < 0)
+        goto final;
+    wait_replication();
+    items = curr_items(socket);
+    if (items <= base_items) {
+        printf("chunked set: curr_items %lld base %lld\n", items, base_items);
+        goto final;
+    }
+
+    /* 以前のチャンクを削除して新しいチャンクを保存します。*/
+    if (set_large_value(socket, key, data, CHUNK_DATASIZE, 'b') < 0)
+        goto final;
+    wait_replication();
+    if (curr_items(socket) != items) {
+        printf("chunked set again: curr_items %lld expected %lld\n", curr_items(socket), items);
+        goto final;
+    }
+
+    snprintf(cmd, sizeof(cmd), "delete %s\r\n", key);
+    if (send_command(socket, cmd) < 0 || expect_line(socket, "DELETED") < 0)
+        goto final;
+    wait_replication();
+    items = curr_items(socket);
+    if (items != base_items) {
+        printf("chunked delete: curr_items %lld expected %lld\n", items, base_items);
+        goto final;
+    }
+    result = 0;
+
+final:
+    free(data);
+    SOCKET_CLOSE(socket);
+    return result;
+}
+
+/* ソケットの受信タイムアウトを設定します。*/
+static void recv_timeout(SOCKET socket, int sec)
+{
+#ifdef _WIN32
+    DWORD tv = sec * 1000;
+#else
+    struct timeval tv;
+
+    tv.tv_sec = sec;
+    tv.tv_usec = 0;
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+}
+
+/*
+ * 応答を受信しないクライアントへの送信が止まっている間も
+ * 他のクライアントのコマンドが処理されることを確認します。
+ */
+static int slow_test()
+{
+    SOCKET socket;
+    SOCKET slow_socket = INVALID_SOCKET;
+    char cmd[256];
+    char* data;
+    int rcvbuf = 4096;
+    int result = -1;
+    int i, n;
+
+    socket = connect_server();
+    if (socket == INVALID_SOCKET) {
+        printf("can't connect server.\n");
+        return -1;
+    }
+    data = (char*)malloc(SLOW_DATASIZE+2);  /* append data area CR/LF */
+    if (data == NULL) {
+        printf("no memory\n");
+        SOCKET_CLOSE(socket);
+        return -1;
+    }
+    for (i = 0; i < SLOW_KEYS; i++) {
+        snprintf(cmd, sizeof(cmd), "proxy_test_slow%d", i);
+        if (set_large_value(socket, cmd, data, SLOW_DATASIZE, 's') < 0)
+            goto final;
+    }
+
+    slow_socket = connect_server();
+    if (slow_socket == INVALID_SOCKET) {
+        printf("can't connect server.\n");
+        goto final;
+    }
+    setsockopt(slow_socket, SOL_SOCKET, SO_RCVBUF, (const char*)&rcvbuf, sizeof(rcvbuf));
+
+    /* 応答を受信しないで get を送信します。
+       送信が止まった後に完了する応答も送信します。*/
+    for (n = 0; n < 2; n++) {
+        for (i = 0; i < SLOW_KEYS; i++) {
+            snprintf(cmd, sizeof(cmd), "get proxy_test_slow%d\r\n", i);
+            if (send_command(slow_socket, cmd) < 0)
+                goto final;
+        }
+#ifdef _WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif
+    }
+
+    recv_timeout(socket, SLOW_TIMEOUT);
+    for (i = 0; i < SLOW_KEYS; i++) {
+        snprintf(cmd, sizeof(cmd), "set proxy_test_fast%d 0 0 1\r\nx\r\n", i);
+        if (send_command(socket, cmd) < 0 || expect_line(socket, "STORED") < 0) {
+            printf("other client is blocked.\n");
+            goto final;
+        }
+    }
+
+    /* 応答は送信した順番で受信できます。*/
+    recv_timeout(slow_socket, SLOW_TIMEOUT * 10);
+    for (i = 0; i < 3; i++) {
+        if (recv_value(slow_socket, data, SLOW_DATASIZE+2) != SLOW_DATASIZE)
+            goto final;
+    }
+    result = 0;
+
+final:
+    free(data);
+    if (slow_socket != INVALID_SOCKET)
+        SOCKET_CLOSE(slow_socket);
+    SOCKET_CLOSE(socket);
+    return result;
+}
+
+/*
+ * UNIX ドメインソケット(-u)で接続してコマンドを実行します。
+ * ソケットファイルのパーミッションが既定値(0660)のように
+ * 他のユーザーに接続を許可していないことも確認します。
+ */
+static int unix_test()
+{
+#ifdef _WIN32
+    printf("unix domain socket is not supported.\n");
+    return -1;
+#else
+    const char* key = "proxy_test_unix";
+    struct stat st;
+    SOCKET socket;
+    char cmd[256];
+    char data[1024];
+    int result = -1;
+
+    if (_unix_path == NULL) {
+        printf("-u option is required.\n");
+        return -1;
+    }
+    if (stat(_unix_path, &st) < 0 || ! S_ISSOCK(st.st_mode)) {
+        printf("%s is not a socket.\n", _unix_path);
+        return -1;
+    }
+    if (st.st_mode & S_IRWXO) {
+        printf("%s mode %04o allows other users.\n", _unix_path, st.st_mode & 07777);
+        return -1;
+    }
+
+    socket = connect_server();
+    if (socket == INVALID_SOCKET) {
+        printf("%s can't connect server.\n", _unix_path);
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "set %s 0 0 4\r\nunix\r\n", key);
+    if (send_command(socket, cmd) < 0 || expect_line(socket, "STORED") < 0)
+        goto final;
+
+    /* パイプラインで送信した応答が順番に返ることを確認します。*/
+    snprintf(cmd, sizeof(cmd), "get %s\r\ndelete %s\r\nget %s\r\n", key, key, key);
+    if (send_command(socket, cmd) < 0)
+        goto final;
+    if (recv_value(socket, data, sizeof(data)) != 4 || strcmp(data, "unix") != 0) {
+        printf("get: [%s] expected [unix]\n", data);
+        goto final;
+    }
+    if (expect_line(socket, "DELETED") < 0)
+        goto final;
+    if (recv_value(socket, data, sizeof(data)) != 0) {
+        printf("get after delete: [%s]\n", data);
+        goto final;
+    }
+    result = 0;
+
+final:
+    SOCKET_CLOSE(socket);
+    return result;
+#endif
+}
+
+static int run_case(const char* name, int (*func)())
+{
+    int result;
+
+    if (strcmp(_case, "all") != 0 && strcmp(_case, name) != 0)
+        return 0;
+    result = func();
+    printf("%s: %s\n", name, (result == 0)? "OK" : "NG");
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int result = 0;
+
+    if (args(argc, argv) < 0) {
+        usage();
+        return 0;
+    }
+    sock_initialize();
+
+    if (run_case("flight", flight_test) < 0)
+        result = 1;
+    if (run_case("chunk", chunk_test) < 0)
+        result = 1;
+    if (run_case("slow", slow_test) < 0)
+        result = 1;
+    /* unix は -u でソケットのパスを指定した場合に実行します。*/
+    if ((_unix_path || strcmp(_case, "unix") == 0) && run_case("unix", unix_test) < 0)
+        result = 1;
+
+    sock_finalize();
+
+#ifdef _WIN32
+    _CrtDumpMemoryLeaks();
+#endif
+    return result;
+}